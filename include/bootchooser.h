@@ -66,3 +66,25 @@ G_GNUC_WARN_UNUSED_RESULT;
  */
 gboolean r_boot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Starts a sequence of boot loader accesses that share the boot loader state
+ * read by the first one.
+ *
+ * Currently, this caches the barebox state of all slots and the EFI
+ * variables read from efivarfs, so that querying the state of all slots
+ * reads them only once. Changes made by r_boot_set_state() and
+ * r_boot_set_primary() update (EFI) or invalidate (barebox) the cached
+ * state.
+ * Each r_boot_*() call forms such a sequence implicitly. Calls can be nested
+ * and must be balanced by r_boot_query_end().
+ * Sequences of different threads are serialized, so a thread calling this
+ * blocks until a sequence running in another thread has ended.
+ */
+void r_boot_query_begin(void);
+
+/**
+ * Ends a sequence started by r_boot_query_begin() and drops the cached boot
+ * loader state after the outermost one.
+ */
+void r_boot_query_end(void);
@@ -137,7 +137,8 @@ G_GNUC_WARN_UNUSED_RESULT;
  * RaucBundle struct.
  *
  * @param bundle RaucBundle struct as returned by check_bundle()
- * @param outpath filename of the resigned output bundle
+ * @param outpath filename of the resigned output bundle, or NULL to replace
+ *        the signature of the input bundle in-place
  * @param error Return location for a GError
  *
  * @return TRUE on success, FALSE if an error occurred
@@ -153,7 +154,8 @@ G_GNUC_WARN_UNUSED_RESULT;
  *
  * @param bundle RaucBundle struct as returned by check_bundle()
  * @param insig filename of the signature for replacement
- * @param outpath filename of the output bundle
+ * @param outpath filename of the output bundle, or NULL to replace the
+ *        signature of the input bundle in-place
  * @param params bit-field enum CheckBundleParams with additional flags for the check
  * @param error Return location for a GError
  *
@@ -4,10 +4,16 @@
 
 #include "checksum.h"
 #include "manifest.h"
+#include "qos.h"
 #include "slot.h"
 
 /* Default maximum downloadable bundle size (8 MiB) */
 #define DEFAULT_MAX_BUNDLE_DOWNLOAD_SIZE 8*1024*1024
+/* Default writeback window for slot writes (16 MiB) */
+#define DEFAULT_WRITEBACK_WINDOW (16*1024*1024)
+/* Default interval for slot write checkpoints (64 MiB) */
+#define DEFAULT_CHECKPOINT_INTERVAL (64*1024*1024)
+#define DEFAULT_STATUS_CACHE_DIRECTORY "/run/rauc/slot-status"
 
 typedef enum {
 	R_CONFIG_ERROR_INVALID_FORMAT,
@@ -62,6 +68,8 @@ typedef struct {
 	gboolean activate_installed;
 	gchar *data_directory;
 	gchar *statusfile_path;
+	/* cache for per-slot status files (NULL if disabled) */
+	gchar *status_cache_directory;
 	gchar *keyring_path;
 	gchar *keyring_directory;
 	gboolean keyring_allow_partial_chain;
@@ -72,6 +80,12 @@ typedef struct {
 	guint bundle_formats_mask;
 	/* enable complete read before mount */
 	gboolean perform_pre_check;
+	/* maximum number of devices to write to concurrently */
+	gint parallel_installs;
+	/* size of the writeback window for slot writes (0 to disable) */
+	guint64 writeback_window;
+	/* interval between slot write checkpoints (0 to disable) */
+	guint64 checkpoint_interval;
 
 	gchar *autoinstall_path;
 	gchar *preinstall_handler;
@@ -79,6 +93,18 @@ typedef struct {
 
 	gchar *systeminfo_handler;
 
+	/* install QoS ([qos] section) */
+	gboolean qos_enabled;
+	/* use the 'background' profile by default */
+	gboolean qos_background;
+	RQosIoClass qos_io_class;
+	gint qos_io_priority;
+	gboolean qos_has_nice;
+	gint qos_nice;
+	gchar *qos_cgroup;
+	/* maximum slot write rate in bytes per second (0 for unlimited) */
+	guint64 qos_write_rate;
+
 	gchar **enabled_headers; /* standard HTTP headers to send */
 
 	/* streaming */
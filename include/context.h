@@ -8,12 +8,32 @@
 #include "status_file.h"
 #include "bundle.h"
 
+/* minimum interval between progress updates sent by r_context_set_step_progress() */
+#define R_PROGRESS_UPDATE_INTERVAL (250 * G_TIME_SPAN_MILLISECOND)
+
 typedef void (*progress_callback) (gint percentage, const gchar *message,
 		gint nesting_depth);
 
+/* Timing of a progress step, recorded by r_context_begin_step() and
+ * r_context_end_step() */
+typedef struct _RaucStepTiming {
+	gchar *name;
+	gchar *description;
+	/* monotonic start time and duration in microseconds */
+	gint64 start;
+	gint64 duration;
+	/* bytes processed by the step (see r_context_set_step_progress()) */
+	guint64 bytes;
+	gboolean success;
+	/* RaucStepTiming of the sub steps in the order they were begun */
+	GPtrArray *children;
+} RaucStepTiming;
+
 typedef struct {
 	/* The bundle currently mounted by RAUC */
 	RaucBundle *mounted_bundle;
+	/* timing of the last finished root progress step and its sub steps */
+	RaucStepTiming *step_timing;
 } RContextInstallationInfo;
 
 typedef enum {
@@ -54,6 +74,8 @@ typedef struct {
 	gchar *encryption_key;
 	gchar *mksquashfs_args;
 	gchar *casync_args;
+	/* optional directory for caching image checksums and hash indexes */
+	gchar *digest_cache_dir;
 	gchar **recipients;
 	gchar **intermediatepaths;
 	/* optional global mount prefix overwrite */
@@ -90,7 +112,14 @@ typedef struct {
 
 	gfloat percent_total;
 	gfloat percent_done;
-	gint last_explicit_percent;
+	gfloat last_explicit_percent;
+
+	/* bytes processed so far (see r_context_set_step_progress()) */
+	guint64 bytes_done;
+
+	/* owned by the parent step's timing (or moved to
+	 * RContextInstallationInfo for the root step) */
+	RaucStepTiming *timing;
 } RaucProgressStep;
 
 /**
@@ -156,6 +185,32 @@ void r_context_end_step(const gchar *name, gboolean success);
  */
 void r_context_set_step_percentage(const gchar *name, gint percentage);
 
+/**
+ * Sets the progress of the given step in bytes. This is useful for copying
+ * data, where the step's weight should reflect the data size.
+ *
+ * In contrast to r_context_set_step_percentage(), the progress is not limited
+ * to full percents, and the processed bytes are used to calculate the
+ * throughput. To limit the overhead, progress updates are sent at most every
+ * R_PROGRESS_UPDATE_INTERVAL.
+ *
+ * @param name identifying the step
+ * @param done number of bytes processed so far
+ * @param total total number of bytes to process
+ */
+void r_context_set_step_progress(const gchar *name, guint64 done, guint64 total);
+
+/**
+ * Returns the current throughput and estimated time until completion of the
+ * running operation. This is intended to be called from the progress callback.
+ *
+ * @param throughput return location for the throughput in bytes per second
+ *        (0 if unknown)
+ * @param eta return location for the estimated remaining time in seconds
+ *        (-1 if unknown)
+ */
+void r_context_get_progress_rate(guint64 *throughput, gint64 *eta);
+
 /**
  * Frees the memory allocated by the RaucProgressStep.
  *
@@ -165,8 +220,66 @@ void r_context_free_progress_step(RaucProgressStep *step);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucProgressStep, r_context_free_progress_step);
 
+/**
+ * Frees a RaucStepTiming including the timing of its sub steps.
+ *
+ * @param timing a RaucStepTiming to free
+ */
+void r_context_free_step_timing(RaucStepTiming *timing);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucStepTiming, r_context_free_step_timing);
+
+/**
+ * Formats a hierarchical report of a step timing, with one line per step
+ * containing its start relative to the first step, its duration and the
+ * processed bytes and throughput (if any).
+ *
+ * @param timing RaucStepTiming to format
+ *
+ * @return newly allocated report
+ */
+gchar *r_context_step_timing_format(const RaucStepTiming *timing);
+
+/**
+ * Converts a step timing to an array of (depth, name, description, start,
+ * duration, bytes, success) tuples (signature a(isstttb)) in the order the
+ * steps were begun. Start and duration are given in microseconds, the start
+ * being relative to the first step.
+ *
+ * @param timing RaucStepTiming to convert
+ *
+ * @return new floating GVariant
+ */
+GVariant *r_context_step_timing_to_variant(const RaucStepTiming *timing);
+
 void r_context_register_progress_callback(progress_callback progress_cb);
 
+/**
+ * Returns the innermost progress step of the calling thread.
+ *
+ * @return current step, or NULL if no step is active
+ */
+RaucProgressStep *r_context_progress_current_step(void);
+
+/**
+ * Attaches the calling (worker) thread to the progress tracking.
+ *
+ * Steps begun by the thread afterwards are kept on a separate stack and are
+ * nested in 'parent', so that several threads can report progress for
+ * substeps of the same parent step concurrently.
+ *
+ * @param parent step to nest this thread's steps in (usually obtained by
+ *        r_context_progress_current_step() in the main thread)
+ */
+void r_context_progress_attach_thread(RaucProgressStep *parent);
+
+/**
+ * Detaches the calling thread from progress tracking again.
+ *
+ * All steps begun by the thread must have been ended before.
+ */
+void r_context_progress_detach_thread(void);
+
 /**
  * Return if context is marked 'busy'.
  *
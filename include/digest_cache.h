@@ -0,0 +1,93 @@
+#pragma once
+
+#include <glib.h>
+
+#include "checksum.h"
+
+/**
+ * Computes a cache key identifying the current state of a file.
+ *
+ * The key is derived from the device, inode, size and modification time of
+ * the file, so it changes whenever the file is replaced or modified.
+ *
+ * @param filename file to compute the key for
+ * @param error return location for a GError, or NULL
+ *
+ * @return newly allocated key string, NULL if an error occurred
+ */
+gchar *r_digest_cache_file_key(const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Looks up a checksum in the digest cache.
+ *
+ * The checksum type requested in 'checksum' (or the default type if unset)
+ * must match the cached entry.
+ *
+ * @param cachedir digest cache directory
+ * @param key cache key (as returned by r_digest_cache_file_key() or
+ *        supplied by the caller)
+ * @param checksum RaucChecksum to update on a cache hit
+ *
+ * @return TRUE if the checksum was found and updated, FALSE otherwise
+ */
+gboolean r_digest_cache_get_checksum(const gchar *cachedir, const gchar *key, RaucChecksum *checksum)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Stores a checksum in the digest cache.
+ *
+ * @param cachedir digest cache directory (created if missing)
+ * @param key cache key
+ * @param checksum RaucChecksum to store
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_digest_cache_put_checksum(const gchar *cachedir, const gchar *key, const RaucChecksum *checksum, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Looks up a block hash index in the digest cache and writes it to
+ * 'indexpath' on a cache hit.
+ *
+ * @param cachedir digest cache directory
+ * @param key cache key
+ * @param indexpath location to write the cached hash index to
+ *
+ * @return TRUE if the hash index was found and written, FALSE otherwise
+ */
+gboolean r_digest_cache_get_hash_index(const gchar *cachedir, const gchar *key, const gchar *indexpath)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Stores the block hash index file at 'indexpath' in the digest cache.
+ *
+ * @param cachedir digest cache directory (created if missing)
+ * @param key cache key
+ * @param indexpath hash index file to store
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_digest_cache_put_hash_index(const gchar *cachedir, const gchar *key, const gchar *indexpath, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Updates RaucChecksum for the given file, using the digest cache if
+ * possible.
+ *
+ * This behaves like compute_checksum(), but first tries to find the checksum
+ * in the cache (keyed by r_digest_cache_file_key()) and stores newly
+ * computed checksums in the cache.
+ * Failing to update the cache is not considered an error.
+ *
+ * @param cachedir digest cache directory
+ * @param checksum RaucChecksum to update
+ * @param filename name of file to calculate checksum for
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_digest_cache_compute_checksum(const gchar *cachedir, RaucChecksum *checksum, const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_EFIVARS_ERROR r_efivars_error_quark()
+GQuark r_efivars_error_quark(void);
+
+typedef enum {
+	R_EFIVARS_ERROR_INVALID,
+	R_EFIVARS_ERROR_NOT_FOUND,
+} REfivarsError;
+
+#define R_EFIVARS_DEFAULT_DIR "/sys/firmware/efi/efivars"
+
+typedef struct {
+	guint16 num;
+	/* description (as shown by efibootmgr) */
+	gchar *description;
+	/* LOAD_OPTION_ACTIVE is set */
+	gboolean active;
+} REfiLoadOption;
+
+typedef struct {
+	/* boot numbers (guint16) in 'BootOrder' */
+	GArray *boot_order;
+	guint32 boot_order_attributes;
+	gboolean has_boot_next;
+	guint16 boot_next;
+	gboolean has_boot_current;
+	guint16 boot_current;
+	/* REfiLoadOption for each 'Boot####' variable, sorted by number */
+	GPtrArray *load_options;
+} REfiBootState;
+
+/**
+ * Reads the EFI boot manager variables (BootOrder, BootNext, BootCurrent
+ * and all Boot#### load options) from an efivarfs directory.
+ *
+ * @param dir efivarfs mount point (usually R_EFIVARS_DEFAULT_DIR)
+ * @param error return location for a GError, or NULL
+ *
+ * @return newly allocated REfiBootState, or NULL if an error occurred
+ */
+REfiBootState *r_efivars_read_boot_state(const gchar *dir, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the load option with the given number.
+ *
+ * @param state REfiBootState to search
+ * @param num boot number
+ *
+ * @return REfiLoadOption (owned by state), or NULL if not found
+ */
+REfiLoadOption *r_efivars_get_load_option(const REfiBootState *state, guint16 num);
+
+/**
+ * Writes the 'BootOrder' variable and updates 'state' accordingly.
+ *
+ * @param dir efivarfs mount point
+ * @param state REfiBootState read from 'dir'
+ * @param order boot numbers in the new order
+ * @param len number of entries in 'order'
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_efivars_set_boot_order(const gchar *dir, REfiBootState *state, const guint16 *order, guint len, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Writes the 'BootNext' variable and updates 'state' accordingly.
+ *
+ * @param dir efivarfs mount point
+ * @param state REfiBootState read from 'dir'
+ * @param num boot number to use for the next boot
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_efivars_set_boot_next(const gchar *dir, REfiBootState *state, guint16 num, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees an REfiBootState.
+ *
+ * @param state REfiBootState to free
+ */
+void r_efivars_boot_state_free(REfiBootState *state);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(REfiBootState, r_efivars_boot_state_free);
@@ -28,6 +28,11 @@
  *
  * To log events, modules should define their own logging method that creates
  * a log structure array and calls g_log_structured_array().
+ *
+ * Events are formatted by the logging thread. For loggers using
+ * R_EVENT_LOG_FLUSH_ASYNC, the formatted events are then passed through a
+ * bounded queue to a background thread per logger, which rotates the log
+ * files and writes the events in batches.
  */
 
 #define R_EVENT_LOG_DOMAIN "rauc-event"
@@ -42,8 +47,14 @@
 #define R_EVENT_LOG_TYPE_SERVICE "service"
 /* Event log type for slot updates */
 #define R_EVENT_LOG_TYPE_WRITE_SLOT "writeslot"
+/* Event log type for operation statistics */
+#define R_EVENT_LOG_TYPE_STATS "stats"
+
+/* maximum number of events queued for a background writer */
+#define R_EVENT_LOG_QUEUE_SIZE 256
 
 typedef struct _REventLogger REventLogger;
+typedef struct _REventLogQueue REventLogQueue;
 
 typedef enum {
 	/* Readable, timestamped output, including "MESSAGE" and all known log fields */
@@ -56,6 +67,13 @@ typedef enum {
 	R_EVENT_LOGFMT_JSON_PRETTY,
 } REventLogFormat;
 
+typedef enum {
+	/* Events are written by the logging thread */
+	R_EVENT_LOG_FLUSH_SYNC,
+	/* Events are written in batches by a background thread */
+	R_EVENT_LOG_FLUSH_ASYNC,
+} REventLogFlush;
+
 typedef struct _REventLogger {
 	/* configured information */
 	gchar *name;
@@ -64,11 +82,16 @@ typedef struct _REventLogger {
 	REventLogFormat format;
 	goffset maxsize;
 	guint maxfiles;
+	REventLogFlush flush;
+	/* maximum time (in ms) an event may be delayed to batch it with others */
+	guint flush_interval;
 	/* runtime information */
 	gboolean configured;
 	gboolean broken;
 	goffset filesize;
 	GFileOutputStream *logstream;
+	/* background writer (for R_EVENT_LOG_FLUSH_ASYNC) */
+	REventLogQueue *queue;
 	void (*writer)(REventLogger* logger, const GLogField *fields, gsize n_fields);
 } REventLogger;
 
@@ -114,7 +137,7 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
  * Sets up a logger.
  *
  * Attempts to open the log file under the given filename and to query the
- * size.
+ * size. For R_EVENT_LOG_FLUSH_ASYNC, the background writer is started.
  *
  * If setting up the logger fails, it will be marked as 'broken'.
  *
@@ -122,9 +145,19 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
  */
 void r_event_log_setup_logger(REventLogger *logger);
 
+/**
+ * Waits until all events queued for background writers have been written.
+ *
+ * This should be called at the end of an installation and before
+ * terminating, so no events are lost.
+ */
+void r_event_log_flush(void);
+
 /**
  * Frees event logging structure.
  *
+ * Queued events are written and the background writer is stopped first.
+ *
  * @param config Logger to free
  */
 void r_event_log_free_logger(REventLogger *logger);
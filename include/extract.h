@@ -0,0 +1,44 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_EXTRACT_ERROR r_extract_error_quark()
+GQuark r_extract_error_quark(void);
+
+typedef enum {
+	R_EXTRACT_ERROR_FAILED,
+} RExtractError;
+
+typedef enum {
+	R_EXTRACT_FLAGS_NONE = 0,
+	/* restore ACLs and extended attributes (including SELinux labels) */
+	R_EXTRACT_FLAGS_XATTRS = 1 << 0,
+} RExtractFlags;
+
+#if ENABLE_ARCHIVE
+/**
+ * Extracts a (possibly compressed) tar archive to a directory.
+ *
+ * The archive is extracted in-process using libarchive. Reading the archive,
+ * decompressing and parsing it, and creating the files run in separate
+ * threads, so that they overlap.
+ * Ownership (numeric IDs), permissions and modification times are restored,
+ * leading '/' characters are stripped from the member names.
+ * Members are neither extracted through symlinks nor through '..' components,
+ * so that an archive cannot write outside of 'dest'.
+ * Instead of syncing each file, the file system containing 'dest' is synced
+ * once at the end.
+ *
+ * Progress is reported to the 'copy_image' step (if in progress context)
+ * based on the amount of archive data read.
+ *
+ * @param filename archive to extract
+ * @param dest existing directory to extract to
+ * @param flags RExtractFlags to select optional metadata
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_extract_archive(const gchar *filename, const gchar *dest, RExtractFlags flags, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+#endif
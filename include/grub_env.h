@@ -0,0 +1,75 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_GRUB_ENV_ERROR r_grub_env_error_quark()
+GQuark r_grub_env_error_quark(void);
+
+typedef enum {
+	R_GRUB_ENV_ERROR_INVALID,
+	R_GRUB_ENV_ERROR_TOO_LARGE,
+} RGrubEnvError;
+
+typedef struct _RGrubEnv RGrubEnv;
+
+/**
+ * Reads a GRUB environment block file (as used by grub-editenv and GRUB's
+ * load_env/save_env commands).
+ *
+ * If the file does not exist, an empty environment block of the default
+ * size (1 KiB) is used, as grub-editenv does.
+ *
+ * @param path grubenv file to read
+ * @param error return location for a GError, or NULL
+ *
+ * @return newly allocated RGrubEnv, or NULL if an error occurred
+ */
+RGrubEnv *r_grub_env_read(const gchar *path, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the value of a variable of the in-memory environment.
+ *
+ * @param env RGrubEnv to look up
+ * @param key variable name
+ *
+ * @return value (owned by env), or NULL if the variable is not set
+ */
+const gchar *r_grub_env_get(RGrubEnv *env, const gchar *key);
+
+/**
+ * Sets a variable of the in-memory environment.
+ *
+ * Changes are only written by r_grub_env_write().
+ *
+ * @param env RGrubEnv to modify
+ * @param key variable name
+ * @param value new value
+ */
+void r_grub_env_set(RGrubEnv *env, const gchar *key, const gchar *value);
+
+/**
+ * Writes all changes made by r_grub_env_set() at once.
+ *
+ * The environment block keeps its size and is overwritten in place (as
+ * grub-editenv does), so that symlinks and the file mode are preserved.
+ * Without modifications, nothing is written.
+ *
+ * @param env RGrubEnv to write
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_grub_env_write(RGrubEnv *env, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees the environment.
+ *
+ * Unwritten changes are discarded.
+ *
+ * @param env RGrubEnv to free
+ */
+void r_grub_env_free(RGrubEnv *env);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RGrubEnv, r_grub_env_free);
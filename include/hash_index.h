@@ -15,8 +15,10 @@ typedef enum {
 	R_HASH_INDEX_ERROR_MODIFIED,
 } RHashIndexErrorError;
 
+#define R_HASH_INDEX_CHUNK_SIZE 4096
+
 typedef struct {
-	guint8 data[4096];
+	guint8 data[R_HASH_INDEX_CHUNK_SIZE];
 	guint8 hash[32];
 } RaucHashIndexChunk;
 
@@ -140,6 +142,41 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, RaucHashIndexChunk *chunk, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Determines how many leading chunks of a file match the hash index.
+ *
+ * This is used to check which part of an interrupted write to a slot is
+ * still valid, without needing access to the source data.
+ *
+ * @param idx RaucHashIndex to compare with
+ * @param data_fd open file descriptor of the data to check
+ * @param count maximum number of chunks to check, updated with the number of
+ *        matching chunks
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if reading failed
+ */
+gboolean r_hash_index_verify_prefix(const RaucHashIndex *idx, int data_fd, guint32 *count, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Compares consecutive chunks in a buffer against the hash index.
+ *
+ * This does not access the indexed data, so it can be called from several
+ * threads concurrently.
+ *
+ * @param idx RaucHashIndex to compare with
+ * @param first number of the first chunk contained in the buffer
+ * @param data buffer containing 'count' chunks
+ * @param count number of chunks in the buffer
+ * @param mismatch return location for the number of the first chunk which
+ *        does not match
+ *
+ * @return TRUE if all chunks match, FALSE otherwise
+ */
+gboolean r_hash_index_check_chunks(const RaucHashIndex *idx, guint32 first, const guint8 *data, guint32 count, guint32 *mismatch)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Frees the hash index.
  *
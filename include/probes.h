@@ -0,0 +1,30 @@
+#pragma once
+
+/**
+ * @file probes.h
+ * @brief Static tracepoints (USDT) for bpftrace, perf and SystemTap
+ *
+ * When built with '-Dsdt=enabled', each R_PROBE*() places a single nop and an
+ * ELF note describing the probe 'rauc:<name>' in the binary. Tools attaching
+ * to a probe replace the nop with a breakpoint, so there is no runtime cost
+ * unless a probe is in use. Otherwise, the macros expand to nothing.
+ *
+ * Probe arguments must be integers or pointers and should be cheap to
+ * compute, as they are evaluated even if nothing is attached.
+ *
+ * The available probes are listed in the 'Static Tracepoints' section of the
+ * documentation.
+ */
+
+#if ENABLE_SDT
+#include <sys/sdt.h>
+
+#define R_PROBE1(name, a1) DTRACE_PROBE1(rauc, name, a1)
+#define R_PROBE2(name, a1, a2) DTRACE_PROBE2(rauc, name, a1, a2)
+#define R_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(rauc, name, a1, a2, a3)
+#else
+/* sizeof() marks the arguments as used without evaluating them */
+#define R_PROBE1(name, a1) do { (void) sizeof(a1); } while (0)
+#define R_PROBE2(name, a1, a2) do { (void) sizeof(a1); (void) sizeof(a2); } while (0)
+#define R_PROBE3(name, a1, a2, a3) do { (void) sizeof(a1); (void) sizeof(a2); (void) sizeof(a3); } while (0)
+#endif
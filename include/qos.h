@@ -0,0 +1,125 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#define R_QOS_ERROR r_qos_error_quark()
+GQuark r_qos_error_quark(void);
+
+typedef enum {
+	R_QOS_ERROR_INVALID_PROFILE,
+} RQosError;
+
+/* I/O scheduling classes (values as used by the kernel) */
+typedef enum {
+	R_QOS_IO_CLASS_NONE = 0,
+	R_QOS_IO_CLASS_REALTIME = 1,
+	R_QOS_IO_CLASS_BEST_EFFORT = 2,
+	R_QOS_IO_CLASS_IDLE = 3,
+} RQosIoClass;
+
+/**
+ * Parses an I/O scheduling class name ('idle', 'best-effort', 'realtime' or
+ * 'none').
+ *
+ * @param name class name to parse
+ * @param io_class return location for the parsed class
+ *
+ * @return TRUE if the name is valid, FALSE otherwise
+ */
+gboolean r_qos_parse_io_class(const gchar *name, RQosIoClass *io_class)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Switches the QoS profile used for installations.
+ *
+ * With the 'background' profile, the I/O class, nice level, cgroup and write
+ * rate limit configured in the [qos] section are applied to all registered
+ * install threads and tracked subprocesses.
+ * With the 'full' profile, their original settings are restored.
+ * The switch takes effect immediately, also for a running installation.
+ *
+ * @param name profile name ('background' or 'full')
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if the profile is invalid or not configured
+ */
+gboolean r_qos_set_profile(const gchar *name, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the name of the current QoS profile ('background' or 'full').
+ *
+ * @return profile name (static string)
+ */
+const gchar *r_qos_get_profile(void);
+
+/**
+ * Registers the calling thread as install thread and applies the current
+ * QoS profile to it.
+ *
+ * Must be balanced by a call to r_qos_leave_thread() in the same thread.
+ */
+void r_qos_enter_thread(void);
+
+/**
+ * Restores the original scheduling settings of the calling thread and
+ * unregisters it.
+ */
+void r_qos_leave_thread(void);
+
+typedef struct _RQosChildSetup RQosChildSetup;
+
+/**
+ * Captures the current QoS profile for a subprocess which is about to be
+ * spawned.
+ *
+ * Pass r_qos_child_setup() with the result as child setup function to the
+ * GSubprocessLauncher, so that the profile is applied before the subprocess
+ * executes (and thus also to all processes it forks).
+ * Until QoS has been initialized by r_qos_enter_thread() or
+ * r_qos_set_profile(), nothing is applied.
+ *
+ * @param child_setup additional child setup function to call afterwards, or
+ *        NULL
+ * @param user_data user data for child_setup
+ *
+ * @return new RQosChildSetup, free with r_qos_child_setup_free()
+ */
+RQosChildSetup *r_qos_child_setup_new(GSpawnChildSetupFunc child_setup, gpointer user_data)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Applies the captured QoS profile in the forked child.
+ *
+ * Only uses async-signal-safe functions, see signal-safety(7).
+ *
+ * @param user_data RQosChildSetup
+ */
+void r_qos_child_setup(gpointer user_data);
+
+/**
+ * Frees a RQosChildSetup.
+ *
+ * @param user_data RQosChildSetup to free
+ */
+void r_qos_child_setup_free(gpointer user_data);
+
+/**
+ * Keeps track of a subprocess spawned with 'setup' for later profile changes.
+ *
+ * If the profile was switched since 'setup' was captured, the current one is
+ * applied.
+ *
+ * @param sproc subprocess to track
+ * @param setup QoS settings the subprocess was spawned with
+ */
+void r_qos_track_subprocess(GSubprocess *sproc, const RQosChildSetup *setup);
+
+/**
+ * Accounts for 'bytes' written to a slot and sleeps as needed to keep the
+ * write rate below the limit of the current QoS profile.
+ *
+ * @param bytes number of bytes written since the last call
+ */
+void r_qos_throttle_write(guint64 bytes);
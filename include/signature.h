@@ -160,6 +160,11 @@ G_GNUC_WARN_UNUSED_RESULT;
 /**
  * Verify detached signature for given file.
  *
+ * For detached signatures, the content is read sequentially in chunks (on a
+ * separate thread) and passed to OpenSSL through a BIO, so it is never held
+ * in memory completely. Otherwise, the content is mapped and verified by
+ * cms_verify_bytes().
+ *
  * @param fd file descriptor to verify against signature
  * @param sig signature used to verify
  * @param limit size of content to use, 0 if all should be included
@@ -11,6 +11,13 @@ typedef enum {
 	ST_BOOTED = 4 | ST_ACTIVE,
 } SlotState;
 
+typedef enum {
+	/** write the complete image */
+	R_SLOT_WRITE_MODE_FULL = 0,
+	/** write only the blocks which differ from the current slot content */
+	R_SLOT_WRITE_MODE_COMPARE,
+} RSlotWriteMode;
+
 typedef struct {
 	gchar *bundle_compatible;
 	gchar *bundle_version;
@@ -51,6 +58,10 @@ typedef struct _RaucSlot {
 	gchar *extra_mount_opts;
 	/** flag indicating to resize after writing (only for ext4) */
 	gboolean resize;
+	/** how raw images are written to this slot */
+	RSlotWriteMode write_mode;
+	/** flag indicating to read back and verify images after writing */
+	gboolean verify_write;
 	/** start address of first boot-partition (for boot-mbr-switch, boot-gpt-switch and boot-raw-fallback) */
 	guint64 region_start;
 	/** size of both partitions(for boot-mbr-switch, boot-gpt-switch and boot-raw-fallback) */
@@ -208,6 +219,45 @@ G_GNUC_WARN_UNUSED_RESULT;
  */
 void r_slot_clean_data_directory(const RaucSlot *slot);
 
+/**
+ * Returns the offset up to which a previous, interrupted write of an image
+ * to the slot is known to be on disk.
+ *
+ * The checkpoint is only returned if it was recorded for the same image
+ * (identified by its checksum) and write method.
+ *
+ * @param slot slot to get the checkpoint for
+ * @param checksum checksum of the image to be written
+ * @param method write method (e.g. 'raw' or 'block-hash-index')
+ *
+ * @return checkpoint offset, or 0 if there is no matching checkpoint
+ */
+goffset r_slot_get_write_checkpoint(const RaucSlot *slot, const RaucChecksum *checksum, const gchar *method);
+
+/**
+ * Records the offset up to which an image has been written to the slot.
+ *
+ * The caller must ensure that the data up to 'offset' is already on disk.
+ * The checkpoint is stored in the slot's data directory.
+ *
+ * @param slot slot to set the checkpoint for
+ * @param checksum checksum of the image being written
+ * @param method write method (e.g. 'raw' or 'block-hash-index')
+ * @param offset offset up to which the image has been written
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if successful, otherwise FALSE
+ */
+gboolean r_slot_set_write_checkpoint(const RaucSlot *slot, const RaucChecksum *checksum, const gchar *method, goffset offset, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Removes the write checkpoint of the slot (if any).
+ *
+ * @param slot slot to remove the checkpoint for
+ */
+void r_slot_clear_write_checkpoint(const RaucSlot *slot);
+
 /**
  * Gets all classes that do not have a parent
  *
@@ -2,12 +2,26 @@
 
 #include <glib.h>
 
+/* number of recent values used by r_stats_get_recent_avg() */
+#define R_STATS_WINDOW 64
+
+/**
+ * Collects count, sum, min and max of a series of values, the most recent
+ * R_STATS_WINDOW values and a log-bucketed histogram (8 buckets per power of
+ * two, so percentiles have a relative error below 12.5%).
+ *
+ * All functions can be called from multiple threads concurrently.
+ */
 typedef struct {
 	gchar *label;
-	gdouble values[64];
+	gdouble values[R_STATS_WINDOW];
 	guint64 count, next;
 	gdouble sum;
 	gdouble min, max;
+	guint64 *buckets;
+	/* last time the values were recorded as trace event */
+	gint64 trace_time;
+	GMutex lock;
 } RaucStats;
 
 RaucStats *r_stats_new(const gchar *label);
@@ -16,10 +30,62 @@ void r_stats_add(RaucStats *stats, gdouble value);
 
 gdouble r_stats_get_avg(const RaucStats *stats);
 
+/**
+ * Returns the average of the last R_STATS_WINDOW values.
+ *
+ * @param stats RaucStats to query
+ *
+ * @return average, or 0.0 if no value was added
+ */
 gdouble r_stats_get_recent_avg(const RaucStats *stats);
 
+/**
+ * Returns an approximation of a percentile of all values.
+ *
+ * The result is the upper bound of the histogram bucket containing the
+ * percentile, limited to the minimum and maximum value.
+ *
+ * @param stats RaucStats to query
+ * @param percentile percentile (0-100)
+ *
+ * @return approximated percentile, or 0.0 if no value was added
+ */
+gdouble r_stats_get_percentile(const RaucStats *stats, gdouble percentile);
+
 void r_stats_show(const RaucStats *stats, const gchar *prefix);
 
+/**
+ * Returns the statistics as a dictionary (a{sv}) containing 'label',
+ * 'count', 'sum', 'min', 'max', 'avg', 'recent-avg', 'p50', 'p90' and 'p99'.
+ *
+ * @param stats RaucStats to export
+ *
+ * @return new floating GVariant
+ */
+GVariant *r_stats_to_variant(const RaucStats *stats);
+
+#if ENABLE_JSON
+/**
+ * Returns the statistics as a JSON object with the members described for
+ * r_stats_to_variant().
+ *
+ * @param stats RaucStats to export
+ *
+ * @return newly allocated JSON string
+ */
+gchar *r_stats_to_json(const RaucStats *stats);
+#endif
+
+/**
+ * Logs the statistics as 'stats' event to the event log.
+ *
+ * The values are available in the RAUC_STATS_* fields.
+ *
+ * @param stats RaucStats to log
+ * @param prefix optional prefix for the label
+ */
+void r_stats_log_event(const RaucStats *stats, const gchar *prefix);
+
 void r_stats_free(RaucStats *stats);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucStats, r_stats_free);
 
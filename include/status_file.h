@@ -39,6 +39,9 @@ G_GNUC_WARN_UNUSED_RESULT;
  * afterwards. If a problem occurs the stored slot status consists of default
  * values. Do nothing if the status information have already been loaded before.
  *
+ * Per-slot status files are cached in the status cache directory, so that the
+ * slot is only mounted if there is no cache entry matching the slot device.
+ *
  * @param dest_slot Slot to load status information for
  */
 void r_slot_status_load(RaucSlot *dest_slot);
@@ -50,7 +53,7 @@ void r_slot_status_load(RaucSlot *dest_slot);
  * given slot data structure. If the user configured a global status file in the
  * system.conf they are written to this file. Otherwise mount the given slot,
  * transfer the status information to the local status file and unmount the slot
- * afterwards.
+ * afterwards. The status cache is updated as well.
  *
  * @param dest_slot Slot to write status information for
  * @param error return location for a GError, or NULL
@@ -60,6 +63,17 @@ void r_slot_status_load(RaucSlot *dest_slot);
 gboolean r_slot_status_save(RaucSlot *dest_slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Removes the cached per-slot status of a slot.
+ *
+ * Must be called before the slot content is modified, so that an interrupted
+ * update does not leave an outdated cache entry behind.
+ * Does nothing if no per-slot status files are used.
+ *
+ * @param dest_slot Slot to remove the cached status for
+ */
+void r_slot_status_invalidate_cache(RaucSlot *dest_slot);
+
 typedef struct {
 	gchar *boot_id;
 } RSystemStatus;
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <gio/gio.h>
+
+/**
+ * @file trace_event.h
+ * @brief Timeline of internal activity in the Chrome trace event format
+ *
+ * Events are appended to the trace file as elements of a JSON array, each on
+ * its own line and written with a single write(). The closing ']' is omitted,
+ * as allowed by the format, so that helper processes (like the NBD server) can
+ * append their events to the same file. The file can be loaded in Perfetto or
+ * chrome://tracing.
+ *
+ * Timestamps are taken from the monotonic clock (in microseconds), so events
+ * of different processes are on the same time line.
+ *
+ * All functions do nothing if no trace file is open.
+ */
+
+/* environment variable passing the trace file to tracing helper processes */
+#define R_TRACE_EVENT_FILE_ENV "RAUC_TRACE_FILE"
+
+#define R_TRACE_EVENT_ERROR r_trace_event_error_quark()
+GQuark r_trace_event_error_quark(void);
+
+typedef enum {
+	R_TRACE_EVENT_ERROR_FAILED,
+} RTraceEventError;
+
+/**
+ * Creates (or truncates) a trace file and starts recording events.
+ *
+ * Use r_trace_event_setup_launcher() to let helper processes append to it.
+ *
+ * @param path trace file to write
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_trace_event_open(const gchar *path, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Passes the open trace file (if any) to a helper process which records events
+ * itself, by setting R_TRACE_EVENT_FILE_ENV in the launcher's environment.
+ *
+ * Other subprocesses do not get the variable.
+ *
+ * @param launcher GSubprocessLauncher of the helper process
+ */
+void r_trace_event_setup_launcher(GSubprocessLauncher *launcher);
+
+/**
+ * Starts appending events to the trace file set in R_TRACE_EVENT_FILE_ENV by
+ * the parent process, if any.
+ *
+ * The variable is removed from the environment, so that it is not inherited
+ * by further subprocesses. Thus this must be called before any threads are
+ * started.
+ */
+void r_trace_event_attach(void);
+
+/**
+ * Stops recording events and closes the trace file.
+ */
+void r_trace_event_close(void);
+
+/**
+ * Returns whether events are recorded.
+ *
+ * This can be used to skip preparing event arguments.
+ *
+ * @return TRUE if a trace file is open, FALSE otherwise
+ */
+gboolean r_trace_event_enabled(void);
+
+/**
+ * Records the begin of a duration on the calling thread.
+ *
+ * @param category event category (such as "step")
+ * @param name event name
+ */
+void r_trace_event_begin(const gchar *category, const gchar *name);
+
+/**
+ * Records the end of the duration begun last on the calling thread.
+ *
+ * @param category event category
+ * @param name event name
+ */
+void r_trace_event_end(const gchar *category, const gchar *name);
+
+/**
+ * Records a finished duration on the calling thread.
+ *
+ * @param category event category
+ * @param name event name
+ * @param start monotonic start time (see g_get_monotonic_time())
+ * @param duration duration in microseconds
+ * @param args JSON object members describing the event (such as
+ *        "\"offset\":0,\"length\":4096"), or NULL
+ */
+void r_trace_event_complete(const gchar *category, const gchar *name, gint64 start, gint64 duration, const gchar *args);
+
+/**
+ * Records an event without duration on the calling thread.
+ *
+ * @param category event category
+ * @param name event name
+ * @param args JSON object members describing the event, or NULL
+ */
+void r_trace_event_instant(const gchar *category, const gchar *name, const gchar *args);
+
+/**
+ * Records the value of a counter.
+ *
+ * @param name counter name
+ * @param series name of the value series
+ * @param value current value
+ */
+void r_trace_event_counter(const gchar *name, const gchar *series, gdouble value);
+
+/**
+ * Returns a string quoted and escaped for use in JSON event arguments.
+ *
+ * @param str string to quote
+ *
+ * @return newly allocated JSON string
+ */
+gchar *r_trace_event_quote(const gchar *str);
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_UBOOT_ENV_ERROR r_uboot_env_error_quark()
+GQuark r_uboot_env_error_quark(void);
+
+typedef enum {
+	R_UBOOT_ENV_ERROR_CONFIG,
+	R_UBOOT_ENV_ERROR_UNSUPPORTED,
+	R_UBOOT_ENV_ERROR_CORRUPT,
+	R_UBOOT_ENV_ERROR_TOO_LARGE,
+	R_UBOOT_ENV_ERROR_NOT_FOUND,
+} RUbootEnvError;
+
+#define R_UBOOT_ENV_DEFAULT_CONFIG "/etc/fw_env.config"
+
+typedef struct _RUbootEnv RUbootEnv;
+
+/**
+ * Reads the U-Boot environment described by a fw_env.config file.
+ *
+ * The configuration uses the format of the U-Boot fw_printenv/fw_setenv
+ * tools: one line per environment copy, containing the device (or file)
+ * name, the offset, the environment size and optionally the erase sector
+ * size and number of sectors. With two lines, the environment is redundant
+ * and the valid copy with the newer flag byte is used. Like fw_printenv, the
+ * flag is a boolean (active/obsolete) for NOR flash and an incrementing
+ * counter otherwise.
+ *
+ * The environment stays locked (using the same lock file as fw_printenv)
+ * until it is freed.
+ *
+ * @param config_path fw_env.config to use
+ * @param error return location for a GError, or NULL
+ *
+ * @return newly allocated RUbootEnv, or NULL if an error occurred
+ */
+RUbootEnv *r_uboot_env_open(const gchar *config_path, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the value of a variable of the in-memory environment.
+ *
+ * @param env RUbootEnv to look up
+ * @param key variable name
+ *
+ * @return value (owned by env), or NULL if the variable is not set
+ */
+const gchar *r_uboot_env_get(RUbootEnv *env, const gchar *key);
+
+/**
+ * Sets or removes a variable of the in-memory environment.
+ *
+ * Changes are only written by r_uboot_env_commit().
+ *
+ * @param env RUbootEnv to modify
+ * @param key variable name
+ * @param value new value, NULL or "" to remove the variable
+ */
+void r_uboot_env_set(RUbootEnv *env, const gchar *key, const gchar *value);
+
+/**
+ * Writes all changes made by r_uboot_env_set() in a single update.
+ *
+ * For redundant environments, the inactive copy is written with an
+ * incremented flag byte, so that the update is atomic. On NOR flash, the new
+ * copy is written as active instead and the flag of the previous copy is
+ * cleared to obsolete afterwards. Without modifications, nothing is written.
+ *
+ * @param env RUbootEnv to write
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_uboot_env_commit(RUbootEnv *env, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees the environment and releases the lock.
+ *
+ * Uncommitted changes are discarded.
+ *
+ * @param env RUbootEnv to free
+ */
+void r_uboot_env_free(RUbootEnv *env);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RUbootEnv, r_uboot_env_free);
@@ -13,6 +13,7 @@ typedef enum {
 	R_UPDATE_ERROR_FAILED,
 	R_UPDATE_ERROR_NO_HANDLER,
 	R_UPDATE_ERROR_UNSUPPORTED_ADAPTIVE_MODE,
+	R_UPDATE_ERROR_VERIFY_FAILED,
 } RUpdateError;
 
 typedef gboolean (*img_to_slot_handler)(RaucImage *image, RaucSlot *dest_slot, const gchar *hook_name, GError **error)
@@ -21,6 +22,23 @@ G_GNUC_WARN_UNUSED_RESULT;
 img_to_slot_handler get_update_handler(RaucImage *mfimage, RaucSlot  *dest_slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Checks whether the given handler reads back and verifies the image after
+ * writing it to the slot.
+ *
+ * This is the case if 'verify-write' is enabled for the slot and the handler
+ * writes the image contents to the slot device as-is.
+ * The handler then splits its 'copy_image' progress step into a 'copy_image'
+ * and a 'verify_image' substep (with equal weight).
+ *
+ * @param handler update handler (as returned by get_update_handler())
+ * @param image image to install
+ * @param slot target slot
+ *
+ * @return TRUE if the handler verifies the written image, FALSE otherwise
+ */
+gboolean r_update_handler_verifies_write(img_to_slot_handler handler, const RaucImage *image, const RaucSlot *slot);
+
 struct boot_switch_partition {
 	guint64 start;          /* address in bytes */
 	guint64 size;           /* size in bytes */
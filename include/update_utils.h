@@ -5,6 +5,9 @@
 #include <gio/gunixoutputstream.h>
 #include <glib.h>
 
+#include "checksum.h"
+#include "hash_index.h"
+
 /* These functions can be used by slot and artifact update handlers. */
 
 /**
@@ -63,3 +66,114 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
 		goffset size, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Called by r_copy_stream_with_checkpoints() each time another checkpoint
+ * interval has been written.
+ *
+ * @param offset offset up to which data has been written
+ * @param data user data
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE to continue copying, FALSE to abort with an error
+ */
+typedef gboolean (*RCopyCheckpointFunc)(goffset offset, gpointer data, GError **error);
+
+/**
+ * Copies data from an input stream to an output stream, while generating
+ * progress updates and calling a checkpoint function at regular intervals.
+ *
+ * Both streams must already be positioned at offset 'done', which allows
+ * continuing an interrupted copy.
+ *
+ * @param in_stream input stream
+ * @param out_stream output stream
+ * @param size expected total size of the data
+ * @param done size of the data which is already in place
+ * @param interval checkpoint interval in bytes (0 to disable)
+ * @param checkpoint checkpoint function, or NULL
+ * @param data user data for the checkpoint function
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if copying was successful, FALSE otherwise
+ */
+gboolean r_copy_stream_with_checkpoints(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, goffset done, goffset interval,
+		RCopyCheckpointFunc checkpoint, gpointer data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Copies a file to a file or device, while generating progress updates and
+ * calling a checkpoint function at regular intervals.
+ *
+ * Uses r_copy_fd_with_progress(), so that the data is shared (reflink) or
+ * copied in the kernel where possible. The amount of dirty data and the
+ * write rate are bounded as for the other copy functions.
+ * The data is copied to the same offsets in the output, starting at 0,
+ * regardless of the file position of 'out_fd'.
+ *
+ * @param in_fd input file descriptor
+ * @param out_fd output file descriptor
+ * @param size size of the data to copy
+ * @param interval checkpoint interval in bytes (0 to disable)
+ * @param checkpoint checkpoint function, or NULL
+ * @param data user data for the checkpoint function
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if copying was successful, FALSE otherwise
+ */
+gboolean r_copy_fd_with_checkpoints(int in_fd, int out_fd, goffset size,
+		goffset interval, RCopyCheckpointFunc checkpoint, gpointer data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Copies a sparse file to a file or device, while generating progress updates
+ * and calling a checkpoint function at regular intervals.
+ *
+ * Only the data extents of the input file (as found by SEEK_DATA/SEEK_HOLE)
+ * are copied. The holes are zeroed on the output in a single request each,
+ * using BLKZEROOUT for block devices and hole punching for regular files.
+ * Where this is not supported, zeros are written instead.
+ *
+ * The data is copied to the same offsets in the output, starting at 'done',
+ * regardless of the file position of 'out_fd'. Zeroed holes are not accounted
+ * for the write rate limit.
+ *
+ * @param in_fd input file descriptor
+ * @param out_fd output file descriptor
+ * @param size total size of the data
+ * @param done size of the data which is already in place
+ * @param interval checkpoint interval in bytes (0 to disable)
+ * @param checkpoint checkpoint function, or NULL
+ * @param data user data for the checkpoint function
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if copying was successful, FALSE otherwise
+ */
+gboolean r_copy_sparse_fd_with_checkpoints(int in_fd, int out_fd,
+		goffset size, goffset done, goffset interval,
+		RCopyCheckpointFunc checkpoint, gpointer data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Reads back the data written to a slot device and compares it against the
+ * image it was written from.
+ *
+ * If a block hash index of the image is given, the device is read by several
+ * threads in parallel and each chunk is compared against the index.
+ * Otherwise, the data is hashed and compared against the image checksum,
+ * while the next data is read ahead on a separate thread.
+ * Where supported, the device is read with O_DIRECT, so that the data is
+ * actually read back from the storage instead of the page cache.
+ *
+ * Progress is reported for the 'verify_image' step.
+ *
+ * @param device slot device to verify
+ * @param checksum checksum of the image
+ * @param idx block hash index of the image, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the data matches, FALSE otherwise
+ */
+gboolean r_verify_written_image(const gchar *device, const RaucChecksum *checksum, const RaucHashIndex *idx, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
@@ -43,22 +43,51 @@ G_DEFINE_AUTO_CLEANUP_FREE_FUNC(filedesc, close_preserve_errno, -1)
 
 #define R_LOG_DOMAIN_SUBPROCESS "rauc-subprocess"
 
-static inline GSubprocess* r_subprocess_newv(GPtrArray *args, GSubprocessFlags flags, GError **error)
-{
-	g_autofree gchar *call = g_strjoinv(" ", (gchar**) args->pdata);
-	g_log(R_LOG_DOMAIN_SUBPROCESS, G_LOG_LEVEL_DEBUG, "launching subprocess: %s", call);
-
-	return g_subprocess_newv((const gchar * const *) args->pdata, flags, error);
-}
+/**
+ * Starts a subprocess.
+ *
+ * The current QoS profile is applied to it before it executes.
+ *
+ * @param args subprocess arguments (NULL-terminated)
+ * @param flags subprocess flags
+ * @param error return location for a GError, or NULL
+ *
+ * @return new GSubprocess, or NULL if an error occurred
+ */
+GSubprocess *r_subprocess_newv(GPtrArray *args, GSubprocessFlags flags, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
 
-static inline GSubprocess * r_subprocess_launcher_spawnv(GSubprocessLauncher *launcher, GPtrArray *args, GError **error)
-{
-	g_autofree gchar *call = g_strjoinv(" ", (gchar**) args->pdata);
-	g_log(R_LOG_DOMAIN_SUBPROCESS, G_LOG_LEVEL_DEBUG, "launching subprocess: %s", call);
+/**
+ * Starts a subprocess using a GSubprocessLauncher.
+ *
+ * The current QoS profile is applied to it before it executes. As this uses
+ * the child setup function of the launcher, use
+ * r_subprocess_launcher_spawnv_full() to run an additional one.
+ *
+ * @param launcher GSubprocessLauncher to use
+ * @param args subprocess arguments (NULL-terminated)
+ * @param error return location for a GError, or NULL
+ *
+ * @return new GSubprocess, or NULL if an error occurred
+ */
+GSubprocess *r_subprocess_launcher_spawnv(GSubprocessLauncher *launcher, GPtrArray *args, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
 
-	return g_subprocess_launcher_spawnv(launcher,
-			(const gchar * const *)args->pdata, error);
-}
+/**
+ * Like r_subprocess_launcher_spawnv(), but runs 'child_setup' in the child
+ * after applying the QoS profile.
+ *
+ * @param launcher GSubprocessLauncher to use
+ * @param args subprocess arguments (NULL-terminated)
+ * @param child_setup child setup function, see g_subprocess_launcher_set_child_setup()
+ * @param user_data user data for child_setup
+ * @param error return location for a GError, or NULL
+ *
+ * @return new GSubprocess, or NULL if an error occurred
+ */
+GSubprocess *r_subprocess_launcher_spawnv_full(GSubprocessLauncher *launcher, GPtrArray *args,
+		GSpawnChildSetupFunc child_setup, gpointer user_data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
 
 GSubprocess *r_subprocess_new(GSubprocessFlags flags, GError **error, const gchar *argv0, ...)
 G_GNUC_WARN_UNUSED_RESULT;
@@ -191,6 +220,106 @@ gboolean copy_file(const gchar *srcprefix, const gchar *srcfile,
 		const gchar *dstprefix, const gchar *dstfile, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Share the data of a file with another file (reflink).
+ *
+ * Creates a copy-on-write clone of infd in outfd and truncates it to 'size'
+ * bytes. Both files must be on the same filesystem and the filesystem must
+ * support reflinks (such as btrfs or XFS).
+ *
+ * @param infd file descriptor of the source file
+ * @param outfd file descriptor of the (empty) destination file
+ * @param size number of bytes to keep (must not exceed the source size)
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred. If reflinks are not
+ *         supported, G_IO_ERROR_NOT_SUPPORTED is returned.
+ */
+gboolean r_reflink_fd(int infd, int outfd, goffset size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Called by r_copy_fd_with_progress() after each copied chunk.
+ *
+ * @param done number of bytes copied so far
+ * @param data user data
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE to continue copying, FALSE to abort with an error
+ */
+typedef gboolean (*RCopyFdProgressFunc)(goffset done, gpointer data, GError **error);
+
+/**
+ * Copy the first 'size' bytes of a file to a file or device.
+ *
+ * Uses the fastest method available for the given file descriptors:
+ * 1. a reflink (FICLONE for empty destination files, FICLONERANGE
+ *    otherwise, so that existing data after 'size' is kept),
+ * 2. copy_file_range() (which can avoid copying the data through user space
+ *    or even share it on some filesystems),
+ * 3. sendfile() (which also works across filesystems and to devices),
+ * 4. pread() and pwrite() as fallback.
+ *
+ * The data is written to the same offsets in the destination.
+ *
+ * @param infd file descriptor of the source file
+ * @param outfd file descriptor of the destination file or device
+ * @param size number of bytes to copy
+ * @param progress function called after each copied chunk, or NULL
+ * @param data user data for the progress function
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_copy_fd_with_progress(int infd, int outfd, goffset size, RCopyFdProgressFunc progress, gpointer data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Copy the first 'size' bytes of a file to another file.
+ *
+ * Same as r_copy_fd_with_progress() without progress reporting.
+ *
+ * @param infd file descriptor of the source file
+ * @param outfd file descriptor of the (empty) destination file
+ * @param size number of bytes to copy
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_copy_fd(int infd, int outfd, goffset size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Function type for jobs run by r_run_jobs().
+ *
+ * @param job_data the job element from the jobs array
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+typedef gboolean (*RJobFunc)(gpointer job_data, GError **error);
+
+/**
+ * Runs independent jobs concurrently on a bounded number of threads.
+ *
+ * Once a job has failed, jobs which were not started yet are skipped.
+ * If several jobs fail, the error of the first failed job (in array order)
+ * is returned, independent of the order in which the jobs finished.
+ *
+ * With max_jobs set to 1, the jobs are run sequentially in the calling
+ * thread.
+ *
+ * @param jobs array of job elements passed to func
+ * @param func function to call for each job
+ * @param max_jobs maximum number of jobs to run at the same time (0 for the
+ *        number of available processors)
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if all jobs succeeded, FALSE otherwise
+ */
+gboolean r_run_jobs(GPtrArray *jobs, RJobFunc func, guint max_jobs, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Recursively delete directory contents.
  *
@@ -323,9 +452,82 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_pwrite_exact(const int fd, const guint8 *data, size_t size, off_t offset, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
-gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offset, GError **error)
+/**
+ * Writes data at the given offset, unless it is already present there.
+ *
+ * @param fd file descriptor to write to (must be readable as well)
+ * @param data data to write
+ * @param size size of data
+ * @param offset offset to write to
+ * @param written return location for whether the data was written, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offset, gboolean *written, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * State for bounding the amount of dirty pages while writing a file or device
+ * sequentially.
+ *
+ * Once a window of 'window' bytes has been written, its writeback is started
+ * with sync_file_range(). Then the writeback of the previous window is waited
+ * for and it is dropped from the page cache, so that at most two windows are
+ * dirty or under writeback at any time.
+ */
+typedef struct {
+	int fd;
+	goffset window;
+	/** start of the window currently being written */
+	goffset start;
+	/** end of the range known to be written back */
+	goffset done;
+	/** end of the range reported as written so far */
+	goffset end;
+} RWriteback;
+
+/**
+ * Initializes writeback state for a sequential write.
+ *
+ * @param wb RWriteback to initialize
+ * @param fd file descriptor written to
+ * @param offset offset at which the write starts
+ * @param window size of the writeback window in bytes (0 disables bounding)
+ */
+void r_writeback_init(RWriteback *wb, int fd, goffset offset, goffset window);
+
+/**
+ * Informs the writeback state that data has been written up to 'end'.
+ *
+ * Starts writeback for each completely written window and waits for the
+ * writeback of the window before it.
+ * If the file descriptor does not support sync_file_range(), bounding is
+ * disabled silently.
+ * The newly written data is also accounted for the write rate limit of the
+ * current QoS profile (see r_qos_throttle_write()).
+ *
+ * @param wb RWriteback
+ * @param end offset up to which data has been written
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if writeback failed
+ */
+gboolean r_writeback_update(RWriteback *wb, goffset end, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Informs the writeback state that the range up to 'end' has been skipped.
+ *
+ * This is used for ranges which were not written as data (such as holes
+ * zeroed by the storage), so that they are not accounted for the write rate
+ * limit.
+ *
+ * @param wb RWriteback
+ * @param end offset up to which the output has been skipped
+ */
+void r_writeback_skip(RWriteback *wb, goffset end);
+
 guint get_sectorsize(gint fd)
 G_GNUC_WARN_UNUSED_RESULT;
 
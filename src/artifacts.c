@@ -5,6 +5,7 @@
 
 #include "artifacts_composefs.h"
 #include "context.h"
+#include "extract.h"
 #include "glib/gstdio.h"
 #include "slot.h"
 #include "update_utils.h"
@@ -733,8 +734,8 @@ static gboolean files_artifact_install(const RArtifact *artifact, const RaucImag
 		return FALSE;
 	}
 
-	/* call copy with progress */
-	if (!r_copy_stream_with_progress(G_INPUT_STREAM(in_stream), G_OUTPUT_STREAM(out_stream), image->checksum.size, &ierror)) {
+	/* copy with progress, sharing the data with the bundle if possible */
+	if (!r_copy_fd_with_checkpoints(in_fd, out_fd, image->checksum.size, 0, NULL, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -769,6 +770,12 @@ static gboolean tree_artifact_install_tar(const RArtifact *artifact, const RaucI
 		return FALSE;
 	}
 
+#if ENABLE_ARCHIVE == 1
+	if (!r_extract_archive(name, artifact->path_tmp, R_EXTRACT_FLAGS_XATTRS, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to extract archive: ");
+		return FALSE;
+	}
+#else
 	g_autoptr(GPtrArray) args = g_ptr_array_new_full(10, g_free);
 	g_ptr_array_add(args, g_strdup("tar"));
 	g_ptr_array_add(args, g_strdup("--numeric-owner"));
@@ -785,6 +792,7 @@ static gboolean tree_artifact_install_tar(const RArtifact *artifact, const RaucI
 		g_propagate_prefixed_error(error, ierror, "Failed to extract archive (tar -xf): ");
 		return FALSE;
 	}
+#endif
 	return TRUE;
 }
 
@@ -5,7 +5,10 @@
 #include "bootchooser.h"
 #include "config_file.h"
 #include "context.h"
+#include "efivars.h"
+#include "grub_env.h"
 #include "install.h"
+#include "uboot_env.h"
 #include "utils.h"
 
 GQuark r_bootchooser_error_quark(void)
@@ -23,7 +26,6 @@ GQuark r_bootchooser_error_quark(void)
 #define UBOOT_DEFAULT_ATTEMPTS  3
 #define UBOOT_ATTEMPTS_PRIMARY  3
 #define EFIBOOTMGR_NAME "efibootmgr"
-#define GRUB_EDITENV "grub-editenv"
 
 static const gchar *supported_bootloaders[] = {"barebox", "grub", "uboot", "efi", "custom", "noop", NULL};
 
@@ -57,6 +59,32 @@ static GString *bootchooser_order_primary(RaucSlot *slot)
 	return order;
 }
 
+/* Boot loader state shared by all accesses between r_boot_query_begin() and
+ * r_boot_query_end(). As both the D-Bus main thread and the install thread
+ * query the boot loader, the lock is held for the whole sequence. */
+static GRecMutex boot_query_lock;
+static GHashTable *barebox_cached_states = NULL;
+static REfiBootState *efi_cached_state = NULL;
+static guint boot_query_depth = 0;
+
+void r_boot_query_begin(void)
+{
+	g_rec_mutex_lock(&boot_query_lock);
+	boot_query_depth++;
+}
+
+void r_boot_query_end(void)
+{
+	g_return_if_fail(boot_query_depth > 0);
+
+	if (--boot_query_depth == 0) {
+		g_clear_pointer(&barebox_cached_states, g_hash_table_destroy);
+		g_clear_pointer(&efi_cached_state, r_efivars_boot_state_free);
+	}
+
+	g_rec_mutex_unlock(&boot_query_lock);
+}
+
 typedef struct {
 	guint32 prio;
 	guint32 attempts;
@@ -64,48 +92,88 @@ typedef struct {
 
 #define BOOTSTATE_PREFIX "bootstate"
 
-static gboolean barebox_state_get(const gchar* bootname, BareboxSlotState *bb_state, GError **error)
+static gboolean barebox_parse_value(const gchar *outline, guint32 *value, GError **error)
+{
+	gchar *endptr = NULL;
+	guint64 result;
+
+	errno = 0;
+	result = g_ascii_strtoull(outline, &endptr, 10);
+	if (result == 0 && outline == endptr) {
+		g_set_error(
+				error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"Failed to parse value: '%s'", outline);
+		return FALSE;
+	} else if (result == G_MAXUINT64 && errno != 0) {
+		g_set_error(
+				error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"Return value overflow: '%s', error: %d", outline, errno);
+		return FALSE;
+	}
+
+	*value = result;
+
+	return TRUE;
+}
+
+/* Reads priority and remaining attempts of the given bootnames using a single
+ * barebox-state call.
+ * Returns a table mapping bootname to BareboxSlotState. */
+static GHashTable *barebox_state_read(GPtrArray *bootnames, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
 	GInputStream *instream;
 	g_autoptr(GDataInputStream) datainstream = NULL;
-	guint64 result[2] = {};
+	g_autoptr(GHashTable) states = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	g_autoptr(GPtrArray) args = g_ptr_array_new_full(6, g_free);
 
-	g_return_val_if_fail(bootname, FALSE);
-	g_return_val_if_fail(bb_state, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(bootnames, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
 	g_ptr_array_add(args, g_strdup(BAREBOX_STATE_NAME));
 	if (r_context()->config->system_bb_statename) {
 		g_ptr_array_add(args, g_strdup("-n"));
 		g_ptr_array_add(args, g_strdup(r_context()->config->system_bb_statename));
 	}
-	g_ptr_array_add(args, g_strdup("-g"));
-	g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.priority", bootname));
-	g_ptr_array_add(args, g_strdup("-g"));
-	g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.remaining_attempts", bootname));
+	for (guint i = 0; i < bootnames->len; i++) {
+		const gchar *bootname = bootnames->pdata[i];
+
+		g_hash_table_insert(states, g_strdup(bootname), g_new0(BareboxSlotState, 1));
+
+		g_ptr_array_add(args, g_strdup("-g"));
+		g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.priority", bootname));
+		g_ptr_array_add(args, g_strdup("-g"));
+		g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.remaining_attempts", bootname));
+	}
 	if (r_context()->config->system_bb_dtbpath) {
 		g_ptr_array_add(args, g_strdup("-i"));
 		g_ptr_array_add(args, g_strdup(r_context()->config->system_bb_dtbpath));
 	}
 	g_ptr_array_add(args, NULL);
 
+	if (bootnames->len == 0)
+		return g_steal_pointer(&states);
+
 	sub = r_subprocess_newv(args, G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror);
 	if (!sub) {
 		g_propagate_prefixed_error(
 				error,
 				ierror,
 				"Failed to start " BAREBOX_STATE_NAME ": ");
-		return FALSE;
+		return NULL;
 	}
 
 	instream = g_subprocess_get_stdout_pipe(sub);
 	datainstream = g_data_input_stream_new(instream);
 
-	for (int i = 0; i < 2; i++) {
-		gchar *endptr = NULL;
+	/* values are printed in the order of the '-g' arguments */
+	for (guint i = 0; i < 2 * bootnames->len; i++) {
+		BareboxSlotState *bb_state = g_hash_table_lookup(states, bootnames->pdata[i / 2]);
 		g_autofree gchar* outline = g_data_input_stream_read_line(datainstream, NULL, NULL, &ierror);
 		if (!outline) {
 			/* Having no error set there was means no content to read */
@@ -121,24 +189,12 @@ static gboolean barebox_state_get(const gchar* bootname, BareboxSlotState *bb_st
 						ierror,
 						"Failed parsing " BAREBOX_STATE_NAME " output: ");
 			}
-			return FALSE;
+			return NULL;
 		}
 
-		result[i] = g_ascii_strtoull(outline, &endptr, 10);
-		if (result[i] == 0 && outline == endptr) {
-			g_set_error(
-					error,
-					R_BOOTCHOOSER_ERROR,
-					R_BOOTCHOOSER_ERROR_PARSE_FAILED,
-					"Failed to parse value: '%s'", outline);
-			return FALSE;
-		} else if (result[i] == G_MAXUINT64 && errno != 0) {
-			g_set_error(
-					error,
-					R_BOOTCHOOSER_ERROR,
-					R_BOOTCHOOSER_ERROR_PARSE_FAILED,
-					"Return value overflow: '%s', error: %d", outline, errno);
-			return FALSE;
+		if (!barebox_parse_value(outline, (i % 2) ? &bb_state->attempts : &bb_state->prio, &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
 		}
 	}
 
@@ -147,11 +203,72 @@ static gboolean barebox_state_get(const gchar* bootname, BareboxSlotState *bb_st
 				error,
 				ierror,
 				"Failed to run " BAREBOX_STATE_NAME ": ");
-		return FALSE;
+		return NULL;
 	}
 
-	bb_state->prio = result[0];
-	bb_state->attempts = result[1];
+	return g_steal_pointer(&states);
+}
+
+/* Reads the state of all slots with a bootname at once. */
+static GHashTable *barebox_state_read_all(GError **error)
+{
+	g_autoptr(GPtrArray) bootnames = g_ptr_array_new();
+	GHashTableIter iter;
+	RaucSlot *slot;
+
+	g_hash_table_iter_init(&iter, r_context()->config->slots);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
+		if (!slot->bootname)
+			continue;
+		if (g_ptr_array_find_with_equal_func(bootnames, slot->bootname, g_str_equal, NULL))
+			continue;
+
+		g_ptr_array_add(bootnames, slot->bootname);
+	}
+
+	return barebox_state_read(bootnames, error);
+}
+
+static gboolean barebox_state_get(const gchar* bootname, BareboxSlotState *bb_state, GError **error)
+{
+	GError *ierror = NULL;
+	BareboxSlotState *cached;
+
+	g_return_val_if_fail(bootname, FALSE);
+	g_return_val_if_fail(bb_state, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	g_assert(boot_query_depth > 0);
+
+	if (!barebox_cached_states) {
+		barebox_cached_states = barebox_state_read_all(&ierror);
+		if (!barebox_cached_states) {
+			/* a single broken slot state must not affect the others, so
+			 * query each slot on its own (and report its own error) */
+			g_debug("Failed to read barebox state of all slots, reading them separately: %s", ierror->message);
+			g_clear_error(&ierror);
+			barebox_cached_states = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		}
+	}
+
+	cached = g_hash_table_lookup(barebox_cached_states, bootname);
+	if (!cached) {
+		g_autoptr(GPtrArray) bootnames = g_ptr_array_new();
+		g_autoptr(GHashTable) states = NULL;
+
+		g_ptr_array_add(bootnames, (gpointer) bootname);
+		states = barebox_state_read(bootnames, &ierror);
+		if (!states) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		cached = g_new(BareboxSlotState, 1);
+		*cached = *(BareboxSlotState *) g_hash_table_lookup(states, bootname);
+		g_hash_table_insert(barebox_cached_states, g_strdup(bootname), cached);
+	}
+
+	*bb_state = *cached;
 
 	return TRUE;
 }
@@ -167,6 +284,7 @@ static gboolean barebox_state_set(GPtrArray *pairs, GError **error)
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	g_assert_cmpuint(pairs->len, >, 0);
+	g_assert(boot_query_depth > 0);
 
 	g_ptr_array_add(args, g_strdup(BAREBOX_STATE_NAME));
 	if (r_context()->config->system_bb_statename) {
@@ -192,6 +310,9 @@ static gboolean barebox_state_set(GPtrArray *pairs, GError **error)
 		return FALSE;
 	}
 
+	/* barebox-state may adjust values, so read them again when needed */
+	g_clear_pointer(&barebox_cached_states, g_hash_table_destroy);
+
 	if (!g_subprocess_wait_check(sub, NULL, &ierror)) {
 		g_propagate_prefixed_error(
 				error,
@@ -350,133 +471,82 @@ static gboolean barebox_set_primary(RaucSlot *slot, GError **error)
 	return TRUE;
 }
 
-static gboolean grub_env_get(const gchar *key, GString **value, GError **error)
+static RGrubEnv *grub_env_read(GError **error)
 {
-	g_autoptr(GPtrArray) sub_args = NULL;
-	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
-	g_autoptr(GBytes) stdout_bytes = NULL;
-	g_autofree gchar *stdout_str = NULL;
-	gsize offset;
-	gsize size;
-	gint ret;
-
-	g_return_val_if_fail(key, FALSE);
-	g_return_val_if_fail(value && *value == NULL, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	RGrubEnv *env;
 
-	sub_args = g_ptr_array_new_full(4, g_free);
-	g_ptr_array_add(sub_args, g_strdup(GRUB_EDITENV));
-	if (r_context()->config->grubenv_path) {
-		g_ptr_array_add(sub_args, g_strdup(r_context()->config->grubenv_path));
-	}
-	g_ptr_array_add(sub_args, g_strdup("list"));
-	g_ptr_array_add(sub_args, NULL);
+	g_assert_nonnull(r_context()->config->grubenv_path);
 
-	sub = r_subprocess_newv(sub_args, G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE, &ierror);
-	if (!sub) {
+	env = r_grub_env_read(r_context()->config->grubenv_path, &ierror);
+	if (!env) {
 		g_propagate_prefixed_error(
 				error,
 				ierror,
-				"Failed to start " GRUB_EDITENV ": ");
-		return FALSE;
+				"Failed to read GRUB environment: ");
+		return NULL;
 	}
 
-	if (!g_subprocess_communicate(sub, NULL, NULL, &stdout_bytes, NULL, &ierror)) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"Failed to run " GRUB_EDITENV ": ");
-		return FALSE;
-	}
+	return env;
+}
 
-	if (!g_subprocess_get_if_exited(sub)) {
-		g_set_error_literal(
-				error,
-				G_SPAWN_ERROR,
-				G_SPAWN_ERROR_FAILED,
-				GRUB_EDITENV " did not exit normally");
-		return FALSE;
-	}
+static gboolean grub_env_get(RGrubEnv *env, const gchar *key, GString **value, GError **error)
+{
+	const gchar *val;
 
-	ret = g_subprocess_get_exit_status(sub);
-	if (ret != 0) {
+	g_return_val_if_fail(env, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(value && *value == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	val = r_grub_env_get(env, key);
+	if (!val) {
 		g_set_error(
 				error,
-				G_SPAWN_EXIT_ERROR,
-				ret,
-				GRUB_EDITENV " failed with exit code: %i", ret);
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"Variable %s not set in grub environment", key);
 		return FALSE;
 	}
 
-	/* Call to grub-editenv lists all variables */
-	stdout_str = r_bytes_unref_to_string(&stdout_bytes);
-	if (stdout_str) {
-		g_autofree gchar *key_prefix = g_strdup_printf("%s=", key);
-		g_auto(GStrv) variables = g_strsplit(stdout_str, "\n", -1);
-		for (gchar **variable = variables; *variable; variable++) {
-			if (!g_str_has_prefix(*variable, key_prefix)) {
-				continue;
-			}
+	*value = g_string_new(val);
 
-			offset = strlen(key_prefix);
-			size = strlen(*variable);
-			*value = g_string_new_len(*variable + offset, size - offset);
-			g_strchomp((*value)->str);
-			return TRUE;
-		}
-	}
-
-	/* Environment variable with specified key not found */
-	g_set_error(
-			error,
-			R_BOOTCHOOSER_ERROR,
-			R_BOOTCHOOSER_ERROR_PARSE_FAILED,
-			"Variable %s not set in grub environment", key);
-	return FALSE;
+	return TRUE;
 }
 
+/* Sets all 'key=value' pairs in a single update of the environment block */
 static gboolean grub_env_set(GPtrArray *pairs, GError **error)
 {
-	g_autoptr(GSubprocess) sub = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
 	GError *ierror = NULL;
-	gboolean res = FALSE;
 
 	g_return_val_if_fail(pairs, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	g_assert_cmpuint(pairs->len, >, 0);
-	g_assert_nonnull(r_context()->config->grubenv_path);
 
-	g_ptr_array_insert(pairs, 0, g_strdup(GRUB_EDITENV));
-	g_ptr_array_insert(pairs, 1, g_strdup(r_context()->config->grubenv_path));
-	g_ptr_array_insert(pairs, 2, g_strdup("set"));
-	g_ptr_array_add(pairs, NULL);
+	env = grub_env_read(&ierror);
+	if (!env) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < pairs->len; i++) {
+		g_auto(GStrv) pair = g_strsplit(pairs->pdata[i], "=", 2);
 
-	sub = r_subprocess_newv(pairs, G_SUBPROCESS_FLAGS_NONE, &ierror);
-	if (!sub) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"Failed to start " GRUB_EDITENV ": ");
-		goto out;
+		g_assert_nonnull(pair[1]);
+		r_grub_env_set(env, pair[0], pair[1]);
 	}
 
-	res = g_subprocess_wait_check(sub, NULL, &ierror);
-	if (!res) {
+	if (!r_grub_env_write(env, &ierror)) {
 		g_propagate_prefixed_error(
 				error,
 				ierror,
-				"Failed to run " GRUB_EDITENV ": ");
-		goto out;
+				"Failed to write GRUB environment: ");
+		return FALSE;
 	}
 
-out:
-	g_ptr_array_remove_index(pairs, pairs->len-1);
-	g_ptr_array_remove_index(pairs, 2);
-	g_ptr_array_remove_index(pairs, 1);
-	g_ptr_array_remove_index(pairs, 0);
-	return res;
+	return TRUE;
 }
 
 /* We assume bootstate to be good if slot is listed in 'ORDER', its
@@ -488,6 +558,7 @@ static gboolean grub_get_state(RaucSlot* slot, gboolean *good, GError **error)
 	g_autoptr(GString) slot_try = NULL;
 	g_auto(GStrv) bootnames = NULL;
 	g_autofree gchar *key = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
 	GError *ierror = NULL;
 	gboolean found = FALSE;
 
@@ -496,7 +567,13 @@ static gboolean grub_get_state(RaucSlot* slot, gboolean *good, GError **error)
 	g_return_val_if_fail(good, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!grub_env_get("ORDER", &order, &ierror)) {
+	env = grub_env_read(&ierror);
+	if (!env) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!grub_env_get(env, "ORDER", &order, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -516,13 +593,13 @@ static gboolean grub_get_state(RaucSlot* slot, gboolean *good, GError **error)
 
 	/* Check slot state */
 	key = g_strdup_printf("%s_OK", slot->bootname);
-	if (!grub_env_get(key, &slot_ok, &ierror)) {
+	if (!grub_env_get(env, key, &slot_ok, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
 	g_free(key);
 	key = g_strdup_printf("%s_TRY", slot->bootname);
-	if (!grub_env_get(key, &slot_try, &ierror)) {
+	if (!grub_env_get(env, key, &slot_try, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -562,6 +639,7 @@ static RaucSlot* grub_get_primary(GError **error)
 {
 	g_autoptr(GString) order = NULL;
 	g_auto(GStrv) bootnames = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
 	GError *ierror = NULL;
 	RaucSlot *primary = NULL;
 	RaucSlot *slot = NULL;
@@ -569,7 +647,13 @@ static RaucSlot* grub_get_primary(GError **error)
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!grub_env_get("ORDER", &order, &ierror)) {
+	env = grub_env_read(&ierror);
+	if (!env) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!grub_env_get(env, "ORDER", &order, &ierror)) {
 		g_propagate_error(error, ierror);
 		return NULL;
 	}
@@ -599,13 +683,13 @@ static RaucSlot* grub_get_primary(GError **error)
 
 			/* Check slot state */
 			key = g_strdup_printf("%s_OK", slot->bootname);
-			if (!grub_env_get(key, &slot_ok, &ierror)) {
+			if (!grub_env_get(env, key, &slot_ok, &ierror)) {
 				g_propagate_error(error, ierror);
 				return NULL;
 			}
 			g_free(key);
 			key = g_strdup_printf("%s_TRY", slot->bootname);
-			if (!grub_env_get(key, &slot_try, &ierror)) {
+			if (!grub_env_get(env, key, &slot_try, &ierror)) {
 				g_propagate_error(error, ierror);
 				return NULL;
 			}
@@ -748,6 +832,85 @@ static gboolean uboot_env_set(const gchar *key, const gchar *value, GError **err
 	return TRUE;
 }
 
+static const gchar *uboot_env_config(void)
+{
+	const gchar *config = g_getenv("RAUC_TEST_FW_ENV_CONFIG");
+
+	return config ? config : R_UBOOT_ENV_DEFAULT_CONFIG;
+}
+
+/* Opens the U-Boot environment for in-process access, so that all variables
+ * of an operation are read once and written in a single update.
+ * Returns NULL without setting an error if fw_printenv/fw_setenv should be
+ * used instead (no fw_env.config or an unsupported/uninitialized
+ * environment). */
+static RUbootEnv *uboot_env_open(GError **error)
+{
+	GError *ierror = NULL;
+	RUbootEnv *env;
+
+	if (!g_file_test(uboot_env_config(), G_FILE_TEST_EXISTS))
+		return NULL;
+
+	env = r_uboot_env_open(uboot_env_config(), &ierror);
+	if (!env) {
+		if (g_error_matches(ierror, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_UNSUPPORTED) ||
+		    g_error_matches(ierror, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CORRUPT)) {
+			g_message("%s, using " UBOOT_FWPRINTENV_NAME "/" UBOOT_FWSETENV_NAME, ierror->message);
+			g_clear_error(&ierror);
+			return NULL;
+		}
+		g_propagate_prefixed_error(error, ierror, "Failed to read U-Boot environment: ");
+		return NULL;
+	}
+
+	return env;
+}
+
+static gboolean uboot_var_get(RUbootEnv *env, const gchar *key, GString **value, GError **error)
+{
+	const gchar *val;
+
+	if (!env)
+		return uboot_env_get(key, value, error);
+
+	val = r_uboot_env_get(env, key);
+	if (!val) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_NOT_FOUND,
+				"U-Boot environment variable %s not found", key);
+		return FALSE;
+	}
+	*value = g_string_new(val);
+
+	return TRUE;
+}
+
+static gboolean uboot_var_set(RUbootEnv *env, const gchar *key, const gchar *value, GError **error)
+{
+	if (!env)
+		return uboot_env_set(key, value, error);
+
+	r_uboot_env_set(env, key, value);
+
+	return TRUE;
+}
+
+/* Writes all changes made with uboot_var_set() at once */
+static gboolean uboot_env_commit(RUbootEnv *env, GError **error)
+{
+	GError *ierror = NULL;
+
+	if (!env)
+		return TRUE;
+
+	if (!r_uboot_env_commit(env, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write U-Boot environment: ");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /* We assume bootstate to be good if slot is listed in 'BOOT_ORDER' and its
  * remaining attempts counter is > 0 */
 static gboolean uboot_get_state(RaucSlot* slot, gboolean *good, GError **error)
@@ -756,6 +919,7 @@ static gboolean uboot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 	g_autoptr(GString) attempts = NULL;
 	g_auto(GStrv) bootnames = NULL;
 	g_autofree gchar *key = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
 	GError *ierror = NULL;
 	gboolean found = FALSE;
 
@@ -763,7 +927,13 @@ static gboolean uboot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 	g_return_val_if_fail(good, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!uboot_env_get("BOOT_ORDER", &order, &ierror)) {
+	env = uboot_env_open(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!uboot_var_get(env, "BOOT_ORDER", &order, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -783,7 +953,7 @@ static gboolean uboot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 
 	/* Check remaining attempts */
 	key = g_strdup_printf("BOOT_%s_LEFT", slot->bootname);
-	if (!uboot_env_get(key, &attempts, &ierror)) {
+	if (!uboot_var_get(env, key, &attempts, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -795,6 +965,7 @@ static gboolean uboot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 /* Set slot status values */
 static gboolean uboot_set_state(RaucSlot *slot, gboolean good, GError **error)
 {
+	g_autoptr(RUbootEnv) env = NULL;
 	GError *ierror = NULL;
 	g_autofree gchar *key = NULL;
 	g_autofree gchar *val = NULL;
@@ -803,13 +974,19 @@ static gboolean uboot_set_state(RaucSlot *slot, gboolean good, GError **error)
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	env = uboot_env_open(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	if (!good) {
 		g_autoptr(GString) order_current = NULL;
 		g_autoptr(GPtrArray) order_new = NULL;
 		g_auto(GStrv) bootnames = NULL;
 		g_autofree gchar *order = NULL;
 
-		if (!uboot_env_get("BOOT_ORDER", &order_current, &ierror)) {
+		if (!uboot_var_get(env, "BOOT_ORDER", &order_current, &ierror)) {
 			g_message("Unable to obtain BOOT_ORDER: %s", ierror->message);
 			g_clear_error(&ierror);
 			goto set_left;
@@ -832,7 +1009,7 @@ static gboolean uboot_set_state(RaucSlot *slot, gboolean good, GError **error)
 		g_ptr_array_add(order_new, NULL);
 
 		order = g_strjoinv(" ", (gchar**) order_new->pdata);
-		if (!uboot_env_set("BOOT_ORDER", order, &ierror)) {
+		if (!uboot_var_set(env, "BOOT_ORDER", order, &ierror)) {
 			g_propagate_error(error, ierror);
 			return FALSE;
 		}
@@ -850,7 +1027,12 @@ set_left:
 
 	val = g_strdup_printf("%x", attempts);
 
-	if (!uboot_env_set(key, val, &ierror)) {
+	if (!uboot_var_set(env, key, val, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!uboot_env_commit(env, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -863,6 +1045,7 @@ static RaucSlot* uboot_get_primary(GError **error)
 {
 	g_autoptr(GString) order = NULL;
 	g_auto(GStrv) bootnames = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
 	GError *ierror = NULL;
 	RaucSlot *primary = NULL;
 	RaucSlot *slot;
@@ -870,7 +1053,13 @@ static RaucSlot* uboot_get_primary(GError **error)
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!uboot_env_get("BOOT_ORDER", &order, &ierror)) {
+	env = uboot_env_open(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!uboot_var_get(env, "BOOT_ORDER", &order, &ierror)) {
 		g_propagate_error(error, ierror);
 		return NULL;
 	}
@@ -889,7 +1078,7 @@ static RaucSlot* uboot_get_primary(GError **error)
 
 			/* Check that > 0 attempts left */
 			key = g_strdup_printf("BOOT_%s_LEFT", slot->bootname);
-			if (!uboot_env_get(key, &attempts, &ierror)) {
+			if (!uboot_var_get(env, key, &attempts, &ierror)) {
 				g_propagate_error(error, ierror);
 				return NULL;
 			}
@@ -922,6 +1111,7 @@ static gboolean uboot_set_primary(RaucSlot *slot, GError **error)
 	g_autoptr(GString) order_new = NULL;
 	g_autoptr(GString) order_current = NULL;
 	g_auto(GStrv) bootnames = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
 	GError *ierror = NULL;
 	g_autofree gchar *key = NULL;
 	g_autofree gchar *val = NULL;
@@ -930,10 +1120,16 @@ static gboolean uboot_set_primary(RaucSlot *slot, GError **error)
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	env = uboot_env_open(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	/* Add updated slot as first entry in new boot order */
 	order_new = g_string_new(slot->bootname);
 
-	if (!uboot_env_get("BOOT_ORDER", &order_current, &ierror)) {
+	if (!uboot_var_get(env, "BOOT_ORDER", &order_current, &ierror)) {
 		g_message("Unable to obtain BOOT_ORDER (%s), using defaults", ierror->message);
 		g_clear_error(&ierror);
 
@@ -963,11 +1159,16 @@ static gboolean uboot_set_primary(RaucSlot *slot, GError **error)
 
 	val = g_strdup_printf("%x", attempts);
 
-	if (!uboot_env_set(key, val, &ierror)) {
+	if (!uboot_var_set(env, key, val, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (!uboot_var_set(env, "BOOT_ORDER", order_new->str, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
-	if (!uboot_env_set("BOOT_ORDER", order_new->str, &ierror)) {
+
+	if (!uboot_env_commit(env, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -993,14 +1194,83 @@ static void efi_bootentry_free(efi_bootentry *entry)
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(efi_bootentry, efi_bootentry_free);
 
+static const gchar *efivars_dir(void)
+{
+	const gchar *dir = g_getenv("RAUC_TEST_EFIVARS_DIR");
+
+	return dir ? dir : R_EFIVARS_DEFAULT_DIR;
+}
+
+/* Returns the EFI boot state read from efivarfs (owned by the cache), or NULL
+ * without setting an error if efivarfs is not available and efibootmgr
+ * should be used instead. */
+static REfiBootState *efi_boot_state_get(GError **error)
+{
+	GError *ierror = NULL;
+
+	g_assert(boot_query_depth > 0);
+
+	if (efi_cached_state)
+		return efi_cached_state;
+
+	if (!g_file_test(efivars_dir(), G_FILE_TEST_IS_DIR))
+		return NULL;
+
+	efi_cached_state = r_efivars_read_boot_state(efivars_dir(), &ierror);
+	if (!efi_cached_state) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read EFI variables: ");
+		return NULL;
+	}
+
+	return efi_cached_state;
+}
+
+static gboolean efi_parse_bootnum(const gchar *str, guint16 *num)
+{
+	gchar *end = NULL;
+	guint64 val = g_ascii_strtoull(str, &end, 16);
+
+	if (!*str || *end || val > G_MAXUINT16)
+		return FALSE;
+	*num = val;
+
+	return TRUE;
+}
+
 static gboolean efi_bootorder_set(gchar *order, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
+	REfiBootState *state = NULL;
 	GError *ierror = NULL;
 
 	g_return_val_if_fail(order, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	state = efi_boot_state_get(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (state) {
+		g_auto(GStrv) nums = g_strsplit(order, ",", -1);
+		g_autoptr(GArray) bootorder = g_array_new(FALSE, FALSE, sizeof(guint16));
+
+		for (gchar **num = nums; *num; num++) {
+			guint16 val;
+
+			if (!**num)
+				continue;
+			if (!efi_parse_bootnum(*num, &val)) {
+				g_set_error(error, R_BOOTCHOOSER_ERROR, R_BOOTCHOOSER_ERROR_FAILED,
+						"Invalid boot number '%s'", *num);
+				return FALSE;
+			}
+			g_array_append_val(bootorder, val);
+		}
+
+		return r_efivars_set_boot_order(efivars_dir(), state, (guint16 *) bootorder->data, bootorder->len, error);
+	}
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &ierror, EFIBOOTMGR_NAME,
 			"--bootorder", order, NULL);
 
@@ -1026,11 +1296,29 @@ static gboolean efi_bootorder_set(gchar *order, GError **error)
 static gboolean efi_set_bootnext(gchar *bootnumber, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
+	REfiBootState *state = NULL;
 	GError *ierror = NULL;
 
 	g_return_val_if_fail(bootnumber, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	state = efi_boot_state_get(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (state) {
+		guint16 num;
+
+		if (!efi_parse_bootnum(bootnumber, &num)) {
+			g_set_error(error, R_BOOTCHOOSER_ERROR, R_BOOTCHOOSER_ERROR_FAILED,
+					"Invalid boot number '%s'", bootnumber);
+			return FALSE;
+		}
+
+		return r_efivars_set_boot_next(efivars_dir(), state, num, error);
+	}
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &ierror, EFIBOOTMGR_NAME,
 			"--bootnext", bootnumber, NULL);
 
@@ -1071,6 +1359,43 @@ static efi_bootentry* get_efi_entry_by_bootnum(GList *entries, const gchar *boot
 	return found_entry;
 }
 
+/* Converts the boot state read from efivarfs to the lists returned by
+ * efi_bootorder_get() */
+static gboolean efi_bootorder_from_state(const REfiBootState *state, GList **bootorder_entries, GList **all_entries, efi_bootentry **bootnext)
+{
+	g_autolist(efi_bootentry) entries = NULL;
+	g_autoptr(GList) returnorder = NULL;
+
+	for (guint i = 0; i < state->load_options->len; i++) {
+		const REfiLoadOption *option = g_ptr_array_index(state->load_options, i);
+		efi_bootentry *entry = g_new0(efi_bootentry, 1);
+
+		entry->num = g_strdup_printf("%04X", option->num);
+		entry->name = g_strdup(option->description);
+		entry->active = option->active;
+		entries = g_list_prepend(entries, entry);
+	}
+	entries = g_list_reverse(entries);
+
+	if (bootnext && state->has_boot_next && entries) {
+		g_autofree gchar *num = g_strdup_printf("%04X", state->boot_next);
+		*bootnext = get_efi_entry_by_bootnum(entries, num);
+	}
+
+	for (guint i = 0; i < state->boot_order->len; i++) {
+		g_autofree gchar *num = g_strdup_printf("%04X", g_array_index(state->boot_order, guint16, i));
+		efi_bootentry *bentry = entries ? get_efi_entry_by_bootnum(entries, num) : NULL;
+		if (bentry)
+			returnorder = g_list_append(returnorder, bentry);
+	}
+
+	if (bootorder_entries)
+		*bootorder_entries = g_steal_pointer(&returnorder);
+	*all_entries = g_steal_pointer(&entries);
+
+	return TRUE;
+}
+
 /* Parses output of efibootmgr and returns information obtained.
  *
  * Note that this function can return two lists, pointing to the same elements.
@@ -1099,12 +1424,21 @@ static gboolean efi_bootorder_get(GList **bootorder_entries, GList **all_entries
 	g_autolist(efi_bootentry) entries = NULL;
 	g_autoptr(GList) returnorder = NULL;
 	g_auto(GStrv) bootnumorder = NULL;
+	REfiBootState *state = NULL;
 
 	g_return_val_if_fail(bootorder_entries == NULL || *bootorder_entries == NULL, FALSE);
 	g_return_val_if_fail(all_entries != NULL && *all_entries == NULL, FALSE);
 	g_return_val_if_fail(bootnext == NULL || *bootnext == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	state = efi_boot_state_get(&ierror);
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (state)
+		return efi_bootorder_from_state(state, bootorder_entries, all_entries, bootnext);
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror,
 			EFIBOOTMGR_NAME, NULL);
 	if (!sub) {
@@ -1323,7 +1657,7 @@ static gboolean efi_modify_persistent_bootorder(RaucSlot *slot, gboolean prepend
 
 	order = g_strjoinv(",", (gchar**)bootorder->pdata);
 
-	if (!efi_bootorder_set(order, NULL)) {
+	if (!efi_bootorder_set(order, &ierror)) {
 		g_propagate_prefixed_error(error, ierror, "Modifying bootorder failed: ");
 		return FALSE;
 	}
@@ -1667,13 +2001,17 @@ gboolean r_boot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 	g_assert_nonnull(slot->bootname);
 
 	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		r_boot_query_begin();
 		res = barebox_get_state(slot, good, &ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "grub") == 0) {
 		res = grub_get_state(slot, good, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "uboot") == 0) {
 		res = uboot_get_state(slot, good, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "efi") == 0) {
+		r_boot_query_begin();
 		res = efi_get_state(slot, good, &ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "custom") == 0) {
 		res = custom_get_state(slot, good, &ierror);
 	} else {
@@ -1704,13 +2042,17 @@ gboolean r_boot_set_state(RaucSlot *slot, gboolean good, GError **error)
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		r_boot_query_begin();
 		res = barebox_set_state(slot, good, &ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "grub") == 0) {
 		res = grub_set_state(slot, good, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "uboot") == 0) {
 		res = uboot_set_state(slot, good, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "efi") == 0) {
+		r_boot_query_begin();
 		res = efi_set_state(slot, good, &ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "custom") == 0) {
 		res = custom_set_state(slot, good, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "noop") == 0) {
@@ -1743,13 +2085,17 @@ RaucSlot* r_boot_get_primary(GError **error)
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		r_boot_query_begin();
 		slot = barebox_get_primary(&ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "grub") == 0) {
 		slot = grub_get_primary(&ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "uboot") == 0) {
 		slot = uboot_get_primary(&ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "efi") == 0) {
+		r_boot_query_begin();
 		slot = efi_get_primary(&ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "custom") == 0) {
 		slot = custom_get_primary(&ierror);
 	} else {
@@ -1780,13 +2126,17 @@ gboolean r_boot_set_primary(RaucSlot *slot, GError **error)
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		r_boot_query_begin();
 		res = barebox_set_primary(slot, &ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "grub") == 0) {
 		res = grub_set_primary(slot, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "uboot") == 0) {
 		res = uboot_set_primary(slot, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "efi") == 0) {
+		r_boot_query_begin();
 		res = efi_set_primary(slot, &ierror);
+		r_boot_query_end();
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "custom") == 0) {
 		res = custom_set_primary(slot, &ierror);
 	} else if (g_strcmp0(r_context()->config->system_bootloader, "noop") == 0) {
@@ -3,6 +3,7 @@
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gunixmounts.h>
 #include <glib/gstdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -16,6 +17,7 @@
 #include "bundle.h"
 #include "context.h"
 #include "crypt.h"
+#include "digest_cache.h"
 #include "manifest.h"
 #include "mount.h"
 #include "signature.h"
@@ -417,12 +419,26 @@ static gboolean generate_adaptive_data(RaucManifest *manifest, const gchar *dir,
 				g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
 				g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
 				g_autoptr(RaucHashIndex) index = NULL;
+				g_autofree gchar *cache_key = NULL;
 				g_auto(filedesc) fd = -1;
 
 				if (image_is_archive(image)) {
 					g_warning("Generating block hash index requires a block device image but %s looks like an archive", image->filename);
 				}
 
+				if (r_context()->digest_cache_dir) {
+					cache_key = r_digest_cache_file_key(imagepath, &ierror);
+					if (!cache_key) {
+						g_propagate_error(error, ierror);
+						return FALSE;
+					}
+
+					if (r_digest_cache_get_hash_index(r_context()->digest_cache_dir, cache_key, indexpath)) {
+						g_debug("Using cached block-hash-index for image %s", image->filename);
+						continue;
+					}
+				}
+
 				fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
 				if (fd < 0) {
 					int err = errno;
@@ -451,6 +467,11 @@ static gboolean generate_adaptive_data(RaucManifest *manifest, const gchar *dir,
 					return FALSE;
 				}
 
+				if (cache_key && !r_digest_cache_put_hash_index(r_context()->digest_cache_dir, cache_key, indexpath, &ierror)) {
+					g_warning("Failed to update digest cache for %s: %s", image->filename, ierror->message);
+					g_clear_error(&ierror);
+				}
+
 				g_debug("Created block-hash-index for image %s", image->filename);
 			} else if (g_str_equal(*method, "adaptive-test-method")) {
 				g_debug("Ignoring adaptive-test-method for image %s", image->filename);
@@ -559,9 +580,99 @@ static gchar *convert_composefs(RaucImage *image, const gchar *dir, const gchar
 }
 #endif
 
+typedef struct {
+	RaucImage *image;
+	const gchar *dir;
+	const gchar *fakeroot;
+} ConvertImageJob;
+
+static gboolean convert_image(gpointer data, GError **error)
+{
+	ConvertImageJob *job = data;
+	RaucImage *image = job->image;
+	const gchar *dir = job->dir;
+	const gchar *fakeroot = job->fakeroot;
+	GError *ierror = NULL;
+
+	g_autofree gchar *tar_extracted = NULL;
+	g_autofree gchar *tar_extracted_path = NULL;
+	/* extract tar early if we need it for other outputs */
+	if (g_strv_contains((const gchar * const *)image->convert, "tar-extract") ||
+	    g_strv_contains((const gchar * const *)image->convert, "composefs")) {
+		g_debug("extracting tar artifact image '%s'", image->filename);
+		tar_extracted = convert_tar_extract(image, dir, fakeroot, &ierror);
+		if (!tar_extracted) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		tar_extracted_path = g_build_filename(dir, tar_extracted, NULL);
+	}
+
+	gboolean keep = FALSE;
+	g_autoptr(GPtrArray) converted = g_ptr_array_new_with_free_func(g_free);
+	for (gchar **method = image->convert; *method != NULL; method++) {
+		gchar *converted_filename = NULL;
+		if (g_str_equal(*method, "tar-extract")) {
+			converted_filename = g_strdup(tar_extracted);
+		} else if (g_str_equal(*method, "composefs")) {
+#if ENABLE_COMPOSEFS == 1
+			g_debug("converting '%s' to composefs image", tar_extracted_path);
+			converted_filename = convert_composefs(image, dir, tar_extracted_path, fakeroot, &ierror);
+			if (!converted_filename) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+#else
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+					"Convert method 'composefs' not enabled, recompile with -Dcomposefs=enabled");
+			return FALSE;
+#endif
+		} else if (g_str_equal(*method, "keep")) {
+			g_debug("keeping input artifact image '%s'", image->filename);
+			keep = TRUE;
+			converted_filename = g_strdup(image->filename);
+		} else {
+			g_set_error(
+					error,
+					R_BUNDLE_ERROR,
+					R_BUNDLE_ERROR_PAYLOAD,
+					"Unsupported convert method: %s", *method);
+			return FALSE;
+		}
+
+		g_assert(converted_filename != NULL);
+		g_ptr_array_add(converted, converted_filename);
+	}
+
+	if (tar_extracted_path && !g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
+		if (!rm_tree(tar_extracted_path, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to remove files extacted from tar: ");
+			return FALSE;
+		}
+	}
+
+	if (!keep) {
+		g_autofree gchar *file_path = g_build_filename(dir, image->filename, NULL);
+		g_debug("removing input artifact image '%s' after conversion", image->filename);
+		if (g_unlink(file_path) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to remove input artifact image after conversion '%s': %s\n",
+					file_path, g_strerror(errno));
+			return FALSE;
+		}
+	}
+
+	g_clear_pointer(&image->converted, g_ptr_array_unref);
+	image->converted = g_steal_pointer(&converted);
+
+	return TRUE;
+}
+
 static gboolean convert_images(RaucManifest *manifest, const gchar *dir, const gchar *fakeroot, GError **error)
 {
 	GError *ierror = NULL;
+	g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func(g_free);
 
 	g_return_val_if_fail(manifest, FALSE);
 	g_return_val_if_fail(dir, FALSE);
@@ -582,77 +693,20 @@ static gboolean convert_images(RaucManifest *manifest, const gchar *dir, const g
 		if (!image->convert)
 			continue;
 
-		g_autofree gchar *tar_extracted = NULL;
-		g_autofree gchar *tar_extracted_path = NULL;
-		/* extract tar early if we need it for other outputs */
-		if (g_strv_contains((const gchar * const *)image->convert, "tar-extract") ||
-		    g_strv_contains((const gchar * const *)image->convert, "composefs")) {
-			g_debug("extracting tar artifact image '%s'", image->filename);
-			tar_extracted = convert_tar_extract(image, dir, fakeroot, &ierror);
-			if (!tar_extracted) {
-				g_propagate_error(error, ierror);
-				return FALSE;
-			}
-			tar_extracted_path = g_build_filename(dir, tar_extracted, NULL);
-		}
-
-		gboolean keep = FALSE;
-		g_autoptr(GPtrArray) converted = g_ptr_array_new_with_free_func(g_free);
-		for (gchar **method = image->convert; *method != NULL; method++) {
-			gchar *converted_filename = NULL;
-			if (g_str_equal(*method, "tar-extract")) {
-				converted_filename = g_strdup(tar_extracted);
-			} else if (g_str_equal(*method, "composefs")) {
-#if ENABLE_COMPOSEFS == 1
-				g_debug("converting '%s' to composefs image", tar_extracted_path);
-				converted_filename = convert_composefs(image, dir, tar_extracted_path, fakeroot, &ierror);
-				if (!converted_filename) {
-					g_propagate_error(error, ierror);
-					return FALSE;
-				}
-#else
-				g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
-						"Convert method 'composefs' not enabled, recompile with -Dcomposefs=enabled");
-				return FALSE;
-#endif
-			} else if (g_str_equal(*method, "keep")) {
-				g_debug("keeping input artifact image '%s'", image->filename);
-				keep = TRUE;
-				converted_filename = g_strdup(image->filename);
-			} else {
-				g_set_error(
-						error,
-						R_BUNDLE_ERROR,
-						R_BUNDLE_ERROR_PAYLOAD,
-						"Unsupported convert method: %s", *method);
-				return FALSE;
-			}
-
-			g_assert(converted_filename != NULL);
-			g_ptr_array_add(converted, converted_filename);
-		}
-
-		if (tar_extracted_path && !g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
-			if (!rm_tree(tar_extracted_path, &ierror)) {
-				g_propagate_prefixed_error(error, ierror, "Failed to remove files extacted from tar: ");
-				return FALSE;
-			}
-		}
-
-		if (!keep) {
-			g_autofree gchar *file_path = g_build_filename(dir, image->filename, NULL);
-			g_debug("removing input artifact image '%s' after conversion", image->filename);
-			if (g_unlink(file_path) != 0) {
-				int err = errno;
-				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-						"Failed to remove input artifact image after conversion '%s': %s\n",
-						file_path, g_strerror(errno));
-				return FALSE;
-			}
-		}
+		ConvertImageJob *job = g_new0(ConvertImageJob, 1);
+		job->image = image;
+		job->dir = dir;
+		job->fakeroot = fakeroot;
+		g_ptr_array_add(jobs, job);
+	}
 
-		g_clear_pointer(&image->converted, g_ptr_array_unref);
-		image->converted = g_steal_pointer(&converted);
+	/* The images are independent of each other, so they can be converted
+	 * concurrently. The fakeroot environment file is loaded and saved by
+	 * each fakeroot invocation, so concurrent invocations would lose
+	 * ownership information. Convert sequentially in that case. */
+	if (!r_run_jobs(jobs, convert_image, fakeroot ? 1 : 0, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
 	}
 
 	return TRUE;
@@ -1377,63 +1431,199 @@ out:
 	return res;
 }
 
-static gboolean truncate_bundle(const gchar *inpath, const gchar *outpath, goffset size, GError **error)
+/* Creates outpath with the first 'size' bytes of inpath (i.e. without the
+ * signature). If reflink_only is set, this fails with
+ * G_IO_ERROR_NOT_SUPPORTED unless the data can be shared between both
+ * files. */
+static gboolean truncate_bundle(const gchar *inpath, const gchar *outpath, goffset size, gboolean reflink_only, GError **error)
 {
-	g_autoptr(GFile) infile = NULL;
-	g_autoptr(GFile) outfile = NULL;
-	g_autoptr(GFileInputStream) instream = NULL;
-	g_autoptr(GFileOutputStream) outstream = NULL;
+	g_auto(filedesc) infd = -1;
+	g_auto(filedesc) outfd = -1;
 	GError *ierror = NULL;
+	GStatBuf st;
 	gboolean res = FALSE;
-	gssize ssize;
 
 	g_return_val_if_fail(inpath != NULL, FALSE);
 	g_return_val_if_fail(outpath != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	infile = g_file_new_for_path(inpath);
-	outfile = g_file_new_for_path(outpath);
-
-	instream = g_file_read(infile, NULL, &ierror);
-	if (instream == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to open bundle for reading: ");
-		res = FALSE;
-		goto out;
+	infd = g_open(inpath, O_RDONLY | O_CLOEXEC, 0);
+	if (infd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"failed to open bundle for reading: %s", g_strerror(err));
+		return FALSE;
 	}
-	outstream = g_file_create(outfile, G_FILE_CREATE_NONE, NULL,
-			&ierror);
-	if (outstream == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to open bundle for writing: ");
-		res = FALSE;
-		goto out;
+	if (fstat(infd, &st) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"failed to stat bundle: %s", g_strerror(err));
+		return FALSE;
 	}
 
-	ssize = g_output_stream_splice(
-			(GOutputStream*)outstream,
-			(GInputStream*)instream,
-			G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-			NULL, &ierror);
-	if (ssize == -1) {
-		g_propagate_error(error, ierror);
-		res = FALSE;
-		goto out;
+	outfd = g_open(outpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777);
+	if (outfd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"failed to open bundle for writing: %s", g_strerror(err));
+		return FALSE;
 	}
 
-	res = g_seekable_truncate(G_SEEKABLE(outstream), size, NULL, &ierror);
+	if (reflink_only)
+		res = r_reflink_fd(infd, outfd, size, &ierror);
+	else
+		res = r_copy_fd(infd, outfd, size, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
-		goto out;
+		if (g_remove(outpath) != 0)
+			g_warning("failed to remove %s", outpath);
+		return FALSE;
 	}
 
-	res = TRUE;
-out:
-	return res;
+	return TRUE;
+}
+
+/* Tracks the output file while replacing the signature of a bundle.
+ *
+ * The new bundle is written to a temporary file next to the target, which
+ * is renamed to the target on success. For in-place operation, the payload
+ * is shared with the temporary file via a reflink if supported. Otherwise,
+ * the original bundle is truncated directly and its original signature is
+ * kept in memory to restore it on failure. */
+typedef struct {
+	gchar *target;
+	gchar *workpath;
+	goffset size;
+	GBytes *trailer;
+} BundleRewrite;
+
+static void bundle_rewrite_clear(BundleRewrite *rw)
+{
+	g_clear_pointer(&rw->target, g_free);
+	g_clear_pointer(&rw->workpath, g_free);
+	g_clear_pointer(&rw->trailer, g_bytes_unref);
+}
+
+static gboolean bundle_rewrite_begin(RaucBundle *bundle, const gchar *outpath, BundleRewrite *rw, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dirname = NULL;
+	g_autofree gchar *tmpfilename = NULL;
+	g_auto(filedesc) fd = -1;
+	GStatBuf st;
+	gsize trailer_size;
+	guint8 *trailer = NULL;
+
+	if (!outpath && (bundle->origpath || bundle->nbd_srv)) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+				"In-place modification is only supported for local bundles");
+		return FALSE;
+	}
+
+	rw->target = g_strdup(outpath ? outpath : bundle->path);
+	rw->size = bundle->size;
+
+	dirname = g_path_get_dirname(rw->target);
+	tmpfilename = get_random_file_name();
+	rw->workpath = g_build_filename(dirname, tmpfilename, NULL);
+
+	if (outpath)
+		return truncate_bundle(bundle->path, rw->workpath, bundle->size, FALSE, error);
+
+	if (truncate_bundle(bundle->path, rw->workpath, bundle->size, TRUE, &ierror))
+		return TRUE;
+	if (!g_error_matches(ierror, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_debug("Modifying bundle in-place: %s", ierror->message);
+	g_clear_error(&ierror);
+
+	/* no reflink support, so truncate the original bundle directly */
+	g_free(rw->workpath);
+	rw->workpath = g_strdup(rw->target);
+
+	fd = g_open(rw->target, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"failed to open bundle for writing: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	trailer_size = st.st_size - bundle->size;
+	trailer = g_malloc(trailer_size);
+	if (!r_pread_exact(fd, trailer, trailer_size, bundle->size, &ierror)) {
+		g_free(trailer);
+		g_propagate_prefixed_error(error, ierror, "failed to save signature: ");
+		return FALSE;
+	}
+	rw->trailer = g_bytes_new_take(trailer, trailer_size);
+
+	if (ftruncate(fd, bundle->size) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"failed to truncate bundle: %s", g_strerror(err));
+		g_clear_pointer(&rw->trailer, g_bytes_unref);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean bundle_rewrite_commit(BundleRewrite *rw, GError **error)
+{
+	if (g_strcmp0(rw->workpath, rw->target) != 0) {
+		if (g_rename(rw->workpath, rw->target) != 0) {
+			int err = errno;
+			g_set_error(error,
+					G_FILE_ERROR,
+					g_file_error_from_errno(err),
+					"Renaming %s to %s failed: %s", rw->workpath, rw->target, g_strerror(err));
+			return FALSE;
+		}
+	}
+
+	g_clear_pointer(&rw->workpath, g_free);
+	g_clear_pointer(&rw->trailer, g_bytes_unref);
+
+	return TRUE;
+}
+
+static void bundle_rewrite_abort(BundleRewrite *rw)
+{
+	g_auto(filedesc) fd = -1;
+	g_autoptr(GError) ierror = NULL;
+
+	if (!rw->workpath)
+		return;
+
+	if (!rw->trailer) {
+		if (g_file_test(rw->workpath, G_FILE_TEST_IS_REGULAR))
+			if (g_remove(rw->workpath) != 0)
+				g_warning("failed to remove %s", rw->workpath);
+		return;
+	}
+
+	/* restore the original signature of a bundle modified in-place */
+	fd = g_open(rw->workpath, O_WRONLY | O_CLOEXEC, 0);
+	if (fd < 0 || ftruncate(fd, rw->size) != 0) {
+		int err = errno;
+		g_warning("failed to restore signature of %s: %s", rw->workpath, g_strerror(err));
+		return;
+	}
+	if (!r_pwrite_exact(fd, g_bytes_get_data(rw->trailer, NULL), g_bytes_get_size(rw->trailer), rw->size, &ierror))
+		g_warning("failed to restore signature of %s: %s", rw->workpath, ierror->message);
 }
 
 gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
@@ -1443,12 +1633,12 @@ gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 	g_autoptr(GBytes) sig = NULL;
+	BundleRewrite rw = {0};
 
 	g_return_val_if_fail(bundle != NULL, FALSE);
-	g_return_val_if_fail(outpath != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (g_file_test(outpath, G_FILE_TEST_EXISTS)) {
+	if (outpath && g_file_test(outpath, G_FILE_TEST_EXISTS)) {
 		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", outpath);
 		return FALSE;
 	}
@@ -1472,34 +1662,91 @@ gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
 
 	g_print("Resigning '%s' format bundle\n", r_manifest_bundle_format_to_str(manifest->bundle_format));
 
-	res = truncate_bundle(bundle->path, outpath, bundle->size, &ierror);
+	res = bundle_rewrite_begin(bundle, outpath, &rw, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
-	sig = generate_bundle_signature(outpath, manifest, &ierror);
+	sig = generate_bundle_signature(rw.workpath, manifest, &ierror);
 	if (!sig) {
 		g_propagate_error(error, ierror);
 		res = FALSE;
 		goto out;
 	}
 
-	res = append_signature_to_bundle(outpath, sig, &ierror);
+	res = append_signature_to_bundle(rw.workpath, sig, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	res = bundle_rewrite_commit(&rw, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
 out:
-	/* Remove output file on error */
-	if (!res &&
-	    g_file_test(outpath, G_FILE_TEST_IS_REGULAR))
-		if (g_remove(outpath) != 0)
-			g_warning("failed to remove %s", outpath);
+	/* Remove output file (or restore in-place bundle) on error */
+	if (!res)
+		bundle_rewrite_abort(&rw);
+	bundle_rewrite_clear(&rw);
 	return res;
 }
 
+typedef struct {
+	RaucImage *image;
+	const gchar *contentdir;
+	const gchar *storepath;
+} CasyncConvertJob;
+
+static gboolean casync_convert_image(gpointer data, GError **error)
+{
+	CasyncConvertJob *job = data;
+	RaucImage *image = job->image;
+	GError *ierror = NULL;
+	g_autofree gchar *imgpath = NULL;
+	g_autofree gchar *idxfile = NULL;
+	g_autofree gchar *idxpath = NULL;
+
+	imgpath = g_build_filename(job->contentdir, image->filename, NULL);
+
+	if (image_is_archive(image)) {
+		idxfile = g_strconcat(image->filename, ".caidx", NULL);
+		idxpath = g_build_filename(job->contentdir, idxfile, NULL);
+
+		g_message("Converting %s to casync directory tree idx %s", image->filename, idxfile);
+
+		if (!casync_make_arch(idxpath, imgpath, job->storepath, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	} else {
+		idxfile = g_strconcat(image->filename, ".caibx", NULL);
+		idxpath = g_build_filename(job->contentdir, idxfile, NULL);
+
+		g_message("Converting %s to casync blob idx %s", image->filename, idxfile);
+
+		/* Generate index for content */
+		if (!casync_make_blob(idxpath, imgpath, job->storepath, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	/* Rewrite manifest filename */
+	g_free(image->filename);
+	image->filename = g_steal_pointer(&idxfile);
+
+	/* Remove original file */
+	if (g_remove(imgpath) != 0) {
+		g_warning("failed to remove %s", imgpath);
+	}
+
+	return TRUE;
+}
+
 static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbundle, const gchar **ignore_images, GError **error)
 {
 	GError *ierror = NULL;
@@ -1509,6 +1756,7 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 	g_autofree gchar *mfpath = NULL;
 	g_autofree gchar *storepath = NULL;
 	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func(g_free);
 
 	g_return_val_if_fail(bundle, FALSE);
 	g_return_val_if_fail(outbundle, FALSE);
@@ -1556,14 +1804,9 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 	g_clear_pointer(&manifest->bundle_verity_hash, g_free);
 	manifest->bundle_verity_size = 0;
 
-	/* Iterate over each image and convert */
+	/* Collect images to convert */
 	for (GList *l = manifest->images; l != NULL; l = l->next) {
 		RaucImage *image = l->data;
-		g_autofree gchar *imgpath = NULL;
-		g_autofree gchar *idxfile = NULL;
-		g_autofree gchar *idxpath = NULL;
-
-		imgpath = g_build_filename(contentdir, image->filename, NULL);
 
 		if (!image->filename)
 			continue;
@@ -1573,39 +1816,19 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 			continue;
 		}
 
-		if (image_is_archive(image)) {
-			idxfile = g_strconcat(image->filename, ".caidx", NULL);
-			idxpath = g_build_filename(contentdir, idxfile, NULL);
-
-			g_message("Converting %s to casync directory tree idx %s", image->filename, idxfile);
-
-			res = casync_make_arch(idxpath, imgpath, storepath, &ierror);
-			if (!res) {
-				g_propagate_error(error, ierror);
-				goto out;
-			}
-		} else {
-			idxfile = g_strconcat(image->filename, ".caibx", NULL);
-			idxpath = g_build_filename(contentdir, idxfile, NULL);
-
-			g_message("Converting %s to casync blob idx %s", image->filename, idxfile);
-
-			/* Generate index for content */
-			res = casync_make_blob(idxpath, imgpath, storepath, &ierror);
-			if (!res) {
-				g_propagate_error(error, ierror);
-				goto out;
-			}
-		}
-
-		/* Rewrite manifest filename */
-		g_free(image->filename);
-		image->filename = g_steal_pointer(&idxfile);
+		CasyncConvertJob *job = g_new0(CasyncConvertJob, 1);
+		job->image = image;
+		job->contentdir = contentdir;
+		job->storepath = storepath;
+		g_ptr_array_add(jobs, job);
+	}
 
-		/* Remove original file */
-		if (g_remove(imgpath) != 0) {
-			g_warning("failed to remove %s", imgpath);
-		}
+	/* casync/desync store chunks atomically, so the images can be chunked
+	 * into the same store concurrently */
+	res = r_run_jobs(jobs, casync_convert_image, 0, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
 	}
 
 	/* Rewrite manifest to content/ dir */
@@ -1700,7 +1923,7 @@ gboolean encrypt_bundle(RaucBundle *bundle, const gchar *outbundle, GError **err
 		return FALSE;
 	}
 
-	res = truncate_bundle(bundle->path, outbundle, bundle->size, &ierror);
+	res = truncate_bundle(bundle->path, outbundle, bundle->size, FALSE, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2634,13 +2857,13 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 	gchar* keyringdirectory = NULL;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
+	BundleRewrite rw = {0};
 
 	g_return_val_if_fail(bundle != NULL, FALSE);
-	g_return_val_if_fail(outpath != NULL, FALSE);
 	g_return_val_if_fail(insig != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (g_file_test(outpath, G_FILE_TEST_EXISTS)) {
+	if (outpath && g_file_test(outpath, G_FILE_TEST_EXISTS)) {
 		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", outpath);
 		return FALSE;
 	}
@@ -2669,13 +2892,13 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 		goto out;
 	}
 
-	res = truncate_bundle(bundle->path, outpath, bundle->size, &ierror);
+	res = bundle_rewrite_begin(bundle, outpath, &rw, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
-	res = append_signature_to_bundle(outpath, sig, &ierror);
+	res = append_signature_to_bundle(rw.workpath, sig, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2701,7 +2924,7 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 		params |= CHECK_BUNDLE_NO_VERIFY;
 	}
 
-	res = check_bundle(outpath, &outbundle, params, NULL, &ierror);
+	res = check_bundle(rw.workpath, &outbundle, params, NULL, &ierror);
 	if (!res) {
 		g_propagate_prefixed_error(
 				error,
@@ -2710,13 +2933,18 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 		goto out;
 	}
 
+	res = bundle_rewrite_commit(&rw, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
 	res = TRUE;
 out:
-	/* Remove output file on error */
-	if (!res &&
-	    g_file_test(outpath, G_FILE_TEST_IS_REGULAR))
-		if (g_remove(outpath) != 0)
-			g_warning("failed to remove %s", outpath);
+	/* Remove output file (or restore in-place bundle) on error */
+	if (!res)
+		bundle_rewrite_abort(&rw);
+	bundle_rewrite_clear(&rw);
 
 	/* Restore saved paths if necessary */
 	if (keyringpath || keyringdirectory) {
@@ -2866,19 +3094,129 @@ out:
 	return res;
 }
 
-static gboolean read_complete_dm_device(gchar *dev, GError **error)
+#define PRE_CHECK_READ_SIZE (1024*1024)
+#define PRE_CHECK_MAX_THREADS 8
+/* granularity of the range reported on errors */
+#define PRE_CHECK_REPORT_SIZE 65536
+
+typedef struct {
+	const gchar *dev;
+	int fd;
+	goffset size;
+	/* index of the next chunk to read, shared by all threads */
+	gint next_chunk;
+	gint chunks_done;
+	gint failed;
+	/* first error reported by any thread */
+	GMutex error_lock;
+	GError *error;
+	/* receives one entry for each finished thread */
+	GAsyncQueue *finished;
+} PreCheckData;
+
+/* Reads len bytes at offset, returns 0 on success or the errno value. */
+static int pre_check_read(int fd, void *buf, gsize len, goffset offset)
+{
+	gsize done = 0;
+
+	while (done < len) {
+		ssize_t r = pread(fd, (guint8 *)buf + done, len - done, offset + done);
+		if (r == 0)
+			break;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		done += r;
+	}
+
+	return 0;
+}
+
+static gpointer pre_check_thread(gpointer data)
 {
-	int fd = -1;
-	const goffset chunk_size = 65536;
-	g_autofree void* buf = NULL;
-	ssize_t r;
-	gboolean ret = TRUE;
+	PreCheckData *check = data;
+	void *buf = NULL;
+
+	/* O_DIRECT requires aligned buffers */
+	if (posix_memalign(&buf, 4096, PRE_CHECK_READ_SIZE) != 0)
+		g_error("Failed to allocate pre-check buffer");
+
+	while (!g_atomic_int_get(&check->failed)) {
+		goffset offset = (goffset)g_atomic_int_add(&check->next_chunk, 1) * PRE_CHECK_READ_SIZE;
+		gsize len;
+		int err;
+
+		if (offset >= check->size)
+			break;
+		len = MIN(PRE_CHECK_READ_SIZE, check->size - offset);
+
+		err = pre_check_read(check->fd, buf, len, offset);
+		if (err) {
+			/* narrow down the error to a smaller range for reporting */
+			for (gsize sub = 0; sub < len; sub += PRE_CHECK_REPORT_SIZE) {
+				gsize sublen = MIN(PRE_CHECK_REPORT_SIZE, len - sub);
+				int suberr = pre_check_read(check->fd, buf, sublen, offset + sub);
+				if (suberr) {
+					err = suberr;
+					offset += sub;
+					len = sublen;
+					break;
+				}
+			}
+
+			g_mutex_lock(&check->error_lock);
+			if (!check->error)
+				g_set_error(&check->error,
+						G_FILE_ERROR,
+						g_file_error_from_errno(err),
+						"Check %s device failed between %"G_GOFFSET_FORMAT " and %"G_GOFFSET_FORMAT " bytes with error: %s",
+						check->dev, offset, offset + (goffset)len, g_strerror(err));
+			g_mutex_unlock(&check->error_lock);
+			g_atomic_int_set(&check->failed, 1);
+			break;
+		}
+
+		g_atomic_int_inc(&check->chunks_done);
+	}
+
+	free(buf);
+	g_async_queue_push(check->finished, GINT_TO_POINTER(1));
+
+	return NULL;
+}
+
+/* Reads the complete device to let dm-verity check all data blocks.
+ *
+ * The device is split into chunks which are read by several threads in
+ * parallel, so that the kernel's verity workers are kept busy. Local bundles
+ * are read with O_DIRECT to avoid filling the page cache with data which is
+ * not needed afterwards. Streamed bundles are read through the page cache
+ * instead, so that the subsequent installation does not need to download the
+ * data again.
+ *
+ * If 'progress' is set, the percentage of the current 'pre_check' step is
+ * updated while reading. */
+static gboolean read_complete_dm_device(gchar *dev, gboolean streaming, gboolean progress, GError **error)
+{
+	PreCheckData check = {
+		.dev = dev,
+		.fd = -1,
+	};
+	g_autoptr(GPtrArray) threads = g_ptr_array_new();
+	guint running;
+	gint chunks_total;
+	gboolean ret = FALSE;
 
 	g_return_val_if_fail(dev != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	fd = g_open(dev, O_RDONLY | O_CLOEXEC, 0);
-	if (fd < 0) {
+	if (!streaming)
+		check.fd = g_open(dev, O_RDONLY | O_CLOEXEC | O_DIRECT, 0);
+	if (check.fd < 0)
+		check.fd = g_open(dev, O_RDONLY | O_CLOEXEC, 0);
+	if (check.fd < 0) {
 		int err = errno;
 		g_set_error(error,
 				G_FILE_ERROR,
@@ -2887,28 +3225,82 @@ static gboolean read_complete_dm_device(gchar *dev, GError **error)
 		return FALSE;
 	}
 
-	buf = g_malloc0(chunk_size);
+	check.size = lseek(check.fd, 0, SEEK_END);
+	if (check.size < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to determine size of %s: %s", dev, g_strerror(err));
+		g_close(check.fd, NULL);
+		return FALSE;
+	}
+	chunks_total = (check.size + PRE_CHECK_READ_SIZE - 1) / PRE_CHECK_READ_SIZE;
 
-	for (goffset chunk = 0;; chunk++) {
-		r = pread(fd, buf, chunk_size, chunk*chunk_size);
-		if (r == 0)
-			break;
-		else if (r < 0)	{
-			int err = errno;
-			g_set_error(error,
-					G_FILE_ERROR,
-					g_file_error_from_errno(err),
-					"Check %s device failed between %"G_GOFFSET_FORMAT " and %"G_GOFFSET_FORMAT " bytes with error: %s", dev, chunk*chunk_size, (chunk+1)*chunk_size, g_strerror(err));
-			ret = FALSE;
-			break;
-		}
+	if (streaming)
+		(void) posix_fadvise(check.fd, 0, check.size, POSIX_FADV_SEQUENTIAL);
+
+	g_mutex_init(&check.error_lock);
+	check.finished = g_async_queue_new();
+
+	for (guint i = 0; i < MIN(g_get_num_processors(), PRE_CHECK_MAX_THREADS); i++)
+		g_ptr_array_add(threads, g_thread_new("pre-check", pre_check_thread, &check));
+
+	running = threads->len;
+	while (running) {
+		if (g_async_queue_timeout_pop(check.finished, 100 * G_TIME_SPAN_MILLISECOND))
+			running--;
+		if (progress && chunks_total)
+			r_context_set_step_percentage("pre_check", MIN(g_atomic_int_get(&check.chunks_done), chunks_total) * 100 / chunks_total);
 	}
 
-	g_close(fd, NULL);
+	for (guint i = 0; i < threads->len; i++)
+		g_thread_join(g_ptr_array_index(threads, i));
+
+	if (check.error) {
+		g_propagate_error(error, check.error);
+		goto out;
+	}
+
+	ret = TRUE;
+out:
+	g_async_queue_unref(check.finished);
+	g_mutex_clear(&check.error_lock);
+	g_close(check.fd, NULL);
 
 	return ret;
 }
 
+/* Performs the pre-check of the bundle payload on the given dm device, if
+ * enabled.
+ *
+ * During an installation, the check is reported as a 'pre_check' step with
+ * weight 0, as the number of install substeps must not depend on the bundle
+ * format or configuration. Outside of an installation (e.g. 'rauc mount'), no
+ * step is started. */
+static gboolean pre_check_bundle_payload(RaucBundle *bundle, gchar *dev, GError **error)
+{
+	gboolean progress = r_context_progress_current_step() != NULL;
+	gboolean res;
+
+	if (!r_context()->config->perform_pre_check)
+		return TRUE;
+
+	if (!dev) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"No device for bundle payload pre-check");
+		return FALSE;
+	}
+
+	if (progress)
+		r_context_begin_step_weighted("pre_check", "Checking bundle payload", 0, 0);
+	res = read_complete_dm_device(dev, bundle->nbd_dev != NULL, progress, error);
+	if (progress)
+		r_context_end_step("pre_check", res);
+
+	return res;
+}
+
 /*
  * Sets up dm-verity for reading verity bundles.
  *
@@ -2947,16 +3339,14 @@ static gboolean prepare_verity(RaucBundle *bundle, gchar *loopname, gchar* mount
 		return FALSE;
 	}
 
-	if (r_context()->config->perform_pre_check) {
-		res = read_complete_dm_device(dm_verity->upper_dev, &ierror);
-		if (!res) {
-			/* ensure the already-set-up dm-verity layer is cleaned */
-			if (!r_dm_remove(dm_verity, FALSE, &ierror_dm))	{
-				g_warning("Failed to remove dm-verity device: %s", ierror_dm->message);
-			}
-			g_propagate_error(error, ierror);
-			return FALSE;
+	res = pre_check_bundle_payload(bundle, dm_verity->upper_dev, &ierror);
+	if (!res) {
+		/* ensure the already-set-up dm-verity layer is cleaned */
+		if (!r_dm_remove(dm_verity, FALSE, &ierror_dm))	{
+			g_warning("Failed to remove dm-verity device: %s", ierror_dm->message);
 		}
+		g_propagate_error(error, ierror);
+		return FALSE;
 	}
 
 	res = r_mount_bundle(dm_verity->upper_dev, mount_point, &ierror);
@@ -3030,20 +3420,18 @@ static gboolean prepare_crypt(RaucBundle *bundle, gchar *loopname, gchar* mount_
 		return FALSE;
 	}
 
-	if (r_context()->config->perform_pre_check) {
-		res = read_complete_dm_device(dm_crypt->upper_dev, &ierror);
-		if (!res) {
-			/* ensure the already-set-up dm-verity and dm-crypt layers are cleaned */
-			if (!r_dm_remove(dm_crypt, TRUE, &ierror_dm)) {
-				g_warning("Failed to remove dm-crypt device: %s", ierror_dm->message);
-				g_clear_error(&ierror_dm);
-			}
-			if (!r_dm_remove(dm_verity, TRUE, &ierror_dm)) {
-				g_warning("Failed to remove dm-verity device: %s", ierror_dm->message);
-			}
-			g_propagate_error(error, ierror);
-			return FALSE;
+	res = pre_check_bundle_payload(bundle, dm_crypt->upper_dev, &ierror);
+	if (!res) {
+		/* ensure the already-set-up dm-verity and dm-crypt layers are cleaned */
+		if (!r_dm_remove(dm_crypt, TRUE, &ierror_dm)) {
+			g_warning("Failed to remove dm-crypt device: %s", ierror_dm->message);
+			g_clear_error(&ierror_dm);
+		}
+		if (!r_dm_remove(dm_verity, TRUE, &ierror_dm)) {
+			g_warning("Failed to remove dm-verity device: %s", ierror_dm->message);
 		}
+		g_propagate_error(error, ierror);
+		return FALSE;
 	}
 
 	res = r_mount_bundle(dm_crypt->upper_dev, mount_point, &ierror);
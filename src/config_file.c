@@ -23,6 +23,9 @@ void default_config(RaucConfig **config)
 
 	c->max_bundle_download_size = DEFAULT_MAX_BUNDLE_DOWNLOAD_SIZE;
 	c->mount_prefix = g_strdup("/mnt/rauc/");
+	c->parallel_installs = 1;
+	c->writeback_window = DEFAULT_WRITEBACK_WINDOW;
+	c->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
 	/* When installing, we need a system.conf anyway, so this is used only
 	 * for info/convert/extract/...
 	 */
@@ -167,6 +170,7 @@ static gboolean r_event_log_parse_config_sections(GKeyFile *key_file, RaucConfig
 	gsize group_count;
 	g_auto(GStrv) groups = NULL;
 	gint tmp_maxfiles;
+	gint tmp_flush_interval;
 
 	g_return_val_if_fail(key_file, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
@@ -180,6 +184,7 @@ static gboolean r_event_log_parse_config_sections(GKeyFile *key_file, RaucConfig
 		g_autoptr(REventLogger) logger = NULL;
 		const gchar *logger_name;
 		g_autofree gchar *log_format = NULL;
+		g_autofree gchar *flush = NULL;
 		gsize entries;
 
 		if (!g_str_has_prefix(*group, RAUC_LOG_EVENT_CONF_PREFIX "."))
@@ -323,6 +328,53 @@ static gboolean r_event_log_parse_config_sections(GKeyFile *key_file, RaucConfig
 		}
 		logger->maxfiles = (guint) tmp_maxfiles;
 
+		flush = key_file_consume_string(key_file, *group, "flush", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			flush = g_strdup("sync");
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		if (g_strcmp0(flush, "async") == 0) {
+			logger->flush = R_EVENT_LOG_FLUSH_ASYNC;
+		} else if (g_strcmp0(flush, "sync") == 0) {
+			logger->flush = R_EVENT_LOG_FLUSH_SYNC;
+		} else {
+			g_set_error(
+					error,
+					G_KEY_FILE_ERROR,
+					G_KEY_FILE_ERROR_INVALID_VALUE,
+					"Unknown flush policy '%s'", flush);
+			return FALSE;
+		}
+
+		tmp_flush_interval = key_file_consume_integer(key_file, *group, "flush-interval", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			tmp_flush_interval = 0;
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		if (tmp_flush_interval < 0 || tmp_flush_interval > 60000) {
+			g_set_error_literal(
+					error,
+					G_KEY_FILE_ERROR,
+					G_KEY_FILE_ERROR_INVALID_VALUE,
+					"Value for 'flush-interval' must be between 0 and 60000 (ms)");
+			return FALSE;
+		} else if (tmp_flush_interval && logger->flush != R_EVENT_LOG_FLUSH_ASYNC) {
+			g_set_error_literal(
+					error,
+					G_KEY_FILE_ERROR,
+					G_KEY_FILE_ERROR_INVALID_VALUE,
+					"'flush-interval' requires 'flush=async'");
+			return FALSE;
+		}
+		logger->flush_interval = (guint) tmp_flush_interval;
+
 		if (!check_remaining_keys(key_file, *group, &ierror)) {
 			g_propagate_error(error, ierror);
 			return FALSE;
@@ -511,6 +563,32 @@ static GHashTable *parse_slots(const char *filename, const char *data_directory,
 			}
 			g_key_file_remove_key(key_file, groups[i], "resize", NULL);
 
+			value = key_file_consume_string(key_file, groups[i], "write-mode", NULL);
+			if (!value || g_strcmp0(value, "full") == 0) {
+				slot->write_mode = R_SLOT_WRITE_MODE_FULL;
+			} else if (g_strcmp0(value, "compare") == 0) {
+				slot->write_mode = R_SLOT_WRITE_MODE_COMPARE;
+			} else {
+				g_set_error(
+						error,
+						R_CONFIG_ERROR,
+						R_CONFIG_ERROR_INVALID_FORMAT,
+						"Unsupported write-mode '%s' for slot %s", value, slot->name);
+				g_free(value);
+				return NULL;
+			}
+			g_free(value);
+
+			slot->verify_write = g_key_file_get_boolean(key_file, groups[i], "verify-write", &ierror);
+			if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+				slot->verify_write = FALSE;
+				g_clear_error(&ierror);
+			} else if (ierror) {
+				g_propagate_error(error, ierror);
+				return NULL;
+			}
+			g_key_file_remove_key(key_file, groups[i], "verify-write", NULL);
+
 			if (g_strcmp0(slot->type, "boot-mbr-switch") == 0 ||
 			    g_strcmp0(slot->type, "boot-gpt-switch") == 0 ||
 			    g_strcmp0(slot->type, "boot-raw-fallback") == 0) {
@@ -667,6 +745,112 @@ static GHashTable *parse_artifact_repos(const char *filename, const char *data_d
 	return g_steal_pointer(&repos);
 }
 
+static gboolean parse_qos(GKeyFile *key_file, RaucConfig *c, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *profile = NULL;
+	g_autofree gchar *io_class = NULL;
+
+	g_return_val_if_fail(key_file, FALSE);
+	g_return_val_if_fail(c, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	c->qos_enabled = g_key_file_has_group(key_file, "qos");
+	if (!c->qos_enabled)
+		return TRUE;
+
+	profile = key_file_consume_string(key_file, "qos", "default-profile", NULL);
+	if (!profile || g_strcmp0(profile, "background") == 0) {
+		c->qos_background = TRUE;
+	} else if (g_strcmp0(profile, "full") == 0) {
+		c->qos_background = FALSE;
+	} else {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Unsupported QoS profile '%s' for \"default-profile\"", profile);
+		return FALSE;
+	}
+
+	io_class = key_file_consume_string(key_file, "qos", "io-class", NULL);
+	if (!io_class) {
+		c->qos_io_class = R_QOS_IO_CLASS_IDLE;
+	} else if (!r_qos_parse_io_class(io_class, &c->qos_io_class)) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Unsupported I/O class '%s' for \"io-class\"", io_class);
+		return FALSE;
+	}
+
+	c->qos_io_priority = key_file_consume_integer(key_file, "qos", "io-priority", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		/* the idle class has no priority levels */
+		c->qos_io_priority = c->qos_io_class == R_QOS_IO_CLASS_IDLE ? 0 : 7;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (c->qos_io_priority < 0 || c->qos_io_priority > 7) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Value for \"io-priority\" must be between 0 and 7");
+		return FALSE;
+	}
+
+	c->qos_nice = key_file_consume_integer(key_file, "qos", "nice", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->qos_has_nice = FALSE;
+		c->qos_nice = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	} else {
+		c->qos_has_nice = TRUE;
+	}
+	if (c->qos_nice < -20 || c->qos_nice > 19) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Value for \"nice\" must be between -20 and 19");
+		return FALSE;
+	}
+
+	c->qos_cgroup = key_file_consume_string(key_file, "qos", "cgroup", NULL);
+	if (c->qos_cgroup && !g_path_is_absolute(c->qos_cgroup)) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Value for \"cgroup\" must be an absolute path");
+		return FALSE;
+	}
+
+	c->qos_write_rate = key_file_consume_binary_suffixed_string(key_file, "qos", "write-rate", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->qos_write_rate = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!check_remaining_keys(key_file, "qos", &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_key_file_remove_group(key_file, "qos", NULL);
+
+	return TRUE;
+}
+
 static gboolean check_unique_slotclasses(RaucConfig *config, GError **error)
 {
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
@@ -1044,6 +1228,19 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 		g_message("Using central status file %s", c->statusfile_path);
 	}
 
+	/* the cache is only used for per-slot status files */
+	c->status_cache_directory = resolve_path_take(filename,
+			key_file_consume_string(key_file, "system", "status-cache-directory", &ierror));
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->status_cache_directory = g_strdup(DEFAULT_STATUS_CACHE_DIRECTORY);
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (g_strcmp0(c->statusfile_path, "per-slot") != 0)
+		g_clear_pointer(&c->status_cache_directory, g_free);
+
 	/* parse bundle formats */
 	c->bundle_formats_mask =
 		1 << R_MANIFEST_FORMAT_PLAIN |
@@ -1072,6 +1269,41 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	}
 	g_key_file_remove_key(key_file, "system", "perform-pre-check", NULL);
 
+	c->parallel_installs = key_file_consume_integer(key_file, "system", "parallel-installs", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->parallel_installs = 1;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (c->parallel_installs < 1) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Value for \"parallel-installs\" must be at least 1");
+		return FALSE;
+	}
+
+	c->writeback_window = key_file_consume_binary_suffixed_string(key_file, "system", "writeback-window", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->writeback_window = DEFAULT_WRITEBACK_WINDOW;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	c->checkpoint_interval = key_file_consume_binary_suffixed_string(key_file, "system", "checkpoint-interval", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	if (!check_remaining_keys(key_file, "system", &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -1222,6 +1454,12 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	}
 	g_key_file_remove_group(key_file, "handlers", NULL);
 
+	/* parse [qos] section */
+	if (!parse_qos(key_file, c, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	if (!r_event_log_parse_config_sections(key_file, c, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -1291,11 +1529,13 @@ void free_config(RaucConfig *config)
 	g_free(config->grubenv_path);
 	g_free(config->data_directory);
 	g_free(config->statusfile_path);
+	g_free(config->status_cache_directory);
 	g_free(config->keyring_path);
 	g_free(config->keyring_directory);
 	g_free(config->keyring_check_purpose);
 	g_free(config->autoinstall_path);
 	g_free(config->systeminfo_handler);
+	g_free(config->qos_cgroup);
 	g_free(config->preinstall_handler);
 	g_free(config->postinstall_handler);
 	g_free(config->streaming_sandbox_user);
@@ -7,8 +7,10 @@
 #include "context.h"
 #include "event_log.h"
 #include "status_file.h"
+#include "trace_event.h"
 #include "network.h"
 #include "install.h"
+#include "probes.h"
 #include "signature.h"
 #include "utils.h"
 
@@ -573,22 +575,149 @@ void r_context_set_busy(gboolean busy)
 	context->busy = busy;
 }
 
+/* Progress steps begun by a worker thread are kept on a separate stack for
+ * each thread. Its bottom step is nested in the step which was active in the
+ * main stack when the thread was attached. */
+typedef struct {
+	GList *stack;
+	RaucProgressStep *parent;
+} RProgressThread;
+
+static GRecMutex progress_lock;
+static GPrivate progress_thread;
+
+/* state for calculating throughput and ETA, protected by progress_lock */
+static gint64 progress_start_time;
+static gint64 progress_last_update;
+static guint64 progress_bytes;
+static guint64 progress_rate_bytes;
+static gint64 progress_rate_time;
+static guint64 progress_throughput;
+static gint64 progress_eta = -1;
+
+static GList **progress_stack(void)
+{
+	RProgressThread *thread = g_private_get(&progress_thread);
+
+	return thread ? &thread->stack : &context->progress;
+}
+
+/* Returns the parent of the step in the given stack element, NULL for the
+ * root step. */
+static RaucProgressStep *progress_parent(GList *element)
+{
+	RProgressThread *thread = g_private_get(&progress_thread);
+
+	if (g_list_next(element))
+		return g_list_next(element)->data;
+
+	return thread ? thread->parent : NULL;
+}
+
+void r_context_progress_attach_thread(RaucProgressStep *parent)
+{
+	RProgressThread *thread;
+
+	g_return_if_fail(parent);
+	g_assert_null(g_private_get(&progress_thread));
+
+	thread = g_new0(RProgressThread, 1);
+	thread->parent = parent;
+	g_private_set(&progress_thread, thread);
+}
+
+void r_context_progress_detach_thread(void)
+{
+	RProgressThread *thread = g_private_get(&progress_thread);
+
+	g_assert_nonnull(thread);
+	g_assert_null(thread->stack);
+
+	g_private_set(&progress_thread, NULL);
+	g_free(thread);
+}
+
+RaucProgressStep *r_context_progress_current_step(void)
+{
+	RaucProgressStep *step;
+	GList *stack;
+
+	g_rec_mutex_lock(&progress_lock);
+	stack = *progress_stack();
+	if (stack)
+		step = stack->data;
+	else
+		step = progress_parent(NULL);
+	g_rec_mutex_unlock(&progress_lock);
+
+	return step;
+}
+
+static void reset_progress_rate(void)
+{
+	progress_start_time = g_get_monotonic_time();
+	progress_last_update = progress_start_time;
+	progress_bytes = 0;
+	progress_rate_bytes = 0;
+	progress_rate_time = progress_start_time;
+	progress_throughput = 0;
+	progress_eta = -1;
+}
+
+static void update_progress_rate(gfloat percentage)
+{
+	gint64 now = g_get_monotonic_time();
+
+	/* the throughput is smoothed over several update intervals */
+	if (now - progress_rate_time >= R_PROGRESS_UPDATE_INTERVAL) {
+		guint64 rate = (progress_bytes - progress_rate_bytes) * G_USEC_PER_SEC / (now - progress_rate_time);
+
+		progress_throughput = progress_throughput ? (progress_throughput * 3 + rate) / 4 : rate;
+		progress_rate_bytes = progress_bytes;
+		progress_rate_time = now;
+	}
+
+	/* with size-weighted steps, the overall percentage is a good estimate
+	 * of the remaining work */
+	if (percentage >= 100.0f)
+		progress_eta = 0;
+	else if (percentage >= 1.0f)
+		progress_eta = (now - progress_start_time) * (100.0f - percentage) / percentage / G_USEC_PER_SEC;
+	else
+		progress_eta = -1;
+
+	progress_last_update = now;
+}
+
+void r_context_get_progress_rate(guint64 *throughput, gint64 *eta)
+{
+	g_rec_mutex_lock(&progress_lock);
+	if (throughput)
+		*throughput = progress_throughput;
+	if (eta)
+		*eta = progress_eta;
+	g_rec_mutex_unlock(&progress_lock);
+}
+
 static void r_context_send_progress(gboolean op_finished, gboolean success)
 {
 	RaucProgressStep *step;
 	RaucProgressStep *iter_step;
+	RProgressThread *thread = g_private_get(&progress_thread);
+	GList *stack = *progress_stack();
 	gfloat percentage = 0;
+	gint depth;
 
 	/* last step already notified parent, ignore it */
-	GList *iter = g_list_next(context->progress);
+	GList *iter = g_list_next(stack);
 
 	/* "stack" should never be NULL at this point */
-	g_assert_nonnull(context->progress);
+	g_assert_nonnull(stack);
 
-	step = context->progress->data;
+	step = stack->data;
 
 	/* no step in list left means operation complete */
-	if (!iter)
+	if (!iter && !thread)
 		percentage = step->percent_done;
 
 	/* sum up done percentages of all steps */
@@ -598,6 +727,17 @@ static void r_context_send_progress(gboolean op_finished, gboolean success)
 		iter = g_list_next(iter);
 	}
 
+	/* include the steps of the main stack, starting at the parent of this
+	 * thread's steps */
+	depth = g_list_length(stack);
+	if (thread) {
+		for (iter = context->progress; iter; iter = g_list_next(iter)) {
+			iter_step = iter->data;
+			percentage = percentage + iter_step->percent_done;
+		}
+		depth += g_list_length(context->progress);
+	}
+
 	/* This step is not 100% itself, so it must not be the root step even though the
 	   previous steps sum to 100. Max out the percentage at 99% in that case. */
 	if (step->percent_done < 100.0f && percentage > 99.0f)
@@ -605,6 +745,8 @@ static void r_context_send_progress(gboolean op_finished, gboolean success)
 
 	g_assert_cmpint(percentage, <=, 100);
 
+	update_progress_rate(percentage);
+
 	/* call installer callback with percentage and message */
 	if (op_finished) {
 		g_autofree gchar *old = step->description;
@@ -616,8 +758,7 @@ static void r_context_send_progress(gboolean op_finished, gboolean success)
 
 	/* handle missing callback gracefully */
 	if (context->progress_callback)
-		context->progress_callback(percentage, step->description,
-				g_list_length(context->progress));
+		context->progress_callback(percentage, step->description, depth);
 }
 
 void r_context_begin_step(const gchar *name, const gchar *description,
@@ -631,6 +772,7 @@ void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 {
 	RaucProgressStep *step = g_new0(RaucProgressStep, 1);
 	RaucProgressStep *parent;
+	GList **stack;
 
 	g_return_if_fail(name);
 	g_return_if_fail(description);
@@ -644,9 +786,12 @@ void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 	step->percent_done = 0;
 	step->last_explicit_percent = 0;
 
+	g_rec_mutex_lock(&progress_lock);
+	stack = progress_stack();
+
 	/* calculate percentage */
-	if (context->progress) {
-		parent = context->progress->data;
+	parent = *stack ? (*stack)->data : progress_parent(NULL);
+	if (parent) {
 		g_assert_cmpint(parent->substeps_total, >, 0);
 
 		/* nesting check */
@@ -665,12 +810,25 @@ void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 	} else {
 		/* root step */
 		step->percent_total = 100;
+		reset_progress_rate();
 	}
 
+	step->timing = g_new0(RaucStepTiming, 1);
+	step->timing->name = g_strdup(name);
+	step->timing->description = g_strdup(description);
+	step->timing->start = g_get_monotonic_time();
+	step->timing->children = g_ptr_array_new_with_free_func((GDestroyNotify) r_context_free_step_timing);
+	if (parent)
+		g_ptr_array_add(parent->timing->children, step->timing);
+
+	R_PROBE2(step_begin, name, description);
+	r_trace_event_begin("step", description);
+
 	/* add step to "stack" */
-	context->progress = g_list_prepend(context->progress, step);
+	*stack = g_list_prepend(*stack, step);
 
 	r_context_send_progress(FALSE, FALSE);
+	g_rec_mutex_unlock(&progress_lock);
 }
 
 void r_context_begin_step_formatted(const gchar *name, gint substeps, const gchar *description, ...)
@@ -703,19 +861,44 @@ void r_context_begin_step_weighted_formatted(const gchar *name, gint substeps, g
 	r_context_begin_step_weighted(name, desc_formatted, substeps, weight);
 }
 
+/* Advances the explicit percentage of a step and passes the difference on to
+ * its parent. Returns FALSE if the percentage did not increase. */
+static gboolean advance_step_percent(RaucProgressStep *step, RaucProgressStep *parent, gfloat percent)
+{
+	gfloat difference = percent - step->last_explicit_percent;
+
+	if (difference <= 0)
+		return FALSE;
+
+	step->percent_done = step->percent_total * (difference / 100.0f);
+
+	/* pass to parent */
+	if (parent)
+		parent->percent_done = parent->percent_done
+		                       + step->percent_done;
+
+	step->last_explicit_percent = percent;
+
+	return TRUE;
+}
+
 void r_context_end_step(const gchar *name, gboolean success)
 {
 	RaucProgressStep *step;
 	GList *step_element;
 	RaucProgressStep *parent;
+	GList **stack;
 
 	g_return_if_fail(name);
 
+	g_rec_mutex_lock(&progress_lock);
+	stack = progress_stack();
+
 	/* "stack" should never be NULL at this point */
-	g_assert_nonnull(context->progress);
+	g_assert_nonnull(*stack);
 
 	/* get element from "stack" */
-	step_element = context->progress;
+	step_element = *stack;
 	step = step_element->data;
 	g_assert_nonnull(step);
 
@@ -740,13 +923,13 @@ void r_context_end_step(const gchar *name, gboolean success)
 	g_assert_cmpstr(step->name, ==, name);
 
 	/* increment step count and percentage on parent step */
-	if (g_list_next(context->progress)) {
-		parent = g_list_next(context->progress)->data;
+	parent = progress_parent(step_element);
+	if (parent) {
 		parent->substeps_done += step->weight;
 
 		/* clean up explicit percentage */
 		if (step->last_explicit_percent != 0)
-			r_context_set_step_percentage(step->name, 100);
+			advance_step_percent(step, parent, 100);
 		else
 			parent->percent_done = parent->percent_done
 			                       + step->percent_done;
@@ -755,26 +938,43 @@ void r_context_end_step(const gchar *name, gboolean success)
 				parent->percent_done);
 	}
 
+	/* a finished copy does not contribute to the throughput anymore */
+	if (step->bytes_done)
+		progress_throughput = 0;
+
+	R_PROBE2(step_end, name, success);
+	r_trace_event_end("step", step->timing->description);
+	step->timing->duration = g_get_monotonic_time() - step->timing->start;
+	step->timing->bytes = step->bytes_done;
+	step->timing->success = success;
+	if (!parent) {
+		g_clear_pointer(&context->install_info->step_timing, r_context_free_step_timing);
+		context->install_info->step_timing = g_steal_pointer(&step->timing);
+	}
+
 	r_context_send_progress(TRUE, success);
-	context->progress = g_list_remove_link(context->progress,
-			step_element);
+	*stack = g_list_remove_link(*stack, step_element);
 
 	g_list_free(step_element);
 	r_context_free_progress_step(step);
+	g_rec_mutex_unlock(&progress_lock);
 }
 
 void r_context_set_step_percentage(const gchar *name, gint custom_percent)
 {
 	RaucProgressStep *step;
 	RaucProgressStep *parent;
-	gint percent_difference;
+	GList *stack;
 
 	g_return_if_fail(name);
 
-	g_assert_nonnull(context->progress);
+	g_rec_mutex_lock(&progress_lock);
+	stack = *progress_stack();
 
-	step = context->progress->data;
-	parent = g_list_next(context->progress)->data;
+	g_assert_nonnull(stack);
+
+	step = stack->data;
+	parent = progress_parent(stack);
 
 	/* ensure that progress step nesting is done correctly */
 	g_assert_cmpstr(step->name, ==, name);
@@ -782,25 +982,59 @@ void r_context_set_step_percentage(const gchar *name, gint custom_percent)
 	/* substeps and setting explicit percentage does not make sense */
 	g_assert_cmpint(step->substeps_total, ==, 0);
 
-	percent_difference = custom_percent - step->last_explicit_percent;
-
 	/* skip progress update if percentage did not change */
-	if (percent_difference < 1)
+	if (custom_percent - step->last_explicit_percent < 1) {
+		g_rec_mutex_unlock(&progress_lock);
 		return;
+	}
 
-	step->percent_done = step->percent_total
-	                     * (percent_difference / 100.0f);
+	advance_step_percent(step, parent, custom_percent);
 
-	/* pass to parent */
-	if (parent)
-		parent->percent_done = parent->percent_done
-		                       + step->percent_done;
+	/* r_context_step_end sends 100% progress step */
+	if (custom_percent != 100)
+		r_context_send_progress(FALSE, FALSE);
+	g_rec_mutex_unlock(&progress_lock);
+}
+
+void r_context_set_step_progress(const gchar *name, guint64 done, guint64 total)
+{
+	RaucProgressStep *step;
+	RaucProgressStep *parent;
+	GList *stack;
+	gfloat percent;
+
+	g_return_if_fail(name);
+
+	g_rec_mutex_lock(&progress_lock);
+	stack = *progress_stack();
+
+	g_assert_nonnull(stack);
+
+	step = stack->data;
+	parent = progress_parent(stack);
+
+	/* ensure that progress step nesting is done correctly */
+	g_assert_cmpstr(step->name, ==, name);
+
+	/* substeps and setting explicit progress does not make sense */
+	g_assert_cmpint(step->substeps_total, ==, 0);
 
-	step->last_explicit_percent = custom_percent;
+	if (done > step->bytes_done) {
+		progress_bytes += done - step->bytes_done;
+		step->bytes_done = done;
+	}
+
+	percent = total ? MIN(done, total) * 100.0 / total : 100.0f;
+	if (!advance_step_percent(step, parent, percent)) {
+		g_rec_mutex_unlock(&progress_lock);
+		return;
+	}
 
 	/* r_context_step_end sends 100% progress step */
-	if (custom_percent != 100)
+	if (percent < 100.0f &&
+	    g_get_monotonic_time() - progress_last_update >= R_PROGRESS_UPDATE_INTERVAL)
 		r_context_send_progress(FALSE, FALSE);
+	g_rec_mutex_unlock(&progress_lock);
 }
 
 void r_context_free_progress_step(RaucProgressStep *step)
@@ -813,6 +1047,69 @@ void r_context_free_progress_step(RaucProgressStep *step)
 	g_free(step);
 }
 
+void r_context_free_step_timing(RaucStepTiming *timing)
+{
+	if (!timing)
+		return;
+
+	g_free(timing->name);
+	g_free(timing->description);
+	g_clear_pointer(&timing->children, g_ptr_array_unref);
+	g_free(timing);
+}
+
+static void format_step_timing(GString *report, const RaucStepTiming *timing, gint64 root_start, guint depth)
+{
+	g_string_append_printf(report, "%*s[+%.3f s] %s: %.3f s", depth * 2, "",
+			(timing->start - root_start) / (gdouble) G_USEC_PER_SEC,
+			timing->description, timing->duration / (gdouble) G_USEC_PER_SEC);
+	if (timing->bytes) {
+		g_string_append_printf(report, ", %"G_GUINT64_FORMAT " bytes", timing->bytes);
+		if (timing->duration > 0)
+			g_string_append_printf(report, " (%.1f MiB/s)",
+					timing->bytes * (gdouble) G_USEC_PER_SEC / timing->duration / (1024 * 1024));
+	}
+	if (!timing->success)
+		g_string_append(report, " (failed)");
+	g_string_append_c(report, '\n');
+
+	for (guint i = 0; i < timing->children->len; i++)
+		format_step_timing(report, timing->children->pdata[i], root_start, depth + 1);
+}
+
+gchar *r_context_step_timing_format(const RaucStepTiming *timing)
+{
+	GString *report = g_string_new(NULL);
+
+	g_return_val_if_fail(timing, NULL);
+
+	format_step_timing(report, timing, timing->start, 0);
+
+	return g_string_free(report, FALSE);
+}
+
+static void step_timing_to_builder(GVariantBuilder *builder, const RaucStepTiming *timing, gint64 root_start, gint depth)
+{
+	g_variant_builder_add(builder, "(isstttb)", depth, timing->name, timing->description,
+			(guint64) (timing->start - root_start), (guint64) timing->duration,
+			timing->bytes, timing->success);
+
+	for (guint i = 0; i < timing->children->len; i++)
+		step_timing_to_builder(builder, timing->children->pdata[i], root_start, depth + 1);
+}
+
+GVariant *r_context_step_timing_to_variant(const RaucStepTiming *timing)
+{
+	GVariantBuilder builder;
+
+	g_return_val_if_fail(timing, NULL);
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(isstttb)"));
+	step_timing_to_builder(&builder, timing, timing->start, 0);
+
+	return g_variant_builder_end(&builder);
+}
+
 void r_context_register_progress_callback(progress_callback progress_cb)
 {
 	g_return_if_fail(progress_cb);
@@ -876,6 +1173,7 @@ void r_context_install_info_free(RContextInstallationInfo *info)
 {
 	/* contains only reference to existing bundle instance */
 	info->mounted_bundle = NULL;
+	g_clear_pointer(&info->step_timing, r_context_free_step_timing);
 	g_free(info);
 }
 
@@ -891,6 +1189,7 @@ void r_context_clean(void)
 		g_clear_pointer(&context->encryption_key, g_free);
 		g_clear_pointer(&context->mksquashfs_args, g_free);
 		g_clear_pointer(&context->casync_args, g_free);
+		g_clear_pointer(&context->digest_cache_dir, g_free);
 		g_clear_pointer(&context->recipients, g_strfreev);
 		g_clear_pointer(&context->intermediatepaths, g_strfreev);
 		g_clear_pointer(&context->mountprefix, g_free);
@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "digest_cache.h"
+#include "utils.h"
+
+#define DIGEST_CACHE_GROUP "checksum"
+
+/* Returns the path of a cache entry. The key is hashed, so that
+ * caller-supplied keys can contain arbitrary characters. */
+static gchar *cache_entry_path(const gchar *cachedir, const gchar *key, const gchar *suffix)
+{
+	g_autofree gchar *hashed = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+	g_autofree gchar *name = g_strconcat(hashed, suffix, NULL);
+
+	return g_build_filename(cachedir, name, NULL);
+}
+
+static gboolean ensure_cachedir(const gchar *cachedir, GError **error)
+{
+	if (g_mkdir_with_parents(cachedir, 0755) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create digest cache directory '%s': %s", cachedir, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gchar *r_digest_cache_file_key(const gchar *filename, GError **error)
+{
+	GStatBuf st;
+
+	g_return_val_if_fail(filename, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	if (g_stat(filename, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", filename, g_strerror(err));
+		return NULL;
+	}
+
+	/* The ctime is not part of the key, as bundle creation hard-links the
+	 * input files into the workdir (and removes them again), which updates
+	 * the ctime on every build. */
+	return g_strdup_printf("file:%"G_GUINT64_FORMAT":%"G_GUINT64_FORMAT":%"G_GUINT64_FORMAT":%"G_GINT64_FORMAT".%09ld",
+			(guint64) st.st_dev, (guint64) st.st_ino, (guint64) st.st_size,
+			(gint64) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+}
+
+gboolean r_digest_cache_get_checksum(const gchar *cachedir, const gchar *key, RaucChecksum *checksum)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *digest = NULL;
+	guint64 size;
+
+	g_return_val_if_fail(cachedir, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
+
+	/* only SHA256 (the default) is cached */
+	if (checksum->type && checksum->type != G_CHECKSUM_SHA256)
+		return FALSE;
+
+	path = cache_entry_path(cachedir, key, ".checksum");
+	if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, &ierror)) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_debug("Ignoring digest cache entry %s: %s", path, ierror->message);
+		return FALSE;
+	}
+
+	digest = g_key_file_get_string(key_file, DIGEST_CACHE_GROUP, "sha256", &ierror);
+	if (!digest) {
+		g_debug("Ignoring digest cache entry %s: %s", path, ierror->message);
+		return FALSE;
+	}
+	size = g_key_file_get_uint64(key_file, DIGEST_CACHE_GROUP, "size", &ierror);
+	if (ierror) {
+		g_debug("Ignoring digest cache entry %s: %s", path, ierror->message);
+		return FALSE;
+	}
+
+	g_clear_pointer(&checksum->digest, g_free);
+	checksum->digest = g_steal_pointer(&digest);
+	checksum->size = size;
+	checksum->type = G_CHECKSUM_SHA256;
+
+	return TRUE;
+}
+
+gboolean r_digest_cache_put_checksum(const gchar *cachedir, const gchar *key, const RaucChecksum *checksum, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *path = NULL;
+
+	g_return_val_if_fail(cachedir, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
+	g_return_val_if_fail(checksum->digest, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* only SHA256 (the default) is cached */
+	if (checksum->type != G_CHECKSUM_SHA256)
+		return TRUE;
+
+	if (!ensure_cachedir(cachedir, error))
+		return FALSE;
+
+	g_key_file_set_string(key_file, DIGEST_CACHE_GROUP, "sha256", checksum->digest);
+	g_key_file_set_uint64(key_file, DIGEST_CACHE_GROUP, "size", checksum->size);
+
+	path = cache_entry_path(cachedir, key, ".checksum");
+
+	/* g_key_file_save_to_file() replaces the file atomically */
+	return g_key_file_save_to_file(key_file, path, error);
+}
+
+gboolean r_digest_cache_get_hash_index(const gchar *cachedir, const gchar *key, const gchar *indexpath)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GBytes) hashes = NULL;
+	g_autofree gchar *path = NULL;
+
+	g_return_val_if_fail(cachedir, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(indexpath, FALSE);
+
+	path = cache_entry_path(cachedir, key, ".block-hash-index");
+	hashes = read_file(path, &ierror);
+	if (!hashes) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_debug("Ignoring digest cache entry %s: %s", path, ierror->message);
+		return FALSE;
+	}
+
+	/* each entry is a SHA256 hash, so anything else is a damaged entry */
+	if (g_bytes_get_size(hashes) == 0 || g_bytes_get_size(hashes) % 32) {
+		g_debug("Ignoring digest cache entry %s: invalid size", path);
+		return FALSE;
+	}
+
+	if (!write_file(indexpath, hashes, &ierror)) {
+		g_warning("Failed to write cached hash index to %s: %s", indexpath, ierror->message);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_digest_cache_put_hash_index(const gchar *cachedir, const gchar *key, const gchar *indexpath, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GBytes) hashes = NULL;
+	g_autofree gchar *path = NULL;
+
+	g_return_val_if_fail(cachedir, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(indexpath, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!ensure_cachedir(cachedir, error))
+		return FALSE;
+
+	hashes = read_file(indexpath, &ierror);
+	if (!hashes) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	path = cache_entry_path(cachedir, key, ".block-hash-index");
+
+	/* write_file() replaces the file atomically */
+	return write_file(path, hashes, error);
+}
+
+gboolean r_digest_cache_compute_checksum(const gchar *cachedir, RaucChecksum *checksum, const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *key = NULL;
+
+	g_return_val_if_fail(cachedir, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
+	g_return_val_if_fail(filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	key = r_digest_cache_file_key(filename, &ierror);
+	if (!key) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (r_digest_cache_get_checksum(cachedir, key, checksum)) {
+		g_debug("Using cached checksum for %s", filename);
+		return TRUE;
+	}
+
+	if (!compute_checksum(checksum, filename, error))
+		return FALSE;
+
+	if (!r_digest_cache_put_checksum(cachedir, key, checksum, &ierror)) {
+		g_warning("Failed to update digest cache for %s: %s", filename, ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	return TRUE;
+}
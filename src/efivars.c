@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "efivars.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-efivars-error-quark, r_efivars_error)
+
+#define EFI_GLOBAL_VARIABLE_GUID "8be4df61-93ca-11d2-aa0d-00e098032b8c"
+/* NON_VOLATILE | BOOTSERVICE_ACCESS | RUNTIME_ACCESS */
+#define EFI_VARIABLE_DEFAULT_ATTRIBUTES 0x7
+#define LOAD_OPTION_ACTIVE 0x1
+
+static gchar *var_path(const gchar *dir, const gchar *name)
+{
+	return g_strdup_printf("%s/%s-" EFI_GLOBAL_VARIABLE_GUID, dir, name);
+}
+
+/* Reads a variable as (attributes, data). Variables are small, but efivarfs
+ * may report a wrong file size, so read until EOF. */
+static GBytes *read_var(const gchar *dir, const gchar *name, guint32 *attributes, GError **error)
+{
+	g_autofree gchar *path = var_path(dir, name);
+	g_autoptr(GByteArray) buf = g_byte_array_new();
+	g_auto(filedesc) fd = -1;
+	guint8 chunk[4096];
+	guint32 attr;
+
+	fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		if (err == ENOENT) {
+			g_set_error(error, R_EFIVARS_ERROR, R_EFIVARS_ERROR_NOT_FOUND,
+					"EFI variable %s not found", name);
+			return NULL;
+		}
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", path, g_strerror(err));
+		return NULL;
+	}
+
+	while (TRUE) {
+		ssize_t ret = read(fd, chunk, sizeof(chunk));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to read %s: %s", path, g_strerror(err));
+			return NULL;
+		}
+		if (ret == 0)
+			break;
+		g_byte_array_append(buf, chunk, ret);
+	}
+
+	if (buf->len < sizeof(attr)) {
+		g_set_error(error, R_EFIVARS_ERROR, R_EFIVARS_ERROR_INVALID,
+				"EFI variable %s is too short", name);
+		return NULL;
+	}
+
+	memcpy(&attr, buf->data, sizeof(attr));
+	if (attributes)
+		*attributes = GUINT32_FROM_LE(attr);
+
+	return g_bytes_new(buf->data + sizeof(attr), buf->len - sizeof(attr));
+}
+
+/* efivarfs marks most variables immutable, like efibootmgr, we clear the
+ * flag before writing. */
+static void clear_immutable(const gchar *path)
+{
+	g_auto(filedesc) fd = -1;
+	int flags;
+
+	fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) != 0 || !(flags & FS_IMMUTABLE_FL))
+		return;
+
+	flags &= ~FS_IMMUTABLE_FL;
+	if (ioctl(fd, FS_IOC_SETFLAGS, &flags) != 0)
+		g_debug("Failed to clear immutable flag of %s: %s", path, g_strerror(errno));
+}
+
+static gboolean write_var(const gchar *dir, const gchar *name, guint32 attributes, const guint8 *data, gsize len, GError **error)
+{
+	g_autofree gchar *path = var_path(dir, name);
+	g_autofree guint8 *buf = g_malloc(sizeof(attributes) + len);
+	g_auto(filedesc) fd = -1;
+	struct statfs sfs;
+	ssize_t ret;
+
+	attributes = GUINT32_TO_LE(attributes);
+	memcpy(buf, &attributes, sizeof(attributes));
+	memcpy(buf + sizeof(attributes), data, len);
+
+	clear_immutable(path);
+
+	fd = g_open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	/* efivarfs replaces the variable with a single write, other file
+	 * systems (used for testing) need to be truncated */
+	if (fstatfs(fd, &sfs) == 0 && sfs.f_type != EFIVARFS_MAGIC && ftruncate(fd, 0) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to truncate %s: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	do {
+		ret = write(fd, buf, sizeof(attributes) + len);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 || (gsize) ret != sizeof(attributes) + len) {
+		int err = ret < 0 ? errno : EIO;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to write EFI variable %s: %s", name, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean read_uint16_var(const gchar *dir, const gchar *name, gboolean *present, guint16 *value, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GBytes) data = NULL;
+	guint16 val;
+
+	data = read_var(dir, name, NULL, &ierror);
+	if (!data) {
+		if (g_error_matches(ierror, R_EFIVARS_ERROR, R_EFIVARS_ERROR_NOT_FOUND)) {
+			g_clear_error(&ierror);
+			*present = FALSE;
+			return TRUE;
+		}
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (g_bytes_get_size(data) != sizeof(val)) {
+		g_set_error(error, R_EFIVARS_ERROR, R_EFIVARS_ERROR_INVALID,
+				"EFI variable %s has invalid size", name);
+		return FALSE;
+	}
+
+	memcpy(&val, g_bytes_get_data(data, NULL), sizeof(val));
+	*value = GUINT16_FROM_LE(val);
+	*present = TRUE;
+
+	return TRUE;
+}
+
+static gboolean read_boot_order(const gchar *dir, REfiBootState *state, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GBytes) data = NULL;
+	const guint8 *raw;
+	gsize size;
+
+	data = read_var(dir, "BootOrder", &state->boot_order_attributes, &ierror);
+	if (!data) {
+		/* like efibootmgr, treat a missing BootOrder as empty, it is
+		 * created with the default attributes when it is written */
+		if (g_error_matches(ierror, R_EFIVARS_ERROR, R_EFIVARS_ERROR_NOT_FOUND)) {
+			g_debug("EFI variable BootOrder not found, using an empty boot order");
+			g_clear_error(&ierror);
+			return TRUE;
+		}
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	raw = g_bytes_get_data(data, &size);
+	if (size % sizeof(guint16)) {
+		g_set_error(error, R_EFIVARS_ERROR, R_EFIVARS_ERROR_INVALID,
+				"EFI variable BootOrder has invalid size");
+		return FALSE;
+	}
+
+	for (gsize i = 0; i < size; i += sizeof(guint16)) {
+		guint16 num;
+		memcpy(&num, raw + i, sizeof(num));
+		num = GUINT16_FROM_LE(num);
+		g_array_append_val(state->boot_order, num);
+	}
+
+	return TRUE;
+}
+
+static void load_option_free(REfiLoadOption *option)
+{
+	g_free(option->description);
+	g_free(option);
+}
+
+/* EFI_LOAD_OPTION: UINT32 Attributes, UINT16 FilePathListLength,
+ * CHAR16 Description[] (NUL terminated), followed by the device path and
+ * optional data, which we don't need. */
+static REfiLoadOption *parse_load_option(guint16 num, GBytes *data, GError **error)
+{
+	g_autofree gunichar2 *desc = NULL;
+	const guint8 *raw;
+	gsize size, len = 0;
+	guint32 attributes;
+	REfiLoadOption *option;
+
+	raw = g_bytes_get_data(data, &size);
+	if (size < 6) {
+		g_set_error(error, R_EFIVARS_ERROR, R_EFIVARS_ERROR_INVALID,
+				"Load option Boot%04X is too short", num);
+		return NULL;
+	}
+
+	memcpy(&attributes, raw, sizeof(attributes));
+	attributes = GUINT32_FROM_LE(attributes);
+
+	/* copy, as the description is not necessarily aligned */
+	desc = g_new0(gunichar2, (size - 6) / 2 + 1);
+	for (gsize pos = 6; pos + 1 < size; pos += 2) {
+		gunichar2 c;
+		memcpy(&c, raw + pos, sizeof(c));
+		c = GUINT16_FROM_LE(c);
+		if (!c)
+			break;
+		desc[len++] = c;
+	}
+
+	option = g_new0(REfiLoadOption, 1);
+	option->num = num;
+	option->active = (attributes & LOAD_OPTION_ACTIVE) != 0;
+	option->description = g_utf16_to_utf8(desc, len, NULL, NULL, NULL);
+	if (!option->description)
+		option->description = g_strdup("");
+
+	return option;
+}
+
+static gint compare_load_options(gconstpointer a, gconstpointer b)
+{
+	const REfiLoadOption *oa = *(REfiLoadOption * const *) a;
+	const REfiLoadOption *ob = *(REfiLoadOption * const *) b;
+
+	return (gint) oa->num - (gint) ob->num;
+}
+
+/* Matches 'Boot####-<global GUID>' and returns the boot number. */
+static gboolean parse_load_option_name(const gchar *name, guint16 *num)
+{
+	g_autofree gchar *hex = NULL;
+
+	if (strlen(name) != strlen("Boot####-" EFI_GLOBAL_VARIABLE_GUID) || !g_str_has_prefix(name, "Boot"))
+		return FALSE;
+
+	for (guint i = 4; i < 8; i++) {
+		if (!g_ascii_isxdigit(name[i]))
+			return FALSE;
+	}
+
+	if (name[8] != '-' || g_ascii_strcasecmp(name + 9, EFI_GLOBAL_VARIABLE_GUID) != 0)
+		return FALSE;
+
+	hex = g_strndup(name + 4, 4);
+	*num = g_ascii_strtoull(hex, NULL, 16);
+
+	return TRUE;
+}
+
+static gboolean read_load_options(const gchar *dir, REfiBootState *state, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GDir) d = NULL;
+	const gchar *name;
+
+	d = g_dir_open(dir, 0, &ierror);
+	if (!d) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	while ((name = g_dir_read_name(d))) {
+		g_autoptr(GBytes) data = NULL;
+		g_autofree gchar *varname = NULL;
+		REfiLoadOption *option;
+		guint16 num;
+
+		if (!parse_load_option_name(name, &num))
+			continue;
+
+		varname = g_strndup(name, 8);
+		data = read_var(dir, varname, NULL, &ierror);
+		if (!data) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		option = parse_load_option(num, data, &ierror);
+		if (!option) {
+			g_debug("Ignoring EFI boot entry: %s", ierror->message);
+			g_clear_error(&ierror);
+			continue;
+		}
+
+		g_debug("Detected EFI boot entry %04X: %s", option->num, option->description);
+		g_ptr_array_add(state->load_options, option);
+	}
+
+	g_ptr_array_sort(state->load_options, compare_load_options);
+
+	return TRUE;
+}
+
+REfiBootState *r_efivars_read_boot_state(const gchar *dir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(REfiBootState) state = NULL;
+
+	g_return_val_if_fail(dir, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	state = g_new0(REfiBootState, 1);
+	state->boot_order = g_array_new(FALSE, FALSE, sizeof(guint16));
+	state->load_options = g_ptr_array_new_with_free_func((GDestroyNotify) load_option_free);
+
+	if (!read_boot_order(dir, state, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!read_uint16_var(dir, "BootNext", &state->has_boot_next, &state->boot_next, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!read_uint16_var(dir, "BootCurrent", &state->has_boot_current, &state->boot_current, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!read_load_options(dir, state, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&state);
+}
+
+REfiLoadOption *r_efivars_get_load_option(const REfiBootState *state, guint16 num)
+{
+	g_return_val_if_fail(state, NULL);
+
+	for (guint i = 0; i < state->load_options->len; i++) {
+		REfiLoadOption *option = g_ptr_array_index(state->load_options, i);
+		if (option->num == num)
+			return option;
+	}
+
+	return NULL;
+}
+
+gboolean r_efivars_set_boot_order(const gchar *dir, REfiBootState *state, const guint16 *order, guint len, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint16 *data = g_new(guint16, MAX(len, 1));
+	guint32 attributes;
+
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(state, FALSE);
+	g_return_val_if_fail(order || len == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (guint i = 0; i < len; i++)
+		data[i] = GUINT16_TO_LE(order[i]);
+
+	attributes = state->boot_order_attributes ? state->boot_order_attributes : EFI_VARIABLE_DEFAULT_ATTRIBUTES;
+	if (!write_var(dir, "BootOrder", attributes, (const guint8 *) data, len * sizeof(guint16), &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	g_array_set_size(state->boot_order, 0);
+	g_array_append_vals(state->boot_order, order, len);
+
+	return TRUE;
+}
+
+gboolean r_efivars_set_boot_next(const gchar *dir, REfiBootState *state, guint16 num, GError **error)
+{
+	GError *ierror = NULL;
+	guint16 data = GUINT16_TO_LE(num);
+
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(state, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!write_var(dir, "BootNext", EFI_VARIABLE_DEFAULT_ATTRIBUTES, (const guint8 *) &data, sizeof(data), &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	state->has_boot_next = TRUE;
+	state->boot_next = num;
+
+	return TRUE;
+}
+
+void r_efivars_boot_state_free(REfiBootState *state)
+{
+	if (!state)
+		return;
+
+	if (state->boot_order)
+		g_array_unref(state->boot_order);
+	if (state->load_options)
+		g_ptr_array_unref(state->load_options);
+	g_free(state);
+}
@@ -2,6 +2,7 @@
 #include <glib.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
+#include <string.h>
 #if ENABLE_JSON
 #include <json-glib/json-glib.h>
 #endif
@@ -16,6 +17,7 @@ static const gchar *supported_event_types[] = {
 	R_EVENT_LOG_TYPE_INSTALL,
 	R_EVENT_LOG_TYPE_SERVICE,
 	R_EVENT_LOG_TYPE_WRITE_SLOT,
+	R_EVENT_LOG_TYPE_STATS,
 	NULL
 };
 
@@ -59,11 +61,39 @@ void r_event_log_message(const gchar *type, const gchar *message, ...)
 			"MESSAGE", "%s", formatted);
 }
 
+struct _REventLogQueue {
+	GThread *thread;
+	GMutex lock;
+	/* signalled when events are queued or a flush or stop is requested */
+	GCond queued_cond;
+	/* signalled when events are taken from the queue or were written */
+	GCond done_cond;
+	/* formatted events (with trailing newline) */
+	GQueue lines;
+	/* number of events queued and processed (written or dropped) so far */
+	guint64 queued;
+	guint64 done;
+	/* a flush up to this number of queued events was requested */
+	guint64 flush_to;
+	gboolean stop;
+	/* set by the writer thread when the logger failed */
+	gboolean broken;
+};
+
+/* loggers with a running background writer */
+static GList *event_log_async_loggers = NULL;
+static GMutex event_log_async_lock;
+
+static void event_log_queue_stop(REventLogger *logger);
+
 void r_event_log_free_logger(REventLogger *logger)
 {
 	if (!logger)
 		return;
 
+	if (logger->queue)
+		event_log_queue_stop(logger);
+
 	g_clear_pointer(&logger->name, g_free);
 	g_clear_pointer(&logger->filename, g_free);
 	g_clear_pointer(&logger->logstream, g_object_unref);
@@ -300,17 +330,207 @@ static gboolean rotate_logfiles(REventLogger* logger, goffset next_len, GError *
 	return TRUE;
 }
 
-static void event_log_writer_file(REventLogger* logger, const GLogField *fields, gsize n_fields)
+/**
+ * Writes pending output to the log file.
+ *
+ * @param logger Logger to write to
+ * @param pending Output to write, cleared on success
+ *
+ * @return TRUE on success, FALSE if the logger is broken
+ */
+static gboolean event_log_write_pending(REventLogger *logger, GString *pending)
+{
+	g_autoptr(GError) ierror = NULL;
+	gsize written = 0;
+
+	if (!pending->len)
+		return TRUE;
+
+	if (!g_output_stream_write_all(G_OUTPUT_STREAM(logger->logstream), pending->str, pending->len, &written, NULL, &ierror)) {
+		g_warning("Failed to write log file '%s': %s", logger->filename, ierror->message);
+		g_warning("Deactivating broken logger '%s'", logger->name);
+		return FALSE;
+	}
+
+	logger->filesize += written;
+	g_string_truncate(pending, 0);
+
+	return TRUE;
+}
+
+/**
+ * Writes formatted events to the log file, rotating it when needed.
+ *
+ * Consecutive events are combined into a single write, unless the log file
+ * needs to be rotated in between.
+ *
+ * @param logger Logger to write to
+ * @param lines formatted events (each with a trailing newline)
+ * @param n_lines number of elements in the lines array
+ *
+ * @return TRUE on success, FALSE if the logger is broken
+ */
+static gboolean event_log_write_lines(REventLogger *logger, gchar **lines, guint n_lines)
 {
 	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GString) pending = g_string_new(NULL);
+
+	for (guint i = 0; i < n_lines; i++) {
+		gsize len = strlen(lines[i]);
+
+		/* Once we know how much to write, we can use this information for trimming */
+		if (logger->maxsize && logger->filesize + (goffset)(pending->len + len) > logger->maxsize) {
+			if (!event_log_write_pending(logger, pending))
+				return FALSE;
+
+			if (!rotate_logfiles(logger, len, &ierror)) {
+				g_warning("Failed to rotate log files: %s", ierror->message);
+				g_warning("Deactivating broken logger %s", logger->name);
+				return FALSE;
+			}
+		}
+
+		g_string_append_len(pending, lines[i], len);
+	}
+
+	return event_log_write_pending(logger, pending);
+}
+
+static gpointer event_log_writer_thread(gpointer data)
+{
+	REventLogger *logger = data;
+	REventLogQueue *queue = logger->queue;
+	g_autoptr(GPtrArray) batch = g_ptr_array_new_with_free_func(g_free);
+	gboolean failed;
+
+	g_mutex_lock(&queue->lock);
+	while (TRUE) {
+		while (!queue->lines.length && !queue->stop)
+			g_cond_wait(&queue->queued_cond, &queue->lock);
+
+		/* remaining events are written before stopping */
+		if (!queue->lines.length)
+			break;
+
+		/* delay writing to collect more events, unless a flush is
+		 * pending or the queue fills up */
+		if (logger->flush_interval) {
+			gint64 deadline = g_get_monotonic_time() + logger->flush_interval * G_TIME_SPAN_MILLISECOND;
+
+			while (!queue->stop && queue->flush_to <= queue->done &&
+			       queue->lines.length < R_EVENT_LOG_QUEUE_SIZE / 2) {
+				if (!g_cond_wait_until(&queue->queued_cond, &queue->lock, deadline))
+					break;
+			}
+		}
+
+		while (queue->lines.length)
+			g_ptr_array_add(batch, g_queue_pop_head(&queue->lines));
+		g_cond_broadcast(&queue->done_cond);
+		g_mutex_unlock(&queue->lock);
+
+		/* the logger's file and stream are only used by this thread */
+		failed = !queue->broken && !event_log_write_lines(logger, (gchar **) batch->pdata, batch->len);
+
+		g_mutex_lock(&queue->lock);
+		if (failed)
+			queue->broken = TRUE;
+		queue->done += batch->len;
+		g_ptr_array_set_size(batch, 0);
+		g_cond_broadcast(&queue->done_cond);
+	}
+	g_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+static void event_log_queue_start(REventLogger *logger)
+{
+	REventLogQueue *queue = g_new0(REventLogQueue, 1);
+
+	g_mutex_init(&queue->lock);
+	g_cond_init(&queue->queued_cond);
+	g_cond_init(&queue->done_cond);
+	g_queue_init(&queue->lines);
+
+	logger->queue = queue;
+	queue->thread = g_thread_new("event-log", event_log_writer_thread, logger);
+
+	g_mutex_lock(&event_log_async_lock);
+	event_log_async_loggers = g_list_prepend(event_log_async_loggers, logger);
+	g_mutex_unlock(&event_log_async_lock);
+}
+
+static void event_log_queue_flush(REventLogQueue *queue)
+{
+	guint64 target;
+
+	g_mutex_lock(&queue->lock);
+	target = queue->queued;
+	queue->flush_to = MAX(queue->flush_to, target);
+	g_cond_signal(&queue->queued_cond);
+	while (queue->done < target)
+		g_cond_wait(&queue->done_cond, &queue->lock);
+	g_mutex_unlock(&queue->lock);
+}
+
+static void event_log_queue_stop(REventLogger *logger)
+{
+	REventLogQueue *queue = logger->queue;
+
+	g_mutex_lock(&event_log_async_lock);
+	event_log_async_loggers = g_list_remove(event_log_async_loggers, logger);
+	g_mutex_unlock(&event_log_async_lock);
+
+	g_mutex_lock(&queue->lock);
+	queue->stop = TRUE;
+	g_cond_signal(&queue->queued_cond);
+	g_mutex_unlock(&queue->lock);
+
+	g_thread_join(queue->thread);
+	g_assert(g_queue_is_empty(&queue->lines));
+
+	g_cond_clear(&queue->done_cond);
+	g_cond_clear(&queue->queued_cond);
+	g_mutex_clear(&queue->lock);
+	g_free(queue);
+	logger->queue = NULL;
+}
+
+/* Passes a formatted event to the background writer (takes ownership). */
+static void event_log_queue_line(REventLogger *logger, gchar *line)
+{
+	REventLogQueue *queue = logger->queue;
+
+	g_mutex_lock(&queue->lock);
+
+	if (queue->broken) {
+		g_mutex_unlock(&queue->lock);
+		g_free(line);
+		logger->broken = TRUE;
+		return;
+	}
+
+	/* rather slow down than lose events if the writer cannot keep up */
+	while (queue->lines.length >= R_EVENT_LOG_QUEUE_SIZE)
+		g_cond_wait(&queue->done_cond, &queue->lock);
+
+	g_queue_push_tail(&queue->lines, line);
+	queue->queued++;
+	g_cond_signal(&queue->queued_cond);
+
+	g_mutex_unlock(&queue->lock);
+}
+
+static void event_log_writer_file(REventLogger* logger, const GLogField *fields, gsize n_fields)
+{
 	g_autofree gchar *formatted = NULL;
 	g_autofree gchar *output = NULL;
-	gsize written = 0;
 
 	if (logger->broken)
 		return;
 
-	if (!logger->logstream)
+	if (!logger->configured)
 		g_error("Called log writer on uninitialized logger '%s'", logger->name);
 
 	switch (logger->format) {
@@ -339,24 +559,30 @@ static void event_log_writer_file(REventLogger* logger, const GLogField *fields,
 	}
 	output = g_strdup_printf("%s\n", formatted);
 
-	/* Once we know how much to write, we can use this information for trimming */
-	if (!rotate_logfiles(logger, strlen(output), &ierror)) {
-		g_warning("Failed to rotate log files: %s", ierror->message);
-		g_warning("Deactivating broken logger %s", logger->name);
-		logger->broken = TRUE;
+	if (logger->queue) {
+		event_log_queue_line(logger, g_steal_pointer(&output));
 		return;
 	}
 
-	if (!g_output_stream_write_all(G_OUTPUT_STREAM(logger->logstream), output, strlen(output), &written, NULL, &ierror)) {
-		g_warning("Failed to write log file '%s': %s", logger->filename, ierror->message);
-		g_warning("Deactivating broken logger '%s'", logger->name);
+	if (!event_log_write_lines(logger, &output, 1))
 		logger->broken = TRUE;
-		return;
-	}
+}
 
-	logger->filesize += written;
+void r_event_log_flush(void)
+{
+	g_mutex_lock(&event_log_async_lock);
+	for (GList *l = event_log_async_loggers; l != NULL; l = l->next) {
+		REventLogger *logger = l->data;
+
+		event_log_queue_flush(logger->queue);
+	}
+	g_mutex_unlock(&event_log_async_lock);
 }
 
+/* Events can be emitted from several install threads concurrently, so
+ * access to the loggers (and their output streams) is serialized. */
+static GRecMutex event_log_lock;
+
 GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *fields, gsize n_fields, gpointer user_data)
 {
 	const gchar *log_domain = NULL;
@@ -386,6 +612,8 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
 		}
 	}
 
+	g_rec_mutex_lock(&event_log_lock);
+
 	/* iterate over registered event loggers */
 	for (GList *l = r_context()->config->loggers; l != NULL; l = l->next) {
 		REventLogger* logger = l->data;
@@ -402,6 +630,8 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
 		logger->writer(logger, fields, n_fields);
 	}
 
+	g_rec_mutex_unlock(&event_log_lock);
+
 	return G_LOG_WRITER_HANDLED;
 }
 
@@ -434,5 +664,8 @@ void r_event_log_setup_logger(REventLogger *logger)
 
 	logger->configured = TRUE;
 
+	if (logger->flush == R_EVENT_LOG_FLUSH_ASYNC)
+		event_log_queue_start(logger);
+
 	return;
 }
@@ -0,0 +1,473 @@
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "extract.h"
+#include "qos.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-extract-error-quark, r_extract_error)
+
+#define EXTRACT_CHUNK_SIZE (1024*1024)
+#define EXTRACT_CHUNKS 4
+/* maximum amount of decompressed data queued for the writer thread */
+#define EXTRACT_WRITE_BUDGET (16*1024*1024)
+/* accounted size of a queued entry header */
+#define EXTRACT_ENTRY_COST 4096
+
+typedef struct {
+	guint8 *data;
+	gsize len;
+} ExtractChunk;
+
+typedef struct {
+	gint fd;
+	goffset size;
+	/* chunks ready to be filled by the reader thread */
+	GAsyncQueue *free_chunks;
+	/* filled chunks, terminated by a chunk with len 0 */
+	GAsyncQueue *full_chunks;
+	/* chunk currently used by libarchive */
+	ExtractChunk *current;
+	gboolean eof;
+	gint abort;
+	goffset consumed;
+	GError *error;
+} ExtractReader;
+
+/* A new entry (if 'entry' is set), a data block of the current entry (if
+ * 'data' is set) or the end of the archive (neither is set). */
+typedef struct {
+	struct archive_entry *entry;
+	guint8 *data;
+	gsize len;
+	gint64 offset;
+} ExtractOp;
+
+typedef struct {
+	struct archive *disk;
+	GAsyncQueue *ops;
+	/* amount of queued data, limited to EXTRACT_WRITE_BUDGET */
+	GMutex lock;
+	GCond cond;
+	gsize pending;
+	gint failed;
+	GError *error;
+} ExtractWriter;
+
+/* Reads the archive sequentially in chunks and passes them to libarchive. A
+ * chunk with zero length signals the end of the archive (or an error). */
+static gpointer extract_reader_thread(gpointer data)
+{
+	ExtractReader *reader = data;
+	ExtractChunk *chunk;
+	goffset offset = 0;
+
+	r_qos_enter_thread();
+
+	while (offset < reader->size && !g_atomic_int_get(&reader->abort)) {
+		chunk = g_async_queue_pop(reader->free_chunks);
+		chunk->len = MIN(EXTRACT_CHUNK_SIZE, reader->size - offset);
+
+		/* start read-ahead for the chunks following this one */
+		(void) posix_fadvise(reader->fd, offset + chunk->len,
+				EXTRACT_CHUNK_SIZE * (EXTRACT_CHUNKS - 1), POSIX_FADV_WILLNEED);
+
+		if (!r_pread_exact(reader->fd, chunk->data, chunk->len, offset, &reader->error)) {
+			chunk->len = 0;
+			g_async_queue_push(reader->full_chunks, chunk);
+			r_qos_leave_thread();
+			return NULL;
+		}
+		offset += chunk->len;
+		g_async_queue_push(reader->full_chunks, chunk);
+	}
+
+	chunk = g_async_queue_pop(reader->free_chunks);
+	chunk->len = 0;
+	g_async_queue_push(reader->full_chunks, chunk);
+
+	r_qos_leave_thread();
+	return NULL;
+}
+
+static la_ssize_t extract_read_cb(struct archive *a, void *data, const void **buffer)
+{
+	ExtractReader *reader = data;
+
+	if (reader->eof)
+		return 0;
+
+	if (reader->current)
+		g_async_queue_push(reader->free_chunks, reader->current);
+
+	reader->current = g_async_queue_pop(reader->full_chunks);
+	if (!reader->current->len) {
+		reader->eof = TRUE;
+		if (reader->error) {
+			archive_set_error(a, EIO, "%s", reader->error->message);
+			return -1;
+		}
+		return 0;
+	}
+
+	reader->consumed += reader->current->len;
+	/* emit progress info (but only when in progress context) */
+	if (r_context()->progress)
+		r_context_set_step_progress("copy_image", reader->consumed, reader->size);
+
+	*buffer = reader->current->data;
+	return reader->current->len;
+}
+
+/* Stops the reader thread and waits until it has sent the last chunk. */
+static void extract_reader_finish(ExtractReader *reader)
+{
+	g_atomic_int_set(&reader->abort, 1);
+
+	if (reader->current) {
+		g_async_queue_push(reader->free_chunks, reader->current);
+		reader->current = NULL;
+	}
+
+	while (!reader->eof) {
+		ExtractChunk *chunk = g_async_queue_pop(reader->full_chunks);
+
+		if (!chunk->len)
+			reader->eof = TRUE;
+		g_async_queue_push(reader->free_chunks, chunk);
+	}
+}
+
+static void extract_writer_set_error(ExtractWriter *writer, const gchar *path, const gchar *action)
+{
+	if (g_atomic_int_get(&writer->failed))
+		return;
+
+	g_set_error(&writer->error, R_EXTRACT_ERROR, R_EXTRACT_ERROR_FAILED,
+			"Failed to %s %s: %s", action, path ?: "archive",
+			archive_error_string(writer->disk) ?: "unknown error");
+	g_atomic_int_set(&writer->failed, 1);
+}
+
+static void extract_writer_reserve(ExtractWriter *writer, gsize len)
+{
+	g_mutex_lock(&writer->lock);
+	while (writer->pending && writer->pending + len > EXTRACT_WRITE_BUDGET)
+		g_cond_wait(&writer->cond, &writer->lock);
+	writer->pending += len;
+	g_mutex_unlock(&writer->lock);
+}
+
+static void extract_writer_release(ExtractWriter *writer, gsize len)
+{
+	g_mutex_lock(&writer->lock);
+	writer->pending -= len;
+	g_cond_signal(&writer->cond);
+	g_mutex_unlock(&writer->lock);
+}
+
+/* Creates the extracted files. After an error, the remaining operations are
+ * only released. */
+static gpointer extract_writer_thread(gpointer data)
+{
+	ExtractWriter *writer = data;
+	g_autofree gchar *path = NULL;
+	gboolean in_entry = FALSE;
+	ExtractOp *op;
+
+	r_qos_enter_thread();
+
+	while (TRUE) {
+		gboolean end;
+		int ret;
+
+		op = g_async_queue_pop(writer->ops);
+		end = !op->entry && !op->data;
+
+		if (in_entry && (op->entry || end) && !g_atomic_int_get(&writer->failed)) {
+			if (archive_write_finish_entry(writer->disk) < ARCHIVE_WARN)
+				extract_writer_set_error(writer, path, "finish");
+			in_entry = FALSE;
+		}
+
+		if (g_atomic_int_get(&writer->failed)) {
+			/* nothing to do but releasing the operation */
+		} else if (op->entry) {
+			g_free(path);
+			path = g_strdup(archive_entry_pathname(op->entry));
+
+			ret = archive_write_header(writer->disk, op->entry);
+			if (ret < ARCHIVE_WARN) {
+				extract_writer_set_error(writer, path, "create");
+			} else {
+				if (ret == ARCHIVE_WARN)
+					g_message("%s: %s", path, archive_error_string(writer->disk));
+				in_entry = TRUE;
+			}
+		} else if (op->data) {
+			if (archive_write_data_block(writer->disk, op->data, op->len, op->offset) < ARCHIVE_WARN)
+				extract_writer_set_error(writer, path, "write");
+			r_qos_throttle_write(op->len);
+		} else {
+			/* applies the deferred metadata of the directories */
+			if (archive_write_close(writer->disk) < ARCHIVE_WARN)
+				extract_writer_set_error(writer, NULL, "finish");
+		}
+
+		if (op->entry) {
+			archive_entry_free(op->entry);
+			extract_writer_release(writer, EXTRACT_ENTRY_COST);
+		} else if (op->data) {
+			g_free(op->data);
+			extract_writer_release(writer, op->len);
+		}
+		g_free(op);
+
+		if (end)
+			break;
+	}
+
+	r_qos_leave_thread();
+	return NULL;
+}
+
+static void extract_writer_push(ExtractWriter *writer, struct archive_entry *entry, const void *data, gsize len, gint64 offset)
+{
+	ExtractOp *op = g_new0(ExtractOp, 1);
+
+	if (entry) {
+		extract_writer_reserve(writer, EXTRACT_ENTRY_COST);
+		op->entry = entry;
+	} else if (data) {
+		extract_writer_reserve(writer, len);
+		op->data = g_memdup(data, len);
+		op->len = len;
+		op->offset = offset;
+	}
+
+	g_async_queue_push(writer->ops, op);
+}
+
+/* Returns a copy of the entry with its paths inside 'dest'. */
+static struct archive_entry *extract_entry_to_dest(struct archive_entry *entry, const gchar *dest)
+{
+	struct archive_entry *copy = archive_entry_clone(entry);
+	const gchar *name;
+	g_autofree gchar *path = NULL;
+
+	name = archive_entry_pathname(entry);
+	/* like tar, strip leading '/' characters */
+	while (name && *name == '/')
+		name++;
+	path = g_build_filename(dest, name, NULL);
+	archive_entry_set_pathname(copy, path);
+
+	name = archive_entry_hardlink(entry);
+	if (name) {
+		g_autofree gchar *target = NULL;
+
+		while (*name == '/')
+			name++;
+		target = g_build_filename(dest, name, NULL);
+		archive_entry_set_hardlink(copy, target);
+	}
+
+	return copy;
+}
+
+static gboolean extract_entries(struct archive *a, ExtractWriter *writer, const gchar *dest, GError **error)
+{
+	struct archive_entry *entry;
+	int ret;
+
+	while (!g_atomic_int_get(&writer->failed)) {
+		const void *buf;
+		size_t len;
+		la_int64_t offset;
+
+		ret = archive_read_next_header(a, &entry);
+		if (ret == ARCHIVE_EOF)
+			break;
+		if (ret < ARCHIVE_WARN) {
+			g_set_error(error, R_EXTRACT_ERROR, R_EXTRACT_ERROR_FAILED,
+					"Failed to read archive: %s", archive_error_string(a));
+			return FALSE;
+		}
+		if (ret == ARCHIVE_WARN)
+			g_message("%s: %s", archive_entry_pathname(entry), archive_error_string(a));
+
+		extract_writer_push(writer, extract_entry_to_dest(entry, dest), NULL, 0, 0);
+
+		while ((ret = archive_read_data_block(a, &buf, &len, &offset)) != ARCHIVE_EOF) {
+			if (ret < ARCHIVE_WARN) {
+				g_set_error(error, R_EXTRACT_ERROR, R_EXTRACT_ERROR_FAILED,
+						"Failed to read %s from archive: %s", archive_entry_pathname(entry),
+						archive_error_string(a));
+				return FALSE;
+			}
+			if (len)
+				extract_writer_push(writer, NULL, buf, len, offset);
+			if (g_atomic_int_get(&writer->failed))
+				break;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean sync_dest(const gchar *dest, GError **error)
+{
+	g_auto(filedesc) fd = -1;
+
+	fd = g_open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", dest, g_strerror(err));
+		return FALSE;
+	}
+
+	if (syncfs(fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to sync %s: %s", dest, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_extract_archive(const gchar *filename, const gchar *dest, RExtractFlags flags, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) fd = -1;
+	g_autoptr(GPtrArray) chunks = g_ptr_array_new_with_free_func(g_free);
+	struct archive *a = NULL;
+	struct stat st;
+	ExtractReader reader = {};
+	ExtractWriter writer = {};
+	GThread *reader_thread = NULL;
+	GThread *writer_thread = NULL;
+	g_autofree gchar *real_dest = NULL;
+	int options;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(filename, FALSE);
+	g_return_val_if_fail(dest, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	fd = g_open(filename, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", filename, g_strerror(err));
+		return FALSE;
+	}
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", filename, g_strerror(err));
+		return FALSE;
+	}
+
+	/* The symlink check covers all components of the (absolute) paths, so
+	 * the destination itself must not contain any symlinks. */
+	real_dest = r_realpath(dest);
+	if (!real_dest) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to resolve %s: %s", dest, g_strerror(err));
+		return FALSE;
+	}
+
+	/* like tar, only restore the ownership when running as root */
+	options = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME |
+	          ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+	if (geteuid() == 0)
+		options |= ARCHIVE_EXTRACT_OWNER;
+	if (flags & R_EXTRACT_FLAGS_XATTRS)
+		options |= ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_XATTR;
+
+	writer.disk = archive_write_disk_new();
+	if (!writer.disk)
+		g_error("Failed to allocate archive writer");
+	archive_write_disk_set_options(writer.disk, options);
+	writer.ops = g_async_queue_new();
+	g_mutex_init(&writer.lock);
+	g_cond_init(&writer.cond);
+
+	reader.fd = fd;
+	reader.size = st.st_size;
+	reader.free_chunks = g_async_queue_new();
+	reader.full_chunks = g_async_queue_new();
+	for (int i = 0; i < EXTRACT_CHUNKS; i++) {
+		ExtractChunk *chunk = g_new0(ExtractChunk, 1);
+		chunk->data = g_malloc(EXTRACT_CHUNK_SIZE);
+		g_ptr_array_add(chunks, chunk->data);
+		g_ptr_array_add(chunks, chunk);
+		g_async_queue_push(reader.free_chunks, chunk);
+	}
+
+	a = archive_read_new();
+	if (!a)
+		g_error("Failed to allocate archive reader");
+	archive_read_support_filter_all(a);
+	archive_read_support_format_tar(a);
+
+	(void) posix_fadvise(fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+
+	reader_thread = g_thread_new("extract-reader", extract_reader_thread, &reader);
+	writer_thread = g_thread_new("extract-writer", extract_writer_thread, &writer);
+
+	if (archive_read_open(a, &reader, NULL, extract_read_cb, NULL) != ARCHIVE_OK) {
+		g_set_error(&ierror, R_EXTRACT_ERROR, R_EXTRACT_ERROR_FAILED,
+				"Failed to open archive: %s", archive_error_string(a));
+	} else {
+		extract_entries(a, &writer, real_dest, &ierror);
+	}
+
+	/* stop both threads, also after an error */
+	extract_writer_push(&writer, NULL, NULL, 0, 0);
+	g_thread_join(writer_thread);
+	extract_reader_finish(&reader);
+	g_thread_join(reader_thread);
+
+	/* a read error is more relevant than the resulting archive error */
+	if (reader.error) {
+		g_clear_error(&ierror);
+		g_propagate_prefixed_error(error, g_steal_pointer(&reader.error),
+				"Failed to read %s: ", filename);
+		goto out;
+	}
+	if (writer.error) {
+		g_clear_error(&ierror);
+		g_propagate_error(error, g_steal_pointer(&writer.error));
+		goto out;
+	}
+	if (ierror) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* the files are not synced individually */
+	if (!sync_dest(real_dest, error))
+		goto out;
+
+	res = TRUE;
+out:
+	archive_read_free(a);
+	archive_write_free(writer.disk);
+	g_async_queue_unref(writer.ops);
+	g_mutex_clear(&writer.lock);
+	g_cond_clear(&writer.cond);
+	g_async_queue_unref(reader.free_chunks);
+	g_async_queue_unref(reader.full_chunks);
+	return res;
+}
@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "grub_env.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-grub-env-error-quark, r_grub_env_error)
+
+#define GRUB_ENV_HEADER "# GRUB Environment Block\n"
+#define GRUB_ENV_DEFAULT_SIZE 1024
+
+struct _RGrubEnv {
+	gchar *path;
+	gsize size;
+	/* variable names in block order */
+	GPtrArray *keys;
+	GHashTable *vars;
+	gboolean dirty;
+};
+
+/* Like GRUB, values are stored with '\' and newlines preceded by a backslash,
+ * so an escaped newline is part of the value. */
+static gchar *unescape_value(const gchar *value, gsize len)
+{
+	GString *str = g_string_sized_new(len);
+
+	for (gsize i = 0; i < len; i++) {
+		if (value[i] == '\\' && i + 1 < len)
+			i++;
+		g_string_append_c(str, value[i]);
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+static void append_escaped(GString *str, const gchar *value)
+{
+	for (const gchar *c = value; *c; c++) {
+		if (*c == '\\' || *c == '\n')
+			g_string_append_c(str, '\\');
+		g_string_append_c(str, *c);
+	}
+}
+
+/* Returns the newline ending the line at 'p' (skipping escaped ones), or NULL
+ * if the line is unterminated. */
+static const gchar *find_eol(const gchar *p, const gchar *end)
+{
+	while (p < end) {
+		if (*p == '\\')
+			p += 2;
+		else if (*p == '\n')
+			return p;
+		else
+			p++;
+	}
+
+	return NULL;
+}
+
+static void add_var(RGrubEnv *env, gchar *key, gchar *value)
+{
+	if (!g_hash_table_contains(env->vars, key))
+		g_ptr_array_add(env->keys, g_strdup(key));
+	g_hash_table_insert(env->vars, key, value);
+}
+
+static gboolean parse_block(RGrubEnv *env, const gchar *data, gsize len, GError **error)
+{
+	const gchar *p = data + strlen(GRUB_ENV_HEADER);
+	const gchar *end = data + len;
+
+	while (p < end) {
+		const gchar *eol = find_eol(p, end);
+		const gchar *eq;
+
+		/* comments and padding */
+		if (*p == '#') {
+			if (!eol)
+				break;
+			p = eol + 1;
+			continue;
+		}
+
+		if (!eol) {
+			g_set_error(error, R_GRUB_ENV_ERROR, R_GRUB_ENV_ERROR_INVALID,
+					"%s: unterminated line in environment block", env->path);
+			return FALSE;
+		}
+
+		eq = memchr(p, '=', eol - p);
+		if (eq && eq != p)
+			add_var(env, g_strndup(p, eq - p), unescape_value(eq + 1, eol - eq - 1));
+		else if (eol != p)
+			g_debug("%s: ignoring invalid line '%.*s'", env->path, (int) (eol - p), p);
+
+		p = eol + 1;
+	}
+
+	return TRUE;
+}
+
+RGrubEnv *r_grub_env_read(const gchar *path, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
+	g_autofree gchar *contents = NULL;
+	gsize len;
+
+	g_return_val_if_fail(path, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	env = g_new0(RGrubEnv, 1);
+	env->path = g_strdup(path);
+	env->keys = g_ptr_array_new_with_free_func(g_free);
+	env->vars = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (!g_file_get_contents(path, &contents, &len, &ierror)) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+		g_clear_error(&ierror);
+		env->size = GRUB_ENV_DEFAULT_SIZE;
+		return g_steal_pointer(&env);
+	}
+
+	if (len < strlen(GRUB_ENV_HEADER) || !g_str_has_prefix(contents, GRUB_ENV_HEADER)) {
+		g_set_error(error, R_GRUB_ENV_ERROR, R_GRUB_ENV_ERROR_INVALID,
+				"%s is not a GRUB environment block", path);
+		return NULL;
+	}
+	env->size = len;
+
+	if (!parse_block(env, contents, len, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&env);
+}
+
+const gchar *r_grub_env_get(RGrubEnv *env, const gchar *key)
+{
+	g_return_val_if_fail(env, NULL);
+	g_return_val_if_fail(key, NULL);
+
+	return g_hash_table_lookup(env->vars, key);
+}
+
+void r_grub_env_set(RGrubEnv *env, const gchar *key, const gchar *value)
+{
+	g_return_if_fail(env);
+	g_return_if_fail(key && *key && !strchr(key, '=') && !strchr(key, '\n'));
+	g_return_if_fail(value);
+
+	if (g_strcmp0(g_hash_table_lookup(env->vars, key), value) == 0)
+		return;
+
+	add_var(env, g_strdup(key), g_strdup(value));
+	env->dirty = TRUE;
+}
+
+gboolean r_grub_env_write(RGrubEnv *env, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GString) block = NULL;
+	g_auto(filedesc) fd = -1;
+
+	g_return_val_if_fail(env, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!env->dirty)
+		return TRUE;
+
+	block = g_string_sized_new(env->size);
+	g_string_append(block, GRUB_ENV_HEADER);
+	for (guint i = 0; i < env->keys->len; i++) {
+		const gchar *key = env->keys->pdata[i];
+
+		g_string_append(block, key);
+		g_string_append_c(block, '=');
+		append_escaped(block, g_hash_table_lookup(env->vars, key));
+		g_string_append_c(block, '\n');
+	}
+
+	if (block->len > env->size) {
+		g_set_error(error, R_GRUB_ENV_ERROR, R_GRUB_ENV_ERROR_TOO_LARGE,
+				"Variables exceed the GRUB environment block size of %"G_GSIZE_FORMAT " bytes", env->size);
+		return FALSE;
+	}
+
+	/* GRUB rewrites the block in place, so its size must not change */
+	while (block->len < env->size)
+		g_string_append_c(block, '#');
+
+	/* Like grub-editenv, overwrite the block in place, so that a symlinked
+	 * grubenv (e.g. to the EFI partition) and the file mode are kept. As
+	 * the size is unchanged, this never allocates new blocks. */
+	fd = g_open(env->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", env->path, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!r_pwrite_exact(fd, (const guint8 *) block->str, block->len, 0, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", env->path);
+		return FALSE;
+	}
+
+	if (fsync(fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to sync %s: %s", env->path, g_strerror(err));
+		return FALSE;
+	}
+
+	env->dirty = FALSE;
+
+	return TRUE;
+}
+
+void r_grub_env_free(RGrubEnv *env)
+{
+	if (!env)
+		return;
+
+	g_free(env->path);
+	g_clear_pointer(&env->vars, g_hash_table_destroy);
+	g_clear_pointer(&env->keys, g_ptr_array_unref);
+	g_free(env);
+}
@@ -7,6 +7,7 @@
 #include <openssl/evp.h>
 
 #include "hash_index.h"
+#include "probes.h"
 #include "utils.h"
 
 #define SHA256_LEN 32
@@ -17,11 +18,9 @@ GQuark r_hash_index_error_quark(void)
 }
 
 /**
- * Hash a single chunk using OpenSSL's SHA256.
- *
- * The calculated hash is stored in the chunk struct.
+ * Hash the data of a single chunk using OpenSSL's SHA256.
  */
-static void hash_chunk(RaucHashIndexChunk *chunk)
+static void hash_chunk_data(const guint8 *data, guint8 *hash)
 {
 	EVP_MD_CTX *mdctx;
 	uint8_t tmp[EVP_MAX_MD_SIZE];
@@ -32,7 +31,7 @@ static void hash_chunk(RaucHashIndexChunk *chunk)
 		g_error("failed to initialize OpenSSL EVP digest");
 	}
 
-	if (EVP_DigestUpdate(mdctx, chunk->data, sizeof(chunk->data)) != 1) {
+	if (EVP_DigestUpdate(mdctx, data, R_HASH_INDEX_CHUNK_SIZE) != 1) {
 		g_error("failed to update OpenSSL EVP digest");
 	}
 
@@ -40,13 +39,23 @@ static void hash_chunk(RaucHashIndexChunk *chunk)
 		g_error("failed to finalize OpenSSL EVP digest");
 	}
 
-	g_assert(tmp_size == sizeof(chunk->hash));
+	g_assert(tmp_size == SHA256_LEN);
 
-	memcpy(chunk->hash, tmp, sizeof(chunk->hash));
+	memcpy(hash, tmp, SHA256_LEN);
 
 	EVP_MD_CTX_free(mdctx);
 }
 
+/**
+ * Hash a single chunk using OpenSSL's SHA256.
+ *
+ * The calculated hash is stored in the chunk struct.
+ */
+static void hash_chunk(RaucHashIndexChunk *chunk)
+{
+	hash_chunk_data(chunk->data, chunk->hash);
+}
+
 /**
  * Build array of chunk hashes using SHA256.
  */
@@ -421,6 +430,60 @@ gboolean r_hash_index_export_slot(const RaucHashIndex *idx, const RaucSlot *slot
 	return write_file(index_filename, idx->hashes, error);
 }
 
+gboolean r_hash_index_verify_prefix(const RaucHashIndex *idx, int data_fd, guint32 *count, GError **error)
+{
+	GError *ierror = NULL;
+	const guint8(*hashes)[SHA256_LEN];
+	g_autofree RaucHashIndexChunk *chunk = g_new0(RaucHashIndexChunk, 1);
+	guint32 max;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(data_fd >= 0, FALSE);
+	g_return_val_if_fail(count, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	hashes = g_bytes_get_data(idx->hashes, NULL);
+	max = MIN(*count, idx->count);
+
+	for (guint32 i = 0; i < max; i++) {
+		if (!r_pread_exact(data_fd, chunk->data, sizeof(chunk->data), (off_t)i * sizeof(chunk->data), &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		hash_chunk(chunk);
+		if (memcmp(chunk->hash, hashes[i], SHA256_LEN) != 0) {
+			*count = i;
+			return TRUE;
+		}
+	}
+
+	*count = max;
+	return TRUE;
+}
+
+gboolean r_hash_index_check_chunks(const RaucHashIndex *idx, guint32 first, const guint8 *data, guint32 count, guint32 *mismatch)
+{
+	const guint8(*hashes)[SHA256_LEN];
+	guint8 hash[SHA256_LEN];
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(data, FALSE);
+	g_return_val_if_fail(first <= idx->count && count <= idx->count - first, FALSE);
+	g_return_val_if_fail(mismatch, FALSE);
+
+	hashes = g_bytes_get_data(idx->hashes, NULL);
+
+	for (guint32 i = 0; i < count; i++) {
+		hash_chunk_data(data + (gsize)i * R_HASH_INDEX_CHUNK_SIZE, hash);
+		if (memcmp(hash, hashes[first + i], SHA256_LEN) != 0) {
+			*mismatch = first + i;
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, RaucHashIndexChunk *chunk, GError **error)
 {
 	GError *ierror = NULL;
@@ -546,6 +609,10 @@ gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, Ra
 
 out:
 	r_stats_add(idx->match_stats, ret);
+	if (ret)
+		R_PROBE2(chunk_hit, idx->label, idx->lookup[middle]);
+	else
+		R_PROBE1(chunk_miss, idx->label);
 
 	return ret;
 }
@@ -7,9 +7,11 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 
 #include "artifacts.h"
@@ -21,6 +23,7 @@
 #include "manifest.h"
 #include "mark.h"
 #include "mount.h"
+#include "qos.h"
 #include "service.h"
 #include "shell.h"
 #include "signature.h"
@@ -252,7 +255,8 @@ gboolean determine_boot_states(GError **error)
 	RaucSlot *slot;
 	gboolean had_errors = FALSE;
 
-	/* get boot state */
+	/* get boot state, reading the boot loader state only once */
+	r_boot_query_begin();
 	g_hash_table_iter_init(&iter, r_context()->config->slots);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
 		g_autoptr(GError) ierror = NULL;
@@ -265,6 +269,7 @@ gboolean determine_boot_states(GError **error)
 			had_errors = TRUE;
 		}
 	}
+	r_boot_query_end();
 
 	if (had_errors)
 		g_set_error_literal(
@@ -1073,6 +1078,29 @@ static void update_slot_status(RaucSlotStatus *slot_state, const gchar* status,
 	slot_state->installed_count++;
 }
 
+/* Protects the slot status (and status file) when several slots are
+ * installed concurrently. */
+static GMutex slot_status_lock;
+
+static gboolean plan_verifies_write(const RImageInstallPlan *plan)
+{
+	return plan->target_slot && r_update_handler_verifies_write(plan->slot_handler, plan->image, plan->target_slot);
+}
+
+/* Returns the progress weight of copying the image of an install plan.
+ * Images get one unit per MiB, so that large images get a proportionally
+ * larger share of the overall progress than small ones. */
+static gint get_copy_weight(const RImageInstallPlan *plan)
+{
+	gint weight = CLAMP(plan->image->checksum.size / (1024 * 1024), 9, G_MAXINT / 1024);
+
+	/* reading the image back takes about as long as writing it */
+	if (plan_verifies_write(plan))
+		weight *= 2;
+
+	return weight;
+}
+
 static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, const char *hook_name, GError **error)
 {
 	GError *ierror = NULL;
@@ -1086,12 +1114,15 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 			plan->target_slot->bootname ? plan->target_slot->bootname : "",
 			plan->target_slot->bootname ? ")" : "");
 
+	g_mutex_lock(&slot_status_lock);
+
 	r_slot_status_load(plan->target_slot);
 	slot_state = plan->target_slot->status;
 
 	/* In case we failed unmounting while reading per-slot status
 	 * file, abort here */
 	if (plan->target_slot->mount_point) {
+		g_mutex_unlock(&slot_status_lock);
 		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_MOUNTED,
 				"Slot '%s' still mounted", plan->target_slot->device);
 		r_context_end_step("check_slot", FALSE);
@@ -1100,21 +1131,25 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 
 	/* if explicitly enabled, skip update of up-to-date slots */
 	if (!plan->target_slot->install_same && g_strcmp0(slot_state->status, "ok") == 0 && g_strcmp0(plan->image->checksum.digest, slot_state->checksum.digest) == 0) {
+		g_mutex_unlock(&slot_status_lock);
 		install_args_update(args, "Skipping update for correct image '%s'", plan->image->filename);
 		g_message("Skipping update for correct image '%s'", plan->image->filename);
 		r_context_end_step("check_slot", TRUE);
 
 		/* Dummy step to indicate slot was skipped and complete required 'update_slots' substeps */
-		r_context_begin_step_weighted_formatted("skip_image", 0, 9, "Copying image skipped");
+		r_context_begin_step_weighted_formatted("skip_image", 0, get_copy_weight(plan), "Copying image skipped");
 
 		/* Update the status also for skipped slots */
 		g_message("Updating slot %s status", plan->target_slot->name);
+		g_mutex_lock(&slot_status_lock);
 		update_slot_status(slot_state, "ok", manifest, plan, args);
 		if (!r_slot_status_save(plan->target_slot, &ierror)) {
+			g_mutex_unlock(&slot_status_lock);
 			g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
 			r_context_end_step("skip_image", FALSE);
 			return FALSE;
 		}
+		g_mutex_unlock(&slot_status_lock);
 
 		r_context_end_step("skip_image", TRUE);
 
@@ -1138,6 +1173,7 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		}
 
 		if (!r_slot_status_save(plan->target_slot, &ierror)) {
+			g_mutex_unlock(&slot_status_lock);
 			g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
 			r_context_end_step("check_slot", FALSE);
 			return FALSE;
@@ -1147,6 +1183,8 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 	g_free(slot_state->status);
 	slot_state->status = g_strdup("update");
 
+	g_mutex_unlock(&slot_status_lock);
+
 	r_context_end_step("check_slot", TRUE);
 
 	install_args_update(args, "Updating slot %s", plan->target_slot->name);
@@ -1162,7 +1200,11 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 			g_message("Updating %s with %s", plan->target_slot->device, plan->image->filename);
 	}
 
-	r_context_begin_step_weighted_formatted("copy_image", 0, 9, "Copying image to %s", plan->target_slot->name);
+	/* the cached per-slot status becomes invalid when the slot is written */
+	r_slot_status_invalidate_cache(plan->target_slot);
+
+	/* the handler splits the step into writing and verifying */
+	r_context_begin_step_weighted_formatted("copy_image", plan_verifies_write(plan) ? 2 : 0, get_copy_weight(plan), "Copying image to %s", plan->target_slot->name);
 
 	if (!plan->slot_handler(plan->image, plan->target_slot, hook_name, &ierror)) {
 		g_autoptr(GError) ierror_status = NULL;
@@ -1172,10 +1214,12 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		r_context_end_step("copy_image", FALSE);
 
 		g_message("Updating slot %s status", plan->target_slot->name);
+		g_mutex_lock(&slot_status_lock);
 		update_slot_status(slot_state, "failed", manifest, plan, args);
 		if (!r_slot_status_save(plan->target_slot, &ierror_status)) {
 			g_warning("Error while writing status file after slot update failure: %s", ierror_status->message);
 		}
+		g_mutex_unlock(&slot_status_lock);
 
 		return FALSE;
 	}
@@ -1183,11 +1227,14 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 	r_context_end_step("copy_image", TRUE);
 
 	g_message("Updating slot %s status", plan->target_slot->name);
+	g_mutex_lock(&slot_status_lock);
 	update_slot_status(slot_state, "ok", manifest, plan, args);
 	if (!r_slot_status_save(plan->target_slot, &ierror)) {
+		g_mutex_unlock(&slot_status_lock);
 		g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
 		return FALSE;
 	}
+	g_mutex_unlock(&slot_status_lock);
 
 	install_args_update(args, "Updating slot %s done", plan->target_slot->name);
 	return TRUE;
@@ -1232,6 +1279,7 @@ static RaucSlot* get_boot_mark_slot(const GPtrArray *install_plans)
 #define MESSAGE_ID_INSTALLATION_SUCCEEDED "0163db5468ac4237b090d28490c301ed"
 #define MESSAGE_ID_INSTALLATION_FAILED    "c48141f7fd49443aafff862b4809168f"
 #define MESSAGE_ID_INSTALLATION_REJECTED  "60bea7e4fea549ccad68af457308b13a"
+#define MESSAGE_ID_INSTALLATION_TIMING    "f2f9849141014fc78b00609801447d59"
 
 static void log_event_installation_started(RaucInstallArgs *args)
 {
@@ -1289,6 +1337,19 @@ static void log_event_installation_done(RaucInstallArgs *args, RaucManifest *man
 	g_log_structured_array(G_LOG_LEVEL_MESSAGE, fields, G_N_ELEMENTS(fields));
 }
 
+static void log_event_installation_timing(RaucInstallArgs *args, const RaucStepTiming *timing)
+{
+	g_autofree gchar *report = r_context_step_timing_format(timing);
+
+	/* the report is not printed by default */
+	g_log_structured(R_EVENT_LOG_DOMAIN, G_LOG_LEVEL_INFO,
+			"RAUC_EVENT_TYPE", "install",
+			"MESSAGE_ID", MESSAGE_ID_INSTALLATION_TIMING,
+			"TRANSACTION_ID", args->transaction,
+			"MESSAGE", "Installation %.8s timing:\n%s", args->transaction, report
+			);
+}
+
 static gboolean remove_old_artifacts(const RaucManifest *manifest, RArtifactRepo *repo, GError **error)
 {
 	GError *ierror = NULL;
@@ -1379,7 +1440,7 @@ static gboolean handle_artifact_install_plan(const RaucManifest *manifest, const
 	r_event_log_message(R_EVENT_LOG_TYPE_WRITE_SLOT, "Updating artifact '%s' in repo '%s'", artifact->name, plan->target_repo->name);
 
 	if (need_install) {
-		r_context_begin_step_weighted_formatted("copy_image", 0, 9, "Copying artifact image to repo '%s'", plan->target_repo->name);
+		r_context_begin_step_weighted_formatted("copy_image", 0, get_copy_weight(plan), "Copying artifact image to repo '%s'", plan->target_repo->name);
 
 		if (!r_artifact_install(artifact, plan->image, &ierror)) {
 			g_propagate_error(error, ierror);
@@ -1387,7 +1448,7 @@ static gboolean handle_artifact_install_plan(const RaucManifest *manifest, const
 			return FALSE;
 		}
 	} else {
-		r_context_begin_step_weighted_formatted("copy_image", 0, 9, "Reusing artifact image in repo '%s'", plan->target_repo->name);
+		r_context_begin_step_weighted_formatted("copy_image", 0, get_copy_weight(plan), "Reusing artifact image in repo '%s'", plan->target_repo->name);
 	}
 
 	/* update links (commit) */
@@ -1405,12 +1466,135 @@ static gboolean handle_artifact_install_plan(const RaucManifest *manifest, const
 	return TRUE;
 }
 
+static gboolean handle_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, const char *hook_name, GError **error)
+{
+	if (plan->target_slot)
+		return handle_slot_install_plan(manifest, plan, args, hook_name, error);
+	else if (plan->target_repo)
+		return handle_artifact_install_plan(manifest, plan, args, hook_name, error);
+
+	return TRUE;
+}
+
+/* Returns a key identifying the storage device the plan writes to.
+ *
+ * Partitions are mapped to their whole disk, so that plans sharing a disk end
+ * up in the same group. MTD and UBI (character) devices are treated as a
+ * single device, as are all artifact repositories. */
+static gchar *get_install_group_key(const RImageInstallPlan *plan)
+{
+	GStatBuf st;
+	dev_t dev;
+	g_autofree gchar *syspath = NULL;
+	g_autofree gchar *realdir = NULL;
+	g_autofree gchar *partfile = NULL;
+
+	if (!plan->target_slot)
+		return g_strdup("artifacts");
+
+	if (g_stat(plan->target_slot->device, &st) != 0)
+		return g_strdup(plan->target_slot->device);
+
+	if (S_ISCHR(st.st_mode))
+		return g_strdup("mtd");
+
+	/* for files and directories, use the device containing them */
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+	syspath = g_strdup_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+	realdir = realpath(syspath, NULL);
+	if (!realdir)
+		return g_strdup_printf("dev:%u:%u", major(dev), minor(dev));
+
+	partfile = g_build_filename(realdir, "partition", NULL);
+	if (g_file_test(partfile, G_FILE_TEST_EXISTS))
+		return g_path_get_dirname(realdir);
+
+	return g_steal_pointer(&realdir);
+}
+
+typedef struct {
+	const RaucManifest *manifest;
+	RaucInstallArgs *args;
+	const gchar *hook_name;
+	RaucProgressStep *parent;
+	/* plans writing to the same device, installed in order */
+	GPtrArray *plans;
+} RInstallGroup;
+
+static void install_group_free(RInstallGroup *group)
+{
+	g_ptr_array_free(group->plans, TRUE);
+	g_free(group);
+}
+
+static gboolean install_group(gpointer data, GError **error)
+{
+	RInstallGroup *group = data;
+	gboolean res = TRUE;
+
+	r_context_progress_attach_thread(group->parent);
+	r_qos_enter_thread();
+
+	for (guint i = 0; i < group->plans->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(group->plans, i);
+
+		res = handle_install_plan(group->manifest, plan, group->args, group->hook_name, error);
+		if (!res)
+			break;
+	}
+
+	r_qos_leave_thread();
+	r_context_progress_detach_thread();
+
+	return res;
+}
+
+/* Installs plans for different devices concurrently, using up to
+ * 'parallel-installs' threads. Plans for the same device are still installed
+ * one after the other. */
+static gboolean handle_install_plans_parallel(const RaucManifest *manifest, GPtrArray *install_plans, RaucInstallArgs *args, const char *hook_name, GError **error)
+{
+	g_autoptr(GPtrArray) groups = g_ptr_array_new_with_free_func((GDestroyNotify) install_group_free);
+	g_autoptr(GHashTable) groups_by_key = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	RaucProgressStep *parent = r_context_progress_current_step();
+
+	for (guint i = 0; i < install_plans->len; i++) {
+		RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+		gchar *key = get_install_group_key(plan);
+		RInstallGroup *group = g_hash_table_lookup(groups_by_key, key);
+
+		g_debug("Install group for %s: %s", plan->image->filename, key);
+
+		if (!group) {
+			group = g_new0(RInstallGroup, 1);
+			group->manifest = manifest;
+			group->args = args;
+			group->hook_name = hook_name;
+			group->parent = parent;
+			group->plans = g_ptr_array_new();
+			g_ptr_array_add(groups, group);
+			g_hash_table_insert(groups_by_key, key, group);
+		} else {
+			g_free(key);
+		}
+
+		g_ptr_array_add(group->plans, plan);
+	}
+
+	g_message("Installing %u images to %u devices using up to %d threads",
+			install_plans->len, groups->len, r_context()->config->parallel_installs);
+
+	return r_run_jobs(groups, install_group, r_context()->config->parallel_installs, error);
+}
+
 static gboolean launch_and_wait_default_handler(RaucInstallArgs *args, gchar* bundledir, RaucManifest *manifest, GHashTable *target_group, GError **error)
 {
 	g_autofree gchar *hook_name = NULL;
 	GError *ierror = NULL;
 	g_autoptr(GPtrArray) install_plans = NULL;
 	RaucSlot *boot_mark_slot = NULL;
+	gint update_weight = 0;
 
 	install_plans = r_install_make_plans(manifest, target_group, &ierror);
 	if (install_plans == NULL) {
@@ -1439,20 +1623,24 @@ static gboolean launch_and_wait_default_handler(RaucInstallArgs *args, gchar* bu
 	if (manifest->hook_name)
 		hook_name = g_build_filename(bundledir, manifest->hook_name, NULL);
 
-	r_context_begin_step_weighted("update_slots", "Updating slots", install_plans->len * 10, 6);
+	/* each plan consists of a check step (weight 1) and a copy step */
+	for (guint i = 0; i < install_plans->len; i++)
+		update_weight += 1 + get_copy_weight(g_ptr_array_index(install_plans, i));
+
+	r_context_begin_step_weighted("update_slots", "Updating slots", update_weight, 6);
 	install_args_update(args, "Updating slots...");
 
-	for (guint i = 0; i < install_plans->len; i++) {
-		const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+	if (r_context()->config->parallel_installs > 1) {
+		if (!handle_install_plans_parallel(manifest, install_plans, args, hook_name, &ierror)) {
+			g_propagate_error(error, ierror);
+			r_context_end_step("update_slots", FALSE);
+			return FALSE;
+		}
+	} else {
+		for (guint i = 0; i < install_plans->len; i++) {
+			const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
 
-		if (plan->target_slot) {
-			if (!handle_slot_install_plan(manifest, plan, args, hook_name, &ierror)) {
-				g_propagate_error(error, ierror);
-				r_context_end_step("update_slots", FALSE);
-				return FALSE;
-			}
-		} else if (plan->target_repo) {
-			if (!handle_artifact_install_plan(manifest, plan, args, hook_name, &ierror)) {
+			if (!handle_install_plan(manifest, plan, args, hook_name, &ierror)) {
 				g_propagate_error(error, ierror);
 				r_context_end_step("update_slots", FALSE);
 				return FALSE;
@@ -1713,6 +1901,14 @@ out:
 
 	r_context_end_step("do_install_bundle", res);
 
+	/* only available if installing was the outermost step */
+	if (r_context()->install_info->step_timing &&
+	    g_strcmp0(r_context()->install_info->step_timing->name, "do_install_bundle") == 0)
+		log_event_installation_timing(args, r_context()->install_info->step_timing);
+
+	/* the installation's events should be on disk before reporting the result */
+	r_event_log_flush();
+
 	return res;
 }
 
@@ -1739,7 +1935,9 @@ static gpointer install_thread(gpointer data)
 	g_debug("thread started for %s", args->name);
 	install_args_update(args, "started");
 
+	r_qos_enter_thread();
 	result = !do_install_bundle(args, &ierror);
+	r_qos_leave_thread();
 
 	if (result != 0) {
 		g_warning("%s", ierror->message);
@@ -26,6 +26,7 @@
 #include "signature.h"
 #include "slot.h"
 #include "status_file.h"
+#include "trace_event.h"
 #include "update_handler.h"
 #include "utils.h"
 #include "mark.h"
@@ -37,6 +38,7 @@ gboolean install_ignore_compatible, install_ignore_version_limit, install_progre
 gboolean trust_environment = FALSE;
 gboolean verification_disabled = FALSE;
 gboolean no_check_time = FALSE;
+gboolean in_place = FALSE;
 gboolean info_dumpcert = FALSE;
 gboolean info_dumprecipients = FALSE;
 gboolean status_detailed = FALSE;
@@ -47,29 +49,41 @@ gchar **intermediate = NULL;
 gchar *signing_keyring = NULL;
 gchar *mksquashfs_args = NULL;
 gchar *casync_args = NULL;
+gchar *digest_cache_dir = NULL;
 gchar **convert_ignore_images = NULL;
 gchar **recipients = NULL;
 gchar *handler_args = NULL;
 gchar *bootslot = NULL;
 gchar *installation_txn = NULL;
+gchar *trace_file = NULL;
 gboolean utf8_supported = FALSE;
 RaucBundleAccessArgs access_args = {0};
 
-static gchar* make_progress_line(gint percentage)
+static gchar* make_progress_line(gint percentage, guint64 throughput, gint64 eta)
 {
 	struct winsize w;
 	GString *printbuf = NULL;
+	g_autoptr(GString) details = g_string_new(NULL);
 	gint pbar_len = 0;
 
 	g_return_val_if_fail(percentage <= 100, NULL);
 
+	if (throughput > 0) {
+		g_autofree gchar *rate = g_format_size_full(throughput, G_FORMAT_SIZE_IEC_UNITS);
+		g_string_append_printf(details, " %s/s", rate);
+	}
+	if (eta >= 3600)
+		g_string_append_printf(details, " ETA %"G_GINT64_FORMAT ":%02d:%02d", eta / 3600, (gint)(eta / 60 % 60), (gint)(eta % 60));
+	else if (eta >= 0)
+		g_string_append_printf(details, " ETA %d:%02d", (gint)(eta / 60), (gint)(eta % 60));
+
 	/* obtain terminal window parameters */
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
 		g_warning("Unable to obtain window parameters: %s", strerror(errno));
 		/* default to 80 */
 		w.ws_col = 80;
 	}
-	pbar_len = w.ws_col - 1 - 1 - 5;
+	pbar_len = MAX(w.ws_col - 1 - 1 - 5 - (gint)details->len, 10);
 
 	printbuf = g_string_sized_new(w.ws_col);
 
@@ -79,6 +93,7 @@ static gchar* make_progress_line(gint percentage)
 	}
 	g_string_append_c(printbuf, ']');
 	g_string_append_printf(printbuf, "%3d%%", percentage);
+	g_string_append(printbuf, details->str);
 
 	return g_string_free(printbuf, FALSE);
 }
@@ -128,7 +143,17 @@ static void on_installer_changed(GDBusProxy *proxy, GVariant *changed,
 		g_queue_push_tail(&args->status_messages, g_strdup(message));
 	} else if (g_variant_lookup(changed, "Progress", "(i&si)", &percentage, &message, &depth)) {
 		if (install_progressbar && isatty(STDOUT_FILENO)) {
-			g_autofree gchar *progress = make_progress_line(percentage);
+			g_autoptr(GVariant) details = g_dbus_proxy_get_cached_property(proxy, "ProgressDetails");
+			guint64 throughput = 0;
+			gint64 eta = -1;
+			g_autofree gchar *progress = NULL;
+
+			/* not provided by older services */
+			if (details) {
+				g_variant_lookup(details, "throughput", "t", &throughput);
+				g_variant_lookup(details, "eta", "x", &eta);
+			}
+			progress = make_progress_line(percentage, throughput, eta);
 			/* This does:
 			 * - move to start of line
 			 * - clear line
@@ -328,6 +353,13 @@ static gboolean install_start(int argc, char **argv)
 			goto out_loop;
 		}
 	} else {
+		if (trace_file && !r_trace_event_open(trace_file, &error)) {
+			g_printerr("%s\n", error->message);
+			g_clear_error(&error);
+			r_exit_status = 1;
+			return TRUE;
+		}
+
 		if (!determine_slot_states(&error)) {
 			g_printerr("Failed to determine slot states: %s\n", error->message);
 			g_clear_error(&error);
@@ -516,6 +548,9 @@ static gboolean write_slot_start(int argc, char **argv)
 		goto out;
 	}
 
+	/* the cached per-slot status becomes invalid when the slot is written */
+	r_slot_status_invalidate_cache(slot);
+
 	/* call update handler */
 	if (!update_handler(image, slot, NULL, &ierror)) {
 		g_printerr("%s\n", ierror->message);
@@ -544,14 +579,14 @@ static gboolean resign_start(int argc, char **argv)
 		goto out;
 	}
 
-	if (argc < 4) {
+	if (argc < 4 && !in_place) {
 		g_printerr("An output bundle must be provided\n");
 		r_exit_status = 1;
 		goto out;
 	}
 
-	if (argc > 4) {
-		g_printerr("Excess argument: %s\n", argv[4]);
+	if (argc > (in_place ? 3 : 4)) {
+		g_printerr("Excess argument: %s\n", argv[in_place ? 3 : 4]);
 		r_exit_status = 1;
 		goto out;
 	}
@@ -575,7 +610,7 @@ static gboolean resign_start(int argc, char **argv)
 		goto out;
 	}
 
-	if (!resign_bundle(bundle, argv[3], &ierror)) {
+	if (!resign_bundle(bundle, in_place ? NULL : argv[3], &ierror)) {
 		g_printerr("Failed to resign bundle: %s\n", ierror->message);
 		g_clear_error(&ierror);
 		r_exit_status = 1;
@@ -606,21 +641,21 @@ static gboolean replace_signature_start(int argc, char **argv)
 		goto out;
 	}
 
-	if (argc < 5) {
+	if (argc < 5 && !in_place) {
 		g_printerr("An output bundle must be provided\n");
 		r_exit_status = 1;
 		goto out;
 	}
 
-	if (argc > 5) {
-		g_printerr("Excess argument: %s\n", argv[4]);
+	if (argc > (in_place ? 4 : 5)) {
+		g_printerr("Excess argument: %s\n", argv[in_place ? 4 : 5]);
 		r_exit_status = 1;
 		goto out;
 	}
 
 	g_debug("input bundle: %s", argv[2]);
 	g_debug("input signature: %s", argv[3]);
-	g_debug("output file: %s", argv[4]);
+	g_debug("output file: %s", in_place ? argv[2] : argv[4]);
 
 	if (verification_disabled)
 		check_bundle_params |= CHECK_BUNDLE_NO_VERIFY;
@@ -634,7 +669,7 @@ static gboolean replace_signature_start(int argc, char **argv)
 		goto out;
 	}
 
-	if (!replace_signature(bundle, argv[3], argv[4], check_bundle_params, &ierror)) {
+	if (!replace_signature(bundle, argv[3], in_place ? NULL : argv[4], check_bundle_params, &ierror)) {
 		g_printerr("Failed to replace signature: %s\n", ierror->message);
 		g_clear_error(&ierror);
 		r_exit_status = 1;
@@ -2130,6 +2165,9 @@ static gboolean status_start(int argc, char **argv)
 			return TRUE;
 		}
 
+		/* share the boot loader state between the state and primary queries */
+		r_boot_query_begin();
+
 		res = determine_boot_states(&ierror);
 		if (!res) {
 			g_printerr("Failed to determine boot states: %s\n", ierror->message);
@@ -2150,6 +2188,7 @@ static gboolean status_start(int argc, char **argv)
 		if (!r_artifacts_init(&ierror)) {
 			g_printerr("Failed to initialize artifact repos: %s\n", ierror->message);
 			g_clear_error(&ierror);
+			r_boot_query_end();
 			r_exit_status = 1;
 			return TRUE;
 		}
@@ -2159,6 +2198,7 @@ static gboolean status_start(int argc, char **argv)
 			g_printerr("Failed getting primary slot: %s\n", ierror->message);
 			g_clear_error(&ierror);
 		}
+		r_boot_query_end();
 
 		status_print->compatible = g_strdup(r_context()->config->system_compatible);
 		status_print->variant = g_strdup(r_context()->config->system_variant);
@@ -2353,6 +2393,12 @@ static gboolean service_start(int argc, char **argv)
 
 	g_debug("service start");
 
+	if (trace_file && !r_trace_event_open(trace_file, &ierror)) {
+		g_printerr("%s\n", ierror->message);
+		r_exit_status = 1;
+		return TRUE;
+	}
+
 	if (!determine_slot_states(&ierror)) {
 		g_printerr("Failed to determine slot states: %s\n", ierror->message);
 		r_exit_status = 1;
@@ -2498,6 +2544,7 @@ static GOptionEntry entries_install[] = {
 #else
 	{"handler-args", '\0', 0, G_OPTION_ARG_STRING, &handler_args, "extra arguments for full custom handler", "ARGS"},
 	{"override-boot-slot", '\0', 0, G_OPTION_ARG_STRING, &bootslot, "override auto-detection of booted slot", "BOOTNAME"},
+	{"trace-file", '\0', 0, G_OPTION_ARG_FILENAME, &trace_file, "write a timeline in Chrome trace event format", "FILENAME"},
 #endif
 	{0}
 };
@@ -2505,6 +2552,7 @@ static GOptionEntry entries_install[] = {
 static GOptionEntry entries_bundle[] = {
 	{"signing-keyring", '\0', 0, G_OPTION_ARG_FILENAME, &signing_keyring, "verification keyring file", "PEMFILE"},
 	{"mksquashfs-args", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_args, "mksquashfs extra args", "ARGS"},
+	{"digest-cache", '\0', 0, G_OPTION_ARG_FILENAME, &digest_cache_dir, "directory to cache image checksums and hash indexes", "PATH"},
 	{0}
 };
 
@@ -2512,6 +2560,7 @@ static GOptionEntry entries_resign[] = {
 	{"no-verify", '\0', 0, G_OPTION_ARG_NONE, &verification_disabled, "disable bundle verification", NULL},
 	{"no-check-time", '\0', 0, G_OPTION_ARG_NONE, &no_check_time, "don't check validity period of certificates against current time", NULL},
 	{"signing-keyring", '\0', 0, G_OPTION_ARG_FILENAME, &signing_keyring, "verification keyring file", "PEMFILE"},
+	{"in-place", '\0', 0, G_OPTION_ARG_NONE, &in_place, "replace the signature of the input bundle instead of creating an output bundle", NULL},
 	{0}
 };
 
@@ -2519,6 +2568,7 @@ static GOptionEntry entries_replace[] = {
 	{"trust-environment", '\0', 0, G_OPTION_ARG_NONE, &trust_environment, "trust environment and skip bundle access checks", NULL},
 	{"no-verify", '\0', 0, G_OPTION_ARG_NONE, &verification_disabled, "disable bundle verification", NULL},
 	{"signing-keyring", '\0', 0, G_OPTION_ARG_FILENAME, &signing_keyring, "verification keyring file", "PEMFILE"},
+	{"in-place", '\0', 0, G_OPTION_ARG_NONE, &in_place, "replace the signature of the input bundle instead of creating an output bundle", NULL},
 	{0}
 };
 
@@ -2566,6 +2616,7 @@ static GOptionEntry entries_status[] = {
 static GOptionEntry entries_service[] = {
 	{"handler-args", '\0', 0, G_OPTION_ARG_STRING, &handler_args, "extra arguments for full custom handler", "ARGS"},
 	{"override-boot-slot", '\0', 0, G_OPTION_ARG_STRING, &bootslot, "override auto-detection of booted slot", "BOOTNAME"},
+	{"trace-file", '\0', 0, G_OPTION_ARG_FILENAME, &trace_file, "write a timeline in Chrome trace event format", "FILENAME"},
 	{0}
 };
 
@@ -2710,7 +2761,7 @@ static void cmdline_handler(int argc, char **argv)
 		{BUNDLE, "bundle", "bundle <INPUTDIR> <BUNDLENAME>",
 		 "Create a bundle from a content directory",
 		 bundle_start, bundle_group, R_CONTEXT_CONFIG_MODE_NONE, FALSE},
-		{RESIGN, "resign", "resign <INBUNDLE> <OUTBUNDLE>",
+		{RESIGN, "resign", "resign <INBUNDLE> [<OUTBUNDLE>]",
 		 "Resign an already signed bundle",
 		 resign_start, resign_group, R_CONTEXT_CONFIG_MODE_NONE, FALSE},
 		{CONVERT, "convert", "convert <INBUNDLE> <OUTBUNDLE>",
@@ -2718,7 +2769,7 @@ static void cmdline_handler(int argc, char **argv)
 		 convert_start, convert_group, R_CONTEXT_CONFIG_MODE_NONE, FALSE},
 		{ENCRYPT, "encrypt", "encrypt <INBUNDLE> <OUTBUNDLE>", "Encrypt a crypt bundle",
 		 encrypt_start, encrypt_group, R_CONTEXT_CONFIG_MODE_NONE, FALSE},
-		{REPLACE_SIG, "replace-signature", "replace-signature <INBUMDLE> <INPUTSIG> <OUTBUNDLE>",
+		{REPLACE_SIG, "replace-signature", "replace-signature <INBUMDLE> <INPUTSIG> [<OUTBUNDLE>]",
 		 "Replaces the signature of an already signed bundle",
 		 replace_signature_start, replace_group, R_CONTEXT_CONFIG_MODE_NONE, FALSE},
 		{EXTRACT_SIG, "extract-signature", "extract-signature <BUNDLENAME> <OUTPUTSIG>",
@@ -2807,11 +2858,13 @@ static void cmdline_handler(int argc, char **argv)
 		domains = g_getenv("G_MESSAGES_DEBUG");
 		g_message("Debug log domains: '%s'", domains);
 		g_debug(PACKAGE_VERSION
+				" archive=" G_STRINGIFY(ENABLE_ARCHIVE)
 				" create=" G_STRINGIFY(ENABLE_CREATE)
 				" emmc-boot=" G_STRINGIFY(ENABLE_EMMC_BOOT_SUPPORT)
 				" gpt=" G_STRINGIFY(ENABLE_GPT)
 				" json=" G_STRINGIFY(ENABLE_JSON)
 				" network=" G_STRINGIFY(ENABLE_NETWORK)
+				" sdt=" G_STRINGIFY(ENABLE_SDT)
 				" service=" G_STRINGIFY(ENABLE_SERVICE)
 				" streaming=" G_STRINGIFY(ENABLE_STREAMING)
 				);
@@ -2908,6 +2961,8 @@ static void cmdline_handler(int argc, char **argv)
 			r_context_conf()->mksquashfs_args = mksquashfs_args;
 		if (casync_args)
 			r_context_conf()->casync_args = casync_args;
+		if (digest_cache_dir)
+			r_context_conf()->digest_cache_dir = digest_cache_dir;
 		if (recipients)
 			r_context_conf()->recipients = recipients;
 		if (intermediate)
@@ -2982,6 +3037,7 @@ int main(int argc, char **argv)
 	if (ENABLE_STREAMING && g_getenv("RAUC_NBD_SERVER")) {
 		g_autoptr(GError) ierror = NULL;
 		pthread_setname_np(pthread_self(), "rauc-nbd");
+		r_trace_event_attach();
 		if (r_nbd_run_server(RAUC_SOCKET_FD, &ierror)) {
 			return 0;
 		} else {
@@ -2997,6 +3053,8 @@ int main(int argc, char **argv)
 	create_option_groups();
 	cmdline_handler(argc, argv);
 
+	r_event_log_flush();
+	r_trace_event_close();
 	r_context_clean();
 	return r_exit_status;
 }
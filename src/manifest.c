@@ -3,6 +3,7 @@
 #include "checksum.h"
 #include "config_file.h"
 #include "context.h"
+#include "digest_cache.h"
 #include "manifest.h"
 #include "signature.h"
 #include "utils.h"
@@ -1163,7 +1164,10 @@ static gboolean update_manifest_checksums(RaucManifest *manifest, const gchar *d
 		}
 
 		filename = g_build_filename(dir, image->filename, NULL);
-		res = compute_checksum(&image->checksum, filename, &ierror);
+		if (r_context()->digest_cache_dir)
+			res = r_digest_cache_compute_checksum(r_context()->digest_cache_dir, &image->checksum, filename, &ierror);
+		else
+			res = compute_checksum(&image->checksum, filename, &ierror);
 		if (!res) {
 			g_warning("Failed updating checksum: %s", ierror->message);
 			g_clear_error(&ierror);
@@ -25,7 +25,9 @@
 
 #include "context.h"
 #include "nbd.h"
+#include "probes.h"
 #include "stats.h"
+#include "trace_event.h"
 #include "utils.h"
 
 /* these are only used before passing the socket to the kernel */
@@ -313,6 +315,8 @@ struct RaucNBDTransfer {
 	guint8 *buffer;
 	curl_off_t buffer_size;
 	curl_off_t buffer_pos;
+	/* monotonic time the first attempt was started */
+	gint64 start_time;
 
 	/* configure request */
 	guint64 content_size;
@@ -510,6 +514,9 @@ static void start_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 	xfer->buffer = g_malloc(xfer->request.len);
 	xfer->buffer_size = xfer->request.len;
 	xfer->buffer_pos = 0;
+	if (!xfer->start_time)
+		xfer->start_time = g_get_monotonic_time();
+	R_PROBE2(nbd_request_start, (guint64)xfer->request.from, (guint32)xfer->request.len);
 
 	prepare_curl(xfer);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
@@ -685,6 +692,17 @@ static gboolean finish_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 
 	collect_curl_stats(ctx, xfer);
 
+	R_PROBE3(nbd_request_finish, (guint64)xfer->request.from, (guint32)xfer->request.len,
+			GUINT32_FROM_BE(xfer->reply.error));
+	if (r_trace_event_enabled()) {
+		g_autofree gchar *trace_args = g_strdup_printf(
+				"\"offset\":%"G_GUINT64_FORMAT ",\"length\":%"G_GUINT32_FORMAT ",\"error\":%"G_GUINT32_FORMAT,
+				(guint64)xfer->request.from, (guint32)xfer->request.len,
+				GUINT32_FROM_BE(xfer->reply.error));
+		r_trace_event_complete("nbd", "read", xfer->start_time,
+				g_get_monotonic_time() - xfer->start_time, trace_args);
+	}
+
 	res = TRUE;
 out:
 	g_clear_pointer(&xfer->buffer, g_free);
@@ -1237,11 +1255,11 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 		g_ptr_array_add(args, NULL);
 
 		launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
-		g_subprocess_launcher_set_child_setup(launcher, nbd_server_child_setup, &child_args, NULL);
 		g_subprocess_launcher_setenv(launcher, "RAUC_NBD_SERVER", "", TRUE);
+		r_trace_event_setup_launcher(launcher);
 		g_subprocess_launcher_take_fd(launcher, sockets[0], RAUC_SOCKET_FD);
 
-		nbd_srv->sproc = r_subprocess_launcher_spawnv(launcher, args, &ierror);
+		nbd_srv->sproc = r_subprocess_launcher_spawnv_full(launcher, args, nbd_server_child_setup, &child_args, &ierror);
 		if (nbd_srv->sproc == NULL) {
 			g_propagate_prefixed_error(
 					error,
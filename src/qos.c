@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "qos.h"
+#include "utils.h"
+
+/* from linux/ioprio.h, which is not available with older kernel headers */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+G_DEFINE_QUARK(r-qos-error-quark, r_qos_error)
+
+static GMutex qos_lock;
+static gboolean qos_initialized = FALSE;
+static gboolean qos_background = FALSE;
+/* registered install thread ids */
+static GArray *qos_threads = NULL;
+/* tracked subprocesses (weak references) */
+static GList *qos_subprocesses = NULL;
+
+/* scheduling settings of the service before applying any profile */
+static gint orig_nice = 0;
+static gint orig_ioprio = 0;
+static gchar *orig_cgroup = NULL;
+
+/* write rate limiter */
+static gint qos_throttling = 0;
+static gint64 qos_write_next = 0;
+
+gboolean r_qos_parse_io_class(const gchar *name, RQosIoClass *io_class)
+{
+	g_return_val_if_fail(name, FALSE);
+	g_return_val_if_fail(io_class, FALSE);
+
+	if (g_strcmp0(name, "idle") == 0)
+		*io_class = R_QOS_IO_CLASS_IDLE;
+	else if (g_strcmp0(name, "best-effort") == 0)
+		*io_class = R_QOS_IO_CLASS_BEST_EFFORT;
+	else if (g_strcmp0(name, "realtime") == 0)
+		*io_class = R_QOS_IO_CLASS_REALTIME;
+	else if (g_strcmp0(name, "none") == 0)
+		*io_class = R_QOS_IO_CLASS_NONE;
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+static pid_t get_tid(void)
+{
+	return syscall(SYS_gettid);
+}
+
+/* Returns the cgroup (v2) directory the service runs in, or NULL. */
+static gchar *get_own_cgroup(void)
+{
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+
+	if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+		return NULL;
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (gchar **line = lines; *line; line++) {
+		if (g_str_has_prefix(*line, "0::"))
+			return g_build_filename("/sys/fs/cgroup", *line + 3, NULL);
+	}
+
+	return NULL;
+}
+
+static void set_task_priority(pid_t pid, gint nice, gint ioprio)
+{
+	if (setpriority(PRIO_PROCESS, pid, nice) != 0)
+		g_debug("Failed to set nice level of %d: %s", pid, g_strerror(errno));
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio) != 0)
+		g_debug("Failed to set I/O priority of %d: %s", pid, g_strerror(errno));
+}
+
+static void set_task_cgroup(pid_t pid, const gchar *cgroup)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *procs = NULL;
+	g_autofree gchar *value = NULL;
+
+	if (!cgroup)
+		return;
+
+	if (g_mkdir_with_parents(cgroup, 0755) != 0) {
+		g_warning("Failed to create cgroup %s: %s", cgroup, g_strerror(errno));
+		return;
+	}
+
+	procs = g_build_filename(cgroup, "cgroup.procs", NULL);
+	value = g_strdup_printf("%d\n", pid);
+	if (!g_file_set_contents(procs, value, -1, &ierror))
+		g_warning("Failed to move process %d to cgroup %s: %s", pid, cgroup, ierror->message);
+}
+
+/* Must be called with qos_lock held. */
+static void apply_thread(pid_t tid)
+{
+	const RaucConfig *config = r_context()->config;
+
+	if (qos_background)
+		set_task_priority(tid,
+				config->qos_has_nice ? config->qos_nice : orig_nice,
+				config->qos_io_class != R_QOS_IO_CLASS_NONE ?
+				IOPRIO_PRIO_VALUE(config->qos_io_class, config->qos_io_priority) : orig_ioprio);
+	else
+		set_task_priority(tid, orig_nice, orig_ioprio);
+}
+
+struct _RQosChildSetup {
+	/* background profile applied to the child */
+	gboolean background;
+	gint nice;
+	gint ioprio;
+	gchar *cgroup_procs;
+	GSpawnChildSetupFunc child_setup;
+	gpointer user_data;
+};
+
+/* Must be called with qos_lock held. */
+static void apply_subprocess(GSubprocess *sproc)
+{
+	const RaucConfig *config = r_context()->config;
+	const gchar *identifier = g_subprocess_get_identifier(sproc);
+	pid_t pid;
+
+	/* already exited */
+	if (!identifier)
+		return;
+
+	pid = atoi(identifier);
+	apply_thread(pid);
+	if (config->qos_cgroup)
+		set_task_cgroup(pid, qos_background ? config->qos_cgroup : orig_cgroup);
+}
+
+/* Must be called with qos_lock held. */
+static void qos_init(void)
+{
+	const RaucConfig *config = r_context()->config;
+	gint ret;
+
+	if (qos_initialized)
+		return;
+
+	errno = 0;
+	orig_nice = getpriority(PRIO_PROCESS, 0);
+	if (orig_nice == -1 && errno != 0)
+		orig_nice = 0;
+	ret = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	orig_ioprio = ret >= 0 ? ret : 0;
+	orig_cgroup = get_own_cgroup();
+	qos_threads = g_array_new(FALSE, FALSE, sizeof(pid_t));
+
+	qos_background = config->qos_enabled && config->qos_background;
+	g_atomic_int_set(&qos_throttling, qos_background && config->qos_write_rate > 0);
+	qos_initialized = TRUE;
+}
+
+gboolean r_qos_set_profile(const gchar *name, GError **error)
+{
+	gboolean background;
+
+	g_return_val_if_fail(name, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (g_strcmp0(name, "background") == 0) {
+		background = TRUE;
+	} else if (g_strcmp0(name, "full") == 0) {
+		background = FALSE;
+	} else {
+		g_set_error(error, R_QOS_ERROR, R_QOS_ERROR_INVALID_PROFILE,
+				"Unknown QoS profile '%s'", name);
+		return FALSE;
+	}
+
+	if (background && !r_context()->config->qos_enabled) {
+		g_set_error(error, R_QOS_ERROR, R_QOS_ERROR_INVALID_PROFILE,
+				"QoS profile 'background' requires a [qos] section in the system configuration");
+		return FALSE;
+	}
+
+	g_mutex_lock(&qos_lock);
+	qos_init();
+	if (qos_background != background) {
+		g_message("Switching to QoS profile '%s'", name);
+		qos_background = background;
+		g_atomic_int_set(&qos_throttling, background && r_context()->config->qos_write_rate > 0);
+
+		for (guint i = 0; i < qos_threads->len; i++)
+			apply_thread(g_array_index(qos_threads, pid_t, i));
+		for (GList *l = qos_subprocesses; l; l = l->next)
+			apply_subprocess(l->data);
+	}
+	g_mutex_unlock(&qos_lock);
+
+	return TRUE;
+}
+
+const gchar *r_qos_get_profile(void)
+{
+	gboolean background;
+
+	g_mutex_lock(&qos_lock);
+	if (qos_initialized)
+		background = qos_background;
+	else
+		background = r_context()->config->qos_enabled && r_context()->config->qos_background;
+	g_mutex_unlock(&qos_lock);
+
+	return background ? "background" : "full";
+}
+
+void r_qos_enter_thread(void)
+{
+	pid_t tid = get_tid();
+
+	g_mutex_lock(&qos_lock);
+	qos_init();
+	g_array_append_val(qos_threads, tid);
+	apply_thread(tid);
+	g_mutex_unlock(&qos_lock);
+}
+
+void r_qos_leave_thread(void)
+{
+	pid_t tid = get_tid();
+
+	g_return_if_fail(qos_initialized);
+
+	g_mutex_lock(&qos_lock);
+	for (guint i = 0; i < qos_threads->len; i++) {
+		if (g_array_index(qos_threads, pid_t, i) == tid) {
+			g_array_remove_index_fast(qos_threads, i);
+			break;
+		}
+	}
+	set_task_priority(tid, orig_nice, orig_ioprio);
+	g_mutex_unlock(&qos_lock);
+}
+
+static void subprocess_finalized(gpointer data, GObject *where_the_object_was)
+{
+	g_mutex_lock(&qos_lock);
+	qos_subprocesses = g_list_remove(qos_subprocesses, where_the_object_was);
+	g_mutex_unlock(&qos_lock);
+}
+
+RQosChildSetup *r_qos_child_setup_new(GSpawnChildSetupFunc child_setup, gpointer user_data)
+{
+	const RaucConfig *config = r_context()->config;
+	RQosChildSetup *setup = g_new0(RQosChildSetup, 1);
+
+	setup->child_setup = child_setup;
+	setup->user_data = user_data;
+
+	g_mutex_lock(&qos_lock);
+	if (qos_initialized && config->qos_enabled && qos_background) {
+		setup->background = TRUE;
+		setup->nice = config->qos_has_nice ? config->qos_nice : orig_nice;
+		setup->ioprio = config->qos_io_class != R_QOS_IO_CLASS_NONE ?
+		                IOPRIO_PRIO_VALUE(config->qos_io_class, config->qos_io_priority) : orig_ioprio;
+		if (config->qos_cgroup) {
+			if (g_mkdir_with_parents(config->qos_cgroup, 0755) == 0)
+				setup->cgroup_procs = g_build_filename(config->qos_cgroup, "cgroup.procs", NULL);
+			else
+				g_warning("Failed to create cgroup %s: %s", config->qos_cgroup, g_strerror(errno));
+		}
+	}
+	g_mutex_unlock(&qos_lock);
+
+	return setup;
+}
+
+void r_qos_child_setup(gpointer user_data)
+{
+	/* see signal-safety(7) for functions which can be used here */
+	RQosChildSetup *setup = user_data;
+
+	if (setup->background) {
+		/* the child is single-threaded, so this covers the whole process */
+		(void) setpriority(PRIO_PROCESS, 0, setup->nice);
+		(void) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, setup->ioprio);
+
+		if (setup->cgroup_procs) {
+			/* writing 0 moves the writing process */
+			int fd = open(setup->cgroup_procs, O_WRONLY | O_CLOEXEC);
+			if (fd >= 0) {
+				if (write(fd, "0", 1) < 0) {
+					const char *msg = "Failed to move process to QoS cgroup\n";
+					(void) write(STDERR_FILENO, msg, strlen(msg));
+				}
+				close(fd);
+			}
+		}
+	}
+
+	if (setup->child_setup)
+		setup->child_setup(setup->user_data);
+}
+
+void r_qos_child_setup_free(gpointer user_data)
+{
+	RQosChildSetup *setup = user_data;
+
+	if (!setup)
+		return;
+
+	g_free(setup->cgroup_procs);
+	g_free(setup);
+}
+
+void r_qos_track_subprocess(GSubprocess *sproc, const RQosChildSetup *setup)
+{
+	g_return_if_fail(G_IS_SUBPROCESS(sproc));
+	g_return_if_fail(setup);
+
+	g_mutex_lock(&qos_lock);
+	if (!qos_initialized || !r_context()->config->qos_enabled) {
+		g_mutex_unlock(&qos_lock);
+		return;
+	}
+	g_object_weak_ref(G_OBJECT(sproc), subprocess_finalized, NULL);
+	qos_subprocesses = g_list_prepend(qos_subprocesses, sproc);
+	/* the profile was switched while spawning */
+	if (qos_background != setup->background)
+		apply_subprocess(sproc);
+	g_mutex_unlock(&qos_lock);
+}
+
+void r_qos_throttle_write(guint64 bytes)
+{
+	gint64 now, delay;
+
+	if (!g_atomic_int_get(&qos_throttling))
+		return;
+
+	g_mutex_lock(&qos_lock);
+	if (!qos_background || r_context()->config->qos_write_rate == 0) {
+		g_mutex_unlock(&qos_lock);
+		return;
+	}
+	/* the limiter does not accumulate credit while idle */
+	now = g_get_monotonic_time();
+	if (qos_write_next < now)
+		qos_write_next = now;
+	qos_write_next += bytes * G_USEC_PER_SEC / r_context()->config->qos_write_rate;
+	delay = qos_write_next - now;
+	g_mutex_unlock(&qos_lock);
+
+	if (delay > 0)
+		g_usleep(delay);
+}
@@ -10,6 +10,7 @@
 #include "context.h"
 #include "install.h"
 #include "mark.h"
+#include "qos.h"
 #include "rauc-installer-generated.h"
 #include "service.h"
 #include "status_file.h"
@@ -43,6 +44,8 @@ static gboolean service_install_cleanup(gpointer data)
 	} else {
 		g_message("installing `%s` failed: %d", args->name, args->status_result);
 	}
+	if (r_context()->install_info->step_timing)
+		r_installer_set_step_timing(r_installer, r_context_step_timing_to_variant(r_context()->install_info->step_timing));
 	r_installer_emit_completed(r_installer, args->status_result);
 	r_installer_set_operation(r_installer, "idle");
 	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(r_installer));
@@ -494,6 +497,25 @@ static gboolean r_on_handle_get_primary(RInstaller *interface,
 	return TRUE;
 }
 
+static gboolean r_on_handle_set_qos(RInstaller *interface,
+		GDBusMethodInvocation  *invocation,
+		const gchar *profile)
+{
+	GError *ierror = NULL;
+
+	/* allowed while busy, as this is meant to control a running installation */
+	if (!r_qos_set_profile(profile, &ierror)) {
+		g_dbus_method_invocation_return_gerror(invocation, ierror);
+		g_clear_error(&ierror);
+		return TRUE;
+	}
+
+	r_installer_set_qos(r_installer, r_qos_get_profile());
+	r_installer_complete_set_qos(interface, invocation);
+
+	return TRUE;
+}
+
 static gboolean auto_install(const gchar *source)
 {
 	RaucInstallArgs *args = install_args_new();
@@ -535,9 +557,17 @@ static void send_progress_callback(gint percentage,
 		gint nesting_depth)
 {
 	GVariant *progress_update_tuple;
+	g_auto(GVariantDict) details = G_VARIANT_DICT_INIT(NULL);
+	guint64 throughput;
+	gint64 eta;
+
+	r_context_get_progress_rate(&throughput, &eta);
+	g_variant_dict_insert(&details, "throughput", "t", throughput);
+	g_variant_dict_insert(&details, "eta", "x", eta);
 
 	progress_update_tuple = g_variant_new("(isi)", percentage, message, nesting_depth);
 
+	r_installer_set_progress_details(r_installer, g_variant_dict_end(&details));
 	r_installer_set_progress(r_installer, progress_update_tuple);
 	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(r_installer));
 }
@@ -582,6 +612,10 @@ static void r_on_bus_acquired(GDBusConnection *connection,
 			G_CALLBACK(r_on_handle_get_primary),
 			NULL);
 
+	g_signal_connect(r_installer, "handle-set-qos",
+			G_CALLBACK(r_on_handle_set_qos),
+			NULL);
+
 	r_context_register_progress_callback(send_progress_callback);
 
 	// Set initial Operation status to "idle"
@@ -598,6 +632,7 @@ static void r_on_bus_acquired(GDBusConnection *connection,
 	r_installer_set_compatible(r_installer, r_context()->config->system_compatible);
 	r_installer_set_variant(r_installer, r_context()->config->system_variant);
 	r_installer_set_boot_slot(r_installer, r_context()->bootslot);
+	r_installer_set_qos(r_installer, r_qos_get_profile());
 
 	return;
 }
@@ -7,10 +7,14 @@
 #include <openssl/crypto.h>
 #include <openssl/engine.h>
 #include <openssl/x509.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "context.h"
 #include "signature.h"
+#include "utils.h"
 
 GQuark r_signature_error_quark(void)
 {
@@ -1265,6 +1269,41 @@ out:
 	return res;
 }
 
+/* Sets the verification time of the store to the signing time contained in
+ * the pkcs9 attributes of the first signer. */
+static gboolean cms_set_verify_signing_time(CMS_ContentInfo *icms, X509_STORE *store, GError **error)
+{
+	STACK_OF(CMS_SignerInfo) *sinfos;
+	CMS_SignerInfo *si;
+	X509_ATTRIBUTE *xa;
+	ASN1_TYPE *so;
+	X509_VERIFY_PARAM *param = X509_STORE_get0_param(store);
+	struct tm tm;
+	time_t signingtime;
+
+	/* Extract signing time from pkcs9 attributes */
+	sinfos = CMS_get0_SignerInfos(icms);
+	si = sk_CMS_SignerInfo_value(sinfos, 0);
+	xa = CMS_signed_get_attr(si, CMS_signed_get_attr_by_NID(si, NID_pkcs9_signingTime, -1));
+	so = X509_ATTRIBUTE_get0_type(xa, 0);
+
+	/* convert to time_t to make it usable for setting verify parameter */
+	if (!asn1_time_to_tm(so->value.utctime, &tm)) {
+		g_set_error(
+				error,
+				R_SIGNATURE_ERROR,
+				R_SIGNATURE_ERROR_UNKNOWN,
+				"Failed to convert bundle signing time");
+		return FALSE;
+	}
+	signingtime = timegm(&tm);
+
+	/* use signing time for verification */
+	X509_VERIFY_PARAM_set_time(param, signingtime);
+
+	return TRUE;
+}
+
 gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
 {
 	GError *ierror = NULL;
@@ -1340,33 +1379,8 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 
 	/* Optionally use certificate signing timestamp for verification */
 	if (r_context()->config->use_bundle_signing_time) {
-		STACK_OF(CMS_SignerInfo) *sinfos;
-		CMS_SignerInfo *si;
-		X509_ATTRIBUTE *xa;
-		ASN1_TYPE *so;
-		X509_VERIFY_PARAM *param = X509_STORE_get0_param(store);
-		struct tm tm;
-		time_t signingtime;
-
-		/* Extract signing time from pkcs9 attributes */
-		sinfos = CMS_get0_SignerInfos(icms);
-		si = sk_CMS_SignerInfo_value(sinfos, 0);
-		xa = CMS_signed_get_attr(si, CMS_signed_get_attr_by_NID(si, NID_pkcs9_signingTime, -1));
-		so = X509_ATTRIBUTE_get0_type(xa, 0);
-
-		/* convert to time_t to make it usable for setting verify parameter */
-		if (!asn1_time_to_tm(so->value.utctime, &tm)) {
-			g_set_error(
-					error,
-					R_SIGNATURE_ERROR,
-					R_SIGNATURE_ERROR_UNKNOWN,
-					"Failed to convert bundle signing time");
+		if (!cms_set_verify_signing_time(icms, store, error))
 			goto out;
-		}
-		signingtime = timegm(&tm);
-
-		/* use signing time for verification */
-		X509_VERIFY_PARAM_set_time(param, signingtime);
 	}
 
 	if (detached)
@@ -1474,19 +1488,19 @@ out:
 	return sig;
 }
 
-gboolean cms_verify_fd(gint fd, GBytes *sig, goffset limit, X509_STORE *store, CMS_ContentInfo **cms, GError **error)
+/* Verifies the signature by mapping the file read-only with mmap() and
+ * passing the mapping to cms_verify_bytes(). If 'limit' is non-zero, only the
+ * first 'limit' bytes of the mapping are used as content (the rest of a bundle
+ * is the signature itself), otherwise the whole file is. This is used by
+ * cms_verify_fd() for signatures which are not detached or can't be parsed,
+ * so that cms_verify_bytes() handles (and reports) them. */
+static gboolean cms_verify_fd_mapped(gint fd, GBytes *sig, goffset limit, X509_STORE *store, CMS_ContentInfo **cms, GError **error)
 {
 	GError *ierror = NULL;
 	g_autoptr(GMappedFile) file = NULL;
 	g_autoptr(GBytes) content = NULL;
 	gboolean res = FALSE;
 
-	g_return_val_if_fail(fd >= 0, FALSE);
-	g_return_val_if_fail(sig != NULL, FALSE);
-	g_return_val_if_fail(store != NULL, FALSE);
-	g_return_val_if_fail(cms == NULL || *cms == NULL, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
 	file = g_mapped_file_new_from_fd(fd, FALSE, &ierror);
 	if (file == NULL) {
 		g_propagate_error(error, ierror);
@@ -1525,6 +1539,251 @@ out:
 	return res;
 }
 
+#define CMS_STREAM_CHUNK_SIZE (1024*1024)
+#define CMS_STREAM_CHUNKS 4
+
+typedef struct {
+	guint8 *data;
+	gsize len;
+} CmsStreamChunk;
+
+typedef struct {
+	gint fd;
+	goffset size;
+	/* chunks ready to be filled by the reader thread */
+	GAsyncQueue *free_chunks;
+	/* filled chunks, terminated by a chunk with len 0 */
+	GAsyncQueue *full_chunks;
+	/* set when the consumer stops before reaching the end */
+	gint cancel;
+	GError *error;
+	/* chunk currently consumed by the BIO and position inside it */
+	CmsStreamChunk *current;
+	gsize pos;
+	gboolean eof;
+} CmsStreamReader;
+
+/* Reads the content sequentially in chunks and passes them to the BIO used
+ * by CMS_verify(). A chunk with zero length signals the end of the content
+ * (or an error). */
+static gpointer cms_stream_reader_thread(gpointer data)
+{
+	CmsStreamReader *reader = data;
+	CmsStreamChunk *chunk;
+	goffset offset = 0;
+
+	while (offset < reader->size && !g_atomic_int_get(&reader->cancel)) {
+		chunk = g_async_queue_pop(reader->free_chunks);
+		chunk->len = MIN(CMS_STREAM_CHUNK_SIZE, reader->size - offset);
+
+		/* start read-ahead for the chunks following this one */
+		(void) posix_fadvise(reader->fd, offset + chunk->len,
+				CMS_STREAM_CHUNK_SIZE * (CMS_STREAM_CHUNKS - 1), POSIX_FADV_WILLNEED);
+
+		if (!r_pread_exact(reader->fd, chunk->data, chunk->len, offset, &reader->error)) {
+			chunk->len = 0;
+			g_async_queue_push(reader->full_chunks, chunk);
+			return NULL;
+		}
+		offset += chunk->len;
+		g_async_queue_push(reader->full_chunks, chunk);
+	}
+
+	chunk = g_async_queue_pop(reader->free_chunks);
+	chunk->len = 0;
+	g_async_queue_push(reader->full_chunks, chunk);
+
+	return NULL;
+}
+
+static int cms_stream_bio_read(BIO *bio, char *buf, int size)
+{
+	CmsStreamReader *reader = BIO_get_data(bio);
+	gsize len;
+
+	if (reader->eof || size <= 0)
+		return 0;
+
+	if (!reader->current) {
+		reader->current = g_async_queue_pop(reader->full_chunks);
+		reader->pos = 0;
+		if (!reader->current->len) {
+			g_async_queue_push(reader->free_chunks, g_steal_pointer(&reader->current));
+			reader->eof = TRUE;
+			return reader->error ? -1 : 0;
+		}
+	}
+
+	len = MIN((gsize) size, reader->current->len - reader->pos);
+	memcpy(buf, reader->current->data + reader->pos, len);
+	reader->pos += len;
+	if (reader->pos == reader->current->len)
+		g_async_queue_push(reader->free_chunks, g_steal_pointer(&reader->current));
+
+	return len;
+}
+
+static long cms_stream_bio_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+	switch (cmd) {
+		case BIO_CTRL_FLUSH:
+			return 1;
+		case BIO_CTRL_EOF: {
+			CmsStreamReader *reader = BIO_get_data(bio);
+			return reader->eof;
+		}
+		default:
+			return 0;
+	}
+}
+
+static gpointer cms_stream_bio_method_new(gpointer data)
+{
+	BIO_METHOD *method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "rauc cms stream");
+
+	if (!method)
+		g_error("failed to create BIO method");
+	BIO_meth_set_read(method, cms_stream_bio_read);
+	BIO_meth_set_ctrl(method, cms_stream_bio_ctrl);
+
+	return method;
+}
+
+/* Stops the reader thread and waits for it, returning all chunks which were
+ * not consumed by the BIO. */
+static void cms_stream_reader_finish(CmsStreamReader *reader, GThread *thread)
+{
+	CmsStreamChunk *chunk;
+
+	if (!reader->eof) {
+		g_atomic_int_set(&reader->cancel, 1);
+		if (reader->current)
+			g_async_queue_push(reader->free_chunks, g_steal_pointer(&reader->current));
+		while ((chunk = g_async_queue_pop(reader->full_chunks))->len)
+			g_async_queue_push(reader->free_chunks, chunk);
+		g_async_queue_push(reader->free_chunks, chunk);
+		reader->eof = TRUE;
+	}
+
+	g_thread_join(thread);
+}
+
+gboolean cms_verify_fd(gint fd, GBytes *sig, goffset limit, X509_STORE *store, CMS_ContentInfo **cms, GError **error)
+{
+	static GOnce method_once = G_ONCE_INIT;
+	GError *ierror = NULL;
+	g_autoptr(CMS_ContentInfo) icms = NULL;
+	g_autoptr(GPtrArray) chunks = g_ptr_array_new_with_free_func(g_free);
+	CmsStreamReader reader = {
+		.fd = fd,
+	};
+	GThread *thread = NULL;
+	BIO *insig = NULL;
+	BIO *incontent = NULL;
+	int verified;
+	g_autofree gchar *signers = NULL;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(fd >= 0, FALSE);
+	g_return_val_if_fail(sig != NULL, FALSE);
+	g_return_val_if_fail(store != NULL, FALSE);
+	g_return_val_if_fail(cms == NULL || *cms == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* Only detached signatures have content to stream, leave everything
+	 * else (including error reporting) to the mapped verification. */
+	insig = bytes_as_bio(sig);
+	icms = d2i_CMS_bio(insig, NULL);
+	BIO_free_all(insig);
+	if (!icms || !CMS_is_detached(icms))
+		return cms_verify_fd_mapped(fd, sig, limit, store, cms, error);
+
+	if (!limit) {
+		struct stat st;
+
+		if (fstat(fd, &st) != 0) {
+			int err = errno;
+			g_set_error(
+					error,
+					G_FILE_ERROR,
+					g_file_error_from_errno(err),
+					"failed to stat signed content: %s", g_strerror(err));
+			return FALSE;
+		}
+		limit = st.st_size;
+	}
+
+	r_context_begin_step("cms_verify", "Verifying signature", 0);
+
+	debug_cms_ci(icms);
+
+	/* Optionally use certificate signing timestamp for verification */
+	if (r_context()->config->use_bundle_signing_time) {
+		if (!cms_set_verify_signing_time(icms, store, error))
+			goto out;
+	}
+
+	reader.size = limit;
+	reader.free_chunks = g_async_queue_new();
+	reader.full_chunks = g_async_queue_new();
+	for (int i = 0; i < CMS_STREAM_CHUNKS; i++) {
+		CmsStreamChunk *chunk = g_new0(CmsStreamChunk, 1);
+		chunk->data = g_malloc(CMS_STREAM_CHUNK_SIZE);
+		g_ptr_array_add(chunks, chunk->data);
+		g_ptr_array_add(chunks, chunk);
+		g_async_queue_push(reader.free_chunks, chunk);
+	}
+
+	incontent = BIO_new(g_once(&method_once, cms_stream_bio_method_new, NULL));
+	if (!incontent)
+		g_error("failed to create BIO");
+	BIO_set_data(incontent, &reader);
+	BIO_set_init(incontent, 1);
+
+	(void) posix_fadvise(fd, 0, limit, POSIX_FADV_SEQUENTIAL);
+
+	/* The content is read on a separate thread and passed to OpenSSL
+	 * through the BIO, so it is never held in memory completely. */
+	thread = g_thread_new("cms-reader", cms_stream_reader_thread, &reader);
+	verified = CMS_verify(icms, NULL, store, incontent, NULL, CMS_DETACHED | CMS_BINARY);
+	cms_stream_reader_finish(&reader, thread);
+
+	if (reader.error) {
+		g_propagate_prefixed_error(error, g_steal_pointer(&reader.error),
+				"failed to read signed content: ");
+		goto out;
+	}
+	if (!verified) {
+		g_set_error(
+				error,
+				R_SIGNATURE_ERROR,
+				R_SIGNATURE_ERROR_INVALID,
+				"signature verification failed: %s", get_openssl_err_string());
+		goto out;
+	}
+
+	signers = cms_get_signers(icms, &ierror);
+	if (!signers) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	g_message("Verified detached signature by %s", signers);
+
+	if (cms)
+		*cms = g_steal_pointer(&icms);
+
+	res = TRUE;
+out:
+	ERR_print_errors_fp(stdout);
+	BIO_free_all(incontent);
+	if (reader.free_chunks)
+		g_async_queue_unref(reader.free_chunks);
+	if (reader.full_chunks)
+		g_async_queue_unref(reader.full_chunks);
+	r_context_end_step("cms_verify", res);
+	return res;
+}
+
 gboolean cms_verify_sig(GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
 {
 	GError *ierror = NULL;
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <glib/gstdio.h>
 #include <stdio.h>
 
 #include "slot.h"
@@ -326,6 +327,100 @@ void r_slot_clean_data_directory(const RaucSlot *slot)
 	}
 }
 
+#define WRITE_CHECKPOINT_GROUP "checkpoint"
+
+static gchar *get_write_checkpoint_path(const RaucSlot *slot)
+{
+	if (!slot->data_directory)
+		return NULL;
+
+	return g_build_filename(slot->data_directory, "write-checkpoint", NULL);
+}
+
+goffset r_slot_get_write_checkpoint(const RaucSlot *slot, const RaucChecksum *checksum, const gchar *method)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *digest = NULL;
+	g_autofree gchar *ckpt_method = NULL;
+	guint64 size, offset;
+
+	g_return_val_if_fail(slot, 0);
+	g_return_val_if_fail(checksum, 0);
+	g_return_val_if_fail(method, 0);
+
+	path = get_write_checkpoint_path(slot);
+	if (!path || !checksum->digest)
+		return 0;
+
+	if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, &ierror)) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_debug("Ignoring write checkpoint %s: %s", path, ierror->message);
+		return 0;
+	}
+
+	digest = g_key_file_get_string(key_file, WRITE_CHECKPOINT_GROUP, "digest", NULL);
+	ckpt_method = g_key_file_get_string(key_file, WRITE_CHECKPOINT_GROUP, "method", NULL);
+	size = g_key_file_get_uint64(key_file, WRITE_CHECKPOINT_GROUP, "size", NULL);
+	offset = g_key_file_get_uint64(key_file, WRITE_CHECKPOINT_GROUP, "offset", NULL);
+
+	if (g_strcmp0(digest, checksum->digest) != 0 ||
+	    g_strcmp0(ckpt_method, method) != 0 ||
+	    size != (guint64) checksum->size ||
+	    offset > size) {
+		g_debug("Ignoring write checkpoint %s for a different image or method", path);
+		return 0;
+	}
+
+	return offset;
+}
+
+gboolean r_slot_set_write_checkpoint(const RaucSlot *slot, const RaucChecksum *checksum, const gchar *method, goffset offset, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *path = NULL;
+
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
+	g_return_val_if_fail(method, FALSE);
+	g_return_val_if_fail(offset >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	path = get_write_checkpoint_path(slot);
+	if (!path || !checksum->digest)
+		return TRUE;
+
+	if (g_mkdir_with_parents(slot->data_directory, 0700) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create slot data directory '%s': %s", slot->data_directory, g_strerror(err));
+		return FALSE;
+	}
+
+	g_key_file_set_string(key_file, WRITE_CHECKPOINT_GROUP, "digest", checksum->digest);
+	g_key_file_set_uint64(key_file, WRITE_CHECKPOINT_GROUP, "size", checksum->size);
+	g_key_file_set_string(key_file, WRITE_CHECKPOINT_GROUP, "method", method);
+	g_key_file_set_uint64(key_file, WRITE_CHECKPOINT_GROUP, "offset", offset);
+
+	/* g_key_file_save_to_file() replaces the file atomically */
+	return g_key_file_save_to_file(key_file, path, error);
+}
+
+void r_slot_clear_write_checkpoint(const RaucSlot *slot)
+{
+	g_autofree gchar *path = NULL;
+
+	g_return_if_fail(slot);
+
+	path = get_write_checkpoint_path(slot);
+	if (!path)
+		return;
+
+	if (g_unlink(path) != 0 && errno != ENOENT)
+		g_warning("Failed to remove write checkpoint %s: %s", path, g_strerror(errno));
+}
+
 gchar** r_slot_get_root_classes(GHashTable *slots)
 {
 	GPtrArray *slotclasses = NULL;
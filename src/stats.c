@@ -1,25 +1,87 @@
+#include <string.h>
+#if ENABLE_JSON
+#include <json-glib/json-glib.h>
+#endif
+
+#include "event_log.h"
 #include "stats.h"
+#include "trace_event.h"
 
 gboolean test_stats_enabled = FALSE;
 GList *test_stats_queue = NULL;
 
+/* The histogram uses the IEEE 754 representation of the values: bucket 0
+ * counts values <= 0, the others split each power of two from 2^-32 to 2^64
+ * into 2^STATS_SUB_BITS buckets. Smaller and larger values are counted in the
+ * first and last of these. */
+#define STATS_SUB_BITS 3
+#define STATS_MIN_EXP (-32)
+#define STATS_MAX_EXP 63
+#define STATS_BUCKETS (1 + ((STATS_MAX_EXP - STATS_MIN_EXP + 1) << STATS_SUB_BITS))
+
+/* minimum interval between trace events of each RaucStats */
+#define STATS_TRACE_INTERVAL (10 * G_TIME_SPAN_MILLISECOND)
+
+static guint stats_bucket(gdouble value)
+{
+	guint64 bits;
+	gint exp;
+
+	if (!(value > 0.0))
+		return 0;
+
+	memcpy(&bits, &value, sizeof(bits));
+	exp = (gint)((bits >> 52) & 0x7ff) - 1023;
+	if (exp < STATS_MIN_EXP)
+		return 1;
+	if (exp > STATS_MAX_EXP)
+		return STATS_BUCKETS - 1;
+
+	return 1 + ((exp - STATS_MIN_EXP) << STATS_SUB_BITS) + ((bits >> (52 - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+static gdouble stats_bucket_upper_bound(guint bucket)
+{
+	guint64 bits;
+	gdouble value;
+
+	if (bucket == 0)
+		return 0.0;
+
+	bucket--;
+	/* the carry of the sub bucket increments the exponent for the last one */
+	bits = ((guint64)((bucket >> STATS_SUB_BITS) + STATS_MIN_EXP + 1023) << 52) +
+	       ((guint64)((bucket & ((1 << STATS_SUB_BITS) - 1)) + 1) << (52 - STATS_SUB_BITS));
+	memcpy(&value, &bits, sizeof(value));
+
+	return value;
+}
+
 RaucStats *r_stats_new(const gchar *label)
 {
 	RaucStats *stats = g_new0(RaucStats, 1);
 
 	stats->label = g_strdup(label);
 	stats->min = G_MAXDOUBLE;
-	stats->max = G_MINDOUBLE;
+	stats->max = -G_MAXDOUBLE;
+	stats->buckets = g_new0(guint64, STATS_BUCKETS);
+	g_mutex_init(&stats->lock);
 
 	return stats;
 }
 
 void r_stats_add(RaucStats *stats, gdouble value)
 {
+	gboolean trace = FALSE;
+	guint64 count;
+	gdouble sum;
+
 	g_return_if_fail(stats);
 
+	g_mutex_lock(&stats->lock);
+
 	stats->values[stats->next] = value;
-	stats->next = (stats->next + 1) % 64;
+	stats->next = (stats->next + 1) % R_STATS_WINDOW;
 	stats->count++;
 
 	stats->sum += value;
@@ -28,30 +90,63 @@ void r_stats_add(RaucStats *stats, gdouble value)
 		stats->min = value;
 	if (value > stats->max)
 		stats->max = value;
+
+	stats->buckets[stats_bucket(value)]++;
+
+	if (r_trace_event_enabled()) {
+		gint64 now = g_get_monotonic_time();
+
+		if (now - stats->trace_time >= STATS_TRACE_INTERVAL) {
+			stats->trace_time = now;
+			trace = TRUE;
+			count = stats->count;
+			sum = stats->sum;
+		}
+	}
+
+	g_mutex_unlock(&stats->lock);
+
+	if (trace) {
+		r_trace_event_counter(stats->label, "count", count);
+		r_trace_event_counter(stats->label, "sum", sum);
+	}
 }
 
-gdouble r_stats_get_avg(const RaucStats *stats)
+/* The readers only take the lock, so they accept const RaucStats. */
+static GMutex *stats_lock(const RaucStats *stats)
 {
-	g_return_val_if_fail(stats, 0.0);
+	return (GMutex *) &stats->lock;
+}
 
+static gdouble stats_get_avg(const RaucStats *stats)
+{
 	if (stats->count)
 		return stats->sum / stats->count;
 	else
 		return 0.0;
 }
 
-gdouble r_stats_get_recent_avg(const RaucStats *stats)
+gdouble r_stats_get_avg(const RaucStats *stats)
 {
-	gdouble sum = 0.0;
-	guint64 count = stats->count;
+	gdouble avg;
 
 	g_return_val_if_fail(stats, 0.0);
 
-	if (count > 64)
-		count = 64;
+	g_mutex_lock(stats_lock(stats));
+	avg = stats_get_avg(stats);
+	g_mutex_unlock(stats_lock(stats));
+
+	return avg;
+}
+
+static gdouble stats_get_recent_avg(const RaucStats *stats)
+{
+	gdouble sum = 0.0;
+	guint64 count = MIN(stats->count, R_STATS_WINDOW);
 
-	for (unsigned int i = 0; i < count; i++)
-		sum += stats->values[i];
+	/* walk back from the newest value */
+	for (guint64 i = 1; i <= count; i++)
+		sum += stats->values[(stats->next + R_STATS_WINDOW - i) % R_STATS_WINDOW];
 
 	if (count)
 		return sum / count;
@@ -59,12 +154,59 @@ gdouble r_stats_get_recent_avg(const RaucStats *stats)
 		return 0.0;
 }
 
-void r_stats_show(const RaucStats *stats, const gchar *prefix)
+gdouble r_stats_get_recent_avg(const RaucStats *stats)
 {
-	g_autofree gchar *prefix_label = NULL;
-	g_autoptr(GString) msg = g_string_sized_new(128);
+	gdouble avg;
 
-	g_return_if_fail(stats);
+	g_return_val_if_fail(stats, 0.0);
+
+	g_mutex_lock(stats_lock(stats));
+	avg = stats_get_recent_avg(stats);
+	g_mutex_unlock(stats_lock(stats));
+
+	return avg;
+}
+
+static gdouble stats_get_percentile(const RaucStats *stats, gdouble percentile)
+{
+	guint64 rank;
+	guint64 seen = 0;
+
+	if (!stats->count)
+		return 0.0;
+
+	/* rank of the value (starting at 1) below which 'percentile' of all
+	 * values are */
+	rank = (guint64)(percentile / 100.0 * stats->count + 0.999999);
+	rank = CLAMP(rank, 1, stats->count);
+
+	for (guint i = 0; i < STATS_BUCKETS; i++) {
+		seen += stats->buckets[i];
+		if (seen >= rank)
+			return CLAMP(stats_bucket_upper_bound(i), stats->min, stats->max);
+	}
+
+	return stats->max;
+}
+
+gdouble r_stats_get_percentile(const RaucStats *stats, gdouble percentile)
+{
+	gdouble result;
+
+	g_return_val_if_fail(stats, 0.0);
+	g_return_val_if_fail(percentile >= 0.0 && percentile <= 100.0, 0.0);
+
+	g_mutex_lock(stats_lock(stats));
+	result = stats_get_percentile(stats, percentile);
+	g_mutex_unlock(stats_lock(stats));
+
+	return result;
+}
+
+static gchar *stats_format(const RaucStats *stats, const gchar *prefix)
+{
+	g_autofree gchar *prefix_label = NULL;
+	GString *msg = g_string_sized_new(128);
 
 	if (prefix) {
 		prefix_label = g_strdup_printf("%s %s", prefix, stats->label);
@@ -76,11 +218,117 @@ void r_stats_show(const RaucStats *stats, const gchar *prefix)
 	if (!stats->count)
 		goto out;
 	g_string_append_printf(msg, " sum=%.3f min=%.3f max=%.3f avg=%.3f",
-			stats->sum, stats->min, stats->max, r_stats_get_avg(stats));
-	g_string_append_printf(msg, " recent-avg=%.3f", r_stats_get_recent_avg(stats));
+			stats->sum, stats->min, stats->max, stats_get_avg(stats));
+	g_string_append_printf(msg, " recent-avg=%.3f", stats_get_recent_avg(stats));
+	g_string_append_printf(msg, " p50=%.3f p90=%.3f p99=%.3f",
+			stats_get_percentile(stats, 50), stats_get_percentile(stats, 90),
+			stats_get_percentile(stats, 99));
 
 out:
-	g_message("%s", msg->str);
+	return g_string_free(msg, FALSE);
+}
+
+void r_stats_show(const RaucStats *stats, const gchar *prefix)
+{
+	g_autofree gchar *msg = NULL;
+
+	g_return_if_fail(stats);
+
+	g_mutex_lock(stats_lock(stats));
+	msg = stats_format(stats, prefix);
+	g_mutex_unlock(stats_lock(stats));
+
+	g_message("%s", msg);
+}
+
+GVariant *r_stats_to_variant(const RaucStats *stats)
+{
+	GVariantDict dict;
+
+	g_return_val_if_fail(stats, NULL);
+
+	g_variant_dict_init(&dict, NULL);
+
+	g_mutex_lock(stats_lock(stats));
+	g_variant_dict_insert(&dict, "label", "s", stats->label);
+	g_variant_dict_insert(&dict, "count", "t", stats->count);
+	if (stats->count) {
+		g_variant_dict_insert(&dict, "sum", "d", stats->sum);
+		g_variant_dict_insert(&dict, "min", "d", stats->min);
+		g_variant_dict_insert(&dict, "max", "d", stats->max);
+		g_variant_dict_insert(&dict, "avg", "d", stats_get_avg(stats));
+		g_variant_dict_insert(&dict, "recent-avg", "d", stats_get_recent_avg(stats));
+		g_variant_dict_insert(&dict, "p50", "d", stats_get_percentile(stats, 50));
+		g_variant_dict_insert(&dict, "p90", "d", stats_get_percentile(stats, 90));
+		g_variant_dict_insert(&dict, "p99", "d", stats_get_percentile(stats, 99));
+	}
+	g_mutex_unlock(stats_lock(stats));
+
+	return g_variant_dict_end(&dict);
+}
+
+#if ENABLE_JSON
+gchar *r_stats_to_json(const RaucStats *stats)
+{
+	g_autoptr(GVariant) variant = NULL;
+
+	g_return_val_if_fail(stats, NULL);
+
+	variant = g_variant_ref_sink(r_stats_to_variant(stats));
+
+	return json_gvariant_serialize_data(variant, NULL);
+}
+#endif
+
+void r_stats_log_event(const RaucStats *stats, const gchar *prefix)
+{
+	g_autofree gchar *msg = NULL;
+	g_autofree gchar *count = NULL;
+	g_autofree gchar *sum = NULL;
+	g_autofree gchar *min = NULL;
+	g_autofree gchar *max = NULL;
+	g_autofree gchar *p50 = NULL;
+	g_autofree gchar *p90 = NULL;
+	g_autofree gchar *p99 = NULL;
+	GLogField fields[] = {
+		{"MESSAGE", NULL, -1},
+		{"PRIORITY", r_event_log_level_to_priority(G_LOG_LEVEL_MESSAGE), -1},
+		{"GLIB_DOMAIN", R_EVENT_LOG_DOMAIN, -1},
+		{"RAUC_EVENT_TYPE", R_EVENT_LOG_TYPE_STATS, -1},
+		{"RAUC_STATS_LABEL", NULL, -1},
+		{"RAUC_STATS_COUNT", NULL, -1},
+		{"RAUC_STATS_SUM", NULL, -1},
+		{"RAUC_STATS_MIN", NULL, -1},
+		{"RAUC_STATS_MAX", NULL, -1},
+		{"RAUC_STATS_P50", NULL, -1},
+		{"RAUC_STATS_P90", NULL, -1},
+		{"RAUC_STATS_P99", NULL, -1},
+	};
+
+	g_return_if_fail(stats);
+
+	g_mutex_lock(stats_lock(stats));
+	msg = stats_format(stats, prefix);
+	count = g_strdup_printf("%"G_GUINT64_FORMAT, stats->count);
+	sum = g_strdup_printf("%.6f", stats->sum);
+	min = g_strdup_printf("%.6f", stats->count ? stats->min : 0.0);
+	max = g_strdup_printf("%.6f", stats->count ? stats->max : 0.0);
+	p50 = g_strdup_printf("%.6f", stats_get_percentile(stats, 50));
+	p90 = g_strdup_printf("%.6f", stats_get_percentile(stats, 90));
+	p99 = g_strdup_printf("%.6f", stats_get_percentile(stats, 99));
+	g_mutex_unlock(stats_lock(stats));
+
+	fields[0].value = msg;
+	fields[4].value = stats->label;
+	fields[5].value = count;
+	fields[6].value = sum;
+	fields[7].value = min;
+	fields[8].value = max;
+	fields[9].value = p50;
+	fields[10].value = p90;
+	fields[11].value = p99;
+
+	g_log_structured_array(G_LOG_LEVEL_MESSAGE, fields, G_N_ELEMENTS(fields));
 }
 
 void r_stats_free(RaucStats *stats)
@@ -95,6 +343,8 @@ void r_stats_free(RaucStats *stats)
 	}
 
 	g_free(stats->label);
+	g_free(stats->buckets);
+	g_mutex_clear(&stats->lock);
 
 	g_free(stats);
 }
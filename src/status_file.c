@@ -1,6 +1,10 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include "context.h"
 #include "mount.h"
@@ -165,6 +169,160 @@ free:
 	return res;
 }
 
+#define STATUS_CACHE_GROUP "cache"
+
+/* Returns the path of the cache entry for a per-slot status file, or NULL if
+ * the cache is disabled. */
+static gchar *status_cache_path(const RaucSlot *slot)
+{
+	g_autofree gchar *name = NULL;
+
+	if (!r_context()->config->status_cache_directory)
+		return NULL;
+
+	name = g_strconcat(slot->name, ".raucs", NULL);
+	return g_build_filename(r_context()->config->status_cache_directory, name, NULL);
+}
+
+/* Size of the start of a device which is hashed for the cache key. This covers
+ * the superblocks of common filesystems (e.g. ext4, vfat, squashfs, btrfs). */
+#define STATUS_CACHE_HEADER_SIZE (128 * 1024)
+
+/* Returns a hash of the start of a device, which changes when the filesystem
+ * on it is recreated or modified (e.g. by the write time in the superblock). */
+static gchar *status_cache_device_hash(const RaucSlot *slot, goffset *size)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_auto(filedesc) fd = -1;
+	g_autofree guint8 *buf = NULL;
+	gsize len = 0;
+
+	fd = g_open(slot->device, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		g_debug("Failed to open %s for status cache: %s", slot->device, g_strerror(errno));
+		return NULL;
+	}
+
+	/* this fails for character devices, which are identified by the hash only */
+	*size = get_device_size(fd, NULL);
+
+	buf = g_malloc(STATUS_CACHE_HEADER_SIZE);
+	while (len < STATUS_CACHE_HEADER_SIZE) {
+		ssize_t ret = TEMP_FAILURE_RETRY(read(fd, buf + len, STATUS_CACHE_HEADER_SIZE - len));
+		if (ret < 0) {
+			g_debug("Failed to read %s for status cache: %s", slot->device, g_strerror(errno));
+			return NULL;
+		} else if (ret == 0) {
+			break;
+		}
+		len += ret;
+	}
+
+	return g_compute_checksum_for_data(G_CHECKSUM_SHA256, buf, len);
+}
+
+/* Returns a key identifying the slot device and its current generation, so
+ * that a cache entry is not used after the device was replaced or modified.
+ * For devices, the device number alone is not sufficient, as it is reused
+ * (e.g. for loop devices or after repartitioning), so the size and a hash of
+ * the filesystem superblock are included as well. */
+static gchar *status_cache_device_key(const RaucSlot *slot)
+{
+	GStatBuf st;
+
+	if (g_stat(slot->device, &st) != 0)
+		return NULL;
+
+	if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+		g_autofree gchar *hash = NULL;
+		goffset size = 0;
+
+		hash = status_cache_device_hash(slot, &size);
+		if (!hash)
+			return NULL;
+
+		return g_strdup_printf("%s:dev:%u:%u:%"G_GOFFSET_FORMAT ":%s", slot->device,
+				major(st.st_rdev), minor(st.st_rdev), size, hash);
+	}
+
+	return g_strdup_printf("%s:file:%"G_GUINT64_FORMAT":%"G_GUINT64_FORMAT":%"G_GUINT64_FORMAT":%"G_GINT64_FORMAT".%09ld",
+			slot->device, (guint64) st.st_dev, (guint64) st.st_ino, (guint64) st.st_size,
+			(gint64) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+}
+
+/* Loads the slot status from the cache. Returns FALSE if there is no valid
+ * entry. */
+static gboolean load_slot_status_cached(RaucSlot *dest_slot)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *path = status_cache_path(dest_slot);
+	g_autofree gchar *device_key = NULL;
+	g_autofree gchar *cached_key = NULL;
+
+	if (!path)
+		return FALSE;
+
+	if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL))
+		return FALSE;
+
+	device_key = status_cache_device_key(dest_slot);
+	cached_key = g_key_file_get_string(key_file, STATUS_CACHE_GROUP, "device", NULL);
+	if (!device_key || g_strcmp0(device_key, cached_key) != 0) {
+		g_debug("Ignoring outdated status cache entry for slot %s", dest_slot->name);
+		return FALSE;
+	}
+
+	g_debug("Using cached status for slot %s", dest_slot->name);
+	status_file_get_slot_status(key_file, "slot", dest_slot->status);
+
+	return TRUE;
+}
+
+/* Stores the slot status in the cache. As the cache is only an optimization,
+ * errors are ignored. */
+static void save_slot_status_cached(RaucSlot *dest_slot)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *path = status_cache_path(dest_slot);
+	g_autofree gchar *device_key = NULL;
+
+	if (!path)
+		return;
+
+	device_key = status_cache_device_key(dest_slot);
+	if (!device_key) {
+		g_unlink(path);
+		return;
+	}
+
+	if (g_mkdir_with_parents(r_context()->config->status_cache_directory, 0700) != 0) {
+		g_debug("Failed to create status cache directory: %s", g_strerror(errno));
+		return;
+	}
+
+	g_key_file_set_string(key_file, STATUS_CACHE_GROUP, "device", device_key);
+	status_file_set_slot_status(key_file, "slot", dest_slot->status);
+
+	/* g_key_file_save_to_file() replaces the file atomically */
+	if (!g_key_file_save_to_file(key_file, path, &ierror))
+		g_debug("Failed to update status cache for slot %s: %s", dest_slot->name, ierror->message);
+}
+
+void r_slot_status_invalidate_cache(RaucSlot *dest_slot)
+{
+	g_autofree gchar *path = NULL;
+
+	g_return_if_fail(dest_slot);
+
+	if (g_strcmp0(r_context()->config->statusfile_path, "per-slot") != 0)
+		return;
+
+	path = status_cache_path(dest_slot);
+	if (path && g_unlink(path) != 0 && errno != ENOENT)
+		g_debug("Failed to remove status cache entry %s: %s", path, g_strerror(errno));
+}
+
 static void load_slot_status_locally(RaucSlot *dest_slot)
 {
 	GError *ierror = NULL;
@@ -180,6 +338,10 @@ static void load_slot_status_locally(RaucSlot *dest_slot)
 	if (!r_slot_is_mountable(dest_slot))
 		return;
 
+	/* avoid mounting the slot if the status is cached */
+	if (!dest_slot->ext_mount_point && load_slot_status_cached(dest_slot))
+		return;
+
 	/* read slot status */
 	if (!dest_slot->ext_mount_point) {
 		g_message("mounting slot %s", dest_slot->device);
@@ -205,6 +367,8 @@ static void load_slot_status_locally(RaucSlot *dest_slot)
 			g_clear_error(&ierror);
 			return;
 		}
+
+		save_slot_status_cached(dest_slot);
 	}
 }
 
@@ -295,6 +459,7 @@ static gboolean save_slot_status_locally(RaucSlot *dest_slot, GError **error)
 	if (!res) {
 		g_propagate_error(error, ierror);
 		r_umount_slot(dest_slot, NULL);
+		r_slot_status_invalidate_cache(dest_slot);
 
 		goto free;
 	}
@@ -302,9 +467,13 @@ static gboolean save_slot_status_locally(RaucSlot *dest_slot, GError **error)
 	res = r_umount_slot(dest_slot, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
+		r_slot_status_invalidate_cache(dest_slot);
 		goto free;
 	}
 
+	/* the device key must be determined after unmounting */
+	save_slot_status_cached(dest_slot);
+
 free:
 	return res;
 }
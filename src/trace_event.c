@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace_event.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-trace-event-error-quark, r_trace_event_error)
+
+static gint trace_fd = -1;
+/* path of the trace file opened by r_trace_event_open() */
+static gchar *trace_path = NULL;
+/* set once the calling thread's name was recorded */
+static GPrivate trace_thread_named;
+
+gboolean r_trace_event_enabled(void)
+{
+	return g_atomic_int_get(&trace_fd) >= 0;
+}
+
+gchar *r_trace_event_quote(const gchar *str)
+{
+	GString *quoted = g_string_new("\"");
+
+	for (const gchar *c = str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			g_string_append_printf(quoted, "\\%c", *c);
+		else if ((guchar) *c < 0x20)
+			g_string_append_printf(quoted, "\\u%04x", (guchar) *c);
+		else
+			g_string_append_c(quoted, *c);
+	}
+	g_string_append_c(quoted, '"');
+
+	return g_string_free(quoted, FALSE);
+}
+
+static void trace_write(GString *line)
+{
+	gint fd = g_atomic_int_get(&trace_fd);
+	gssize ret;
+
+	if (fd < 0)
+		return;
+
+	/* O_APPEND and a single write() keep lines of concurrent writers
+	 * (threads and processes) intact */
+	ret = TEMP_FAILURE_RETRY(write(fd, line->str, line->len));
+	if (ret < 0)
+		g_debug("Failed to write trace event: %s", g_strerror(errno));
+}
+
+/* Starts an event line with the fields common to all events */
+static GString *trace_line_new(gchar phase, const gchar *category, const gchar *name, gint64 ts)
+{
+	GString *line = g_string_sized_new(160);
+	g_autofree gchar *quoted_name = r_trace_event_quote(name);
+	gint tid = syscall(SYS_gettid);
+
+	/* Perfetto shows threads by name */
+	if (!g_private_get(&trace_thread_named)) {
+		gchar thread_name[17] = {0};
+		g_autofree gchar *quoted_thread_name = NULL;
+
+		g_private_set(&trace_thread_named, GINT_TO_POINTER(TRUE));
+		if (prctl(PR_GET_NAME, thread_name) == 0) {
+			quoted_thread_name = r_trace_event_quote(thread_name);
+			g_string_append_printf(line,
+					"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":%s}},\n",
+					getpid(), tid, quoted_thread_name);
+		}
+	}
+
+	g_string_append_printf(line, "{\"name\":%s,\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%"G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d",
+			quoted_name, category, phase, ts, getpid(), tid);
+
+	return line;
+}
+
+static void trace_line_finish(GString *line, const gchar *args)
+{
+	if (args)
+		g_string_append_printf(line, ",\"args\":{%s}", args);
+	g_string_append(line, "},\n");
+
+	trace_write(line);
+	g_string_free(line, TRUE);
+}
+
+static gboolean trace_open_fd(const gchar *path, gint flags, GError **error)
+{
+	gint fd;
+
+	fd = g_open(path, O_WRONLY | O_APPEND | O_CLOEXEC | flags, 0644);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open trace file %s: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	g_atomic_int_set(&trace_fd, fd);
+
+	return TRUE;
+}
+
+gboolean r_trace_event_open(const gchar *path, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GString) header = g_string_new("[\n");
+
+	g_return_val_if_fail(path, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (r_trace_event_enabled()) {
+		g_set_error(error, R_TRACE_EVENT_ERROR, R_TRACE_EVENT_ERROR_FAILED,
+				"A trace file is already open");
+		return FALSE;
+	}
+
+	if (!trace_open_fd(path, O_CREAT | O_TRUNC, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	trace_write(header);
+	trace_path = g_strdup(path);
+
+	return TRUE;
+}
+
+void r_trace_event_setup_launcher(GSubprocessLauncher *launcher)
+{
+	g_return_if_fail(G_IS_SUBPROCESS_LAUNCHER(launcher));
+
+	if (!trace_path)
+		return;
+
+	g_subprocess_launcher_setenv(launcher, R_TRACE_EVENT_FILE_ENV, trace_path, TRUE);
+}
+
+void r_trace_event_attach(void)
+{
+	g_autofree gchar *path = g_strdup(g_getenv(R_TRACE_EVENT_FILE_ENV));
+	GError *ierror = NULL;
+
+	if (!path)
+		return;
+
+	/* don't pass it on to our own subprocesses */
+	g_unsetenv(R_TRACE_EVENT_FILE_ENV);
+
+	if (r_trace_event_enabled())
+		return;
+
+	/* the file may not be writable after dropping privileges */
+	if (!trace_open_fd(path, 0, &ierror)) {
+		g_debug("%s", ierror->message);
+		g_clear_error(&ierror);
+	}
+}
+
+void r_trace_event_close(void)
+{
+	gint fd = g_atomic_int_get(&trace_fd);
+
+	if (fd < 0)
+		return;
+
+	g_atomic_int_set(&trace_fd, -1);
+	g_clear_pointer(&trace_path, g_free);
+	(void) close(fd);
+}
+
+void r_trace_event_begin(const gchar *category, const gchar *name)
+{
+	if (!r_trace_event_enabled())
+		return;
+
+	trace_line_finish(trace_line_new('B', category, name, g_get_monotonic_time()), NULL);
+}
+
+void r_trace_event_end(const gchar *category, const gchar *name)
+{
+	if (!r_trace_event_enabled())
+		return;
+
+	trace_line_finish(trace_line_new('E', category, name, g_get_monotonic_time()), NULL);
+}
+
+void r_trace_event_complete(const gchar *category, const gchar *name, gint64 start, gint64 duration, const gchar *args)
+{
+	GString *line;
+
+	if (!r_trace_event_enabled())
+		return;
+
+	line = trace_line_new('X', category, name, start);
+	g_string_append_printf(line, ",\"dur\":%"G_GINT64_FORMAT, duration);
+	trace_line_finish(line, args);
+}
+
+void r_trace_event_instant(const gchar *category, const gchar *name, const gchar *args)
+{
+	GString *line;
+
+	if (!r_trace_event_enabled())
+		return;
+
+	line = trace_line_new('i', category, name, g_get_monotonic_time());
+	/* thread scope */
+	g_string_append(line, ",\"s\":\"t\"");
+	trace_line_finish(line, args);
+}
+
+void r_trace_event_counter(const gchar *name, const gchar *series, gdouble value)
+{
+	g_autofree gchar *args = NULL;
+	g_autofree gchar *quoted_series = NULL;
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (!r_trace_event_enabled())
+		return;
+
+	quoted_series = r_trace_event_quote(series);
+	/* JSON numbers must not depend on the locale */
+	args = g_strdup_printf("%s:%s", quoted_series, g_ascii_formatd(buf, sizeof(buf), "%.6f", value));
+	trace_line_finish(trace_line_new('C', "stats", name, g_get_monotonic_time()), args);
+}
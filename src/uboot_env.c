@@ -0,0 +1,662 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <mtd/mtd-user.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "uboot_env.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-uboot-env-error-quark, r_uboot_env_error)
+
+/* same lock file as used by fw_printenv/fw_setenv */
+#define UBOOT_ENV_LOCK_FILE "/var/lock/fw_printenv.lock"
+#define MTD_CHAR_MAJOR 90
+
+/* flag values of redundant environments on NOR flash */
+#define UBOOT_ENV_FLAG_ACTIVE 1
+#define UBOOT_ENV_FLAG_OBSOLETE 0
+
+typedef struct {
+	gchar *device;
+	/* negative offsets are relative to the end of the device */
+	gint64 offset;
+	gsize env_size;
+	gsize sector_size;
+	guint sectors;
+	gboolean mtd;
+	/* NOR (or DataFlash) MTD device */
+	gboolean nor;
+	gboolean valid;
+	guint8 flag;
+} UbootEnvCopy;
+
+struct _RUbootEnv {
+	UbootEnvCopy copies[2];
+	guint num_copies;
+	guint active;
+	/* use active/obsolete flags instead of incrementing them */
+	gboolean boolean_flags;
+	/* variable names in environment order */
+	GPtrArray *keys;
+	GHashTable *vars;
+	gboolean dirty;
+	int lock_fd;
+};
+
+static guint32 crc32_table[256];
+
+static void crc32_init_table(void)
+{
+	static gsize initialized = 0;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	for (guint32 i = 0; i < 256; i++) {
+		guint32 c = i;
+		for (guint j = 0; j < 8; j++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+
+	g_once_init_leave(&initialized, 1);
+}
+
+static guint32 crc32(const guint8 *data, gsize len)
+{
+	guint32 crc = 0xFFFFFFFF;
+
+	crc32_init_table();
+	for (gsize i = 0; i < len; i++)
+		crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+/* CRC (4 bytes) and, for redundant environments, the flag byte */
+static gsize header_size(const RUbootEnv *env)
+{
+	return env->num_copies == 2 ? 5 : 4;
+}
+
+static gboolean parse_config_line(const gchar *line, UbootEnvCopy *copy, GError **error)
+{
+	g_auto(GStrv) tokens = g_strsplit_set(line, " \t", -1);
+	g_autoptr(GPtrArray) fields = g_ptr_array_new();
+	gchar *end;
+
+	for (gchar **token = tokens; *token; token++) {
+		if (**token)
+			g_ptr_array_add(fields, *token);
+	}
+
+	if (fields->len < 3 || fields->len > 5) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+				"Invalid line '%s'", line);
+		return FALSE;
+	}
+
+	copy->device = g_strdup(fields->pdata[0]);
+
+	copy->offset = g_ascii_strtoll(fields->pdata[1], &end, 0);
+	if (*end)
+		goto invalid;
+	copy->env_size = g_ascii_strtoull(fields->pdata[2], &end, 0);
+	if (*end || copy->env_size <= 5)
+		goto invalid;
+	copy->sector_size = copy->env_size;
+	if (fields->len > 3) {
+		copy->sector_size = g_ascii_strtoull(fields->pdata[3], &end, 0);
+		if (*end || copy->sector_size == 0)
+			goto invalid;
+	}
+	copy->sectors = 1;
+	if (fields->len > 4) {
+		copy->sectors = g_ascii_strtoull(fields->pdata[4], &end, 0);
+		if (*end || copy->sectors == 0)
+			goto invalid;
+	}
+
+	return TRUE;
+
+invalid:
+	g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+			"Invalid number in line '%s'", line);
+	return FALSE;
+}
+
+static gboolean parse_config(RUbootEnv *env, const gchar *config_path, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+
+	if (!g_file_get_contents(config_path, &contents, NULL, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (gchar **line = lines; *line; line++) {
+		g_strstrip(*line);
+		if (!**line || **line == '#')
+			continue;
+
+		if (env->num_copies == 2) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+					"%s: more than two environment copies configured", config_path);
+			return FALSE;
+		}
+
+		if (!parse_config_line(*line, &env->copies[env->num_copies], &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "%s: ", config_path);
+			return FALSE;
+		}
+		env->num_copies++;
+	}
+
+	if (env->num_copies == 0) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+				"%s: no environment configured", config_path);
+		return FALSE;
+	}
+
+	if (env->num_copies == 2 && env->copies[0].env_size != env->copies[1].env_size) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+				"%s: redundant environments differ in size", config_path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Block devices and files are accessed directly, NOR flash via the MTD
+ * character device. NAND (which needs bad block handling) and UBI volumes
+ * are left to the U-Boot tools. */
+static gboolean check_device(UbootEnvCopy *copy, int fd, GError **error)
+{
+	struct stat st;
+	struct mtd_info_user info;
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+		return TRUE;
+
+	if (!S_ISCHR(st.st_mode) || major(st.st_rdev) != MTD_CHAR_MAJOR) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_UNSUPPORTED,
+				"Unsupported environment device %s", copy->device);
+		return FALSE;
+	}
+
+	if (ioctl(fd, MEMGETINFO, &info) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to get MTD info for %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (info.type == MTD_NANDFLASH || info.type == MTD_MLCNANDFLASH) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_UNSUPPORTED,
+				"Unsupported NAND environment device %s", copy->device);
+		return FALSE;
+	}
+
+	copy->mtd = TRUE;
+	copy->nor = info.type == MTD_NORFLASH || info.type == MTD_DATAFLASH;
+	return TRUE;
+}
+
+static gboolean resolve_offset(UbootEnvCopy *copy, int fd, off_t *offset, GError **error)
+{
+	off_t size;
+
+	if (copy->offset >= 0) {
+		*offset = copy->offset;
+		return TRUE;
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0 || size + copy->offset < 0) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+				"Invalid negative offset for %s", copy->device);
+		return FALSE;
+	}
+	*offset = size + copy->offset;
+
+	return TRUE;
+}
+
+static gboolean read_copy(RUbootEnv *env, UbootEnvCopy *copy, guint8 **buf, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) fd = -1;
+	g_autofree guint8 *data = NULL;
+	guint32 crc;
+	off_t offset;
+
+	fd = g_open(copy->device, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!check_device(copy, fd, error))
+		return FALSE;
+	if (!resolve_offset(copy, fd, &offset, error))
+		return FALSE;
+
+	data = g_malloc(copy->env_size);
+	if (!r_pread_exact(fd, data, copy->env_size, offset, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read environment from %s: ", copy->device);
+		return FALSE;
+	}
+
+	memcpy(&crc, data, sizeof(crc));
+	copy->valid = GUINT32_FROM_LE(crc) == crc32(data + header_size(env), copy->env_size - header_size(env));
+	if (env->num_copies == 2)
+		copy->flag = data[4];
+
+	*buf = g_steal_pointer(&data);
+	return TRUE;
+}
+
+/* Selects the copy to use, following U-Boot's rules for boolean flags (on NOR
+ * flash) or incremental flags (including the wrap-around from 255 to 0). */
+static gboolean select_active(RUbootEnv *env, GError **error)
+{
+	const UbootEnvCopy *c0 = &env->copies[0];
+	const UbootEnvCopy *c1 = &env->copies[1];
+
+	if (env->num_copies == 1) {
+		env->active = 0;
+	} else if (c0->valid && !c1->valid) {
+		env->active = 0;
+	} else if (!c0->valid && c1->valid) {
+		env->active = 1;
+	} else if (env->boolean_flags) {
+		if (c0->flag == UBOOT_ENV_FLAG_ACTIVE && c1->flag == UBOOT_ENV_FLAG_OBSOLETE)
+			env->active = 0;
+		else if (c0->flag == UBOOT_ENV_FLAG_OBSOLETE && c1->flag == UBOOT_ENV_FLAG_ACTIVE)
+			env->active = 1;
+		else if (c0->flag == c1->flag || c0->flag == 0xFF)
+			env->active = 0;
+		else if (c1->flag == 0xFF)
+			env->active = 1;
+		else
+			env->active = 0;
+	} else if (c0->flag == 0xFF && c1->flag == 0) {
+		env->active = 1;
+	} else if (c1->flag == 0xFF && c0->flag == 0) {
+		env->active = 0;
+	} else {
+		env->active = c1->flag > c0->flag ? 1 : 0;
+	}
+
+	if (!env->copies[env->active].valid) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CORRUPT,
+				"No U-Boot environment with valid CRC found");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean parse_data(RUbootEnv *env, const guint8 *data, gsize len, GError **error)
+{
+	const gchar *p = (const gchar *) data;
+	const gchar *end = p + len;
+
+	while (p < end && *p) {
+		const gchar *nul = memchr(p, '\0', end - p);
+		const gchar *eq;
+
+		if (!nul) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CORRUPT,
+					"Unterminated U-Boot environment entry");
+			return FALSE;
+		}
+
+		eq = memchr(p, '=', nul - p);
+		if (eq && eq != p) {
+			gchar *key = g_strndup(p, eq - p);
+			if (!g_hash_table_contains(env->vars, key))
+				g_ptr_array_add(env->keys, key);
+			g_hash_table_insert(env->vars, key, g_strndup(eq + 1, nul - eq - 1));
+		} else {
+			g_debug("Ignoring invalid U-Boot environment entry '%s'", p);
+		}
+
+		p = nul + 1;
+	}
+
+	return TRUE;
+}
+
+static void lock_env(RUbootEnv *env)
+{
+	env->lock_fd = g_open(UBOOT_ENV_LOCK_FILE, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (env->lock_fd < 0) {
+		g_debug("Failed to open %s: %s", UBOOT_ENV_LOCK_FILE, g_strerror(errno));
+		return;
+	}
+
+	if (flock(env->lock_fd, LOCK_EX) != 0)
+		g_debug("Failed to lock %s: %s", UBOOT_ENV_LOCK_FILE, g_strerror(errno));
+}
+
+RUbootEnv *r_uboot_env_open(const gchar *config_path, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autofree guint8 *data0 = NULL;
+	g_autofree guint8 *data1 = NULL;
+	guint8 **data[2] = {&data0, &data1};
+
+	g_return_val_if_fail(config_path, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	env = g_new0(RUbootEnv, 1);
+	env->lock_fd = -1;
+	/* keys are owned by the array, the hash table references them */
+	env->keys = g_ptr_array_new_with_free_func(g_free);
+	env->vars = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+
+	if (!parse_config(env, config_path, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	lock_env(env);
+
+	for (guint i = 0; i < env->num_copies; i++) {
+		if (!read_copy(env, &env->copies[i], data[i], &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+	}
+
+	/* like fw_setenv, NOR flash uses boolean flags, as a single byte can
+	 * be cleared there without erasing the sector */
+	env->boolean_flags = env->num_copies == 2 && env->copies[0].nor;
+
+	if (!select_active(env, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!parse_data(env, *data[env->active] + header_size(env),
+			env->copies[env->active].env_size - header_size(env), &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&env);
+}
+
+const gchar *r_uboot_env_get(RUbootEnv *env, const gchar *key)
+{
+	g_return_val_if_fail(env, NULL);
+	g_return_val_if_fail(key, NULL);
+
+	return g_hash_table_lookup(env->vars, key);
+}
+
+void r_uboot_env_set(RUbootEnv *env, const gchar *key, const gchar *value)
+{
+	const gchar *current;
+
+	g_return_if_fail(env);
+	g_return_if_fail(key && *key && !strchr(key, '='));
+
+	current = g_hash_table_lookup(env->vars, key);
+
+	if (!value || !*value) {
+		if (!current)
+			return;
+		g_hash_table_remove(env->vars, key);
+		for (guint i = 0; i < env->keys->len; i++) {
+			if (g_strcmp0(env->keys->pdata[i], key) == 0) {
+				g_ptr_array_remove_index(env->keys, i);
+				break;
+			}
+		}
+		env->dirty = TRUE;
+		return;
+	}
+
+	if (g_strcmp0(current, value) == 0)
+		return;
+
+	if (current) {
+		/* replace the value, keeping the key (owned by env->keys) */
+		for (guint i = 0; i < env->keys->len; i++) {
+			if (g_strcmp0(env->keys->pdata[i], key) == 0) {
+				g_hash_table_insert(env->vars, env->keys->pdata[i], g_strdup(value));
+				break;
+			}
+		}
+	} else {
+		gchar *new_key = g_strdup(key);
+		g_ptr_array_add(env->keys, new_key);
+		g_hash_table_insert(env->vars, new_key, g_strdup(value));
+	}
+	env->dirty = TRUE;
+}
+
+static gboolean write_copy(UbootEnvCopy *copy, const guint8 *data, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) fd = -1;
+	g_autofree guint8 *region = NULL;
+	struct erase_info_user erase;
+	off_t offset, start;
+	gsize len;
+
+	fd = g_open(copy->device, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!resolve_offset(copy, fd, &offset, error))
+		return FALSE;
+
+	if (!copy->mtd) {
+		if (!r_pwrite_exact(fd, data, copy->env_size, offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write environment to %s: ", copy->device);
+			return FALSE;
+		}
+	} else {
+		/* Flash can only be erased in whole sectors, so preserve the
+		 * surrounding data like fw_setenv does. */
+		start = offset - (offset % copy->sector_size);
+		len = MAX(copy->sector_size * copy->sectors, (gsize) (offset - start) + copy->env_size);
+		len = ((len + copy->sector_size - 1) / copy->sector_size) * copy->sector_size;
+
+		region = g_malloc(len);
+		if (!r_pread_exact(fd, region, len, start, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read flash sectors from %s: ", copy->device);
+			return FALSE;
+		}
+		memcpy(region + (offset - start), data, copy->env_size);
+
+		erase.start = start;
+		erase.length = len;
+		/* not all flash chips support locking */
+		ioctl(fd, MEMUNLOCK, &erase);
+		if (ioctl(fd, MEMERASE, &erase) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to erase %s: %s", copy->device, g_strerror(err));
+			return FALSE;
+		}
+
+		if (!r_pwrite_exact(fd, region, len, start, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write environment to %s: ", copy->device);
+			return FALSE;
+		}
+	}
+
+	if (fsync(fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to sync %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Marks a copy as obsolete by clearing its flag byte in place. */
+static gboolean write_obsolete_flag(UbootEnvCopy *copy, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) fd = -1;
+	struct erase_info_user erase;
+	guint8 flag = UBOOT_ENV_FLAG_OBSOLETE;
+	off_t offset;
+
+	fd = g_open(copy->device, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!resolve_offset(copy, fd, &offset, error))
+		return FALSE;
+
+	erase.start = offset - (offset % copy->sector_size);
+	erase.length = copy->sector_size * copy->sectors;
+	/* not all flash chips support locking */
+	ioctl(fd, MEMUNLOCK, &erase);
+
+	if (!r_pwrite_exact(fd, &flag, sizeof(flag), offset + 4, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to mark environment on %s obsolete: ", copy->device);
+		return FALSE;
+	}
+
+	if (fsync(fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to sync %s: %s", copy->device, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_uboot_env_commit(RUbootEnv *env, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *data = NULL;
+	UbootEnvCopy *target;
+	gsize hdr, pos, size;
+	guint8 flag = 0;
+	guint32 crc;
+
+	g_return_val_if_fail(env, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!env->dirty)
+		return TRUE;
+
+	hdr = header_size(env);
+	size = env->copies[0].env_size;
+	/* unused space is zero-filled, which also terminates the list */
+	data = g_malloc0(size);
+
+	pos = hdr;
+	for (guint i = 0; i < env->keys->len; i++) {
+		const gchar *key = env->keys->pdata[i];
+		const gchar *value = g_hash_table_lookup(env->vars, key);
+		gsize klen = strlen(key);
+		gsize vlen = strlen(value);
+
+		/* keep room for the terminating empty entry */
+		if (pos + klen + 1 + vlen + 1 >= size) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_TOO_LARGE,
+					"U-Boot environment exceeds %"G_GSIZE_FORMAT " bytes", size);
+			return FALSE;
+		}
+
+		memcpy(data + pos, key, klen);
+		pos += klen;
+		data[pos++] = '=';
+		memcpy(data + pos, value, vlen);
+		pos += vlen;
+		data[pos++] = '\0';
+	}
+
+	crc = GUINT32_TO_LE(crc32(data + hdr, size - hdr));
+	memcpy(data, &crc, sizeof(crc));
+
+	/* for redundant environments, the inactive copy becomes the new one */
+	if (env->num_copies == 2) {
+		if (env->boolean_flags)
+			flag = UBOOT_ENV_FLAG_ACTIVE;
+		else
+			flag = env->copies[env->active].flag + 1;
+		data[4] = flag;
+		target = &env->copies[env->active ^ 1];
+	} else {
+		target = &env->copies[0];
+	}
+
+	if (!write_copy(target, data, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	target->valid = TRUE;
+	target->flag = flag;
+	env->dirty = FALSE;
+
+	/* with boolean flags, the new copy is only used once the previous one
+	 * is marked as obsolete */
+	if (env->boolean_flags) {
+		UbootEnvCopy *previous = &env->copies[env->active];
+
+		if (!write_obsolete_flag(previous, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		previous->flag = UBOOT_ENV_FLAG_OBSOLETE;
+	}
+
+	env->active = target - env->copies;
+
+	return TRUE;
+}
+
+void r_uboot_env_free(RUbootEnv *env)
+{
+	if (!env)
+		return;
+
+	for (guint i = 0; i < G_N_ELEMENTS(env->copies); i++)
+		g_free(env->copies[i].device);
+	/* the hash table references the keys owned by the array */
+	g_clear_pointer(&env->vars, g_hash_table_destroy);
+	g_clear_pointer(&env->keys, g_ptr_array_unref);
+	if (env->lock_fd >= 0)
+		close(env->lock_fd);
+	g_free(env);
+}
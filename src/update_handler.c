@@ -16,10 +16,12 @@
 #include "update_handler.h"
 #include "update_utils.h"
 #include "emmc.h"
+#include "extract.h"
 #include "mbr.h"
 #include "gpt.h"
 #include "utils.h"
 #include "hash_index.h"
+#include "trace_event.h"
 
 #define R_SLOT_HOOK_PRE_INSTALL "slot-pre-install"
 #define R_SLOT_HOOK_POST_INSTALL "slot-post-install"
@@ -27,6 +29,11 @@
 
 #define CLEAR_BLOCK_SIZE 1024
 
+/* size of the requests used to read image and target in write-mode=compare */
+#define COMPARE_READ_SIZE (1024*1024)
+/* granularity of the comparison (and thus of the writes) */
+#define COMPARE_BLOCK_SIZE 4096
+
 GQuark r_update_error_quark(void)
 {
 	return g_quark_from_static_string("r_update_error_quark");
@@ -213,7 +220,7 @@ static gboolean splice_with_progress(GUnixInputStream *image_stream,
 
 		/* emit progress info (but only when in progress context) */
 		if (r_context()->progress)
-			r_context_set_step_percentage("copy_image", sum_size * 100 / stat.st_size);
+			r_context_set_step_progress("copy_image", sum_size, stat.st_size);
 	} while (out_size);
 
 	return TRUE;
@@ -271,18 +278,158 @@ static gboolean splice_file_to_process_stdin(const gchar *filename, GSubprocess
 	return splice_file_to_outstream(filename, out_stream, error);
 }
 
-static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, gsize len_header_last, GError **error)
+/* State for checkpointing a slot write, so that it can be resumed after an
+ * interruption. */
+typedef struct {
+	const RaucImage *image;
+	const RaucSlot *slot;
+	const gchar *method;
+	int fd;
+	/* checkpoint interval in bytes, 0 if checkpointing is disabled */
+	goffset interval;
+	/* offset from which the write continues */
+	goffset resume;
+} RWriteCheckpoint;
+
+/* Sets up checkpointing for writing 'image' to 'fd'.
+ *
+ * Checkpoints are only used if the data written by a previous attempt can be
+ * checked against the image's block hash index 'idx' and the slot has a data
+ * directory to store them. In that case, the longest verified part of the
+ * previous attempt is reused.
+ *
+ * As 'fd' may be opened write-only, the previous data is read through a
+ * separate file descriptor. */
+static void write_checkpoint_init(RWriteCheckpoint *ckpt, const RaucImage *image, const RaucSlot *slot,
+		const gchar *method, int fd, const RaucHashIndex *idx)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_auto(filedesc) read_fd = -1;
+	goffset offset;
+	guint32 count;
+
+	memset(ckpt, 0, sizeof(*ckpt));
+	ckpt->image = image;
+	ckpt->slot = slot;
+	ckpt->method = method;
+	ckpt->fd = fd;
+
+	if (!idx || !slot->data_directory || !r_context()->config->checkpoint_interval)
+		return;
+
+	ckpt->interval = r_context()->config->checkpoint_interval;
+
+	offset = r_slot_get_write_checkpoint(slot, &image->checksum, method);
+	if (!offset)
+		return;
+
+	read_fd = g_open(slot->device, O_RDONLY | O_CLOEXEC, 0);
+	if (read_fd < 0) {
+		int err = errno;
+		g_warning("Failed to open %s to verify data of interrupted write, starting from the beginning: %s",
+				slot->device, g_strerror(err));
+		return;
+	}
+
+	count = offset / R_HASH_INDEX_CHUNK_SIZE;
+	if (!r_hash_index_verify_prefix(idx, read_fd, &count, &ierror)) {
+		g_warning("Failed to verify data of interrupted write, starting from the beginning: %s", ierror->message);
+		return;
+	}
+
+	ckpt->resume = (goffset)count * R_HASH_INDEX_CHUNK_SIZE;
+	if (ckpt->resume)
+		g_message("Resuming interrupted write to %s at offset %"G_GOFFSET_FORMAT " (checkpoint at %"G_GOFFSET_FORMAT ")",
+				slot->device, ckpt->resume, offset);
+}
+
+/* Records that 'image' has been written up to 'offset'. */
+static gboolean write_checkpoint(goffset offset, gpointer data, GError **error)
+{
+	RWriteCheckpoint *ckpt = data;
+	g_autoptr(GError) ierror = NULL;
+
+	/* the checkpoint must never be ahead of the data on disk */
+	if (fsync(ckpt->fd) == -1) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to disk failed: %s", strerror(errno));
+		return FALSE;
+	}
+
+	if (!r_slot_set_write_checkpoint(ckpt->slot, &ckpt->image->checksum, ckpt->method, offset, &ierror))
+		g_warning("Failed to store write checkpoint: %s", ierror->message);
+
+	return TRUE;
+}
+
+/* Opens the block hash index of 'image' if the bundle contains one. */
+static RaucHashIndex *open_image_hash_index(const RaucImage *image)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *index_filename = g_strdup_printf("%s.block-hash-index", image->filename);
+	RaucHashIndex *idx;
+
+	/* avoid building a new index, as this would read the whole image */
+	if (!g_file_test(index_filename, G_FILE_TEST_IS_REGULAR))
+		return NULL;
+
+	idx = r_hash_index_open_image("source_image", image, &ierror);
+	if (!idx)
+		g_debug("Not using block hash index for %s: %s", image->filename, ierror->message);
+
+	return idx;
+}
+
+static gboolean is_regular_fd(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Returns TRUE for regular files and block devices, which (unlike UBI volumes
+ * or MTD character devices) can be written at arbitrary offsets. */
+static gboolean is_plain_fd(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+}
+
+/* Opens the image for a sparse copy. Returns -1 if the image does not contain
+ * any holes (or the file system cannot report them). */
+static int open_sparse_image(const RaucImage *image)
+{
+	int fd;
+	goffset hole;
+
+	fd = g_open(image->filename, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	hole = lseek(fd, 0, SEEK_HOLE);
+	if (hole < 0 || hole >= (goffset)image->checksum.size) {
+		g_close(fd, NULL);
+		return -1;
+	}
+
+	return fd;
+}
+
+static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, gsize len_header_last, RWriteCheckpoint *ckpt, GError **error)
 {
 	GError *ierror = NULL;
 	goffset seeksize;
+	goffset out_pos;
 	g_autoptr(GFile) srcimagefile = NULL;
 	int out_fd = -1;
+	g_auto(filedesc) sparse_fd = -1;
 	g_autofree void *header = NULL;
 	g_autoptr(GInputStream) instream = NULL;
 
 	g_return_val_if_fail(image, FALSE);
 	g_return_val_if_fail(image->checksum.size >= 0, FALSE);
 	g_return_val_if_fail(outstream, FALSE);
+	g_return_val_if_fail(!ckpt || !len_header_last, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	srcimagefile = g_file_new_for_path(image->filename);
@@ -318,13 +465,64 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 		}
 	}
 
-	if (!r_copy_stream_with_progress(instream, G_OUTPUT_STREAM(outstream), image->checksum.size, &ierror)) {
-		g_propagate_prefixed_error(error, ierror,
-				"Failed to copy data: ");
-		return FALSE;
+	if (ckpt && ckpt->resume) {
+		if (!g_seekable_seek(G_SEEKABLE(instream), ckpt->resume, G_SEEK_SET, NULL, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to seek image: ");
+			return FALSE;
+		}
+		if (lseek(out_fd, ckpt->resume, SEEK_SET) == -1) {
+			g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Failed to seek output: %s", strerror(errno));
+			return FALSE;
+		}
 	}
 
-	seeksize = g_seekable_tell(G_SEEKABLE(instream));
+	/* The in-kernel and sparse copies use absolute offsets, so they can
+	 * only be used if the output is positioned at the start of the slot
+	 * (and not behind a skipped header or at a partition offset). */
+	out_pos = lseek(out_fd, 0, SEEK_CUR);
+
+	/* The header is written last, so it cannot be combined with a sparse
+	 * copy or the in-kernel copy. */
+	if (!len_header_last && out_pos == 0 && !(ckpt && ckpt->resume) && is_regular_fd(out_fd)) {
+		/* file-backed slot: share or copy the data in the kernel, which
+		 * also keeps holes on most filesystems */
+		g_auto(filedesc) in_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC, 0);
+
+		if (in_fd < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to open file for reading: %s", g_strerror(err));
+			return FALSE;
+		}
+		if (!r_copy_fd_with_checkpoints(in_fd, out_fd, image->checksum.size,
+				ckpt ? ckpt->interval : 0, write_checkpoint, ckpt, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to copy data: ");
+			return FALSE;
+		}
+		seeksize = image->checksum.size;
+	} else if (!len_header_last && out_pos == (ckpt ? ckpt->resume : 0) && is_plain_fd(out_fd) &&
+	           (sparse_fd = open_sparse_image(image)) >= 0) {
+		g_message("Image %s is sparse, copying data extents only", image->filename);
+		if (!r_copy_sparse_fd_with_checkpoints(sparse_fd, out_fd, image->checksum.size,
+				ckpt ? ckpt->resume : 0, ckpt ? ckpt->interval : 0,
+				write_checkpoint, ckpt, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to copy data: ");
+			return FALSE;
+		}
+		seeksize = image->checksum.size;
+	} else {
+		if (!r_copy_stream_with_checkpoints(instream, G_OUTPUT_STREAM(outstream), image->checksum.size,
+				ckpt ? ckpt->resume : 0, ckpt ? ckpt->interval : 0,
+				write_checkpoint, ckpt, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to copy data: ");
+			return FALSE;
+		}
+		seeksize = g_seekable_tell(G_SEEKABLE(instream));
+	}
 
 	if (seeksize != (goffset)image->checksum.size) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
@@ -358,10 +556,160 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 	}
 
 	/* flush to block device before closing to assure content is written to disk */
+	r_trace_event_begin("io", "fsync");
+	if (fsync(out_fd) == -1) {
+		r_trace_event_end("io", "fsync");
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to disk failed: %s", strerror(errno));
+		return FALSE;
+	}
+	r_trace_event_end("io", "fsync");
+
+	return TRUE;
+}
+
+/* Reads up to 'size' bytes, stopping early only at the end of the file.
+ * Returns the number of bytes read, or -1 on error. */
+static gssize pread_upto(int fd, guint8 *data, gsize size, goffset offset, GError **error)
+{
+	gsize pos = 0;
+
+	while (pos < size) {
+		ssize_t ret = TEMP_FAILURE_RETRY(pread(fd, data + pos, size - pos, offset + pos));
+		if (ret < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to read: %s", g_strerror(err));
+			return -1;
+		} else if (ret == 0) {
+			break;
+		}
+		pos += ret;
+	}
+
+	return pos;
+}
+
+/* Copies the image to out_fd, but writes only those blocks which differ from
+ * the current target content.
+ *
+ * Image and target are read in large requests and each run of consecutive
+ * differing blocks is written with a single request. */
+static gboolean compare_raw_image(RaucImage *image, int out_fd, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) in_fd = -1;
+	g_autofree guint8 *in_buf = NULL;
+	g_autofree guint8 *out_buf = NULL;
+	g_autoptr(RaucStats) stats = NULL;
+	goffset size = image->checksum.size;
+	goffset offset = 0;
+	goffset written = 0;
+	RWriteback wb;
+
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	in_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to open file for reading: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	(void) posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	(void) posix_fadvise(out_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	in_buf = g_malloc(COMPARE_READ_SIZE);
+	out_buf = g_malloc(COMPARE_READ_SIZE);
+	stats = r_stats_new("changed blocks");
+	r_writeback_init(&wb, out_fd, 0, r_context()->config->writeback_window);
+
+	while (offset < size) {
+		gsize len = MIN(COMPARE_READ_SIZE, size - offset);
+		gssize target_len;
+		gsize pos = 0;
+
+		if (!r_pread_exact(in_fd, in_buf, len, offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read image: ");
+			return FALSE;
+		}
+
+		/* data beyond the end of a (file) target always differs */
+		target_len = pread_upto(out_fd, out_buf, len, offset, &ierror);
+		if (target_len < 0) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read target: ");
+			return FALSE;
+		}
+
+		while (pos < len) {
+			gsize start;
+
+			/* skip identical blocks */
+			while (pos < len) {
+				gsize block_len = MIN(COMPARE_BLOCK_SIZE, len - pos);
+
+				if (pos + block_len > (gsize) target_len ||
+				    memcmp(in_buf + pos, out_buf + pos, block_len) != 0)
+					break;
+				r_stats_add(stats, 0);
+				pos += block_len;
+			}
+			/* unchanged data is only read, so don't throttle it */
+			r_writeback_skip(&wb, offset + pos);
+
+			/* collect differing blocks */
+			start = pos;
+			while (pos < len) {
+				gsize block_len = MIN(COMPARE_BLOCK_SIZE, len - pos);
+
+				if (pos + block_len <= (gsize) target_len &&
+				    memcmp(in_buf + pos, out_buf + pos, block_len) == 0)
+					break;
+				r_stats_add(stats, 1);
+				pos += block_len;
+			}
+
+			if (pos == start)
+				continue;
+
+			if (!r_pwrite_exact(out_fd, in_buf + start, pos - start, offset + start, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to write target: ");
+				return FALSE;
+			}
+			written += pos - start;
+
+			if (!r_writeback_update(&wb, offset + pos, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+		}
+
+		offset += len;
+
+		if (!r_writeback_update(&wb, offset, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		/* emit progress info (but only when in progress context) */
+		if (r_context()->progress)
+			r_context_set_step_progress("copy_image", offset, size);
+	}
+
+	g_message("Wrote %"G_GOFFSET_FORMAT " of %"G_GOFFSET_FORMAT " bytes (%"G_GOFFSET_FORMAT " bytes unchanged)",
+			written, size, size - written);
+	r_stats_log_event(stats, "compare stats for");
+
+	/* flush to block device before closing to assure content is written to disk */
+	r_trace_event_begin("io", "fsync");
 	if (fsync(out_fd) == -1) {
+		r_trace_event_end("io", "fsync");
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to disk failed: %s", strerror(errno));
 		return FALSE;
 	}
+	r_trace_event_end("io", "fsync");
 
 	return TRUE;
 }
@@ -407,7 +755,7 @@ static gboolean write_boot_switch_partition(RaucImage *image, const gchar *devic
 		goto out;
 	}
 
-	res = copy_raw_image(image, outstream, len_header_last, &ierror);
+	res = copy_raw_image(image, outstream, len_header_last, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -637,12 +985,47 @@ unmount_out:
 	return res;
 }
 
+static gboolean compare_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) out_fd = -1;
+
+	/* open */
+	g_message("opening slot device %s", slot->device);
+	out_fd = g_open(slot->device, O_RDWR | O_EXCL | O_CLOEXEC);
+	if (out_fd < 0) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Failed to open output file/device %s failed: %s", slot->device, strerror(errno));
+		return FALSE;
+	}
+
+	/* check size */
+	if (!check_image_size(out_fd, image, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	/* copy */
+	g_message("writing changed data to device %s", slot->device);
+	if (!compare_raw_image(image, out_fd, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static gboolean copy_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
 {
 	g_autoptr(GUnixOutputStream) outstream = NULL;
+	g_autoptr(RaucHashIndex) idx = NULL;
+	RWriteCheckpoint ckpt;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 
+	if (slot->write_mode == R_SLOT_WRITE_MODE_COMPARE)
+		return compare_raw_image_to_dev(image, slot, error);
+
 	/* open */
 	g_message("opening slot device %s", slot->device);
 	outstream = r_unix_output_stream_open_device(slot->device, NULL, &ierror);
@@ -659,9 +1042,13 @@ static gboolean copy_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError *
 		goto out;
 	}
 
+	/* a hash index allows resuming an interrupted write */
+	idx = open_image_hash_index(image);
+	write_checkpoint_init(&ckpt, image, slot, "raw", g_unix_output_stream_get_fd(outstream), idx);
+
 	/* copy */
 	g_message("writing data to device %s", slot->device);
-	res = copy_raw_image(image, outstream, 0, &ierror);
+	res = copy_raw_image(image, outstream, 0, &ckpt, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -673,6 +1060,9 @@ static gboolean copy_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError *
 		goto out;
 	}
 
+	if (ckpt.interval)
+		r_slot_clear_write_checkpoint(slot);
+
 out:
 	return res;
 }
@@ -690,6 +1080,10 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	off_t offset = 0;
 	int target_fd = -1;
 	g_autoptr(RaucStats) zero_stats = NULL;
+	RWriteback wb;
+	RWriteCheckpoint ckpt;
+	guint32 first_chunk;
+	goffset next_checkpoint;
 
 	g_return_val_if_fail(image, FALSE);
 	g_return_val_if_fail(slot, FALSE);
@@ -772,10 +1166,22 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 		target_fd = target->data_fd;
 		chunk_hashes = g_bytes_get_data(source->hashes, NULL);
 		chunk_count = source->count;
+
+		/* Continue after the verified part of an interrupted previous write */
+		write_checkpoint_init(&ckpt, image, slot, "block-hash-index", target_fd, source);
+		first_chunk = MIN(ckpt.resume / R_HASH_INDEX_CHUNK_SIZE, chunk_count);
+	}
+
+	/* The chunks before first_chunk are already in place */
+	{
+		RaucHashIndex *target_written = g_ptr_array_index(sources, 0);
+		RaucHashIndex *target_old = g_ptr_array_index(sources, 1);
+		target_written->invalid_from = first_chunk;
+		target_old->invalid_below = first_chunk;
 	}
 
-	/* Ensure we start writing from the beginning */
-	offset = 0;
+	/* Ensure we start writing from the beginning (or resume point) */
+	offset = (off_t)first_chunk * R_HASH_INDEX_CHUNK_SIZE;
 	if (lseek(target_fd, offset, SEEK_SET) != offset) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Failed to seek to start of target slot: %s", g_strerror(errno));
 		res = FALSE;
@@ -785,9 +1191,13 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	/* Temporary data storage */
 	chunk = g_new0(RaucHashIndexChunk, 1);
 
+	r_writeback_init(&wb, target_fd, offset, r_context()->config->writeback_window);
+	next_checkpoint = offset + ckpt.interval;
+
 	/* Iterate over chunks in source image */
-	for (guint32 c = 0; c < chunk_count; c++) {
+	for (guint32 c = first_chunk; c < chunk_count; c++) {
 		gboolean found = FALSE;
+		gboolean chunk_written = FALSE;
 
 		if (memcmp(chunk_hashes[c], R_HASH_INDEX_ZERO_CHUNK, 32) == 0) {
 			/* Generate zero chunk */
@@ -828,7 +1238,15 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 		 * in the correct location, we could skip the write.
 		 */
 		offset = (off_t)c * sizeof(chunk->data);
-		if (!r_pwrite_lazy(target_fd, chunk->data, sizeof(chunk->data), offset, &ierror)) {
+		if (!r_pwrite_lazy(target_fd, chunk->data, sizeof(chunk->data), offset, &chunk_written, &ierror)) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+		if (!chunk_written)
+			r_writeback_skip(&wb, offset + sizeof(chunk->data));
+
+		if (!r_writeback_update(&wb, offset + sizeof(chunk->data), &ierror)) {
 			g_propagate_error(error, ierror);
 			res = FALSE;
 			goto out;
@@ -842,9 +1260,18 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 			target_old->invalid_below = c;
 		}
 
+		if (ckpt.interval && offset + (off_t)sizeof(chunk->data) >= next_checkpoint) {
+			if (!write_checkpoint(offset + sizeof(chunk->data), &ckpt, &ierror)) {
+				g_propagate_error(error, ierror);
+				res = FALSE;
+				goto out;
+			}
+			next_checkpoint += ckpt.interval;
+		}
+
 		/* emit progress info (but only when in progress context) */
 		if (r_context()->progress)
-			r_context_set_step_percentage("copy_image", (c + 1) * 100 / chunk_count);
+			r_context_set_step_progress("copy_image", (c + 1) * sizeof(chunk->data), chunk_count * sizeof(chunk->data));
 	}
 
 	/* Seek after the written data so this behaves similar to the simpler write helpers */
@@ -856,11 +1283,14 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	}
 
 	/* Flush to block device before closing to assure content is written to disk */
+	r_trace_event_begin("io", "fsync");
 	if (fsync(target_fd) == -1) {
+		r_trace_event_end("io", "fsync");
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to slot failed: %s", strerror(errno));
 		res = FALSE;
 		goto out;
 	}
+	r_trace_event_end("io", "fsync");
 
 	/* Write new index to slot data dir. */
 	{
@@ -870,10 +1300,13 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 		}
 	}
 
-	r_stats_show(zero_stats, "access stats for");
+	if (ckpt.interval)
+		r_slot_clear_write_checkpoint(slot);
+
+	r_stats_log_event(zero_stats, "access stats for");
 	for (guint s = 0; s < sources->len; s++) {
 		const RaucHashIndex *source = g_ptr_array_index(sources, s);
-		r_stats_show(source->match_stats, "access stats for");
+		r_stats_log_event(source->match_stats, "access stats for");
 	}
 
 	res = TRUE;
@@ -908,7 +1341,7 @@ static gboolean copy_adaptive_image_to_dev(RaucImage *image, RaucSlot *slot, GEr
 	return FALSE;
 }
 
-static gboolean write_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
+static gboolean write_image_data_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
 {
 	GError *ierror = NULL;
 
@@ -954,6 +1387,50 @@ raw_copy:
 	return TRUE;
 }
 
+static gboolean verify_image_on_dev(RaucImage *image, RaucSlot *slot, GError **error)
+{
+	g_autoptr(RaucHashIndex) idx = NULL;
+
+	/* a hash index allows verifying the chunks in parallel */
+	idx = open_image_hash_index(image);
+
+	return r_verify_written_image(slot->device, &image->checksum, idx, error);
+}
+
+static gboolean write_image_to_dev(RaucImage *image, RaucSlot *slot, img_to_slot_handler handler, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean progress = r_context()->progress != NULL;
+	gboolean res;
+
+	if (!r_update_handler_verifies_write(handler, image, slot))
+		return write_image_data_to_dev(image, slot, error);
+
+	/* The verification happens before any resizing or post-install hooks
+	 * modify the slot contents. */
+	if (progress)
+		r_context_begin_step_weighted("copy_image", "Writing image", 0, 1);
+	res = write_image_data_to_dev(image, slot, &ierror);
+	if (progress)
+		r_context_end_step("copy_image", res);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (progress)
+		r_context_begin_step_weighted_formatted("verify_image", 0, 1, "Verifying image on %s", slot->name);
+	res = verify_image_on_dev(image, slot, &ierror);
+	if (progress)
+		r_context_end_step("verify_image", res);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static gboolean ubifs_format_slot(RaucSlot *dest_slot, GError **error)
 {
 	GError *ierror = NULL;
@@ -1197,6 +1674,7 @@ out:
 	return res;
 }
 
+#if ENABLE_ARCHIVE == 0
 struct suffix_tar_flag {
 	const char *suffix;
 	const char *tar_flag;
@@ -1282,6 +1760,7 @@ static gboolean untar_image(RaucImage *image, gchar *dest, GError **error)
 out:
 	return res;
 }
+#endif
 
 static gboolean unpack_archive(RaucImage *image, gchar *dest, GError **error)
 {
@@ -1290,7 +1769,11 @@ static gboolean unpack_archive(RaucImage *image, gchar *dest, GError **error)
 	else if (g_str_has_suffix(image->filename, ".catar"))
 		return casync_extract_image(image, dest, -1, error);
 	else
+#if ENABLE_ARCHIVE == 1
+		return r_extract_archive(image->filename, dest, R_EXTRACT_FLAGS_NONE, error);
+#else
 		return untar_image(image, dest, error);
+#endif
 }
 
 /**
@@ -1504,7 +1987,7 @@ static gboolean img_to_ubivol_handler(RaucImage *image, RaucSlot *dest_slot, con
 		}
 	} else {
 		/* copy */
-		res = copy_raw_image(image, outstream, 0, &ierror);
+		res = copy_raw_image(image, outstream, 0, NULL, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
@@ -1573,7 +2056,7 @@ static gboolean img_to_ubifs_handler(RaucImage *image, RaucSlot *dest_slot, cons
 		}
 	} else {
 		/* copy */
-		res = copy_raw_image(image, outstream, 0, &ierror);
+		res = copy_raw_image(image, outstream, 0, NULL, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
@@ -1958,7 +2441,7 @@ static gboolean img_to_fs_handler(RaucImage *image, RaucSlot *dest_slot, const g
 	}
 
 	/* copy */
-	if (!write_image_to_dev(image, dest_slot, &ierror)) {
+	if (!write_image_to_dev(image, dest_slot, img_to_fs_handler, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -2259,7 +2742,7 @@ static gboolean img_to_boot_emmc_handler(RaucImage *image, RaucSlot *dest_slot,
 	/* copy */
 	g_message("Copying image to slot device partition %s",
 			part_slot->device);
-	res = copy_raw_image(image, outstream, 0, &ierror);
+	res = copy_raw_image(image, outstream, 0, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2519,7 +3002,7 @@ static gboolean img_to_raw_handler(RaucImage *image, RaucSlot *dest_slot, const
 	}
 
 	/* copy */
-	if (!write_image_to_dev(image, dest_slot, &ierror)) {
+	if (!write_image_to_dev(image, dest_slot, img_to_raw_handler, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -2654,3 +3137,21 @@ img_to_slot_handler get_update_handler(RaucImage *mfimage, RaucSlot *dest_slot,
 out:
 	return handler;
 }
+
+gboolean r_update_handler_verifies_write(img_to_slot_handler handler, const RaucImage *image, const RaucSlot *slot)
+{
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+
+	if (!slot->verify_write)
+		return FALSE;
+
+	if (handler != img_to_raw_handler && handler != img_to_fs_handler)
+		return FALSE;
+
+	/* the checksum of a casync index does not describe the extracted data */
+	if (g_str_has_suffix(image->filename, ".caibx"))
+		return FALSE;
+
+	return TRUE;
+}
@@ -1,15 +1,19 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <gio/gio.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "update_handler.h"
 #include "update_utils.h"
 #include "context.h"
+#include "utils.h"
 
 static GUnixOutputStream* open_unix_output_stream(const gchar *filename, int flags, int mode, int *fd, GError **error)
 {
@@ -85,24 +89,41 @@ GUnixInputStream* r_open_unix_input_stream(const gchar *filename, int *fd, GErro
 	return instream;
 }
 
-gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
-		goffset size, GError **error)
+gboolean r_copy_stream_with_checkpoints(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, goffset done, goffset interval,
+		RCopyCheckpointFunc checkpoint, gpointer data, GError **error)
 {
 	GError *ierror = NULL;
 	gsize out_size = 0;
 	goffset sum_size = 0;
 	gchar buffer[8192];
 	gssize in_size;
+	RWriteback wb;
+	goffset start = -1;
+	goffset next_checkpoint = done + interval;
 
 	g_return_val_if_fail(in_stream, FALSE);
 	g_return_val_if_fail(out_stream, FALSE);
 	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(done >= 0 && done <= size, FALSE);
+	g_return_val_if_fail(interval >= 0, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	/* no-op for zero-sized images */
-	if (size == 0)
+	/* no-op for zero-sized images (or if everything is in place already) */
+	if (size == done)
 		return TRUE;
 
+	/* bound the amount of dirty data when writing to a file or device */
+	if (G_IS_UNIX_OUTPUT_STREAM(out_stream)) {
+		int out_fd = g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(out_stream));
+
+		start = lseek(out_fd, 0, SEEK_CUR);
+		r_writeback_init(&wb, out_fd, start, start >= 0 ? r_context()->config->writeback_window : 0);
+	} else {
+		start = 0;
+		r_writeback_init(&wb, -1, 0, 0);
+	}
+
 	do {
 		gboolean ret;
 
@@ -121,10 +142,546 @@ gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out
 
 		sum_size += out_size;
 
+		if (!r_writeback_update(&wb, start + sum_size, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		if (checkpoint && interval && done + sum_size >= next_checkpoint) {
+			if (!checkpoint(done + sum_size, data, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+			next_checkpoint = done + sum_size + interval;
+		}
+
 		/* emit progress info (but only when in progress context) */
 		if (r_context()->progress)
-			r_context_set_step_percentage("copy_image", sum_size * 100 / size);
+			r_context_set_step_progress("copy_image", done + sum_size, size);
 	} while (out_size);
 
 	return TRUE;
 }
+
+gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, GError **error)
+{
+	return r_copy_stream_with_checkpoints(in_stream, out_stream, size, 0, 0, NULL, NULL, error);
+}
+
+typedef struct {
+	RWriteback wb;
+	goffset size;
+	goffset interval;
+	goffset next_checkpoint;
+	RCopyCheckpointFunc checkpoint;
+	gpointer data;
+} CopyFdData;
+
+static gboolean copy_fd_progress(goffset done, gpointer data, GError **error)
+{
+	CopyFdData *copy = data;
+
+	if (!r_writeback_update(&copy->wb, done, error))
+		return FALSE;
+
+	if (copy->checkpoint && copy->interval && done >= copy->next_checkpoint) {
+		if (!copy->checkpoint(done, copy->data, error))
+			return FALSE;
+		copy->next_checkpoint = done + copy->interval;
+	}
+
+	/* emit progress info (but only when in progress context) */
+	if (r_context()->progress)
+		r_context_set_step_progress("copy_image", done, copy->size);
+
+	return TRUE;
+}
+
+gboolean r_copy_fd_with_checkpoints(int in_fd, int out_fd, goffset size,
+		goffset interval, RCopyCheckpointFunc checkpoint, gpointer data, GError **error)
+{
+	CopyFdData copy = {
+		.size = size,
+		.interval = interval,
+		.next_checkpoint = interval,
+		.checkpoint = checkpoint,
+		.data = data,
+	};
+
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(interval >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	r_writeback_init(&copy.wb, out_fd, 0, r_context()->config->writeback_window);
+
+	return r_copy_fd_with_progress(in_fd, out_fd, size, copy_fd_progress, &copy, error);
+}
+
+#define SPARSE_COPY_BUF_SIZE (1024*1024)
+/* BLKZEROOUT requires ranges aligned to 512 bytes */
+#define SPARSE_ZERO_ALIGN 512
+
+static gboolean write_zeros(int fd, goffset offset, goffset len, GError **error)
+{
+	g_autofree guint8 *zeros = g_malloc0(MIN(len, SPARSE_COPY_BUF_SIZE));
+
+	while (len > 0) {
+		gsize chunk = MIN(len, SPARSE_COPY_BUF_SIZE);
+
+		if (!r_pwrite_exact(fd, zeros, chunk, offset, error))
+			return FALSE;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return TRUE;
+}
+
+/* Zeroes the range [offset, offset+len) of a file or device, avoiding to
+ * write the data where possible. 'written' is set if the complete range had to
+ * be written with zeros instead. */
+static gboolean zero_range(int fd, goffset offset, goffset len, gboolean *written, GError **error)
+{
+	struct stat st;
+
+	*written = FALSE;
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat output: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		goffset start = (offset + SPARSE_ZERO_ALIGN - 1) / SPARSE_ZERO_ALIGN * SPARSE_ZERO_ALIGN;
+		goffset end = (offset + len) / SPARSE_ZERO_ALIGN * SPARSE_ZERO_ALIGN;
+
+		if (end > start) {
+			guint64 range[2] = {start, end - start};
+
+			if (ioctl(fd, BLKZEROOUT, &range) == 0) {
+				/* unaligned head and tail */
+				if (!write_zeros(fd, offset, start - offset, error))
+					return FALSE;
+				return write_zeros(fd, end, offset + len - end, error);
+			}
+			g_debug("BLKZEROOUT failed, writing zeros instead: %s", g_strerror(errno));
+		}
+	} else if (S_ISREG(st.st_mode)) {
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+			/* punching a hole does not extend the file */
+			if (st.st_size < offset + len && ftruncate(fd, offset + len) != 0) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to extend output: %s", g_strerror(err));
+				return FALSE;
+			}
+			return TRUE;
+		}
+		g_debug("Punching hole failed, writing zeros instead: %s", g_strerror(errno));
+	}
+
+	*written = TRUE;
+	return write_zeros(fd, offset, len, error);
+}
+
+/* Returns the start of the next data extent or hole at or after 'offset',
+ * limited to 'size'. */
+static goffset seek_extent(int fd, goffset offset, int whence, goffset size, GError **error)
+{
+	goffset pos = lseek(fd, offset, whence);
+
+	if (pos < 0) {
+		int err = errno;
+		/* no more data after offset */
+		if (err == ENXIO)
+			return size;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to find data extents: %s", g_strerror(err));
+		return -1;
+	}
+
+	return MIN(pos, size);
+}
+
+gboolean r_copy_sparse_fd_with_checkpoints(int in_fd, int out_fd,
+		goffset size, goffset done, goffset interval,
+		RCopyCheckpointFunc checkpoint, gpointer data, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *buf = NULL;
+	RWriteback wb;
+	goffset pos = done;
+	goffset next_checkpoint = done + interval;
+
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(done >= 0 && done <= size, FALSE);
+	g_return_val_if_fail(interval >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	buf = g_malloc(SPARSE_COPY_BUF_SIZE);
+	r_writeback_init(&wb, out_fd, done, r_context()->config->writeback_window);
+
+	while (pos < size) {
+		goffset extent_end;
+		gboolean is_data;
+
+		/* the range up to the next data extent is a hole */
+		extent_end = seek_extent(in_fd, pos, SEEK_DATA, size, &ierror);
+		is_data = extent_end == pos;
+		if (is_data)
+			extent_end = seek_extent(in_fd, pos, SEEK_HOLE, size, &ierror);
+		if (extent_end < 0) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		while (pos < extent_end) {
+			gsize len = is_data ? MIN(SPARSE_COPY_BUF_SIZE, extent_end - pos) : (gsize)(extent_end - pos);
+			gboolean written = TRUE;
+
+			if (is_data) {
+				if (!r_pread_exact(in_fd, buf, len, pos, &ierror) ||
+				    !r_pwrite_exact(out_fd, buf, len, pos, &ierror)) {
+					g_propagate_error(error, ierror);
+					return FALSE;
+				}
+			} else if (!zero_range(out_fd, pos, len, &written, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to zero hole: ");
+				return FALSE;
+			}
+			pos += len;
+
+			/* holes which were not written do not count against the
+			 * write rate limit */
+			if (!written)
+				r_writeback_skip(&wb, pos);
+
+			if (!r_writeback_update(&wb, pos, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+
+			if (checkpoint && interval && pos >= next_checkpoint) {
+				if (!checkpoint(pos, data, &ierror)) {
+					g_propagate_error(error, ierror);
+					return FALSE;
+				}
+				next_checkpoint = pos + interval;
+			}
+
+			/* emit progress info (but only when in progress context) */
+			if (r_context()->progress)
+				r_context_set_step_progress("copy_image", pos, size);
+		}
+	}
+
+	return TRUE;
+}
+
+#define VERIFY_READ_SIZE (1024*1024)
+#define VERIFY_MAX_THREADS 8
+/* number of buffers used for reading ahead when verifying the checksum */
+#define VERIFY_READ_AHEAD 4
+/* O_DIRECT requires aligned buffers, offsets and lengths */
+#define VERIFY_ALIGN 4096
+
+typedef struct {
+	const gchar *device;
+	int fd;
+	gboolean direct;
+	goffset size;
+	const RaucHashIndex *idx;
+	/* index of the next block to read, shared by all threads */
+	gint next_block;
+	gint blocks_done;
+	gint failed;
+	/* first error reported by any thread */
+	GMutex error_lock;
+	GError *error;
+	/* receives one entry for each finished thread */
+	GAsyncQueue *finished;
+	/* buffers for reading ahead (checksum mode) */
+	GAsyncQueue *free_blocks;
+	GAsyncQueue *full_blocks;
+} VerifyData;
+
+typedef struct {
+	guint8 *data;
+	gsize len;
+} VerifyBlock;
+
+static void verify_set_error(VerifyData *verify, GError *ierror)
+{
+	g_mutex_lock(&verify->error_lock);
+	if (!verify->error)
+		verify->error = ierror;
+	else
+		g_error_free(ierror);
+	g_mutex_unlock(&verify->error_lock);
+	g_atomic_int_set(&verify->failed, 1);
+}
+
+/* Reads len bytes at offset. With O_DIRECT, the request is rounded up to the
+ * alignment, as the image size does not need to be aligned. After a short
+ * read, the retry must be aligned as well, so the partially read block is
+ * read again. */
+static gboolean verify_read(VerifyData *verify, guint8 *buf, gsize len, goffset offset, GError **error)
+{
+	gsize req = verify->direct ? (len + VERIFY_ALIGN - 1) / VERIFY_ALIGN * VERIFY_ALIGN : len;
+	gsize done = 0;
+
+	while (done < len) {
+		ssize_t r = pread(verify->fd, buf + done, req - done, offset + done);
+		gsize aligned;
+
+		if (r < 0) {
+			int err = errno;
+			if (err == EINTR)
+				continue;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to read %s at offset %"G_GOFFSET_FORMAT ": %s",
+					verify->device, offset + (goffset)done, g_strerror(err));
+			return FALSE;
+		}
+		if (r == 0) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+					"Failed to read %s at offset %"G_GOFFSET_FORMAT ": unexpected end of device",
+					verify->device, offset + (goffset)done);
+			return FALSE;
+		}
+		if (!verify->direct || done + r >= len) {
+			done += r;
+			continue;
+		}
+
+		aligned = (done + r) / VERIFY_ALIGN * VERIFY_ALIGN;
+		if (aligned == done) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+					"Failed to read %s at offset %"G_GOFFSET_FORMAT ": short read of %"G_GSSIZE_FORMAT " bytes",
+					verify->device, offset + (goffset)done, r);
+			return FALSE;
+		}
+		done = aligned;
+	}
+
+	return TRUE;
+}
+
+static gpointer verify_index_thread(gpointer data)
+{
+	VerifyData *verify = data;
+	void *buf = NULL;
+
+	if (posix_memalign(&buf, VERIFY_ALIGN, VERIFY_READ_SIZE) != 0)
+		g_error("Failed to allocate verification buffer");
+
+	while (!g_atomic_int_get(&verify->failed)) {
+		goffset offset = (goffset)g_atomic_int_add(&verify->next_block, 1) * VERIFY_READ_SIZE;
+		GError *ierror = NULL;
+		guint32 mismatch;
+		gsize len;
+
+		if (offset >= verify->size)
+			break;
+		len = MIN(VERIFY_READ_SIZE, verify->size - offset);
+
+		if (!verify_read(verify, buf, len, offset, &ierror)) {
+			verify_set_error(verify, ierror);
+			break;
+		}
+
+		if (!r_hash_index_check_chunks(verify->idx, offset / R_HASH_INDEX_CHUNK_SIZE, buf,
+				len / R_HASH_INDEX_CHUNK_SIZE, &mismatch)) {
+			verify_set_error(verify, g_error_new(R_UPDATE_ERROR, R_UPDATE_ERROR_VERIFY_FAILED,
+					"Data written to %s differs from image at offset %"G_GOFFSET_FORMAT,
+					verify->device, (goffset)mismatch * R_HASH_INDEX_CHUNK_SIZE));
+			break;
+		}
+
+		g_atomic_int_inc(&verify->blocks_done);
+	}
+
+	free(buf);
+	g_async_queue_push(verify->finished, GINT_TO_POINTER(1));
+
+	return NULL;
+}
+
+static gboolean verify_with_index(VerifyData *verify, GError **error)
+{
+	g_autoptr(GPtrArray) threads = g_ptr_array_new();
+	guint running;
+	gint blocks_total;
+
+	blocks_total = (verify->size + VERIFY_READ_SIZE - 1) / VERIFY_READ_SIZE;
+
+	for (guint i = 0; i < MIN(g_get_num_processors(), VERIFY_MAX_THREADS); i++)
+		g_ptr_array_add(threads, g_thread_new("verify", verify_index_thread, verify));
+
+	running = threads->len;
+	while (running) {
+		if (g_async_queue_timeout_pop(verify->finished, 100 * G_TIME_SPAN_MILLISECOND))
+			running--;
+		if (r_context()->progress && blocks_total)
+			r_context_set_step_progress("verify_image",
+					(guint64)MIN(g_atomic_int_get(&verify->blocks_done), blocks_total) * VERIFY_READ_SIZE,
+					(guint64)blocks_total * VERIFY_READ_SIZE);
+	}
+
+	for (guint i = 0; i < threads->len; i++)
+		g_thread_join(g_ptr_array_index(threads, i));
+
+	if (verify->error) {
+		g_propagate_error(error, g_steal_pointer(&verify->error));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gpointer verify_reader_thread(gpointer data)
+{
+	VerifyData *verify = data;
+	VerifyBlock *block;
+	goffset offset = 0;
+
+	while (offset < verify->size) {
+		GError *ierror = NULL;
+
+		block = g_async_queue_pop(verify->free_blocks);
+		block->len = MIN(VERIFY_READ_SIZE, verify->size - offset);
+
+		if (!verify_read(verify, block->data, block->len, offset, &ierror)) {
+			verify_set_error(verify, ierror);
+			block->len = 0;
+			g_async_queue_push(verify->full_blocks, block);
+			return NULL;
+		}
+		offset += block->len;
+		g_async_queue_push(verify->full_blocks, block);
+	}
+
+	block = g_async_queue_pop(verify->free_blocks);
+	block->len = 0;
+	g_async_queue_push(verify->full_blocks, block);
+
+	return NULL;
+}
+
+static gboolean verify_with_checksum(VerifyData *verify, const RaucChecksum *checksum, GError **error)
+{
+	g_autoptr(GChecksum) ctx = g_checksum_new(checksum->type);
+	VerifyBlock blocks[VERIFY_READ_AHEAD];
+	VerifyBlock *block;
+	GThread *thread;
+	goffset done = 0;
+	gboolean res = FALSE;
+
+	verify->free_blocks = g_async_queue_new();
+	verify->full_blocks = g_async_queue_new();
+
+	for (guint i = 0; i < VERIFY_READ_AHEAD; i++) {
+		if (posix_memalign((void **)&blocks[i].data, VERIFY_ALIGN, VERIFY_READ_SIZE) != 0)
+			g_error("Failed to allocate verification buffer");
+		g_async_queue_push(verify->free_blocks, &blocks[i]);
+	}
+
+	thread = g_thread_new("verify", verify_reader_thread, verify);
+	while ((block = g_async_queue_pop(verify->full_blocks))->len) {
+		g_checksum_update(ctx, block->data, block->len);
+		done += block->len;
+		g_async_queue_push(verify->free_blocks, block);
+
+		if (r_context()->progress)
+			r_context_set_step_progress("verify_image", done, verify->size);
+	}
+	g_thread_join(thread);
+
+	if (verify->error) {
+		g_propagate_error(error, g_steal_pointer(&verify->error));
+		goto out;
+	}
+
+	if (g_strcmp0(checksum->digest, g_checksum_get_string(ctx)) != 0) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_VERIFY_FAILED,
+				"Data written to %s does not match image checksum", verify->device);
+		goto out;
+	}
+
+	res = TRUE;
+out:
+	for (guint i = 0; i < VERIFY_READ_AHEAD; i++)
+		free(blocks[i].data);
+	g_async_queue_unref(verify->free_blocks);
+	g_async_queue_unref(verify->full_blocks);
+	return res;
+}
+
+gboolean r_verify_written_image(const gchar *device, const RaucChecksum *checksum, const RaucHashIndex *idx, GError **error)
+{
+	VerifyData verify = {
+		.device = device,
+		.fd = -1,
+		.idx = idx,
+	};
+	gboolean res;
+
+	g_return_val_if_fail(device, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
+	g_return_val_if_fail(checksum->digest, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	verify.size = checksum->size;
+
+	/* the index can only be used if it covers the whole image */
+	if (idx && (goffset)idx->count * R_HASH_INDEX_CHUNK_SIZE != verify.size) {
+		g_debug("Not using block hash index for verification, as its size does not match the image");
+		verify.idx = NULL;
+	}
+
+	/* Direct reads bypass the page cache, so the data is actually read
+	 * back from the storage. Dirty pages are written back before. */
+	verify.fd = g_open(device, O_RDONLY | O_CLOEXEC | O_DIRECT, 0);
+	if (verify.fd >= 0) {
+		verify.direct = TRUE;
+	} else {
+		g_debug("Failed to open %s with O_DIRECT, falling back to buffered reads: %s", device, g_strerror(errno));
+		verify.fd = g_open(device, O_RDONLY | O_CLOEXEC, 0);
+	}
+	if (verify.fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s for verification: %s", device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!verify.direct) {
+		/* make sure we read from the storage instead of the page cache */
+		if (fdatasync(verify.fd) != 0)
+			g_debug("Failed to sync %s: %s", device, g_strerror(errno));
+		(void) posix_fadvise(verify.fd, 0, verify.size, POSIX_FADV_DONTNEED);
+		(void) posix_fadvise(verify.fd, 0, verify.size, POSIX_FADV_SEQUENTIAL);
+	}
+
+	g_mutex_init(&verify.error_lock);
+	verify.finished = g_async_queue_new();
+
+	g_message("Verifying %s using %s", device, verify.idx ? "block hash index" : "image checksum");
+	if (verify.idx)
+		res = verify_with_index(&verify, error);
+	else
+		res = verify_with_checksum(&verify, checksum, error);
+
+	g_async_queue_unref(verify.finished);
+	g_mutex_clear(&verify.error_lock);
+	g_close(verify.fd, NULL);
+
+	return res;
+}
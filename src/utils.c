@@ -9,8 +9,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "probes.h"
+#include "qos.h"
+#include "trace_event.h"
 #include "utils.h"
 
 GQuark r_utils_error_quark(void)
@@ -39,6 +44,54 @@ GSubprocess *r_subprocess_new(GSubprocessFlags flags, GError **error, const gcha
 	return result;
 }
 
+static void subprocess_trace_launch(GPtrArray *args, const gchar *call)
+{
+	g_autofree gchar *quoted = NULL;
+	g_autofree gchar *trace_args = NULL;
+
+	if (!r_trace_event_enabled())
+		return;
+
+	quoted = r_trace_event_quote(call);
+	trace_args = g_strdup_printf("\"cmd\":%s", quoted);
+	r_trace_event_instant("subprocess", args->pdata[0], trace_args);
+}
+
+GSubprocess *r_subprocess_launcher_spawnv_full(GSubprocessLauncher *launcher, GPtrArray *args,
+		GSpawnChildSetupFunc child_setup, gpointer user_data, GError **error)
+{
+	g_autofree gchar *call = g_strjoinv(" ", (gchar**) args->pdata);
+	RQosChildSetup *qos;
+	GSubprocess *sproc;
+
+	g_log(R_LOG_DOMAIN_SUBPROCESS, G_LOG_LEVEL_DEBUG, "launching subprocess: %s", call);
+	subprocess_trace_launch(args, call);
+
+	/* applying the QoS profile before exec also covers the processes the
+	 * child forks right away; the launcher owns 'qos' afterwards */
+	qos = r_qos_child_setup_new(child_setup, user_data);
+	g_subprocess_launcher_set_child_setup(launcher, r_qos_child_setup, qos, r_qos_child_setup_free);
+
+	sproc = g_subprocess_launcher_spawnv(launcher,
+			(const gchar * const *)args->pdata, error);
+	if (sproc)
+		r_qos_track_subprocess(sproc, qos);
+
+	return sproc;
+}
+
+GSubprocess *r_subprocess_launcher_spawnv(GSubprocessLauncher *launcher, GPtrArray *args, GError **error)
+{
+	return r_subprocess_launcher_spawnv_full(launcher, args, NULL, NULL, error);
+}
+
+GSubprocess *r_subprocess_newv(GPtrArray *args, GSubprocessFlags flags, GError **error)
+{
+	g_autoptr(GSubprocessLauncher) launcher = g_subprocess_launcher_new(flags);
+
+	return r_subprocess_launcher_spawnv(launcher, args, error);
+}
+
 gboolean r_subprocess_runv(GPtrArray *args, GSubprocessFlags flags, GError **error)
 {
 	GError *ierror = NULL;
@@ -52,10 +105,13 @@ gboolean r_subprocess_runv(GPtrArray *args, GSubprocessFlags flags, GError **err
 		return FALSE;
 	}
 
+	r_trace_event_begin("subprocess", args->pdata[0]);
 	if (!g_subprocess_wait_check(sproc, NULL, &ierror)) {
+		r_trace_event_end("subprocess", args->pdata[0]);
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
+	r_trace_event_end("subprocess", args->pdata[0]);
 
 	return TRUE;
 }
@@ -189,19 +245,313 @@ gboolean write_file(const gchar *filename, GBytes *bytes, GError **error)
 gboolean copy_file(const gchar *srcprefix, const gchar *srcfile,
 		const gchar *dstprefix, const gchar *dstfile, GError **error)
 {
-	gboolean res = FALSE;
 	GError *ierror = NULL;
 	g_autofree gchar *srcpath = g_build_filename(srcprefix, srcfile, NULL);
 	g_autofree gchar *dstpath = g_build_filename(dstprefix, dstfile, NULL);
-	g_autoptr(GFile) src = g_file_new_for_path(srcpath);
-	g_autoptr(GFile) dst = g_file_new_for_path(dstpath);
+	g_auto(filedesc) infd = -1;
+	g_auto(filedesc) outfd = -1;
+	struct stat st;
 
-	res = g_file_copy(src, dst, G_FILE_COPY_NONE, NULL, NULL, NULL,
-			&ierror);
-	if (!res)
-		g_propagate_error(error, ierror);
+	infd = g_open(srcpath, O_RDONLY | O_CLOEXEC, 0);
+	if (infd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", srcpath, g_strerror(err));
+		return FALSE;
+	}
 
-	return res;
+	if (fstat(infd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", srcpath, g_strerror(err));
+		return FALSE;
+	}
+
+	/* like g_file_copy(), refuse to overwrite and keep the permissions */
+	outfd = g_open(dstpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	if (outfd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create %s: %s", dstpath, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!r_copy_fd(infd, outfd, st.st_size, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to copy %s to %s: ", srcpath, dstpath);
+		g_unlink(dstpath);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_reflink_fd(int infd, int outfd, goffset size, GError **error)
+{
+	g_return_val_if_fail(infd >= 0, FALSE);
+	g_return_val_if_fail(outfd >= 0, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (ioctl(outfd, FICLONE, infd) != 0) {
+		int err = errno;
+		if (err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL || err == EPERM)
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+					"Reflink not supported: %s", g_strerror(err));
+		else
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to reflink file: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	if (ftruncate(outfd, size) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to truncate file: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#define COPY_FD_BUF_SIZE (1024*1024)
+/* maximum size of a single in-kernel copy request, so that progress can be
+ * reported in between */
+#define COPY_FD_CHUNK_SIZE (16*1024*1024)
+
+/* Clones the range [0, size) of infd into an existing file, keeping the
+ * data of outfd beyond 'size'. */
+static gboolean reflink_range_fd(int infd, int outfd, goffset size, GError **error)
+{
+	struct file_clone_range range = {
+		.src_fd = infd,
+		.src_offset = 0,
+		.src_length = size,
+		.dest_offset = 0,
+	};
+
+	if (ioctl(outfd, FICLONERANGE, &range) != 0) {
+		int err = errno;
+		/* EINVAL is also returned for unaligned ranges */
+		if (err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL || err == EPERM || err == EISDIR)
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+					"Reflink not supported: %s", g_strerror(err));
+		else
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to reflink file: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Reports progress and returns FALSE if the callback aborted the copy. */
+static gboolean copy_fd_progress(RCopyFdProgressFunc progress, goffset done, gpointer data, GError **error)
+{
+	if (!progress)
+		return TRUE;
+
+	return progress(done, data, error);
+}
+
+gboolean r_copy_fd_with_progress(int infd, int outfd, goffset size, RCopyFdProgressFunc progress, gpointer data, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *buf = NULL;
+	goffset done = 0;
+	struct stat st;
+
+	g_return_val_if_fail(infd >= 0, FALSE);
+	g_return_val_if_fail(outfd >= 0, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* 1. share the data (only for regular files) */
+	if (fstat(outfd, &st) == 0 && S_ISREG(st.st_mode)) {
+		gboolean res;
+
+		/* an empty file can simply be replaced by the clone, otherwise
+		 * the data after 'size' must be kept */
+		if (st.st_size == 0)
+			res = r_reflink_fd(infd, outfd, size, &ierror);
+		else
+			res = reflink_range_fd(infd, outfd, size, &ierror);
+		if (res)
+			return copy_fd_progress(progress, size, data, error);
+		if (!g_error_matches(ierror, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_clear_error(&ierror);
+	}
+
+	/* 2. copy in the kernel, possibly sharing data or offloading the copy */
+	while (done < size) {
+		loff_t inoff = done;
+		loff_t outoff = done;
+		ssize_t r = copy_file_range(infd, &inoff, outfd, &outoff, MIN(COPY_FD_CHUNK_SIZE, size - done), 0);
+		if (r < 0) {
+			int err = errno;
+			if (err == EINTR)
+				continue;
+			/* not supported for these files, use the fallback below */
+			if (done == 0 && (err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EINVAL || err == EBADF))
+				break;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to copy file: %s", g_strerror(err));
+			return FALSE;
+		}
+		if (r == 0) {
+			/* some file systems report 0 instead of an error, so
+			 * fall back if nothing was copied yet */
+			if (done == 0)
+				break;
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"Failed to copy file: unexpected end of file");
+			return FALSE;
+		}
+		done += r;
+		if (!copy_fd_progress(progress, done, data, error))
+			return FALSE;
+	}
+	if (done == size)
+		return TRUE;
+
+	/* 3. copy in the kernel without a user space buffer, which also works
+	 * across file systems and to block devices */
+	if (lseek(outfd, done, SEEK_SET) == done) {
+		while (done < size) {
+			off_t inoff = done;
+			ssize_t r = sendfile(outfd, infd, &inoff, MIN(COPY_FD_CHUNK_SIZE, size - done));
+			if (r < 0) {
+				int err = errno;
+				if (err == EINTR)
+					continue;
+				/* not supported for these files, use the fallback below */
+				if (done == 0 && (err == ENOSYS || err == EINVAL))
+					break;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to copy file: %s", g_strerror(err));
+				return FALSE;
+			}
+			if (r == 0) {
+				g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+						"Failed to copy file: unexpected end of file");
+				return FALSE;
+			}
+			done += r;
+			if (!copy_fd_progress(progress, done, data, error))
+				return FALSE;
+		}
+		if (done == size)
+			return TRUE;
+	}
+
+	/* 4. copy through user space */
+	buf = g_malloc(COPY_FD_BUF_SIZE);
+	while (done < size) {
+		gsize len = MIN(COPY_FD_BUF_SIZE, size - done);
+
+		if (!r_pread_exact(infd, buf, len, done, error))
+			return FALSE;
+		if (!r_pwrite_exact(outfd, buf, len, done, error))
+			return FALSE;
+		done += len;
+		if (!copy_fd_progress(progress, done, data, error))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_copy_fd(int infd, int outfd, goffset size, GError **error)
+{
+	return r_copy_fd_with_progress(infd, outfd, size, NULL, NULL, error);
+}
+
+typedef struct {
+	RJobFunc func;
+	gpointer data;
+	gint *failed;
+	GError *error;
+} RJob;
+
+static void run_job(gpointer data, gpointer user_data)
+{
+	RJob *job = data;
+
+	/* skip remaining jobs after a failure */
+	if (g_atomic_int_get(job->failed))
+		return;
+
+	if (!job->func(job->data, &job->error)) {
+		/* jobs must set an error on failure */
+		if (!job->error)
+			g_set_error(&job->error, R_UTILS_ERROR, R_UTILS_ERROR_FAILED, "Job failed");
+		g_atomic_int_set(job->failed, 1);
+	}
+}
+
+gboolean r_run_jobs(GPtrArray *jobs, RJobFunc func, guint max_jobs, GError **error)
+{
+	GError *ierror = NULL;
+	GThreadPool *pool = NULL;
+	g_autofree RJob *state = NULL;
+	gint failed = 0;
+	gboolean reported = FALSE;
+
+	g_return_val_if_fail(jobs, FALSE);
+	g_return_val_if_fail(func, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (max_jobs == 0)
+		max_jobs = g_get_num_processors();
+	max_jobs = MIN(max_jobs, jobs->len);
+
+	state = g_new0(RJob, jobs->len);
+	for (guint i = 0; i < jobs->len; i++) {
+		state[i].func = func;
+		state[i].data = g_ptr_array_index(jobs, i);
+		state[i].failed = &failed;
+	}
+
+	if (max_jobs <= 1) {
+		for (guint i = 0; i < jobs->len; i++)
+			run_job(&state[i], NULL);
+	} else {
+		g_debug("Running %u jobs with up to %u threads", jobs->len, max_jobs);
+
+		pool = g_thread_pool_new(run_job, NULL, max_jobs, TRUE, &ierror);
+		if (!pool) {
+			g_propagate_prefixed_error(error, ierror, "Failed to create thread pool: ");
+			return FALSE;
+		}
+
+		for (guint i = 0; i < jobs->len; i++) {
+			if (!g_thread_pool_push(pool, &state[i], &ierror)) {
+				g_atomic_int_set(&failed, 1);
+				state[i].error = g_steal_pointer(&ierror);
+				break;
+			}
+		}
+
+		/* wait for all queued jobs to finish */
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+
+	/* report the first error in job order */
+	for (guint i = 0; i < jobs->len; i++) {
+		if (!state[i].error)
+			continue;
+
+		if (!reported) {
+			g_propagate_error(error, g_steal_pointer(&state[i].error));
+			reported = TRUE;
+		} else {
+			g_clear_error(&state[i].error);
+		}
+	}
+
+	return !failed;
 }
 
 static int rm_tree_cb(const char *fpath, const struct stat *sb,
@@ -667,7 +1017,7 @@ gboolean r_pwrite_exact(const int fd, const guint8 *data, size_t size, off_t off
 	return TRUE;
 }
 
-gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offset, GError **error)
+gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offset, gboolean *written, GError **error)
 {
 	g_autofree guint8 *read_data = g_malloc(size);
 	GError *ierror = NULL;
@@ -677,11 +1027,88 @@ gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offs
 		return FALSE;
 	}
 
+	if (written)
+		*written = FALSE;
+
 	if (memcmp(data, read_data, size) == 0) {
+		R_PROBE2(chunk_skip, offset, size);
+		return TRUE;
+	}
+
+	R_PROBE2(chunk_write, offset, size);
+	if (!r_pwrite_exact(fd, data, size, offset, error))
+		return FALSE;
+
+	if (written)
+		*written = TRUE;
+
+	return TRUE;
+}
+
+void r_writeback_init(RWriteback *wb, int fd, goffset offset, goffset window)
+{
+	g_return_if_fail(wb);
+
+	wb->fd = fd;
+	wb->window = window;
+	wb->start = offset;
+	wb->done = offset;
+	wb->end = offset;
+}
+
+gboolean r_writeback_update(RWriteback *wb, goffset end, GError **error)
+{
+	g_return_val_if_fail(wb, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* apply the write rate limit of the current QoS profile */
+	if (end > wb->end) {
+		r_qos_throttle_write(end - wb->end);
+		wb->end = end;
+	}
+
+	if (wb->window <= 0)
 		return TRUE;
+
+	while (end - wb->start >= wb->window) {
+		/* start writeback of the window which was just filled */
+		if (sync_file_range(wb->fd, wb->start, wb->window, SYNC_FILE_RANGE_WRITE) != 0) {
+			int err = errno;
+			if (err == EINVAL || err == ESPIPE || err == ENOSYS) {
+				g_debug("Disabling bounded writeback: %s", g_strerror(err));
+				wb->window = 0;
+				return TRUE;
+			}
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to start writeback: %s", g_strerror(err));
+			return FALSE;
+		}
+
+		/* wait for the previous window and drop it from the page cache */
+		if (wb->start > wb->done) {
+			if (sync_file_range(wb->fd, wb->done, wb->start - wb->done,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to wait for writeback: %s", g_strerror(err));
+				return FALSE;
+			}
+			(void) posix_fadvise(wb->fd, wb->done, wb->start - wb->done, POSIX_FADV_DONTNEED);
+			wb->done = wb->start;
+		}
+
+		wb->start += wb->window;
 	}
 
-	return r_pwrite_exact(fd, data, size, offset, error);
+	return TRUE;
+}
+
+void r_writeback_skip(RWriteback *wb, goffset end)
+{
+	g_return_if_fail(wb);
+
+	if (end > wb->end)
+		wb->end = end;
 }
 
 guint get_sectorsize(gint fd)
@@ -810,14 +1237,17 @@ gboolean r_syncfs(const gchar *path, GError **error)
 		return FALSE;
 	}
 
+	r_trace_event_begin("io", "syncfs");
 	if (syncfs(fd) == -1) {
 		int err = errno;
+		r_trace_event_end("io", "syncfs");
 		g_set_error(error,
 				G_FILE_ERROR,
 				g_file_error_from_errno(err),
 				"Failed to sync filesystem for %s: %s", path, g_strerror(err));
 		return FALSE;
 	}
+	r_trace_event_end("io", "syncfs");
 
 	return TRUE;
 }
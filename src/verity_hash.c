@@ -31,6 +31,7 @@
 #include <openssl/evp.h>
 #include <openssl/objects.h>
 
+#include "probes.h"
 #include "verity_hash.h"
 
 #define VERITY_MAX_LEVELS	63
@@ -185,6 +186,7 @@ static int create_or_verify(FILE *rd, FILE *wr,
 	size_t digest_size_full = 1 << get_bits_up(digest_size);
 	uint64_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
 	uint64_t seek_rd, seek_wr;
+	uint64_t block = data_block;
 	size_t left_bytes;
 	unsigned i;
 	int r;
@@ -231,10 +233,12 @@ static int create_or_verify(FILE *rd, FILE *wr,
 					return -EIO;
 				}
 				if (memcmp(read_digest, calculated_digest, digest_size)) {
+					R_PROBE2(verity_block, block, FALSE);
 					g_message("Verification failed at position %" PRIu64 ".",
 							ftello(rd) - data_block_size);
 					return -EPERM;
 				}
+				R_PROBE2(verity_block, block, TRUE);
 			} else {
 				if (fwrite(calculated_digest, digest_size, 1, wr) != 1) {
 					g_debug("Cannot write digest to hash device.");
@@ -254,6 +258,7 @@ static int create_or_verify(FILE *rd, FILE *wr,
 				}
 				left_bytes -= digest_size_full;
 			}
+			block++;
 		}
 		if (wr && left_bytes) {
 			if (verify) {
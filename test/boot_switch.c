@@ -1,4 +1,6 @@
+#include <fcntl.h>
 #include <locale.h>
+#include <unistd.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
@@ -22,6 +24,7 @@ typedef enum {
 	BOOT_SWITCH_GPT           = BIT(2),
 	BOOT_SWITCH_WRITE_FIRST   = BIT(3),
 	BOOT_SWITCH_WRITE_SECOND  = BIT(4),
+	BOOT_SWITCH_SPARSE_IMAGE  = BIT(5),
 } BootSwitchTestParams;
 
 typedef struct {
@@ -316,8 +319,16 @@ static void test_boot_switch(BootSwitchFixture *fixture,
 	image->checksum.size = IMAGE_SIZE;
 	image->checksum.digest = g_strdup("0xdeadbeef");
 
-	g_assert(test_prepare_dummy_file(fixture->tmpdir, imagename,
-			IMAGE_SIZE, "/dev/zero") == 0);
+	if (data->params & BOOT_SWITCH_SPARSE_IMAGE) {
+		/* only the marker will be a data extent */
+		int fd = g_open(imagepath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		g_assert_cmpint(fd, >=, 0);
+		g_assert_cmpint(ftruncate(fd, IMAGE_SIZE), ==, 0);
+		g_assert_true(g_close(fd, NULL));
+	} else {
+		g_assert(test_prepare_dummy_file(fixture->tmpdir, imagename,
+				IMAGE_SIZE, "/dev/zero") == 0);
+	}
 
 	/* create marker in source image */
 	marker = M_IMAGE_START;
@@ -515,6 +526,62 @@ int main(int argc, char *argv[])
 			test_boot_switch,
 			boot_switch_fixture_tear_down);
 
+	/* a sparse image must be written to the partition, not the start of
+	 * the device */
+	data = &(BootSwitchData) {
+		.params = BOOT_SWITCH_MBR | BOOT_SWITCH_WRITE_FIRST | BOOT_SWITCH_SPARSE_IMAGE,
+		.err_domain = 0, .err_code = 0,
+		.slottype = "boot-mbr-switch",
+		.sfdisk_setup =
+			"label: dos\n"
+			"label-id: 0x8b9e754a\n"
+			"unit: sectors\n"
+			"\n"
+			"start=        8192, size=        6144, type=ef, bootable\n"
+			"start=       14336, size=       65536, type=83\n"
+			"start=       79872, size=           1, type=5\n"
+			"start=       81920, size=       49152, type=82\n"
+		,
+		.sfdisk_expect = R_QUOTE({
+			/* *INDENT-OFF* */
+			"partitiontable" : {
+				"label" : "dos",
+				"id" : "0x8b9e754a",
+				"unit" : "sectors",
+				"partitions" : [
+				{
+					"start" : 2048,
+					"size" : 6144,
+					"type" : "ef",
+					"bootable" : true
+				},
+				{
+					"start" : 14336,
+					"size" : 65536,
+					"type" : "83"
+				},
+				{
+					"start" : 79872,
+					"size" : 1,
+					"type" : "5"
+				},
+				{
+					"start" : 81920,
+					"size" : 49152,
+					"type" : "82"
+				}
+				]
+			}
+			/* *INDENT-ON* */
+		}),
+	};
+	g_test_add("/boot_switch/mbr/sparse-image",
+			BootSwitchFixture,
+			data,
+			boot_switch_fixture_set_up,
+			test_boot_switch,
+			boot_switch_fixture_tear_down);
+
 #if ENABLE_GPT == 1
 	data = &(BootSwitchData) {
 		.params = BOOT_SWITCH_GPT | BOOT_SWITCH_WRITE_SECOND,
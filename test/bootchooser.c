@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <string.h>
 #include <locale.h>
 #include <glib.h>
 
 #include <bootchooser.h>
 #include <context.h>
+#include <uboot_env.h>
 #include <utils.h>
 
 #include "common.h"
@@ -40,6 +42,7 @@ static void bootchooser_barebox(BootchooserFixture *fixture,
 {
 	RaucSlot *rootfs0 = NULL, *rootfs1 = NULL, *primary = NULL;
 	gboolean good;
+	g_autoptr(GError) error = NULL;
 
 	const gchar *cfg_file = "\
 [system]\n\
@@ -187,6 +190,44 @@ bootstate.system1.remaining_attempts=3\n\
 bootstate.system1.priority=20\n\
 ", TRUE));
 	g_assert_true(r_boot_set_primary(rootfs1, NULL));
+
+	/* check the state of all slots is read only once within a query */
+	g_assert_true(g_setenv("BAREBOX_STATE_VARS_PRE", " \
+bootstate.system0.remaining_attempts=3\n\
+bootstate.system0.priority=20\n\
+bootstate.system1.remaining_attempts=3\n\
+bootstate.system1.priority=10\n\
+", TRUE));
+	r_boot_query_begin();
+	g_assert_true(r_boot_get_state(rootfs0, &good, NULL));
+	g_assert_true(good);
+	/* changes made outside of rauc are not seen until the query ends */
+	g_assert_true(g_setenv("BAREBOX_STATE_VARS_PRE", " \
+bootstate.system0.remaining_attempts=0\n\
+bootstate.system0.priority=20\n\
+bootstate.system1.remaining_attempts=3\n\
+bootstate.system1.priority=10\n\
+", TRUE));
+	g_assert_true(r_boot_get_state(rootfs1, &good, NULL));
+	g_assert_true(good);
+	primary = r_boot_get_primary(NULL);
+	g_assert(primary == rootfs0);
+	r_boot_query_end();
+	primary = r_boot_get_primary(NULL);
+	g_assert(primary == rootfs1);
+
+	/* a slot with missing variables does not affect the other slots */
+	g_assert_true(g_setenv("BAREBOX_STATE_VARS_PRE", " \
+bootstate.system0.remaining_attempts=3\n\
+bootstate.system0.priority=20\n\
+", TRUE));
+	r_boot_query_begin();
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_no_error(error);
+	g_assert_true(good);
+	g_assert_false(r_boot_get_state(rootfs1, &good, &error));
+	g_assert_error(error, R_BOOTCHOOSER_ERROR, R_BOOTCHOOSER_ERROR_PARSE_FAILED);
+	r_boot_query_end();
 }
 
 static void bootchooser_barebox_asymmetric(BootchooserFixture *fixture,
@@ -337,7 +378,7 @@ bootstate.system1.priority=10\n\
 	g_assert_true(res);
 }
 
-/* Write content to state storage for grub-editenv RAUC mock tool.
+/* Write a GRUB environment block with the given variables.
  * Content should be similar to:
  * "\
  * A_TRY=1\n\
@@ -349,21 +390,37 @@ bootstate.system1.priority=10\n\
  */
 static void test_grub_initialize_state(const gchar *vars)
 {
-	g_assert_true(g_file_set_contents(r_context()->config->grubenv_path, vars, -1, NULL));
+	g_autoptr(GString) block = g_string_new("# GRUB Environment Block\n");
+
+	g_string_append(block, vars);
+	g_assert_cmpuint(block->len, <=, 1024);
+	while (block->len < 1024)
+		g_string_append_c(block, '#');
+
+	g_assert_true(g_file_set_contents(r_context()->config->grubenv_path, block->str, block->len, NULL));
 }
 
 /**
- * Returns TRUE if mock tools state content equals desired content,
- * FALSE otherwise
+ * Returns TRUE if the variables in the GRUB environment block equal the
+ * desired content, FALSE otherwise
  */
 static gboolean test_grub_post_state(const gchar *compare)
 {
 	g_autofree gchar *contents = NULL;
+	gsize len;
+	gchar *vars;
 
-	g_assert_true(g_file_get_contents(r_context()->config->grubenv_path, &contents, NULL, NULL));
+	g_assert_true(g_file_get_contents(r_context()->config->grubenv_path, &contents, &len, NULL));
+	g_assert_cmpuint(len, ==, 1024);
+	g_assert_true(g_str_has_prefix(contents, "# GRUB Environment Block\n"));
 
-	if (g_strcmp0(contents, compare) != 0) {
-		g_print("Error: '%s' and '%s' differ\n", contents, compare);
+	/* strip header and padding */
+	vars = contents + strlen("# GRUB Environment Block\n");
+	while (len > 0 && contents[len - 1] == '#')
+		contents[--len] = '\0';
+
+	if (g_strcmp0(vars, compare) != 0) {
+		g_print("Error: '%s' and '%s' differ\n", vars, compare);
 		return FALSE;
 	}
 
@@ -762,6 +819,80 @@ BOOT_B_LEFT=3\n\
 "));
 }
 
+static void bootchooser_uboot_native(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *rootfs0 = NULL;
+	RaucSlot *rootfs1 = NULL;
+	gboolean good;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autofree gchar *envpath = NULL;
+	g_autofree gchar *fwconfig = NULL;
+	g_autofree gchar *fwconfig_contents = NULL;
+	/* CRC of the variables padded with zeros to 0x100 - 4 bytes */
+	const gchar vars[] = "BOOT_ORDER=A B\0BOOT_A_LEFT=3\0BOOT_B_LEFT=3\0";
+	guint32 crc = GUINT32_TO_LE(0x186a9c2b);
+	guint8 buf[0x100] = {0};
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=uboot\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=A\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=B\n";
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "uboot.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_name(r_context()->config, "rootfs.0");
+	g_assert_nonnull(rootfs0);
+	rootfs1 = find_config_slot_by_name(r_context()->config, "rootfs.1");
+	g_assert_nonnull(rootfs1);
+
+	/* environment in a file instead of the host's /etc/fw_env.config */
+	memcpy(buf, &crc, sizeof(crc));
+	memcpy(buf + sizeof(crc), vars, sizeof(vars));
+	envpath = g_build_filename(fixture->tmpdir, "uboot.env", NULL);
+	g_assert_true(g_file_set_contents(envpath, (gchar *) buf, sizeof(buf), NULL));
+	fwconfig_contents = g_strdup_printf("%s 0x0 0x%zx\n", envpath, sizeof(buf));
+	fwconfig = write_tmp_file(fixture->tmpdir, "fw_env.config", fwconfig_contents, NULL);
+	g_assert_nonnull(fwconfig);
+	g_assert_true(g_setenv("RAUC_TEST_FW_ENV_CONFIG", fwconfig, TRUE));
+
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_no_error(error);
+	g_assert_true(good);
+
+	/* check rootfs.1 is marked primary in the environment file */
+	g_assert_true(r_boot_set_primary(rootfs1, &error));
+	g_assert_no_error(error);
+
+	env = r_uboot_env_open(fwconfig, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER"), ==, "B A");
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_A_LEFT"), ==, "3");
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_B_LEFT"), ==, "3");
+
+	g_assert_true(g_setenv("RAUC_TEST_FW_ENV_CONFIG", "test/_MISSING_fw_env.config", TRUE));
+}
+
 static void bootchooser_uboot_asymmetric(BootchooserFixture *fixture,
 		gconstpointer user_data)
 {
@@ -917,6 +1048,7 @@ static void bootchooser_efi(BootchooserFixture *fixture,
 	RaucSlot *slot;
 	gboolean good;
 	RaucSlot *primary = NULL;
+	g_autofree gchar *efivars = NULL;
 
 	const gchar *cfg_file = "\
 [system]\n\
@@ -946,6 +1078,10 @@ bootname=system1\n";
 	gchar* pathname = write_tmp_file(fixture->tmpdir, "efi.conf", cfg_file, NULL);
 	g_assert_nonnull(pathname);
 
+	/* without efivarfs, the efibootmgr mock tool is used */
+	efivars = g_build_filename(fixture->tmpdir, "no-efivars", NULL);
+	g_assert_true(g_setenv("RAUC_TEST_EFIVARS_DIR", efivars, TRUE));
+
 	g_clear_pointer(&r_context_conf()->configpath, g_free);
 	r_context_conf()->configpath = pathname;
 	r_context();
@@ -965,6 +1101,222 @@ bootname=system1\n";
 	g_assert_nonnull(slot);
 
 	g_assert_true(r_boot_set_primary(slot, NULL));
+
+	g_unsetenv("RAUC_TEST_EFIVARS_DIR");
+}
+
+/* Writes an EFI global variable (attributes followed by data) to a fake
+ * efivarfs directory. */
+static void test_efivars_write(const gchar *dir, const gchar *name, const guint8 *data, gsize len)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/%s-8be4df61-93ca-11d2-aa0d-00e098032b8c", dir, name);
+	g_autoptr(GByteArray) buf = g_byte_array_new();
+	const guint8 attributes[] = {0x07, 0x00, 0x00, 0x00};
+
+	g_byte_array_append(buf, attributes, sizeof(attributes));
+	g_byte_array_append(buf, data, len);
+	g_assert_true(g_file_set_contents(path, (gchar *) buf->data, buf->len, NULL));
+}
+
+/* Writes a Boot#### load option with the given description and an empty
+ * device path. */
+static void test_efivars_write_load_option(const gchar *dir, guint16 num, const gchar *description, gboolean active)
+{
+	g_autofree gchar *name = g_strdup_printf("Boot%04X", num);
+	g_autoptr(GByteArray) buf = g_byte_array_new();
+	const guint8 header[] = {active ? 0x01 : 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	const guint8 nul[] = {0x00, 0x00};
+
+	g_byte_array_append(buf, header, sizeof(header));
+	for (const gchar *c = description; *c; c++) {
+		const guint8 ucs2[] = {*c, 0x00};
+		g_byte_array_append(buf, ucs2, sizeof(ucs2));
+	}
+	g_byte_array_append(buf, nul, sizeof(nul));
+
+	test_efivars_write(dir, name, buf->data, buf->len);
+}
+
+/* Returns TRUE if the variable contains the given data. */
+static gboolean test_efivars_check(const gchar *dir, const gchar *name, const guint8 *data, gsize len)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/%s-8be4df61-93ca-11d2-aa0d-00e098032b8c", dir, name);
+	g_autofree gchar *contents = NULL;
+	gsize size;
+
+	if (!g_file_get_contents(path, &contents, &size, NULL))
+		return FALSE;
+
+	return size == len + 4 && memcmp(contents + 4, data, len) == 0;
+}
+
+static void bootchooser_efivars(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *rootfs0, *rootfs1;
+	RaucSlot *primary = NULL;
+	gboolean good;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *efivars = NULL;
+	const guint8 bootorder[] = {0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x00, 0x00};
+	const guint8 bootorder_bad[] = {0x02, 0x00, 0x03, 0x00, 0x00, 0x00};
+	const guint8 bootcurrent[] = {0x02, 0x00};
+	const guint8 bootnext[] = {0x02, 0x00};
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=efi\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rescue.0]\n\
+device=/dev/mtd4\n\
+type=raw\n\
+bootname=recover\n\
+readonly=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=system1\n";
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "efi.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	/* same entries as provided by the efibootmgr mock tool */
+	efivars = g_build_filename(fixture->tmpdir, "efivars", NULL);
+	g_assert_cmpint(g_mkdir(efivars, 0755), ==, 0);
+	test_efivars_write(efivars, "BootOrder", bootorder, sizeof(bootorder));
+	test_efivars_write(efivars, "BootCurrent", bootcurrent, sizeof(bootcurrent));
+	test_efivars_write_load_option(efivars, 0x0000, "invalid", TRUE);
+	test_efivars_write_load_option(efivars, 0x0001, "system0", TRUE);
+	test_efivars_write_load_option(efivars, 0x0002, "system1", TRUE);
+	test_efivars_write_load_option(efivars, 0x0003, "recovery", FALSE);
+	g_assert_true(g_setenv("RAUC_TEST_EFIVARS_DIR", efivars, TRUE));
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_name(r_context()->config, "rootfs.0");
+	g_assert_nonnull(rootfs0);
+	rootfs1 = find_config_slot_by_name(r_context()->config, "rootfs.1");
+	g_assert_nonnull(rootfs1);
+
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_no_error(error);
+	g_assert_true(good);
+	primary = r_boot_get_primary(&error);
+	g_assert_no_error(error);
+	g_assert(primary == rootfs0);
+
+	/* marking bad removes the entry from BootOrder */
+	g_assert_true(r_boot_set_state(rootfs0, FALSE, &error));
+	g_assert_no_error(error);
+	g_assert_true(test_efivars_check(efivars, "BootOrder", bootorder_bad, sizeof(bootorder_bad)));
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_false(good);
+	primary = r_boot_get_primary(&error);
+	g_assert_no_error(error);
+	g_assert(primary == rootfs1);
+
+	/* marking good prepends it again */
+	g_assert_true(r_boot_set_state(rootfs0, TRUE, &error));
+	g_assert_no_error(error);
+	g_assert_true(test_efivars_check(efivars, "BootOrder", bootorder, sizeof(bootorder)));
+
+	/* with efi-use-bootnext (default), only BootNext is set */
+	g_assert_true(r_boot_set_primary(rootfs1, &error));
+	g_assert_no_error(error);
+	g_assert_true(test_efivars_check(efivars, "BootNext", bootnext, sizeof(bootnext)));
+	g_assert_true(test_efivars_check(efivars, "BootOrder", bootorder, sizeof(bootorder)));
+	primary = r_boot_get_primary(&error);
+	g_assert_no_error(error);
+	g_assert(primary == rootfs1);
+
+	/* queries share one read of the variables */
+	r_boot_query_begin();
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_true(good);
+	test_efivars_write(efivars, "BootOrder", bootorder_bad, sizeof(bootorder_bad));
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_true(good);
+	r_boot_query_end();
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_false(good);
+
+	g_unsetenv("RAUC_TEST_EFIVARS_DIR");
+}
+
+/* A missing BootOrder is treated as empty and created when written */
+static void bootchooser_efivars_no_bootorder(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *rootfs0;
+	gboolean good;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *efivars = NULL;
+	g_autofree gchar *bootorder_path = NULL;
+	const guint8 bootorder[] = {0x01, 0x00};
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=efi\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=system1\n";
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "efi.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	efivars = g_build_filename(fixture->tmpdir, "efivars", NULL);
+	g_assert_cmpint(g_mkdir(efivars, 0755), ==, 0);
+	test_efivars_write_load_option(efivars, 0x0001, "system0", TRUE);
+	test_efivars_write_load_option(efivars, 0x0002, "system1", TRUE);
+	g_assert_true(g_setenv("RAUC_TEST_EFIVARS_DIR", efivars, TRUE));
+	bootorder_path = g_build_filename(efivars, "BootOrder-8be4df61-93ca-11d2-aa0d-00e098032b8c", NULL);
+	g_assert_false(g_file_test(bootorder_path, G_FILE_TEST_EXISTS));
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_name(r_context()->config, "rootfs.0");
+	g_assert_nonnull(rootfs0);
+
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_no_error(error);
+	g_assert_false(good);
+
+	/* marking good creates BootOrder */
+	g_assert_true(r_boot_set_state(rootfs0, TRUE, &error));
+	g_assert_no_error(error);
+	g_assert_true(test_efivars_check(efivars, "BootOrder", bootorder, sizeof(bootorder)));
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_no_error(error);
+	g_assert_true(good);
+
+	g_unsetenv("RAUC_TEST_EFIVARS_DIR");
 }
 
 /* Write content to state storage for custom-backend RAUC mock
@@ -1197,6 +1549,10 @@ int main(int argc, char *argv[])
 	g_assert_true(g_setenv("PATH", path, TRUE));
 	g_free(path);
 
+	/* use the fw_printenv/fw_setenv mock tools instead of the host's U-Boot
+	 * environment */
+	g_assert_true(g_setenv("RAUC_TEST_FW_ENV_CONFIG", "test/_MISSING_fw_env.config", TRUE));
+
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add("/bootchooser/barebox", BootchooserFixture, NULL,
@@ -1223,6 +1579,10 @@ int main(int argc, char *argv[])
 			bootchooser_fixture_set_up, bootchooser_uboot_conf_attempts,
 			bootchooser_fixture_tear_down);
 
+	g_test_add("/bootchooser/uboot-native", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_uboot_native,
+			bootchooser_fixture_tear_down);
+
 	g_test_add("/bootchooser/uboot-asymmetric", BootchooserFixture, NULL,
 			bootchooser_fixture_set_up, bootchooser_uboot_asymmetric,
 			bootchooser_fixture_tear_down);
@@ -1231,6 +1591,14 @@ int main(int argc, char *argv[])
 			bootchooser_fixture_set_up, bootchooser_efi,
 			bootchooser_fixture_tear_down);
 
+	g_test_add("/bootchooser/efivars", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_efivars,
+			bootchooser_fixture_tear_down);
+
+	g_test_add("/bootchooser/efivars-no-bootorder", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_efivars_no_bootorder,
+			bootchooser_fixture_tear_down);
+
 	g_test_add("/bootchooser/custom", BootchooserFixture, NULL,
 			custom_bootchooser_fixture_set_up, bootchooser_custom,
 			bootchooser_fixture_tear_down);
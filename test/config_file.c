@@ -4,6 +4,7 @@
 
 #include <config_file.h>
 #include <context.h>
+#include <event_log.h>
 
 #include "common.h"
 #include "utils.h"
@@ -1042,6 +1043,52 @@ mountprefix=/mnt/myrauc/\n";
 	g_assert_nonnull(config);
 	g_assert_nonnull(config->statusfile_path);
 	g_assert_cmpstr(config->statusfile_path, ==, "per-slot");
+	g_assert_cmpstr(config->status_cache_directory, ==, "/run/rauc/slot-status");
+}
+
+static void config_file_status_cache_directory(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+	g_autofree gchar* expected = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+statusfile=per-slot\n\
+status-cache-directory=cache\n";
+
+	const gchar *cfg_file_central = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+data-directory=/data/rauc\n\
+status-cache-directory=cache\n";
+
+	/* relative to the config file */
+	pathname = write_tmp_file(fixture->tmpdir, "status_cache.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	expected = g_build_filename(fixture->tmpdir, "cache", NULL);
+	g_assert_cmpstr(config->status_cache_directory, ==, expected);
+	g_clear_pointer(&config, free_config);
+	g_clear_pointer(&pathname, g_free);
+
+	/* not used with a central status file */
+	pathname = write_tmp_file(fixture->tmpdir, "status_cache_central.conf", cfg_file_central, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_null(config->status_cache_directory);
 }
 
 static void config_file_keyring_checks(ConfigFileFixture *fixture,
@@ -1385,6 +1432,10 @@ filename=test.log\n\
 	g_assert_no_error(ierror);
 	g_assert_true(res);
 	g_assert_nonnull(config);
+
+	/* events are written synchronously by default */
+	g_assert_nonnull(config->loggers);
+	g_assert_cmpint(((REventLogger *) config->loggers->data)->flush, ==, R_EVENT_LOG_FLUSH_SYNC);
 }
 
 /* Test specifying a full option logger */
@@ -1407,6 +1458,8 @@ events=boot;install\n\
 format=readable\n\
 max-size=1M\n\
 max-files=8\n\
+flush=async\n\
+flush-interval=100\n\
 ";
 
 	pathname = write_tmp_file(fixture->tmpdir, "logger.conf", cfg_file, NULL);
@@ -1503,6 +1556,135 @@ max-files=-1\n\
 	g_assert_null(config);
 }
 
+/* Test setting a flush interval for a synchronous logger. */
+static void config_file_logger_invalid_flush_interval(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[log.testlogger]\n\
+filename=/tmp/test.log\n\
+flush=sync\n\
+flush-interval=100\n\
+";
+
+	pathname = write_tmp_file(fixture->tmpdir, "logger.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
+/* Test parsing of parallel-installs. */
+static void config_file_parallel_installs(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+parallel-installs=3\n\
+";
+
+	const gchar *cfg_file_invalid = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+parallel-installs=0\n\
+";
+
+	pathname = write_tmp_file(fixture->tmpdir, "parallel.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpint(config->parallel_installs, ==, 3);
+	g_clear_pointer(&config, free_config);
+	g_clear_pointer(&pathname, g_free);
+
+	pathname = write_tmp_file(fixture->tmpdir, "parallel_invalid.conf", cfg_file_invalid, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
+/* Test parsing of the [qos] section. */
+static void config_file_qos(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[qos]\n\
+default-profile=full\n\
+io-class=best-effort\n\
+io-priority=6\n\
+nice=10\n\
+cgroup=/sys/fs/cgroup/rauc.slice\n\
+write-rate=8M\n\
+";
+
+	const gchar *cfg_file_invalid = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[qos]\n\
+io-class=fastest\n\
+";
+
+	pathname = write_tmp_file(fixture->tmpdir, "qos.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_true(config->qos_enabled);
+	g_assert_false(config->qos_background);
+	g_assert_cmpint(config->qos_io_class, ==, R_QOS_IO_CLASS_BEST_EFFORT);
+	g_assert_cmpint(config->qos_io_priority, ==, 6);
+	g_assert_true(config->qos_has_nice);
+	g_assert_cmpint(config->qos_nice, ==, 10);
+	g_assert_cmpstr(config->qos_cgroup, ==, "/sys/fs/cgroup/rauc.slice");
+	g_assert_cmpuint(config->qos_write_rate, ==, 8*1024*1024);
+	g_clear_pointer(&config, free_config);
+	g_clear_pointer(&pathname, g_free);
+
+	pathname = write_tmp_file(fixture->tmpdir, "qos_invalid.conf", cfg_file_invalid, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
 /* Test specifying a valid min-bundle-version */
 static void config_file_min_bundle_version_good(ConfigFileFixture *fixture,
 		gconstpointer user_data)
@@ -1648,6 +1830,9 @@ int main(int argc, char *argv[])
 	g_test_add("/config-file/statusfile-missing", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_statusfile_missing,
 			config_file_fixture_tear_down);
+	g_test_add("/config-file/status-cache-directory", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_status_cache_directory,
+			config_file_fixture_tear_down);
 	g_test_add("/config-file/keyring-checks", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_keyring_checks,
 			config_file_fixture_tear_down);
@@ -1685,6 +1870,15 @@ int main(int argc, char *argv[])
 	g_test_add("/config-file/logger/invalid-max-size", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_logger_invalid_max_size,
 			config_file_fixture_tear_down);
+	g_test_add("/config-file/logger/invalid-flush-interval", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_logger_invalid_flush_interval,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/parallel-installs", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_parallel_installs,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/qos", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_qos,
+			config_file_fixture_tear_down);
 	g_test_add("/config-file/min-bundle-version/good", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_min_bundle_version_good,
 			config_file_fixture_tear_down);
@@ -46,6 +46,8 @@ def env_setup(monkeysession):
     monkeysession.setenv("LC_ALL", "C")
     monkeysession.setenv("TZ", "UTC")
     monkeysession.setenv("DBUS_STARTER_BUS_TYPE", "session")
+    # never access the U-Boot environment of the host, but use the mock tools
+    monkeysession.setenv("RAUC_TEST_FW_ENV_CONFIG", "/nonexistent/fw_env.config")
 
     os.chdir(f"{os.path.dirname(os.path.abspath(__file__))}")
 
@@ -0,0 +1,142 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "digest_cache.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *cachedir;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	fixture->cachedir = g_build_filename(fixture->tmpdir, "cache", NULL);
+	g_test_message("digest_cache tmpdir: %s\n", fixture->tmpdir);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->cachedir);
+	g_free(fixture->tmpdir);
+}
+
+static void test_file_key(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *key1 = NULL;
+	g_autofree gchar *key2 = NULL;
+	g_autofree gchar *key3 = NULL;
+
+	filename = write_random_file(fixture->tmpdir, "image.img", 8192, 0x1234);
+	g_assert_nonnull(filename);
+
+	key1 = r_digest_cache_file_key(filename, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(key1);
+
+	key2 = r_digest_cache_file_key(filename, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(key1, ==, key2);
+
+	/* replacing the file must result in a different key */
+	g_assert_cmpint(g_unlink(filename), ==, 0);
+	g_clear_pointer(&filename, g_free);
+	filename = write_random_file(fixture->tmpdir, "image.img", 4096, 0x1234);
+	g_assert_nonnull(filename);
+
+	key3 = r_digest_cache_file_key(filename, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(key1, !=, key3);
+
+	g_assert_null(r_digest_cache_file_key("test/_MISSING_", &error));
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+}
+
+static void test_checksum(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	RaucChecksum computed = {};
+	RaucChecksum cached = {};
+
+	/* miss on empty cache */
+	g_assert_false(r_digest_cache_get_checksum(fixture->cachedir, "key", &cached));
+	g_assert_null(cached.digest);
+
+	g_assert_true(r_digest_cache_compute_checksum(fixture->cachedir, &computed, "test/install-content/appfs.img", &error));
+	g_assert_no_error(error);
+	g_assert_cmpstr(computed.digest, ==, "c35020473aed1b4642cd726cad727b63fff2824ad68cedd7ffb73c7cbd890479");
+	g_assert_cmpint(computed.size, ==, 32768);
+
+	/* entry is found via the file key */
+	g_autofree gchar *key = r_digest_cache_file_key("test/install-content/appfs.img", &error);
+	g_assert_no_error(error);
+	g_assert_true(r_digest_cache_get_checksum(fixture->cachedir, key, &cached));
+	g_assert_cmpstr(cached.digest, ==, computed.digest);
+	g_assert_cmpint(cached.size, ==, computed.size);
+	g_assert_cmpint(cached.type, ==, G_CHECKSUM_SHA256);
+	g_clear_pointer(&cached.digest, g_free);
+
+	/* caller-supplied key */
+	g_assert_true(r_digest_cache_put_checksum(fixture->cachedir, "custom/key with spaces", &computed, &error));
+	g_assert_no_error(error);
+	g_assert_true(r_digest_cache_get_checksum(fixture->cachedir, "custom/key with spaces", &cached));
+	g_assert_cmpstr(cached.digest, ==, computed.digest);
+	g_clear_pointer(&cached.digest, g_free);
+
+	/* other checksum types are not cached */
+	cached.type = G_CHECKSUM_SHA512;
+	g_assert_false(r_digest_cache_get_checksum(fixture->cachedir, key, &cached));
+	g_assert_null(cached.digest);
+
+	g_free(computed.digest);
+}
+
+static void test_hash_index(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *indexpath = NULL;
+	g_autofree gchar *outpath = NULL;
+	g_autoptr(GBytes) orig = NULL;
+	g_autoptr(GBytes) copy = NULL;
+
+	indexpath = write_random_file(fixture->tmpdir, "image.block-hash-index", 32*16, 0x5678);
+	g_assert_nonnull(indexpath);
+	outpath = g_build_filename(fixture->tmpdir, "out.block-hash-index", NULL);
+
+	g_assert_false(r_digest_cache_get_hash_index(fixture->cachedir, "key", outpath));
+	g_assert_false(g_file_test(outpath, G_FILE_TEST_EXISTS));
+
+	g_assert_true(r_digest_cache_put_hash_index(fixture->cachedir, "key", indexpath, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(r_digest_cache_get_hash_index(fixture->cachedir, "key", outpath));
+
+	orig = read_file(indexpath, &error);
+	g_assert_no_error(error);
+	copy = read_file(outpath, &error);
+	g_assert_no_error(error);
+	g_assert_true(g_bytes_equal(orig, copy));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/digest_cache/file_key", Fixture, NULL, fixture_set_up, test_file_key, fixture_tear_down);
+	g_test_add("/digest_cache/checksum", Fixture, NULL, fixture_set_up, test_checksum, fixture_tear_down);
+	g_test_add("/digest_cache/hash_index", Fixture, NULL, fixture_set_up, test_hash_index, fixture_tear_down);
+
+	return g_test_run();
+}
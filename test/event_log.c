@@ -273,6 +273,97 @@ static void event_log_test_max_files_rotation(EventLogFixture *fixture,
 	g_assert_false(g_file_get_contents(rotatefile, &compare_content, NULL, NULL));
 }
 
+/* Test writing through the background writer with batching and rotation */
+static void event_log_test_async(EventLogFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(REventLogger) logger = NULL;
+	GLogField fields[] = {
+		{"MESSAGE", "This is a test (mark) log message", -1 },
+		{"MESSAGE_ID", "1d1b7a5aa9084c3a9004650c9d2ce850", -1 },
+		{"GLIB_DOMAIN", R_EVENT_LOG_DOMAIN, -1},
+		{"RAUC_EVENT_TYPE", "mark", -1},
+		{"BUNDLE_HASH", "b970468f-89e4-4793-9904-06c922902b25", -1},
+	};
+	g_autofree gchar *rotatefile = NULL;
+	g_autofree gchar *contents = NULL;
+
+	logger = g_new0(REventLogger, 1);
+	logger->name = g_strdup("testlogger");
+	logger->filename = g_build_filename(fixture->tmpdir, "testfile.log", NULL);
+	logger->maxsize = 256;
+	logger->maxfiles = 2;
+	logger->flush = R_EVENT_LOG_FLUSH_ASYNC;
+	/* long enough to not write before the explicit flush */
+	logger->flush_interval = 10000;
+
+	rotatefile = g_build_filename(fixture->tmpdir, "testfile.log.1", NULL);
+
+	r_event_log_setup_logger(logger);
+	g_assert_true(logger->configured);
+	g_assert_nonnull(logger->queue);
+
+	/* message size is 128 bytes, so the 3rd message rotates */
+	for (gint i = 0; i < 3; i++)
+		logger->writer(logger, fields, G_N_ELEMENTS(fields));
+
+	g_assert_true(g_file_get_contents(logger->filename, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "");
+	g_clear_pointer(&contents, g_free);
+	g_assert_false(g_file_test(rotatefile, G_FILE_TEST_EXISTS));
+
+	r_event_log_flush();
+
+	g_assert_true(g_file_test(rotatefile, G_FILE_TEST_EXISTS));
+	g_assert_true(g_file_get_contents(logger->filename, &contents, NULL, NULL));
+	g_assert_nonnull(strstr(contents, "This is a test (mark) log message"));
+	g_assert_cmpuint(strlen(contents), ==, 128);
+	g_clear_pointer(&contents, g_free);
+
+	/* events queued after the flush are written when freeing the logger */
+	logger->writer(logger, fields, G_N_ELEMENTS(fields));
+	g_clear_pointer(&logger, r_event_log_free_logger);
+
+	g_free(rotatefile);
+	rotatefile = g_build_filename(fixture->tmpdir, "testfile.log", NULL);
+	g_assert_true(g_file_get_contents(rotatefile, &contents, NULL, NULL));
+	g_assert_cmpuint(strlen(contents), ==, 256);
+}
+
+/* Test a background writer failing to write */
+static void event_log_test_async_no_space_left(EventLogFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(REventLogger) logger = NULL;
+	GLogField fields[] = {
+		{"MESSAGE", "This is a test (mark) log message", -1 },
+		{"MESSAGE_ID", "1d1b7a5aa9084c3a9004650c9d2ce850", -1 },
+		{"GLIB_DOMAIN", R_EVENT_LOG_DOMAIN, -1},
+		{"RAUC_EVENT_TYPE", "mark", -1},
+		{"BUNDLE_HASH", "b970468f-89e4-4793-9904-06c922902b25", -1},
+	};
+
+	logger = g_new0(REventLogger, 1);
+	logger->name = g_strdup("testlogger");
+	logger->filename = g_strdup("/dev/full");
+	logger->flush = R_EVENT_LOG_FLUSH_ASYNC;
+
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "Setting up logger testlogger for *");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "Failed to write log file *: Error writing to file: No space left on device");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "Deactivating broken logger *");
+
+	r_event_log_setup_logger(logger);
+
+	logger->writer(logger, fields, G_N_ELEMENTS(fields));
+	r_event_log_flush();
+	g_test_assert_expected_messages();
+
+	/* the failure is noticed when queuing the next event */
+	g_assert_false(logger->broken);
+	logger->writer(logger, fields, G_N_ELEMENTS(fields));
+	g_assert_true(logger->broken);
+}
+
 /* Test setting up a logger, for structured logging and log with g_log_structured */
 static void event_log_test_structured_logging(EventLogFixture *fixture,
 		gconstpointer user_data)
@@ -413,6 +504,12 @@ int main(int argc, char *argv[])
 	g_test_add("/event-log/logger-max-files", EventLogFixture, NULL,
 			event_log_fixture_set_up, event_log_test_max_files_rotation,
 			config_file_fixture_tear_down);
+	g_test_add("/event-log/log-writer/async", EventLogFixture, NULL,
+			event_log_fixture_set_up, event_log_test_async,
+			config_file_fixture_tear_down);
+	g_test_add("/event-log/log-writer/async-no-space-left", EventLogFixture, NULL,
+			event_log_fixture_set_up, event_log_test_async_no_space_left,
+			config_file_fixture_tear_down);
 
 	/* Test writing through structured logging (instead of calling writer directly) */
 	/* Logger registration must be called only once, thus call it here */
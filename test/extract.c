@@ -0,0 +1,190 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+#include "extract.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *srcdir;
+	gchar *destdir;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *subdir = NULL;
+	g_autofree gchar *link = NULL;
+	g_autofree gchar *large = NULL;
+	g_autofree gchar *small = NULL;
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	g_test_message("extract tmpdir: %s\n", fixture->tmpdir);
+
+	/* source tree with a large file, a subdirectory and a symlink */
+	fixture->srcdir = g_build_filename(fixture->tmpdir, "src", NULL);
+	subdir = g_build_filename(fixture->srcdir, "sub", NULL);
+	g_assert_cmpint(g_mkdir_with_parents(subdir, 0755), ==, 0);
+	large = write_random_file(fixture->srcdir, "large", 5*1024*1024 + 17, 0x1234);
+	g_assert_nonnull(large);
+	small = write_random_file(subdir, "small", 100, 0x5678);
+	g_assert_nonnull(small);
+	link = g_build_filename(fixture->srcdir, "link", NULL);
+	g_assert_cmpint(symlink("sub/small", link), ==, 0);
+
+	fixture->destdir = g_build_filename(fixture->tmpdir, "dest", NULL);
+	g_assert_cmpint(g_mkdir(fixture->destdir, 0755), ==, 0);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->destdir);
+	g_free(fixture->srcdir);
+	g_free(fixture->tmpdir);
+}
+
+static void assert_same_file(const gchar *dir1, const gchar *dir2, const gchar *name)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *path1 = g_build_filename(dir1, name, NULL);
+	g_autofree gchar *path2 = g_build_filename(dir2, name, NULL);
+	g_autoptr(GBytes) data1 = NULL;
+	g_autoptr(GBytes) data2 = NULL;
+
+	data1 = read_file(path1, &error);
+	g_assert_no_error(error);
+	data2 = read_file(path2, &error);
+	g_assert_no_error(error);
+	g_assert_true(g_bytes_equal(data1, data2));
+}
+
+static void test_extract(Fixture *fixture, gconstpointer user_data)
+{
+	const gchar *compress = user_data;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *archive = NULL;
+	g_autofree gchar *link = NULL;
+	g_autofree gchar *target = NULL;
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(8, g_free);
+
+	archive = g_build_filename(fixture->tmpdir, "archive.tar", NULL);
+	g_ptr_array_add(args, g_strdup("tar"));
+	g_ptr_array_add(args, g_strdup("-cf"));
+	g_ptr_array_add(args, g_strdup(archive));
+	if (compress)
+		g_ptr_array_add(args, g_strdup(compress));
+	g_ptr_array_add(args, g_strdup("-C"));
+	g_ptr_array_add(args, g_strdup(fixture->srcdir));
+	g_ptr_array_add(args, g_strdup("."));
+	g_ptr_array_add(args, NULL);
+	g_assert_true(r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(r_extract_archive(archive, fixture->destdir, R_EXTRACT_FLAGS_NONE, &error));
+	g_assert_no_error(error);
+
+	assert_same_file(fixture->srcdir, fixture->destdir, "large");
+	assert_same_file(fixture->srcdir, fixture->destdir, "sub/small");
+
+	link = g_build_filename(fixture->destdir, "link", NULL);
+	target = g_file_read_link(link, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(target, ==, "sub/small");
+}
+
+static void test_extract_invalid(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *archive = NULL;
+
+	/* random data is not a valid archive */
+	archive = write_random_file(fixture->tmpdir, "archive.tar", 64*1024, 0x9abc);
+	g_assert_nonnull(archive);
+
+	g_assert_false(r_extract_archive(archive, fixture->destdir, R_EXTRACT_FLAGS_NONE, &error));
+	g_assert_error(error, R_EXTRACT_ERROR, R_EXTRACT_ERROR_FAILED);
+	g_clear_error(&error);
+
+	g_assert_false(r_extract_archive("test/_MISSING_", fixture->destdir, R_EXTRACT_FLAGS_NONE, &error));
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+}
+
+static void test_extract_symlink_escape(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *archive = NULL;
+	g_autofree gchar *linkdir = NULL;
+	g_autofree gchar *filedir = NULL;
+	g_autofree gchar *outside = NULL;
+	g_autofree gchar *link = NULL;
+	g_autofree gchar *file = NULL;
+	g_autofree gchar *escaped = NULL;
+	g_autoptr(GPtrArray) args = NULL;
+
+	/* a symlink pointing outside of the destination, followed by a file
+	 * below the symlink */
+	outside = g_build_filename(fixture->tmpdir, "outside", NULL);
+	g_assert_cmpint(g_mkdir(outside, 0755), ==, 0);
+	linkdir = g_build_filename(fixture->tmpdir, "linkdir", NULL);
+	g_assert_cmpint(g_mkdir(linkdir, 0755), ==, 0);
+	link = g_build_filename(linkdir, "evil", NULL);
+	g_assert_cmpint(symlink(outside, link), ==, 0);
+	filedir = g_build_filename(fixture->tmpdir, "filedir", "evil", NULL);
+	g_assert_cmpint(g_mkdir_with_parents(filedir, 0755), ==, 0);
+	file = write_random_file(filedir, "pwned", 100, 0x5678);
+	g_assert_nonnull(file);
+	g_free(filedir);
+	filedir = g_build_filename(fixture->tmpdir, "filedir", NULL);
+
+	archive = g_build_filename(fixture->tmpdir, "archive.tar", NULL);
+	args = g_ptr_array_new_full(8, g_free);
+	g_ptr_array_add(args, g_strdup("tar"));
+	g_ptr_array_add(args, g_strdup("-cf"));
+	g_ptr_array_add(args, g_strdup(archive));
+	g_ptr_array_add(args, g_strdup("-C"));
+	g_ptr_array_add(args, g_strdup(linkdir));
+	g_ptr_array_add(args, g_strdup("evil"));
+	g_ptr_array_add(args, NULL);
+	g_assert_true(r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&args, g_ptr_array_unref);
+
+	args = g_ptr_array_new_full(8, g_free);
+	g_ptr_array_add(args, g_strdup("tar"));
+	g_ptr_array_add(args, g_strdup("-rf"));
+	g_ptr_array_add(args, g_strdup(archive));
+	g_ptr_array_add(args, g_strdup("-C"));
+	g_ptr_array_add(args, g_strdup(filedir));
+	g_ptr_array_add(args, g_strdup("evil/pwned"));
+	g_ptr_array_add(args, NULL);
+	g_assert_true(r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &error));
+	g_assert_no_error(error);
+
+	g_assert_false(r_extract_archive(archive, fixture->destdir, R_EXTRACT_FLAGS_NONE, &error));
+	g_assert_error(error, R_EXTRACT_ERROR, R_EXTRACT_ERROR_FAILED);
+
+	escaped = g_build_filename(outside, "pwned", NULL);
+	g_assert_false(g_file_test(escaped, G_FILE_TEST_EXISTS));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/extract/tar", Fixture, NULL, fixture_set_up, test_extract, fixture_tear_down);
+	g_test_add("/extract/tar.gz", Fixture, "--gzip", fixture_set_up, test_extract, fixture_tear_down);
+	g_test_add("/extract/tar.xz", Fixture, "--xz", fixture_set_up, test_extract, fixture_tear_down);
+	g_test_add("/extract/invalid", Fixture, NULL, fixture_set_up, test_extract_invalid, fixture_tear_down);
+	g_test_add("/extract/symlink-escape", Fixture, NULL, fixture_set_up, test_extract_symlink_escape, fixture_tear_down);
+
+	return g_test_run();
+}
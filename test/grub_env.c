@@ -0,0 +1,250 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <locale.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "grub_env.h"
+#include "utils.h"
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *envpath;
+} GrubEnvFixture;
+
+static void grub_env_fixture_set_up(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-grub_env-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->envpath = g_build_filename(fixture->tmpdir, "grubenv", NULL);
+}
+
+static void grub_env_fixture_tear_down(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->envpath);
+	g_free(fixture->tmpdir);
+}
+
+static void grub_env_test_read_write(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
+	g_autofree gchar *contents = NULL;
+	gsize len;
+
+	/* a missing file is an empty environment */
+	env = r_grub_env_read(fixture->envpath, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+	g_assert_null(r_grub_env_get(env, "ORDER"));
+
+	r_grub_env_set(env, "ORDER", "A B");
+	r_grub_env_set(env, "A_OK", "1");
+	r_grub_env_set(env, "ESCAPED", "a\\b\nc");
+	g_assert_true(r_grub_env_write(env, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&env, r_grub_env_free);
+
+	g_assert_true(g_file_get_contents(fixture->envpath, &contents, &len, NULL));
+	g_assert_cmpuint(len, ==, 1024);
+	g_assert_true(g_str_has_prefix(contents,
+			"# GRUB Environment Block\n"
+			"ORDER=A B\n"
+			"A_OK=1\n"
+			"ESCAPED=a\\\\b\\\nc\n"
+			"###"));
+	g_assert_cmpint(contents[1023], ==, '#');
+
+	/* existing variables are updated in place */
+	env = r_grub_env_read(fixture->envpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_grub_env_get(env, "ORDER"), ==, "A B");
+	g_assert_cmpstr(r_grub_env_get(env, "ESCAPED"), ==, "a\\b\nc");
+	r_grub_env_set(env, "ORDER", "B A");
+	r_grub_env_set(env, "B_OK", "1");
+	g_assert_true(r_grub_env_write(env, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&env, r_grub_env_free);
+
+	g_clear_pointer(&contents, g_free);
+	g_assert_true(g_file_get_contents(fixture->envpath, &contents, &len, NULL));
+	g_assert_cmpuint(len, ==, 1024);
+	g_assert_true(g_str_has_prefix(contents,
+			"# GRUB Environment Block\n"
+			"ORDER=B A\n"
+			"A_OK=1\n"
+			"ESCAPED=a\\\\b\\\nc\n"
+			"B_OK=1\n"
+			"###"));
+}
+
+/* as written by grub-editenv for ORDER="A B", ESCAPED="a\b<newline>c" and B_OK=1 */
+#define GRUB_BLOCK_VARS \
+	"# GRUB Environment Block\n" \
+	"ORDER=A B\n" \
+	"ESCAPED=a\\\\b\\\nc\n" \
+	"B_OK=1\n"
+
+static void grub_env_test_grub_block(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
+	g_autoptr(GString) block = g_string_new(GRUB_BLOCK_VARS);
+	g_autoptr(GPtrArray) args = NULL;
+	g_autofree gchar *editenv = NULL;
+	g_autofree gchar *grubpath = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *grub_contents = NULL;
+	gsize len;
+
+	while (block->len < 1024)
+		g_string_append_c(block, '#');
+	g_assert_true(g_file_set_contents(fixture->envpath, block->str, block->len, NULL));
+
+	/* the escaped newline is part of the value */
+	env = r_grub_env_read(fixture->envpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_grub_env_get(env, "ORDER"), ==, "A B");
+	g_assert_cmpstr(r_grub_env_get(env, "ESCAPED"), ==, "a\\b\nc");
+	g_assert_cmpstr(r_grub_env_get(env, "B_OK"), ==, "1");
+	g_assert_null(r_grub_env_get(env, "c"));
+	g_clear_pointer(&env, r_grub_env_free);
+
+	/* writing the same variables results in the same block */
+	g_assert_cmpint(g_unlink(fixture->envpath), ==, 0);
+	env = r_grub_env_read(fixture->envpath, &error);
+	g_assert_no_error(error);
+	r_grub_env_set(env, "ORDER", "A B");
+	r_grub_env_set(env, "ESCAPED", "a\\b\nc");
+	r_grub_env_set(env, "B_OK", "1");
+	g_assert_true(r_grub_env_write(env, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(g_file_get_contents(fixture->envpath, &contents, &len, NULL));
+	g_assert_cmpmem(contents, len, block->str, block->len);
+
+	editenv = g_find_program_in_path("grub-editenv");
+	if (!editenv) {
+		g_test_message("grub-editenv not found, skipping comparison with GRUB");
+		return;
+	}
+
+	/* compare with a block written by GRUB itself */
+	grubpath = g_build_filename(fixture->tmpdir, "grubenv.grub", NULL);
+	args = g_ptr_array_new_full(8, g_free);
+	g_ptr_array_add(args, g_strdup(editenv));
+	g_ptr_array_add(args, g_strdup(grubpath));
+	g_ptr_array_add(args, g_strdup("set"));
+	g_ptr_array_add(args, g_strdup("ORDER=A B"));
+	g_ptr_array_add(args, g_strdup("ESCAPED=a\\b\nc"));
+	g_ptr_array_add(args, g_strdup("B_OK=1"));
+	g_ptr_array_add(args, NULL);
+	g_assert_true(r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_file_get_contents(grubpath, &grub_contents, &len, NULL));
+	g_assert_cmpmem(grub_contents, len, block->str, block->len);
+}
+
+static void grub_env_test_symlink(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
+	g_autofree gchar *target = NULL;
+	g_autofree gchar *link = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autoptr(GString) block = g_string_new("# GRUB Environment Block\nORDER=A B\n");
+	struct stat st;
+	gsize len;
+
+	while (block->len < 1024)
+		g_string_append_c(block, '#');
+	g_assert_true(g_file_set_contents(fixture->envpath, block->str, block->len, NULL));
+	g_assert_cmpint(g_chmod(fixture->envpath, 0600), ==, 0);
+
+	/* like /boot/grub2/grubenv pointing to the EFI partition on Fedora */
+	link = g_build_filename(fixture->tmpdir, "grubenv.link", NULL);
+	g_assert_cmpint(symlink("grubenv", link), ==, 0);
+
+	env = r_grub_env_read(link, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_grub_env_get(env, "ORDER"), ==, "A B");
+	r_grub_env_set(env, "ORDER", "B A");
+	g_assert_true(r_grub_env_write(env, &error));
+	g_assert_no_error(error);
+
+	/* the link is kept and the target updated with its mode unchanged */
+	target = g_file_read_link(link, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(target, ==, "grubenv");
+	g_assert_cmpint(g_stat(fixture->envpath, &st), ==, 0);
+	g_assert_cmpint(st.st_mode & 07777, ==, 0600);
+
+	g_assert_true(g_file_get_contents(fixture->envpath, &contents, &len, NULL));
+	g_assert_cmpuint(len, ==, 1024);
+	g_assert_true(g_str_has_prefix(contents,
+			"# GRUB Environment Block\n"
+			"ORDER=B A\n"
+			"###"));
+}
+
+static void grub_env_test_too_large(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
+	g_autofree gchar *value = g_strnfill(1024, 'x');
+
+	env = r_grub_env_read(fixture->envpath, &error);
+	g_assert_no_error(error);
+
+	r_grub_env_set(env, "LARGE", value);
+	g_assert_false(r_grub_env_write(env, &error));
+	g_assert_error(error, R_GRUB_ENV_ERROR, R_GRUB_ENV_ERROR_TOO_LARGE);
+	g_assert_false(g_file_test(fixture->envpath, G_FILE_TEST_EXISTS));
+}
+
+static void grub_env_test_invalid(GrubEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RGrubEnv) env = NULL;
+
+	g_assert_true(g_file_set_contents(fixture->envpath, "ORDER=A B\n", -1, NULL));
+
+	env = r_grub_env_read(fixture->envpath, &error);
+	g_assert_error(error, R_GRUB_ENV_ERROR, R_GRUB_ENV_ERROR_INVALID);
+	g_assert_null(env);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/grub-env/read-write", GrubEnvFixture, NULL,
+			grub_env_fixture_set_up, grub_env_test_read_write,
+			grub_env_fixture_tear_down);
+	g_test_add("/grub-env/grub-block", GrubEnvFixture, NULL,
+			grub_env_fixture_set_up, grub_env_test_grub_block,
+			grub_env_fixture_tear_down);
+	g_test_add("/grub-env/symlink", GrubEnvFixture, NULL,
+			grub_env_fixture_set_up, grub_env_test_symlink,
+			grub_env_fixture_tear_down);
+	g_test_add("/grub-env/too-large", GrubEnvFixture, NULL,
+			grub_env_fixture_set_up, grub_env_test_too_large,
+			grub_env_fixture_tear_down);
+	g_test_add("/grub-env/invalid", GrubEnvFixture, NULL,
+			grub_env_fixture_set_up, grub_env_test_invalid,
+			grub_env_fixture_tear_down);
+
+	return g_test_run();
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <locale.h>
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -162,6 +163,87 @@ static void progress_test_weighted_steps(void)
 	g_assert_cmpint(callback_counter, ==, 13);
 }
 
+static void progress_test_byte_progress(void)
+{
+	guint64 throughput;
+	gint64 eta;
+
+	/* reset global state */
+	callback_counter = 0;
+	last_percentage = 0;
+
+	r_context_begin_step("test_1", "testing step 1", 1);
+	r_context_begin_step("test_1.1", "testing step 1.1", 0);
+
+	/* updates are rate-limited */
+	r_context_set_step_progress("test_1.1", 1024, 4096);
+	g_assert_cmpint(callback_counter, ==, 2);
+	g_assert_cmpint(last_percentage, ==, 0);
+
+	g_usleep(R_PROGRESS_UPDATE_INTERVAL);
+	r_context_set_step_progress("test_1.1", 2048, 4096);
+	g_assert_cmpint(callback_counter, ==, 3);
+	g_assert_cmpint(last_percentage, ==, 50);
+
+	r_context_get_progress_rate(&throughput, &eta);
+	g_assert_cmpuint(throughput, >, 0);
+	g_assert_cmpint(eta, >=, 0);
+
+	r_context_end_step("test_1.1", TRUE);
+	r_context_end_step("test_1", TRUE);
+	g_assert_cmpint(last_percentage, ==, 100);
+
+	r_context_get_progress_rate(&throughput, &eta);
+	g_assert_cmpint(eta, ==, 0);
+
+	g_assert_cmpint(callback_counter, ==, 5);
+}
+
+static void progress_test_step_timing(void)
+{
+	RaucStepTiming *timing;
+	RaucStepTiming *child;
+	g_autoptr(GVariant) variant = NULL;
+	g_autofree gchar *report = NULL;
+
+	r_context_begin_step("test_1", "testing step 1", 2);
+	r_context_begin_step("test_1.1", "testing step 1.1", 0);
+	g_usleep(10 * G_TIME_SPAN_MILLISECOND);
+	r_context_end_step("test_1.1", TRUE);
+	r_context_begin_step("test_1.2", "testing step 1.2", 0);
+	r_context_set_step_progress("test_1.2", 4096, 4096);
+	r_context_end_step("test_1.2", FALSE);
+	r_context_end_step("test_1", FALSE);
+
+	timing = r_context()->install_info->step_timing;
+	g_assert_nonnull(timing);
+	g_assert_cmpstr(timing->name, ==, "test_1");
+	g_assert_false(timing->success);
+	g_assert_cmpuint(timing->children->len, ==, 2);
+
+	child = timing->children->pdata[0];
+	g_assert_cmpstr(child->name, ==, "test_1.1");
+	g_assert_cmpstr(child->description, ==, "testing step 1.1");
+	g_assert_true(child->success);
+	g_assert_cmpint(child->duration, >=, 10 * G_TIME_SPAN_MILLISECOND);
+	g_assert_cmpint(timing->duration, >=, child->duration);
+
+	child = timing->children->pdata[1];
+	g_assert_cmpstr(child->name, ==, "test_1.2");
+	g_assert_false(child->success);
+	g_assert_cmpuint(child->bytes, ==, 4096);
+
+	report = r_context_step_timing_format(timing);
+	g_assert_true(g_str_has_prefix(report, "[+0.000 s] testing step 1: "));
+	g_assert_nonnull(strstr(report, "\n  [+"));
+	g_assert_nonnull(strstr(report, "testing step 1.2: "));
+	g_assert_nonnull(strstr(report, ", 4096 bytes"));
+
+	variant = g_variant_ref_sink(r_context_step_timing_to_variant(timing));
+	g_assert_cmpstr(g_variant_get_type_string(variant), ==, "a(isstttb)");
+	g_assert_cmpuint(g_variant_n_children(variant), ==, 3);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -180,6 +262,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/progress/test_unsuccessful_substep", progress_test_unsuccessful_substep);
 	g_test_add_func("/progress/test_explicit_percentage", progress_test_explicit_percentage);
 	g_test_add_func("/progress/test_weighted_steps", progress_test_weighted_steps);
+	g_test_add_func("/progress/test_byte_progress", progress_test_byte_progress);
+	g_test_add_func("/progress/test_step_timing", progress_test_step_timing);
 
 	return g_test_run();
 }
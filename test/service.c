@@ -90,10 +90,16 @@ static void on_installer_changed(GDBusProxy *proxy, GVariant *changed,
 		g_message("Operation: %s", msg);
 	}
 	if (g_variant_lookup(changed, "Progress", "(isi)", &percentage, &message, &depth)) {
-		g_autoptr(GVariant) var = g_queue_pop_head(args);
+		g_autoptr(GVariant) var = NULL;
 		gint32 cmp_percentage, cmp_depth;
 		g_autofree gchar *cmp_message = NULL;
 
+		/* copy progress updates are rate-limited by time, so their
+		 * number depends on the write speed */
+		if (g_str_has_prefix(message, "Copying image to ") && !g_str_has_suffix(message, " done."))
+			return;
+
+		var = g_queue_pop_head(args);
 		g_assert_nonnull(var);
 
 		g_assert_true(g_variant_is_floating(var));
@@ -188,13 +194,9 @@ static void service_test_install(ServiceFixture *fixture, gconstpointer user_dat
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  40, "Updating slots", 2));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  40, "Checking slot rootfs.1 (system1)", 3));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  43, "Checking slot rootfs.1 (system1) done.", 3));
-	for (gint32 i = 43; i <= 69; i++)
-		g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)", i, "Copying image to rootfs.1", 3));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  70, "Copying image to rootfs.1 done.", 3));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  70, "Checking slot appfs.1", 3));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  73, "Checking slot appfs.1 done.", 3));
-	for (gint32 i = 73; i <= 99; i++)
-		g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)", i, "Copying image to appfs.1", 3));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  99, "Copying image to appfs.1 done.", 3));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)",  99, "Updating slots done.", 2));
 	g_queue_push_tail(args, (gpointer*)g_variant_new("(isi)", 100, "Installing done.", 1));
@@ -275,6 +275,62 @@ static void signature_verify_file(SignatureFixture *fixture,
 	g_clear_error(&fixture->error);
 }
 
+/* Content spanning multiple read chunks, modified in the last one */
+static void signature_verify_file_chunked(SignatureFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *filename = NULL;
+	gint fd;
+	gboolean res;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+	filename = write_random_file(tmpdir, "content", 3*1024*1024 + 1234, 0xf00d);
+	g_assert_nonnull(filename);
+
+	fixture->sig = cms_sign_file(filename,
+			"test/openssl-ca/rel/release-1.cert.pem",
+			"test/openssl-ca/rel/private/release-1.pem",
+			NULL,
+			&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_nonnull(fixture->sig);
+
+	fd = g_open(filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	res = cms_verify_fd(fd,
+			fixture->sig,
+			0,
+			fixture->store,
+			&fixture->cms,
+			&fixture->error);
+	g_close(fd, NULL);
+	g_assert_no_error(fixture->error);
+	g_assert_true(res);
+	g_assert_nonnull(fixture->cms);
+
+	g_clear_pointer(&fixture->cms, CMS_ContentInfo_free);
+
+	flip_bits_filename(filename, 3*1024*1024 + 1000, 0x01);
+
+	fd = g_open(filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	res = cms_verify_fd(fd,
+			fixture->sig,
+			0,
+			fixture->store,
+			&fixture->cms,
+			&fixture->error);
+	g_close(fd, NULL);
+	g_assert_false(res);
+	g_assert_error(fixture->error, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_INVALID);
+	g_assert_null(fixture->cms);
+
+	g_clear_error(&fixture->error);
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 static void signature_loopback_detached(SignatureFixture *fixture,
 		gconstpointer user_data)
 {
@@ -828,6 +884,7 @@ int main(int argc, char *argv[])
 	g_test_add("/signature/verify_valid", SignatureFixture, NULL, signature_set_up, signature_verify_valid, signature_tear_down);
 	g_test_add("/signature/verify_invalid", SignatureFixture, NULL, signature_set_up, signature_verify_invalid, signature_tear_down);
 	g_test_add("/signature/verify_file", SignatureFixture, NULL, signature_set_up, signature_verify_file, signature_tear_down);
+	g_test_add("/signature/verify_file_chunked", SignatureFixture, NULL, signature_set_up, signature_verify_file_chunked, signature_tear_down);
 	g_test_add("/signature/loopback_detached", SignatureFixture, NULL, signature_set_up, signature_loopback_detached, signature_tear_down);
 	g_test_add("/signature/loopback_inline", SignatureFixture, NULL, signature_set_up, signature_loopback_inline, signature_tear_down);
 	g_test_add("/signature/get_cert_chain", SignatureFixture, NULL, signature_set_up, signature_get_cert_chain, signature_tear_down);
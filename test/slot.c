@@ -2,6 +2,7 @@
 #include <locale.h>
 
 #include <slot.h>
+#include <utils.h>
 
 static void test_slot_get_all_children(void)
 {
@@ -164,6 +165,49 @@ static void test_slot_get_root_classes(void)
 	g_assert_false(string_array_contains(root_classes, "appfs"));
 }
 
+static void test_slot_write_checkpoint(void)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	RaucSlot *slot = NULL;
+	RaucChecksum checksum = {
+		.type = G_CHECKSUM_SHA256,
+		.digest = (gchar *) "c35020473aed1b4642cd726cad727b63fff2824ad68cedd7ffb73c7cbd890479",
+		.size = 32768,
+	};
+	RaucChecksum other = checksum;
+	gboolean res;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	slot = g_new0(RaucSlot, 1);
+	slot->name = g_intern_string("rootfs.0");
+	slot->data_directory = g_build_filename(tmpdir, "slot.rootfs.0", NULL);
+
+	/* no checkpoint yet */
+	g_assert_cmpint(r_slot_get_write_checkpoint(slot, &checksum, "raw"), ==, 0);
+
+	res = r_slot_set_write_checkpoint(slot, &checksum, "raw", 8192, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpint(r_slot_get_write_checkpoint(slot, &checksum, "raw"), ==, 8192);
+
+	/* a different method or image must not use the checkpoint */
+	g_assert_cmpint(r_slot_get_write_checkpoint(slot, &checksum, "block-hash-index"), ==, 0);
+	other.digest = (gchar *) "0000000000000000000000000000000000000000000000000000000000000000";
+	g_assert_cmpint(r_slot_get_write_checkpoint(slot, &other, "raw"), ==, 0);
+	other = checksum;
+	other.size = 4096;
+	g_assert_cmpint(r_slot_get_write_checkpoint(slot, &other, "raw"), ==, 0);
+
+	r_slot_clear_write_checkpoint(slot);
+	g_assert_cmpint(r_slot_get_write_checkpoint(slot, &checksum, "raw"), ==, 0);
+
+	r_slot_free(slot);
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -175,6 +219,7 @@ int main(int argc, char *argv[])
 	g_test_add_func("/slot/get-all-children", test_slot_get_all_children);
 	g_test_add_func("/slot/get-all-of-class", test_slot_get_all_of_class);
 	g_test_add_func("/slot/get-root-classes", test_slot_get_root_classes);
+	g_test_add_func("/slot/write-checkpoint", test_slot_write_checkpoint);
 
 	return g_test_run();
 }
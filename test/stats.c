@@ -52,6 +52,70 @@ static void test_basic(void)
 	g_assert_cmpfloat(stats->max, ==, 127.0);
 }
 
+static void test_percentile(void)
+{
+	g_autoptr(RaucStats) stats = NULL;
+	g_autoptr(GVariant) variant = NULL;
+	guint64 count;
+	gdouble p50;
+
+	stats = r_stats_new("percentile");
+
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 50), ==, 0.0);
+
+	for (guint i = 1; i <= 1000; i++) {
+		r_stats_add(stats, i);
+	}
+
+	/* buckets have a relative width of 12.5% */
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 50), >=, 500.0);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 50), <=, 500.0 * 1.125);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 90), >=, 900.0);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 90), <=, 900.0 * 1.125);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 99), >=, 990.0);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 99), <=, 1000.0);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 100), ==, 1000.0);
+
+	/* the window contains the values 937 to 1000 */
+	g_assert_cmpfloat_with_epsilon(r_stats_get_recent_avg(stats), 968.5, 1e-10);
+
+	variant = g_variant_ref_sink(r_stats_to_variant(stats));
+	g_assert_true(g_variant_lookup(variant, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 1000);
+	g_assert_true(g_variant_lookup(variant, "p50", "d", &p50));
+	g_assert_cmpfloat(p50, ==, r_stats_get_percentile(stats, 50));
+}
+
+static gpointer add_thread(gpointer data)
+{
+	RaucStats *stats = data;
+
+	for (guint i = 0; i < 10000; i++) {
+		r_stats_add(stats, 1.0);
+	}
+
+	return NULL;
+}
+
+static void test_threads(void)
+{
+	g_autoptr(RaucStats) stats = NULL;
+	GThread *threads[4];
+
+	stats = r_stats_new("threads");
+
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++) {
+		threads[i] = g_thread_new("stats", add_thread, stats);
+	}
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++) {
+		g_thread_join(threads[i]);
+	}
+
+	g_assert_cmpuint(stats->count, ==, 40000);
+	g_assert_cmpfloat(stats->sum, ==, 40000.0);
+	g_assert_cmpfloat(r_stats_get_percentile(stats, 99), ==, 1.0);
+}
+
 static void test_queue(void)
 {
 	g_autoptr(RaucStats) stats = NULL;
@@ -85,6 +149,8 @@ int main(int argc, char *argv[])
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/stats/basic", test_basic);
+	g_test_add_func("/stats/percentile", test_percentile);
+	g_test_add_func("/stats/threads", test_threads);
 	g_test_add_func("/stats/queue", test_queue);
 
 	return g_test_run();
@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <locale.h>
 
 #include "common.h"
@@ -495,6 +496,128 @@ static void status_file_test_datadir(StatusFileFixture *fixture, gconstpointer u
 	g_assert_false(g_file_test(updated_file, G_FILE_TEST_IS_REGULAR));
 }
 
+/* Prepares slot rootfs.0 as a file-backed ext4 slot using per-slot status
+ * files and a status cache in the fixture's tmpdir. */
+static RaucSlot *status_file_prepare_cached_slot(StatusFileFixture *fixture)
+{
+	g_autofree gchar *device = g_build_filename(fixture->tmpdir, "rootfs-0", NULL);
+	g_autofree gchar *mount_prefix = g_build_filename(fixture->tmpdir, "mnt", NULL);
+	g_autofree gchar *cache_dir = g_build_filename(fixture->tmpdir, "cache", NULL);
+	RaucSlot *slot;
+
+	g_assert(test_prepare_dummy_file(fixture->tmpdir, "rootfs-0", 4*1024*1024, "/dev/zero") == 0);
+	g_assert_true(test_make_filesystem(fixture->tmpdir, "rootfs-0"));
+	g_assert(g_mkdir(mount_prefix, 0777) == 0);
+
+	replace_strdup(&r_context()->config->statusfile_path, "per-slot");
+	replace_strdup(&r_context()->config->mount_prefix, mount_prefix);
+	replace_strdup(&r_context()->config->status_cache_directory, cache_dir);
+
+	slot = g_hash_table_lookup(r_context()->config->slots, "rootfs.0");
+	g_assert_nonnull(slot);
+	replace_strdup(&slot->device, device);
+	g_clear_pointer(&slot->status, r_slot_free_status);
+
+	return slot;
+}
+
+static void status_file_save_cached_slot(RaucSlot *slot, const gchar *status)
+{
+	GError *ierror = NULL;
+	gboolean res;
+
+	g_clear_pointer(&slot->status, r_slot_free_status);
+	slot->status = g_new0(RaucSlotStatus, 1);
+	slot->status->status = g_strdup(status);
+
+	res = r_slot_status_save(slot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	g_clear_pointer(&slot->status, r_slot_free_status);
+}
+
+/* Loads the status from the cache while mounting the slot would fail */
+static void status_file_test_cache_hit(StatusFileFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *slot;
+
+	if (!test_running_as_root())
+		return;
+
+	slot = status_file_prepare_cached_slot(fixture);
+	status_file_save_cached_slot(slot, "ok");
+
+	/* the mount options are not part of the cache key */
+	replace_strdup(&slot->extra_mount_opts, "invalid-option");
+
+	r_slot_status_load(slot);
+	g_assert_nonnull(slot->status);
+	g_assert_cmpstr(slot->status->status, ==, "ok");
+}
+
+/* Reloads the status from the slot after the cache was invalidated */
+static void status_file_test_cache_invalidate(StatusFileFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *slot;
+
+	if (!test_running_as_root())
+		return;
+
+	slot = status_file_prepare_cached_slot(fixture);
+	status_file_save_cached_slot(slot, "ok");
+
+	r_slot_status_invalidate_cache(slot);
+
+	/* without a cache entry, the slot must be mounted (which fails) */
+	replace_strdup(&slot->extra_mount_opts, "invalid-option");
+	r_slot_status_load(slot);
+	g_assert_nonnull(slot->status);
+	g_assert_null(slot->status->status);
+	g_clear_pointer(&slot->status, r_slot_free_status);
+
+	/* loading from the slot recreates the cache entry */
+	g_clear_pointer(&slot->extra_mount_opts, g_free);
+	r_slot_status_load(slot);
+	g_assert_nonnull(slot->status);
+	g_assert_cmpstr(slot->status->status, ==, "ok");
+	g_clear_pointer(&slot->status, r_slot_free_status);
+
+	replace_strdup(&slot->extra_mount_opts, "invalid-option");
+	r_slot_status_load(slot);
+	g_assert_nonnull(slot->status);
+	g_assert_cmpstr(slot->status->status, ==, "ok");
+}
+
+/* Reloads the status from the slot if it was modified outside of RAUC */
+static void status_file_test_cache_mismatch(StatusFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucSlotStatus) ss = g_new0(RaucSlotStatus, 1);
+	g_autofree gchar *mount_point = g_build_filename(fixture->tmpdir, "slot", NULL);
+	g_autofree gchar *status_path = g_build_filename(mount_point, "slot.raucs", NULL);
+	RaucSlot *slot;
+
+	if (!test_running_as_root())
+		return;
+
+	slot = status_file_prepare_cached_slot(fixture);
+	status_file_save_cached_slot(slot, "ok");
+
+	/* modify the status file without updating the cache */
+	g_assert(g_mkdir(mount_point, 0777) == 0);
+	g_assert_true(test_mount(slot->device, mount_point));
+	ss->status = g_strdup("bad");
+	g_assert_true(r_slot_status_write(status_path, ss, NULL));
+	g_assert_true(test_umount(fixture->tmpdir, "slot"));
+
+	r_slot_status_load(slot);
+	g_assert_nonnull(slot->status);
+	g_assert_cmpstr(slot->status->status, ==, "bad");
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -537,6 +660,20 @@ int main(int argc, char *argv[])
 			status_file_test_save_slot_status_existing_system_status,
 			status_file_fixture_tear_down);
 
+	/* Tests for the per-slot status cache */
+	g_test_add("/status-file/cache/hit", StatusFileFixture, NULL,
+			status_file_fixture_set_up_global,
+			status_file_test_cache_hit,
+			status_file_fixture_tear_down);
+	g_test_add("/status-file/cache/invalidate", StatusFileFixture, NULL,
+			status_file_fixture_set_up_global,
+			status_file_test_cache_invalidate,
+			status_file_fixture_tear_down);
+	g_test_add("/status-file/cache/mismatch", StatusFileFixture, NULL,
+			status_file_fixture_set_up_global,
+			status_file_test_cache_mismatch,
+			status_file_fixture_tear_down);
+
 	g_test_add("/datadir/installation", StatusFileFixture, NULL,
 			status_file_fixture_set_up_datadir,
 			status_file_test_datadir,
@@ -77,6 +77,31 @@ def test_resign_crypt(tmp_path):
     assert exitcode == 0
 
 
+def test_resign_in_place(tmp_path):
+    # copy to tmp path for safe ownership check
+    shutil.copyfile("good-bundle.raucb", tmp_path / "good-bundle.raucb")
+
+    out, err, exitcode = run(
+        "rauc"
+        " --cert openssl-ca/dev/autobuilder-1.cert.pem"
+        " --key openssl-ca/dev/private/autobuilder-1.pem"
+        " --keyring openssl-ca/rel-ca.pem"
+        f" resign --in-place {tmp_path}/good-bundle.raucb"
+        " --signing-keyring openssl-ca/dev-only-ca.pem"
+    )
+
+    assert exitcode == 0
+
+    # no temporary files are left behind
+    assert os.listdir(tmp_path) == ["good-bundle.raucb"]
+
+    out, err, exitcode = run(f"rauc --keyring openssl-ca/rel-ca.pem info {tmp_path}/good-bundle.raucb")
+    assert exitcode == 1
+
+    out, err, exitcode = run(f"rauc --keyring openssl-ca/dev-only-ca.pem info {tmp_path}/good-bundle.raucb")
+    assert exitcode == 0
+
+
 def test_resign_output_exists(tmp_path):
     # copy to tmp path for safe ownership check
     shutil.copyfile("good-bundle.raucb", tmp_path / "good-bundle.raucb")
@@ -0,0 +1,141 @@
+#include <glib.h>
+#include <locale.h>
+#include <string.h>
+#if ENABLE_JSON
+#include <json-glib/json-glib.h>
+#endif
+
+#include "stats.h"
+#include "trace_event.h"
+#include "utils.h"
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *tracepath;
+} TraceEventFixture;
+
+static void trace_event_fixture_set_up(TraceEventFixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-trace_event-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->tracepath = g_build_filename(fixture->tmpdir, "trace.json", NULL);
+}
+
+static void trace_event_fixture_tear_down(TraceEventFixture *fixture,
+		gconstpointer user_data)
+{
+	r_trace_event_close();
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tracepath);
+	g_free(fixture->tmpdir);
+}
+
+static void trace_event_test_disabled(TraceEventFixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_false(r_trace_event_enabled());
+
+	/* recording without a trace file does nothing */
+	r_trace_event_begin("test", "disabled");
+	r_trace_event_end("test", "disabled");
+
+	g_assert_false(g_file_test(fixture->tracepath, G_FILE_TEST_EXISTS));
+}
+
+static void trace_event_test_write(TraceEventFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucStats) stats = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *quoted = NULL;
+
+	g_assert_true(r_trace_event_open(fixture->tracepath, &error));
+	g_assert_no_error(error);
+	g_assert_true(r_trace_event_enabled());
+	g_assert_null(g_getenv(R_TRACE_EVENT_FILE_ENV));
+
+	r_trace_event_begin("test", "outer");
+	quoted = r_trace_event_quote("say \"hi\"\n");
+	g_assert_cmpstr(quoted, ==, "\"say \\\"hi\\\"\\u000a\"");
+	r_trace_event_instant("test", "instant", "\"cmd\":\"true\"");
+	r_trace_event_complete("test", "complete", g_get_monotonic_time(), 42, NULL);
+	stats = r_stats_new("test stats");
+	r_stats_add(stats, 2.0);
+	r_trace_event_end("test", "outer");
+
+	r_trace_event_close();
+	g_assert_false(r_trace_event_enabled());
+
+	g_assert_true(g_file_get_contents(fixture->tracepath, &contents, NULL, NULL));
+	g_assert_true(g_str_has_prefix(contents, "[\n"));
+	g_assert_true(g_str_has_suffix(contents, "},\n"));
+	g_assert_nonnull(strstr(contents, "\"ph\":\"M\""));
+	g_assert_nonnull(strstr(contents, "{\"name\":\"outer\",\"cat\":\"test\",\"ph\":\"B\""));
+	g_assert_nonnull(strstr(contents, "\"ph\":\"i\""));
+	g_assert_nonnull(strstr(contents, "\"args\":{\"cmd\":\"true\"}"));
+	g_assert_nonnull(strstr(contents, "\"dur\":42"));
+	g_assert_nonnull(strstr(contents, "{\"name\":\"test stats\",\"cat\":\"stats\",\"ph\":\"C\""));
+	g_assert_nonnull(strstr(contents, "\"args\":{\"sum\":2.000000}"));
+	g_assert_nonnull(strstr(contents, "{\"name\":\"outer\",\"cat\":\"test\",\"ph\":\"E\""));
+
+#if ENABLE_JSON
+	{
+		g_autoptr(JsonParser) parser = json_parser_new();
+		g_autoptr(GString) array = g_string_new(contents);
+
+		/* the closing bracket is optional for the trace viewers */
+		g_string_truncate(array, array->len - 2);
+		g_string_append(array, "\n]");
+
+		g_assert_true(json_parser_load_from_data(parser, array->str, -1, &error));
+		g_assert_no_error(error);
+		g_assert_cmpuint(json_array_get_length(json_node_get_array(json_parser_get_root(parser))), ==, 7);
+	}
+#endif
+}
+
+/* Only helper processes set up for tracing get the trace file, which they
+ * remove from their environment again */
+static void trace_event_test_attach(TraceEventFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GSubprocessLauncher) launcher = NULL;
+
+	g_assert_true(r_trace_event_open(fixture->tracepath, &error));
+	g_assert_no_error(error);
+	g_assert_null(g_getenv(R_TRACE_EVENT_FILE_ENV));
+
+	launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+	r_trace_event_setup_launcher(launcher);
+	g_assert_cmpstr(g_subprocess_launcher_getenv(launcher, R_TRACE_EVENT_FILE_ENV), ==, fixture->tracepath);
+	r_trace_event_close();
+
+	/* as in the helper process */
+	g_assert_true(g_setenv(R_TRACE_EVENT_FILE_ENV, fixture->tracepath, TRUE));
+	r_trace_event_attach();
+	g_assert_true(r_trace_event_enabled());
+	g_assert_null(g_getenv(R_TRACE_EVENT_FILE_ENV));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/trace-event/disabled", TraceEventFixture, NULL,
+			trace_event_fixture_set_up, trace_event_test_disabled,
+			trace_event_fixture_tear_down);
+	g_test_add("/trace-event/write", TraceEventFixture, NULL,
+			trace_event_fixture_set_up, trace_event_test_write,
+			trace_event_fixture_tear_down);
+	g_test_add("/trace-event/attach", TraceEventFixture, NULL,
+			trace_event_fixture_set_up, trace_event_test_attach,
+			trace_event_fixture_tear_down);
+
+	return g_test_run();
+}
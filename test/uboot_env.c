@@ -0,0 +1,321 @@
+#include <fcntl.h>
+#include <glib.h>
+#include <locale.h>
+#include <mtd/mtd-user.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "uboot_env.h"
+#include "utils.h"
+
+#define ENV_SIZE 64
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *envpath;
+	gchar *configpath;
+} UbootEnvFixture;
+
+static void uboot_env_fixture_set_up(UbootEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-uboot_env-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->envpath = g_build_filename(fixture->tmpdir, "uboot.env", NULL);
+	fixture->configpath = g_build_filename(fixture->tmpdir, "fw_env.config", NULL);
+}
+
+static void uboot_env_fixture_tear_down(UbootEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->configpath);
+	g_free(fixture->envpath);
+	g_free(fixture->tmpdir);
+}
+
+/* Fills 'buf' with an environment copy. The CRC (which does not cover the
+ * flag byte) must be precomputed for the given variables. */
+static void build_env(guint8 *buf, guint32 crc, gint flag, const gchar *vars, gsize vars_len)
+{
+	gsize hdr = flag >= 0 ? 5 : 4;
+
+	memset(buf, 0, ENV_SIZE);
+	crc = GUINT32_TO_LE(crc);
+	memcpy(buf, &crc, sizeof(crc));
+	if (flag >= 0)
+		buf[4] = flag;
+	memcpy(buf + hdr, vars, vars_len);
+}
+
+static void write_config(UbootEnvFixture *fixture, gboolean redundant)
+{
+	g_autofree gchar *config = NULL;
+
+	if (redundant)
+		config = g_strdup_printf("# device offset size\n%s 0x0 0x%x\n%s %d %d\n",
+				fixture->envpath, ENV_SIZE, fixture->envpath, ENV_SIZE, ENV_SIZE);
+	else
+		config = g_strdup_printf("%s\t0 %d\n", fixture->envpath, ENV_SIZE);
+
+	g_assert_true(g_file_set_contents(fixture->configpath, config, -1, NULL));
+}
+
+static void uboot_env_test_single(UbootEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+	guint8 buf[ENV_SIZE];
+
+	write_config(fixture, FALSE);
+	build_env(buf, 0x67f2c4c5, -1, "a=1\0b=2\0", 8);
+	g_assert_true(g_file_set_contents(fixture->envpath, (gchar *) buf, sizeof(buf), NULL));
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "1");
+	g_assert_cmpstr(r_uboot_env_get(env, "b"), ==, "2");
+	g_assert_null(r_uboot_env_get(env, "c"));
+
+	/* several changes are written at once */
+	r_uboot_env_set(env, "a", "5");
+	r_uboot_env_set(env, "b", NULL);
+	r_uboot_env_set(env, "c", "x y");
+	g_assert_true(r_uboot_env_commit(env, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "5");
+	g_assert_null(r_uboot_env_get(env, "b"));
+	g_assert_cmpstr(r_uboot_env_get(env, "c"), ==, "x y");
+
+	/* does not fit */
+	r_uboot_env_set(env, "d", "01234567890123456789012345678901234567890123456789");
+	g_assert_false(r_uboot_env_commit(env, &error));
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_TOO_LARGE);
+	g_clear_pointer(&env, r_uboot_env_free);
+	g_clear_error(&error);
+
+	/* corrupt CRC */
+	build_env(buf, 0x12345678, -1, "a=1\0b=2\0", 8);
+	g_assert_true(g_file_set_contents(fixture->envpath, (gchar *) buf, sizeof(buf), NULL));
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CORRUPT);
+	g_assert_null(env);
+}
+
+static void uboot_env_test_redundant_incremental(UbootEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autofree gchar *contents = NULL;
+	gsize len;
+	guint8 buf[2 * ENV_SIZE];
+
+	write_config(fixture, TRUE);
+
+	/* copy 0 is newer */
+	build_env(buf, 0x90822fd7, 1, "a=1\0", 4);
+	build_env(buf + ENV_SIZE, 0xb97d597b, 0, "a=2\0", 4);
+	g_assert_true(g_file_set_contents(fixture->envpath, (gchar *) buf, sizeof(buf), NULL));
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "1");
+
+	/* the update goes to copy 1, copy 0 stays untouched */
+	r_uboot_env_set(env, "a", "3");
+	g_assert_true(r_uboot_env_commit(env, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	g_assert_true(g_file_get_contents(fixture->envpath, &contents, &len, NULL));
+	g_assert_cmpuint(len, ==, sizeof(buf));
+	g_assert_cmpmem(contents, ENV_SIZE, buf, ENV_SIZE);
+	g_assert_cmpuint((guint8) contents[ENV_SIZE + 4], ==, 2);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "3");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* the flag wraps around from 255 to 0 */
+	build_env(buf, 0x90822fd7, 0xFF, "a=1\0", 4);
+	build_env(buf + ENV_SIZE, 0xb97d597b, 0, "a=2\0", 4);
+	g_assert_true(g_file_set_contents(fixture->envpath, (gchar *) buf, sizeof(buf), NULL));
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "2");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* a newer copy with bad CRC is ignored */
+	build_env(buf, 0x90822fd7, 1, "a=1\0", 4);
+	build_env(buf + ENV_SIZE, 0x12345678, 2, "a=2\0", 4);
+	g_assert_true(g_file_set_contents(fixture->envpath, (gchar *) buf, sizeof(buf), NULL));
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "1");
+}
+
+/* Erases both sectors and writes the two copies at their start. */
+static void write_nor_env(int fd, guint32 erasesize, const guint8 *buf)
+{
+	struct erase_info_user erase = {0, 2 * erasesize};
+
+	ioctl(fd, MEMUNLOCK, &erase);
+	g_assert_cmpint(ioctl(fd, MEMERASE, &erase), ==, 0);
+	g_assert_true(r_pwrite_exact(fd, buf, ENV_SIZE, 0, NULL));
+	g_assert_true(r_pwrite_exact(fd, buf + ENV_SIZE, ENV_SIZE, erasesize, NULL));
+}
+
+static void read_nor_env(int fd, guint32 erasesize, guint8 *buf)
+{
+	g_assert_true(r_pread_exact(fd, buf, ENV_SIZE, 0, NULL));
+	g_assert_true(r_pread_exact(fd, buf + ENV_SIZE, ENV_SIZE, erasesize, NULL));
+}
+
+static void uboot_env_test_redundant_boolean(UbootEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autofree gchar *config = NULL;
+	g_auto(filedesc) fd = -1;
+	struct mtd_info_user info;
+	const gchar *device;
+	guint8 buf[2 * ENV_SIZE];
+	guint8 contents[2 * ENV_SIZE];
+
+	device = g_getenv("RAUC_TEST_MTD_NOR");
+	if (!device) {
+		g_test_message("no MTD NOR device for testing found (define RAUC_TEST_MTD_NOR)");
+		g_test_skip("RAUC_TEST_MTD_NOR undefined");
+		return;
+	}
+
+	fd = g_open(device, O_RDWR | O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_cmpint(ioctl(fd, MEMGETINFO, &info), ==, 0);
+	g_assert_cmpint(info.type, ==, MTD_NORFLASH);
+
+	/* one sector per copy */
+	config = g_strdup_printf("%s 0x0 0x%x 0x%x\n%s 0x%x 0x%x 0x%x\n",
+			device, ENV_SIZE, info.erasesize,
+			device, info.erasesize, ENV_SIZE, info.erasesize);
+	g_assert_true(g_file_set_contents(fixture->configpath, config, -1, NULL));
+
+	/* copy 0 is active, copy 1 obsolete */
+	build_env(buf, 0x90822fd7, 1, "a=1\0", 4);
+	build_env(buf + ENV_SIZE, 0xb97d597b, 0, "a=2\0", 4);
+	write_nor_env(fd, info.erasesize, buf);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "1");
+
+	/* the update goes to copy 1 as active, copy 0 becomes obsolete */
+	r_uboot_env_set(env, "a", "3");
+	g_assert_true(r_uboot_env_commit(env, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	read_nor_env(fd, info.erasesize, contents);
+	g_assert_cmpuint(contents[4], ==, 0);
+	g_assert_cmpmem(contents + 5, ENV_SIZE - 5, buf + 5, ENV_SIZE - 5);
+	g_assert_cmpuint(contents[ENV_SIZE + 4], ==, 1);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "3");
+
+	/* and back to copy 0 */
+	r_uboot_env_set(env, "a", "4");
+	g_assert_true(r_uboot_env_commit(env, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	read_nor_env(fd, info.erasesize, contents);
+	g_assert_cmpuint(contents[4], ==, 1);
+	g_assert_cmpuint(contents[ENV_SIZE + 4], ==, 0);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "4");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* an erased flag does not wrap around as with incremental flags */
+	build_env(buf, 0x90822fd7, 0xFF, "a=1\0", 4);
+	build_env(buf + ENV_SIZE, 0xb97d597b, 0, "a=2\0", 4);
+	write_nor_env(fd, info.erasesize, buf);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "1");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* both active (interrupted update): copy 0 is used */
+	build_env(buf, 0x90822fd7, 1, "a=1\0", 4);
+	build_env(buf + ENV_SIZE, 0xb97d597b, 1, "a=2\0", 4);
+	write_nor_env(fd, info.erasesize, buf);
+
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "a"), ==, "1");
+}
+
+static void uboot_env_test_invalid_config(UbootEnvFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+
+	g_assert_true(g_file_set_contents(fixture->configpath, "# empty\n", -1, NULL));
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG);
+	g_assert_null(env);
+	g_clear_error(&error);
+
+	g_assert_true(g_file_set_contents(fixture->configpath, "/dev/null 0x0 size\n", -1, NULL));
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG);
+	g_assert_null(env);
+	g_clear_error(&error);
+
+	g_assert_true(g_file_set_contents(fixture->configpath, "/dev/null 0x0 0x4000\n", -1, NULL));
+	env = r_uboot_env_open(fixture->configpath, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_UNSUPPORTED);
+	g_assert_null(env);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/uboot-env/single", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, uboot_env_test_single,
+			uboot_env_fixture_tear_down);
+	g_test_add("/uboot-env/redundant/incremental", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, uboot_env_test_redundant_incremental,
+			uboot_env_fixture_tear_down);
+	g_test_add("/uboot-env/redundant/boolean", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, uboot_env_test_redundant_boolean,
+			uboot_env_fixture_tear_down);
+	g_test_add("/uboot-env/invalid-config", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, uboot_env_test_invalid_config,
+			uboot_env_fixture_tear_down);
+
+	return g_test_run();
+}
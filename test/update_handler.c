@@ -1,9 +1,13 @@
+#include <fcntl.h>
 #include <locale.h>
+#include <string.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
+#include <unistd.h>
 
 #include "update_handler.h"
+#include "update_utils.h"
 #include "manifest.h"
 #include "common.h"
 #include "context.h"
@@ -607,6 +611,333 @@ out:
 	r_slot_free(targetslot);
 }
 
+/* Test update_handler/write_mode/compare:
+ *
+ * With write-mode=compare, only the blocks which differ from the current slot
+ * content must be written. Afterwards, the slot must match the image.
+ */
+static void test_update_handler_write_mode_compare(void)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autoptr(RaucImage) image = NULL;
+	g_autoptr(RaucSlot) targetslot = NULL;
+	g_autoptr(GBytes) imagedata = NULL;
+	g_autoptr(GBytes) slotdata = NULL;
+	g_autofree guint8 *olddata = NULL;
+	img_to_slot_handler handler;
+	RaucStats *stats;
+	GError *ierror = NULL;
+	gboolean res;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	/* image spans several read requests and ends with a partial block */
+	imagepath = write_random_file(tmpdir, "image.img", 3*1024*1024 + 1000, 0x1234);
+	g_assert_nonnull(imagepath);
+	imagedata = read_file(imagepath, &ierror);
+	g_assert_no_error(ierror);
+
+	/* the slot contains the image, with three runs of changed blocks */
+	olddata = g_memdup(g_bytes_get_data(imagedata, NULL), g_bytes_get_size(imagedata));
+	olddata[0] ^= 0xff;
+	memset(olddata + 1024*1024 - 4096, 0, 2*4096);
+	olddata[g_bytes_get_size(imagedata) - 1] ^= 0xff;
+	slotpath = g_build_filename(tmpdir, "rootfs-0", NULL);
+	g_assert_true(g_file_set_contents(slotpath, (gchar *) olddata, g_bytes_get_size(imagedata), &ierror));
+	g_assert_no_error(ierror);
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	image->checksum.size = g_bytes_get_size(imagedata);
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("raw");
+	targetslot->write_mode = R_SLOT_WRITE_MODE_COMPARE;
+
+	r_context();
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	r_test_stats_start();
+	res = handler(image, targetslot, NULL, &ierror);
+	r_test_stats_stop();
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* 1 + 2 + 1 changed blocks, the last one being partial */
+	stats = r_test_stats_next();
+	g_assert_nonnull(stats);
+	g_assert_cmpstr(stats->label, ==, "changed blocks");
+	g_assert_cmpint(stats->count, ==, 3*1024*1024/4096 + 1);
+	g_assert_cmpint(stats->sum, ==, 4);
+	r_stats_free(stats);
+	g_assert_null(r_test_stats_next());
+
+	slotdata = read_file(slotpath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(g_bytes_equal(imagedata, slotdata));
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+/* Test update_handler/sparse_image:
+ *
+ * For sparse images, only the data extents are copied and the holes must be
+ * zeroed on the target, which contains random data before.
+ */
+static void test_update_handler_sparse_image(void)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autoptr(RaucImage) image = NULL;
+	g_autoptr(RaucSlot) targetslot = NULL;
+	g_autoptr(GBytes) imagedata = NULL;
+	g_autoptr(GBytes) slotdata = NULL;
+	g_autoptr(GBytes) slotprefix = NULL;
+	g_auto(filedesc) image_fd = -1;
+	guint8 data[8192];
+	img_to_slot_handler handler;
+	GError *ierror = NULL;
+	gboolean res;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	/* two data extents, an unaligned size and a hole at the end */
+	imagepath = g_build_filename(tmpdir, "image.img", NULL);
+	image_fd = g_open(imagepath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	g_assert_cmpint(image_fd, >=, 0);
+	g_assert_cmpint(ftruncate(image_fd, 4*1024*1024 + 1000), ==, 0);
+	memset(data, 0x55, sizeof(data));
+	g_assert_cmpint(pwrite(image_fd, data, sizeof(data), 0), ==, sizeof(data));
+	g_assert_cmpint(pwrite(image_fd, data, 4096, 2*1024*1024), ==, 4096);
+	imagedata = read_file(imagepath, &ierror);
+	g_assert_no_error(ierror);
+
+	slotpath = write_random_file(tmpdir, "rootfs-0", 5*1024*1024, 0x1234);
+	g_assert_nonnull(slotpath);
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	image->checksum.size = g_bytes_get_size(imagedata);
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("raw");
+
+	r_context();
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	res = handler(image, targetslot, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	slotdata = read_file(slotpath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_cmpuint(g_bytes_get_size(slotdata), ==, 5*1024*1024);
+	slotprefix = g_bytes_new_from_bytes(slotdata, 0, g_bytes_get_size(imagedata));
+	g_assert_true(g_bytes_equal(imagedata, slotprefix));
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+/* Test update_handler/verify_write:
+ *
+ * With verify-write, the slot must be read back after writing the image.
+ * Corrupted slot contents must be detected both by comparing against the
+ * image checksum and against a block hash index.
+ */
+static void test_update_handler_verify_write(void)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autoptr(RaucImage) image = NULL;
+	g_autoptr(RaucSlot) targetslot = NULL;
+	g_autoptr(RaucHashIndex) idx = NULL;
+	g_auto(filedesc) image_fd = -1;
+	g_auto(filedesc) slot_fd = -1;
+	img_to_slot_handler handler;
+	GError *ierror = NULL;
+	gboolean res;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	/* image spans several read requests */
+	imagepath = write_random_file(tmpdir, "image.img", 3*1024*1024, 0x1234);
+	g_assert_nonnull(imagepath);
+	slotpath = write_random_file(tmpdir, "rootfs-0", 4*1024*1024, 0x5678);
+	g_assert_nonnull(slotpath);
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	res = compute_checksum(&image->checksum, imagepath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("raw");
+	targetslot->verify_write = TRUE;
+
+	r_context();
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+	g_assert_true(r_update_handler_verifies_write(handler, image, targetslot));
+
+	res = handler(image, targetslot, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	image_fd = g_open(imagepath, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(image_fd, >=, 0);
+	idx = r_hash_index_open("image", image_fd, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(idx);
+
+	res = r_verify_written_image(slotpath, &image->checksum, idx, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* corrupt a single byte in the middle of the image */
+	slot_fd = g_open(slotpath, O_WRONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(slot_fd, >=, 0);
+	g_assert_cmpint(pwrite(slot_fd, "x", 1, 2*1024*1024 + 4096 + 17), ==, 1);
+
+	res = r_verify_written_image(slotpath, &image->checksum, NULL, &ierror);
+	g_assert_error(ierror, R_UPDATE_ERROR, R_UPDATE_ERROR_VERIFY_FAILED);
+	g_assert_false(res);
+	g_clear_error(&ierror);
+
+	res = r_verify_written_image(slotpath, &image->checksum, idx, &ierror);
+	g_assert_error(ierror, R_UPDATE_ERROR, R_UPDATE_ERROR_VERIFY_FAILED);
+	g_assert_nonnull(strstr(ierror->message, "offset 2101248"));
+	g_assert_false(res);
+	g_clear_error(&ierror);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+/* Test update_handler/resume_write:
+ *
+ * After an interrupted write, the data up to the last checkpoint must be
+ * checked against the block hash index and writing must continue after the
+ * last matching chunk.
+ */
+static void test_update_handler_resume_write(void)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *indexpath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autoptr(RaucImage) image = NULL;
+	g_autoptr(RaucSlot) targetslot = NULL;
+	g_autoptr(RaucHashIndex) idx = NULL;
+	g_autoptr(GBytes) imagedata = NULL;
+	g_autoptr(GBytes) slotdata = NULL;
+	g_autoptr(GBytes) slotprefix = NULL;
+	g_auto(filedesc) image_fd = -1;
+	g_auto(filedesc) slot_fd = -1;
+	img_to_slot_handler handler;
+	guint64 interval = r_context()->config->checkpoint_interval;
+	GError *ierror = NULL;
+	gboolean res;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	imagepath = write_random_file(tmpdir, "image.img", 3*1024*1024, 0x1234);
+	g_assert_nonnull(imagepath);
+	imagedata = read_file(imagepath, &ierror);
+	g_assert_no_error(ierror);
+
+	/* the bundle contains a block hash index for the image */
+	image_fd = g_open(imagepath, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(image_fd, >=, 0);
+	idx = r_hash_index_open("image", image_fd, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(idx);
+	indexpath = g_strconcat(imagepath, ".block-hash-index", NULL);
+	res = r_hash_index_export(idx, indexpath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* the interrupted write got 3 chunks past 2 MiB, but the second of
+	 * them did not reach the disk correctly */
+	slotpath = write_random_file(tmpdir, "rootfs-0", 4*1024*1024, 0x5678);
+	g_assert_nonnull(slotpath);
+	slot_fd = g_open(slotpath, O_WRONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(slot_fd, >=, 0);
+	g_assert_cmpint(pwrite(slot_fd, g_bytes_get_data(imagedata, NULL), 2*1024*1024 + 3*4096, 0), ==, 2*1024*1024 + 3*4096);
+	g_assert_cmpint(pwrite(slot_fd, "x", 1, 2*1024*1024 + 4096 + 17), ==, 1);
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	res = compute_checksum(&image->checksum, imagepath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("raw");
+	targetslot->data_directory = g_build_filename(tmpdir, "slot.rootfs.0", NULL);
+
+	r_context()->config->checkpoint_interval = 1024*1024;
+
+	res = r_slot_set_write_checkpoint(targetslot, &image->checksum, "raw", 2*1024*1024 + 3*4096, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, "opening slot device *");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "Slot is not a block device, skipping size check");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "using existing hash index for source_image from *");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, "Resuming interrupted write to * at offset 2101248 (checkpoint at 2109440)");
+	res = handler(image, targetslot, NULL, &ierror);
+	g_test_assert_expected_messages();
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	slotdata = read_file(slotpath, &ierror);
+	g_assert_no_error(ierror);
+	slotprefix = g_bytes_new_from_bytes(slotdata, 0, g_bytes_get_size(imagedata));
+	g_assert_true(g_bytes_equal(imagedata, slotprefix));
+
+	/* the checkpoint is removed after a complete write */
+	g_assert_cmpint(r_slot_get_write_checkpoint(targetslot, &image->checksum, "raw"), ==, 0);
+
+	r_context()->config->checkpoint_interval = interval;
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 int main(int argc, char *argv[])
 {
 	UpdateHandlerTestPair testpair_matrix[] = {
@@ -1119,6 +1450,18 @@ int main(int argc, char *argv[])
 	                update_handler_fixture_tear_down);
 	 */
 
+	g_test_add_func("/update_handler/write_mode/compare",
+			test_update_handler_write_mode_compare);
+
+	g_test_add_func("/update_handler/verify_write",
+			test_update_handler_verify_write);
+
+	g_test_add_func("/update_handler/sparse_image",
+			test_update_handler_sparse_image);
+
+	g_test_add_func("/update_handler/resume_write",
+			test_update_handler_resume_write);
+
 	/* too large */
 	g_test_add("/update_handler/too_large/normal",
 			UpdateHandlerFixture,
@@ -7,6 +7,8 @@
 
 #include "utils.h"
 
+#include "common.h"
+
 static void whitespace_removed_test(void)
 {
 	gchar *str;
@@ -481,6 +483,212 @@ static void semver_less_equal_test(void)
 	g_assert_no_error(error);
 }
 
+typedef struct {
+	guint index;
+	gboolean fail;
+	gboolean done;
+} TestJob;
+
+static gboolean test_job_func(gpointer data, GError **error)
+{
+	TestJob *job = data;
+
+	if (job->fail) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "job %u failed", job->index);
+		return FALSE;
+	}
+
+	g_usleep(1000);
+	job->done = TRUE;
+
+	return TRUE;
+}
+
+static void run_jobs_test(void)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func(g_free);
+
+	/* empty job list */
+	g_assert_true(r_run_jobs(jobs, test_job_func, 0, &error));
+	g_assert_no_error(error);
+
+	for (guint i = 0; i < 16; i++) {
+		TestJob *job = g_new0(TestJob, 1);
+		job->index = i;
+		g_ptr_array_add(jobs, job);
+	}
+
+	/* sequential */
+	g_assert_true(r_run_jobs(jobs, test_job_func, 1, &error));
+	g_assert_no_error(error);
+	for (guint i = 0; i < jobs->len; i++) {
+		TestJob *job = g_ptr_array_index(jobs, i);
+		g_assert_true(job->done);
+		job->done = FALSE;
+	}
+
+	/* parallel */
+	g_assert_true(r_run_jobs(jobs, test_job_func, 4, &error));
+	g_assert_no_error(error);
+	for (guint i = 0; i < jobs->len; i++) {
+		TestJob *job = g_ptr_array_index(jobs, i);
+		g_assert_true(job->done);
+	}
+
+	/* failure is propagated */
+	((TestJob *)g_ptr_array_index(jobs, 5))->fail = TRUE;
+	g_assert_false(r_run_jobs(jobs, test_job_func, 4, &error));
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+	g_assert_cmpstr(error->message, ==, "job 5 failed");
+	g_clear_error(&error);
+
+	/* remaining jobs are skipped after the first failure */
+	((TestJob *)g_ptr_array_index(jobs, 1))->fail = TRUE;
+	g_assert_false(r_run_jobs(jobs, test_job_func, 1, &error));
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+	g_assert_cmpstr(error->message, ==, "job 1 failed");
+	g_clear_error(&error);
+}
+
+static void copy_fd_test(void)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *inpath = NULL;
+	g_autofree gchar *outpath = NULL;
+	g_autoptr(GBytes) input = NULL;
+	g_autoptr(GBytes) output = NULL;
+	g_autoptr(GBytes) expected = NULL;
+	g_auto(filedesc) infd = -1;
+	g_auto(filedesc) outfd = -1;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", &error);
+	g_assert_no_error(error);
+	inpath = g_build_filename(tmpdir, "input", NULL);
+	outpath = g_build_filename(tmpdir, "output", NULL);
+
+	/* larger than the fallback buffer */
+	input = g_bytes_new_take(g_malloc0(3*1024*1024 + 17), 3*1024*1024 + 17);
+	((guint8 *)g_bytes_get_data(input, NULL))[3*1024*1024] = 0x42;
+	g_assert_true(write_file(inpath, input, &error));
+	g_assert_no_error(error);
+
+	infd = g_open(inpath, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(infd, >=, 0);
+	outfd = g_open(outpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	g_assert_cmpint(outfd, >=, 0);
+
+	g_assert_true(r_copy_fd(infd, outfd, 3*1024*1024 + 1, &error));
+	g_assert_no_error(error);
+
+	output = read_file(outpath, &error);
+	g_assert_no_error(error);
+	expected = g_bytes_new_from_bytes(input, 0, 3*1024*1024 + 1);
+	g_assert_true(g_bytes_equal(output, expected));
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+static gboolean copy_fd_progress_cb(goffset done, gpointer data, GError **error)
+{
+	goffset *last = data;
+
+	g_assert_cmpint(done, >, *last);
+	*last = done;
+
+	return TRUE;
+}
+
+static void copy_fd_progress_test(void)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *inpath = NULL;
+	g_autofree gchar *outpath = NULL;
+	g_autoptr(GBytes) input = NULL;
+	g_autoptr(GBytes) output = NULL;
+	g_autoptr(GBytes) prefix = NULL;
+	g_autoptr(GBytes) expected = NULL;
+	g_autoptr(GBytes) tail = NULL;
+	g_auto(filedesc) infd = -1;
+	g_auto(filedesc) outfd = -1;
+	goffset last = 0;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", &error);
+	g_assert_no_error(error);
+
+	inpath = write_random_file(tmpdir, "input", 3*1024*1024 + 17, 0x1234);
+	g_assert_nonnull(inpath);
+	input = read_file(inpath, &error);
+	g_assert_no_error(error);
+
+	/* the existing data after the copied range must be kept */
+	outpath = write_random_file(tmpdir, "output", 4*1024*1024, 0x5678);
+	g_assert_nonnull(outpath);
+	output = read_file(outpath, &error);
+	g_assert_no_error(error);
+	tail = g_bytes_new_from_bytes(output, 3*1024*1024 + 17, 1024*1024 - 17);
+	g_clear_pointer(&output, g_bytes_unref);
+
+	infd = g_open(inpath, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(infd, >=, 0);
+	outfd = g_open(outpath, O_WRONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(outfd, >=, 0);
+
+	g_assert_true(r_copy_fd_with_progress(infd, outfd, 3*1024*1024 + 17, copy_fd_progress_cb, &last, &error));
+	g_assert_no_error(error);
+	g_assert_cmpint(last, ==, 3*1024*1024 + 17);
+
+	output = read_file(outpath, &error);
+	g_assert_no_error(error);
+	g_assert_cmpuint(g_bytes_get_size(output), ==, 4*1024*1024);
+	prefix = g_bytes_new_from_bytes(output, 0, 3*1024*1024 + 17);
+	g_assert_true(g_bytes_equal(prefix, input));
+	expected = g_bytes_new_from_bytes(output, 3*1024*1024 + 17, 1024*1024 - 17);
+	g_assert_true(g_bytes_equal(expected, tail));
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+static void writeback_test(void)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *outpath = NULL;
+	g_autofree guint8 *data = g_malloc0(4096);
+	g_auto(filedesc) outfd = -1;
+	RWriteback wb;
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", &error);
+	g_assert_no_error(error);
+	outpath = g_build_filename(tmpdir, "output", NULL);
+
+	outfd = g_open(outpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	g_assert_cmpint(outfd, >=, 0);
+
+	/* window of two blocks, starting after a header block */
+	r_writeback_init(&wb, outfd, 4096, 2*4096);
+	for (goffset offset = 4096; offset < 8*4096; offset += 4096) {
+		g_assert_true(r_pwrite_exact(outfd, data, 4096, offset, &error));
+		g_assert_no_error(error);
+		g_assert_true(r_writeback_update(&wb, offset + 4096, &error));
+		g_assert_no_error(error);
+	}
+
+	/* three windows were filled, the first two are known to be written back */
+	g_assert_cmpint(wb.start, ==, 7*4096);
+	g_assert_cmpint(wb.done, ==, 5*4096);
+
+	/* a disabled window does nothing */
+	r_writeback_init(&wb, outfd, 0, 0);
+	g_assert_true(r_writeback_update(&wb, 8*4096, &error));
+	g_assert_no_error(error);
+	g_assert_cmpint(wb.start, ==, 0);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -498,6 +706,10 @@ int main(int argc, char *argv[])
 	g_test_add_func("/utils/environ", environ_test);
 	g_test_add_func("/utils/semver_parse_test", semver_parse_test);
 	g_test_add_func("/utils/semver_less_equal_test", semver_less_equal_test);
+	g_test_add_func("/utils/run_jobs", run_jobs_test);
+	g_test_add_func("/utils/copy_fd", copy_fd_test);
+	g_test_add_func("/utils/copy_fd_progress", copy_fd_progress_test);
+	g_test_add_func("/utils/writeback", writeback_test);
 
 	return g_test_run();
 }